@@ -287,6 +287,36 @@ public class WhisperFullParams extends Structure {
      */
     public Pointer logits_filter_callback_user_data;
 
+    /**
+     * Grammar rules for constrained decoding (const whisper_grammar_element **), null to disable.
+     */
+    public Pointer grammar_rules;
+
+    /** Number of grammar rules (size_t). */
+    public long n_grammar_rules;
+
+    /** Index of the start rule (size_t). */
+    public long i_start_rule;
+
+    /** Logit penalty of the tokens that are not allowed by the grammar. */
+    public float grammar_penalty;
+
+    /**
+     * Constrain the decoding to a grammar.
+     * @param rules pointer to the rules (const whisper_grammar_element **), null to disable
+     * @param nRules number of rules
+     * @param startRule index of the start rule
+     */
+    public void setGrammar(Pointer rules, long nRules, long startRule) {
+        grammar_rules = rules;
+        n_grammar_rules = rules == null ? 0 : nRules;
+        i_start_rule = startRule;
+    }
+
+    public void setGrammarPenalty(float penalty) {
+        grammar_penalty = penalty;
+    }
+
 
     public void setNewSegmentCallback(WhisperNewSegmentCallback callback) {
         new_segment_callback = CallbackReference.getFunctionPointer(callback);
@@ -316,6 +346,7 @@ public class WhisperFullParams extends Structure {
                 "new_segment_callback", "new_segment_callback_user_data",
                 "progress_callback", "progress_callback_user_data",
                 "encoder_begin_callback", "encoder_begin_callback_user_data",
-                "logits_filter_callback", "logits_filter_callback_user_data");
+                "logits_filter_callback", "logits_filter_callback_user_data",
+                "grammar_rules", "n_grammar_rules", "i_start_rule", "grammar_penalty");
     }
 }
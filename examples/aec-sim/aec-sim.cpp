@@ -0,0 +1,148 @@
+// Offline test of the r3_talk echo canceller and barge-in detector
+//
+// The far-end recording is played through a simulated echo path and mixed with the near-end recording, which starts in
+// the middle of it. Needs no audio devices and no models, so it runs in CI:
+//
+//   ./aec-sim near.wav far.wav
+//
+
+#include "echo-cancel.h"
+
+#define DR_WAV_IMPLEMENTATION
+#include "dr_wav.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#if defined(_MSC_VER)
+#pragma warning(disable: 4244 4267) // possible loss of data
+#endif
+
+#define AEC_SIM_SAMPLE_RATE 16000
+
+struct aec_sim_params {
+    float min_erle_db    = 6.0f;
+    int   max_false      = 0;
+    int   max_detect_ms  = 1000;
+
+    std::string fname_near;
+    std::string fname_far;
+};
+
+void aec_sim_print_usage(int /*argc*/, char ** argv, const aec_sim_params & params) {
+    fprintf(stderr, "\n");
+    fprintf(stderr, "usage: %s [options] NEAR FAR\n", argv[0]);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "FAR is played through a simulated echo path, NEAR starts in the middle of it (16 kHz, mono, 16-bit)\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -h,       --help          [default] show this help message and exit\n");
+    fprintf(stderr, "  -erle N,  --min-erle N    [%-7.1f] fail when the echo attenuation is lower (dB)\n", params.min_erle_db);
+    fprintf(stderr, "  -nf N,    --max-false N   [%-7d] fail when there are more false barge-ins\n",     params.max_false);
+    fprintf(stderr, "  -dt N,    --max-detect N  [%-7d] fail when the barge-in is detected later (ms)\n", params.max_detect_ms);
+    fprintf(stderr, "\n");
+}
+
+bool aec_sim_params_parse(int argc, char ** argv, aec_sim_params & params) {
+    std::vector<std::string> fnames;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+
+        if (arg == "-h" || arg == "--help") {
+            aec_sim_print_usage(argc, argv, params);
+            exit(0);
+        }
+        else if (arg[0] != '-')                                 { fnames.push_back(arg); }
+        else if (i + 1 >= argc) {
+            fprintf(stderr, "error: missing value for argument: %s\n", arg.c_str());
+            aec_sim_print_usage(argc, argv, params);
+            return false;
+        }
+        else if (arg == "-erle" || arg == "--min-erle")         { params.min_erle_db   = std::stof(argv[++i]); }
+        else if (arg == "-nf"   || arg == "--max-false")        { params.max_false     = std::stoi(argv[++i]); }
+        else if (arg == "-dt"   || arg == "--max-detect")       { params.max_detect_ms = std::stoi(argv[++i]); }
+        else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            aec_sim_print_usage(argc, argv, params);
+            return false;
+        }
+    }
+
+    if (fnames.size() != 2) {
+        fprintf(stderr, "error: expected the near-end and the far-end recordings\n");
+        aec_sim_print_usage(argc, argv, params);
+        return false;
+    }
+
+    params.fname_near = fnames[0];
+    params.fname_far  = fnames[1];
+
+    return true;
+}
+
+static bool read_wav_mono(const std::string & fname, std::vector<float> & pcmf32) {
+    drwav wav;
+
+    if (drwav_init_file(&wav, fname.c_str(), nullptr) == false) {
+        fprintf(stderr, "error: failed to open '%s' as WAV file\n", fname.c_str());
+        return false;
+    }
+
+    if (wav.channels != 1 || wav.sampleRate != AEC_SIM_SAMPLE_RATE || wav.bitsPerSample != 16) {
+        fprintf(stderr, "error: '%s' must be 16 kHz mono 16-bit\n", fname.c_str());
+        drwav_uninit(&wav);
+        return false;
+    }
+
+    std::vector<int16_t> pcm16(wav.totalPCMFrameCount);
+    drwav_read_pcm_frames_s16(&wav, pcm16.size(), pcm16.data());
+    drwav_uninit(&wav);
+
+    pcmf32.resize(pcm16.size());
+    for (size_t i = 0; i < pcm16.size(); i++) {
+        pcmf32[i] = float(pcm16[i])/32768.0f;
+    }
+
+    return true;
+}
+
+int main(int argc, char ** argv) {
+    aec_sim_params params;
+
+    if (aec_sim_params_parse(argc, argv, params) == false) {
+        return 1;
+    }
+
+    std::vector<float> pcmf32_near;
+    std::vector<float> pcmf32_far;
+
+    if (!read_wav_mono(params.fname_near, pcmf32_near) || !read_wav_mono(params.fname_far, pcmf32_far)) {
+        return 1;
+    }
+
+    echo_canceller_params aec_params;
+    barge_in_params vad_params;
+
+    // the near-end starts in the middle of the far-end
+    const auto result = echo_cancel_sim(pcmf32_near, pcmf32_far, (int) (pcmf32_far.size()*500/AEC_SIM_SAMPLE_RATE), aec_params, vad_params);
+
+    bool ok = true;
+
+    if (result.erle_db < params.min_erle_db) {
+        fprintf(stderr, "%s: the echo attenuation of %.1f dB is below %.1f dB\n", __func__, result.erle_db, params.min_erle_db);
+        ok = false;
+    }
+    if (result.n_false > params.max_false) {
+        fprintf(stderr, "%s: %d false barge-ins, at most %d are allowed\n", __func__, result.n_false, params.max_false);
+        ok = false;
+    }
+    if (result.detect_ms < 0 || result.detect_ms > params.max_detect_ms) {
+        fprintf(stderr, "%s: the barge-in was not detected within %d ms\n", __func__, params.max_detect_ms);
+        ok = false;
+    }
+
+    return ok ? 0 : 1;
+}
@@ -12,7 +12,9 @@
 
 #include <sstream>
 #include <cassert>
+#include <cctype>
 #include <cstdio>
+#include <cstdlib>
 #include <fstream>
 #include <mutex>
 #include <regex>
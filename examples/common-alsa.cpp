@@ -0,0 +1,312 @@
+// ALSA backend of audio_async
+//
+// The devices are accessed directly with mmap transfers and a period size chosen by the caller, so there is no
+// sound server or SDL thread between the device and the callbacks. Every device gets its own thread that waits
+// for a full period and moves it from or to the ring buffer of the device.
+// The hw devices rarely support mono or 16 kHz - use the plughw devices, they convert with little overhead.
+
+#include "common-sdl.h"
+
+#include <alsa/asoundlib.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+
+class audio_backend_alsa : public audio_backend {
+public:
+    audio_backend_alsa(const audio_backend_params & params) : m_params(params) {
+        m_running = false;
+        m_capture = false;
+        m_n_xruns = 0;
+    }
+
+    ~audio_backend_alsa() override {
+        m_running = false;
+
+        for (auto * dev : { &m_in, &m_out }) {
+            if (dev->worker.joinable()) {
+                dev->worker.join();
+            }
+            if (dev->pcm) {
+                snd_pcm_drop(dev->pcm);
+                snd_pcm_close(dev->pcm);
+            }
+        }
+    }
+
+    bool open_capture(int capture_id, int & sample_rate, audio_stream_callback callback) override {
+        const std::string name = !m_params.device_in.empty() ? m_params.device_in :
+                                 capture_id >= 0 ? "plughw:" + std::to_string(capture_id) : "default";
+
+        unsigned int rate = sample_rate;
+        if (!open(m_in, name, SND_PCM_STREAM_CAPTURE, rate, m_params.capture_f32)) {
+            return false;
+        }
+
+        sample_rate = rate;
+        m_in.callback = callback;
+
+        return true;
+    }
+
+    bool open_playback(int capture_id, int sample_rate, audio_stream_callback callback) override {
+        const std::string name = !m_params.device_out.empty() ? m_params.device_out :
+                                 capture_id >= 0 ? "plughw:" + std::to_string(capture_id) : "default";
+
+        unsigned int rate = sample_rate;
+        if (!open(m_out, name, SND_PCM_STREAM_PLAYBACK, rate, false)) {
+            return false;
+        }
+
+        if ((int) rate != sample_rate) {
+            fprintf(stderr, "%s: the playback device '%s' does not support %d Hz\n", __func__, name.c_str(), sample_rate);
+            return false;
+        }
+
+        m_out.callback = callback;
+
+        return true;
+    }
+
+    void resume() override {
+        m_capture = true;
+
+        if (!m_running) {
+            m_running = true;
+
+            if (m_in.pcm) {
+                m_in.worker = std::thread([this]() { run(m_in, true); });
+            }
+            if (m_out.pcm) {
+                m_out.worker = std::thread([this]() { run(m_out, false); });
+            }
+        }
+    }
+
+    void pause() override {
+        // the capture keeps running, so that the device does not overrun
+        m_capture = false;
+    }
+
+    int playback_latency() const override {
+        return (int) m_out.n_buffer;
+    }
+
+    uint64_t n_xruns() const override {
+        return m_n_xruns;
+    }
+
+private:
+    struct device {
+        snd_pcm_t * pcm = nullptr;
+
+        bool mmap = true;
+        bool f32  = false;
+
+        snd_pcm_uframes_t n_period = 0;
+        snd_pcm_uframes_t n_buffer = 0;
+
+        audio_stream_callback callback;
+
+        std::thread worker;
+    };
+
+    bool open(device & dev, const std::string & name, snd_pcm_stream_t stream, unsigned int & rate, bool f32) {
+        const char * dir = stream == SND_PCM_STREAM_CAPTURE ? "capture" : "playback";
+
+        fprintf(stderr, "%s: attempt to open ALSA %s device '%s' ...\n", __func__, dir, name.c_str());
+
+        int err = snd_pcm_open(&dev.pcm, name.c_str(), stream, 0);
+        if (err < 0) {
+            fprintf(stderr, "%s: couldn't open '%s' for %s: %s\n", __func__, name.c_str(), dir, snd_strerror(err));
+            dev.pcm = nullptr;
+            return false;
+        }
+
+        snd_pcm_hw_params_t * hw;
+        snd_pcm_hw_params_alloca(&hw);
+        snd_pcm_hw_params_any(dev.pcm, hw);
+
+        // mmap avoids a copy in the kernel - some plugins only support read / write
+        dev.mmap = snd_pcm_hw_params_set_access(dev.pcm, hw, SND_PCM_ACCESS_MMAP_INTERLEAVED) == 0;
+        if (!dev.mmap && (err = snd_pcm_hw_params_set_access(dev.pcm, hw, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0) {
+            fprintf(stderr, "%s: no supported access type: %s\n", __func__, snd_strerror(err));
+            return false;
+        }
+
+        dev.f32 = f32;
+        if ((err = snd_pcm_hw_params_set_format(dev.pcm, hw, f32 ? SND_PCM_FORMAT_FLOAT : SND_PCM_FORMAT_S16)) < 0) {
+            fprintf(stderr, "%s: %s samples are not supported: %s\n", __func__, f32 ? "float" : "16-bit", snd_strerror(err));
+            return false;
+        }
+
+        if ((err = snd_pcm_hw_params_set_channels(dev.pcm, hw, 1)) < 0) {
+            fprintf(stderr, "%s: mono is not supported (use a plughw device): %s\n", __func__, snd_strerror(err));
+            return false;
+        }
+
+        if ((err = snd_pcm_hw_params_set_rate_near(dev.pcm, hw, &rate, nullptr)) < 0) {
+            fprintf(stderr, "%s: failed to set the sample rate: %s\n", __func__, snd_strerror(err));
+            return false;
+        }
+
+        snd_pcm_uframes_t n_period = std::max(16, m_params.period_size);
+        unsigned int      n_periods = std::max(2, m_params.n_periods);
+
+        snd_pcm_hw_params_set_period_size_near(dev.pcm, hw, &n_period, nullptr);
+        snd_pcm_hw_params_set_periods_near(dev.pcm, hw, &n_periods, nullptr);
+
+        if ((err = snd_pcm_hw_params(dev.pcm, hw)) < 0) {
+            fprintf(stderr, "%s: failed to set the hardware parameters: %s\n", __func__, snd_strerror(err));
+            return false;
+        }
+
+        snd_pcm_hw_params_get_period_size(hw, &dev.n_period, nullptr);
+        snd_pcm_hw_params_get_buffer_size(hw, &dev.n_buffer);
+
+        // wake up for every period, the playback starts when the buffer is full
+        snd_pcm_sw_params_t * sw;
+        snd_pcm_sw_params_alloca(&sw);
+        snd_pcm_sw_params_current(dev.pcm, sw);
+        snd_pcm_sw_params_set_avail_min(dev.pcm, sw, dev.n_period);
+        snd_pcm_sw_params_set_start_threshold(dev.pcm, sw, stream == SND_PCM_STREAM_CAPTURE ? 1 : dev.n_buffer);
+
+        if ((err = snd_pcm_sw_params(dev.pcm, sw)) < 0) {
+            fprintf(stderr, "%s: failed to set the software parameters: %s\n", __func__, snd_strerror(err));
+            return false;
+        }
+
+        fprintf(stderr, "%s: obtained spec for %s device '%s':\n", __func__, dir, name.c_str());
+        fprintf(stderr, "%s:     - sample rate:       %u\n", __func__, rate);
+        fprintf(stderr, "%s:     - format:            %s\n", __func__, f32 ? "float" : "s16");
+        fprintf(stderr, "%s:     - access:            %s\n", __func__, dev.mmap ? "mmap" : "read/write");
+        fprintf(stderr, "%s:     - period:            %d frames\n", __func__, (int) dev.n_period);
+        fprintf(stderr, "%s:     - buffer:            %d frames\n", __func__, (int) dev.n_buffer);
+
+        return snd_pcm_prepare(dev.pcm) == 0;
+    }
+
+    // count the xrun and restart the device
+    void recover(device & dev, int err, bool capture) {
+        m_n_xruns++;
+
+        if (snd_pcm_recover(dev.pcm, err, 1) < 0) {
+            snd_pcm_prepare(dev.pcm);
+        }
+
+        if (capture) {
+            snd_pcm_start(dev.pcm);
+        }
+    }
+
+    void run(device & dev, bool capture) {
+        const int n = dev.n_period;
+
+        std::vector<float>   pcmf32(n);
+        std::vector<int16_t> pcm16(n);
+
+        if (capture) {
+            snd_pcm_start(dev.pcm);
+        }
+
+        while (m_running) {
+            int err = snd_pcm_wait(dev.pcm, 100);
+            if (err < 0) {
+                recover(dev, err, capture);
+                continue;
+            }
+
+            snd_pcm_sframes_t n_avail = snd_pcm_avail_update(dev.pcm);
+            if (n_avail < 0) {
+                recover(dev, n_avail, capture);
+                continue;
+            }
+
+            while (m_running && n_avail >= n) {
+                snd_pcm_uframes_t n_frames = n;
+
+                if (dev.mmap) {
+                    const snd_pcm_channel_area_t * areas;
+                    snd_pcm_uframes_t offset;
+
+                    if ((err = snd_pcm_mmap_begin(dev.pcm, &areas, &offset, &n_frames)) < 0) {
+                        recover(dev, err, capture);
+                        break;
+                    }
+
+                    uint8_t * ptr = (uint8_t *) areas[0].addr + (areas[0].first + offset*areas[0].step)/8;
+
+                    if (capture) {
+                        convert(ptr, dev.f32, pcmf32.data(), n_frames);
+                    } else {
+                        dev.callback(ptr, n_frames*sizeof(int16_t));
+                    }
+
+                    const snd_pcm_sframes_t n_commit = snd_pcm_mmap_commit(dev.pcm, offset, n_frames);
+                    if (n_commit < 0 || (snd_pcm_uframes_t) n_commit != n_frames) {
+                        recover(dev, n_commit < 0 ? n_commit : -EPIPE, capture);
+                        break;
+                    }
+                } else {
+                    snd_pcm_sframes_t n_done;
+                    if (capture) {
+                        n_done = dev.f32 ? snd_pcm_readi(dev.pcm, pcmf32.data(), n_frames) : snd_pcm_readi(dev.pcm, pcm16.data(), n_frames);
+                    } else {
+                        dev.callback((uint8_t *) pcm16.data(), n_frames*sizeof(int16_t));
+                        n_done = snd_pcm_writei(dev.pcm, pcm16.data(), n_frames);
+                    }
+
+                    if (n_done < 0) {
+                        recover(dev, n_done, capture);
+                        break;
+                    }
+
+                    n_frames = n_done;
+
+                    if (capture && !dev.f32) {
+                        convert((const uint8_t *) pcm16.data(), false, pcmf32.data(), n_frames);
+                    }
+                }
+
+                if (capture && m_capture) {
+                    dev.callback((uint8_t *) pcmf32.data(), n_frames*sizeof(float));
+                }
+
+                n_avail -= n_frames;
+            }
+
+            // the playback buffer has been filled for the first time
+            if (!capture && snd_pcm_state(dev.pcm) == SND_PCM_STATE_PREPARED) {
+                snd_pcm_start(dev.pcm);
+            }
+        }
+    }
+
+    static void convert(const uint8_t * src, bool f32, float * dst, size_t n) {
+        if (f32) {
+            memcpy(dst, src, n*sizeof(float));
+        } else {
+            const int16_t * src16 = (const int16_t *) src;
+            for (size_t i = 0; i < n; i++) {
+                dst[i] = src16[i]/32768.0f;
+            }
+        }
+    }
+
+    audio_backend_params m_params;
+
+    device m_in;
+    device m_out;
+
+    std::atomic_bool      m_running;
+    std::atomic_bool      m_capture;
+    std::atomic<uint64_t> m_n_xruns;
+};
+
+std::unique_ptr<audio_backend> audio_backend_alsa_init(const audio_backend_params & params) {
+    return std::unique_ptr<audio_backend>(new audio_backend_alsa(params));
+}
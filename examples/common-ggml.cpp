@@ -9,6 +9,13 @@ static const std::map<std::string, enum ggml_ftype> GGML_FTYPE_MAP = {
     {"q5_0", GGML_FTYPE_MOSTLY_Q5_0},
     {"q5_1", GGML_FTYPE_MOSTLY_Q5_1},
     {"q8_0", GGML_FTYPE_MOSTLY_Q8_0},
+    {"q2_k", GGML_FTYPE_MOSTLY_Q2_K},
+    {"q3_k", GGML_FTYPE_MOSTLY_Q3_K},
+    {"q4_k", GGML_FTYPE_MOSTLY_Q4_K},
+    {"q5_k", GGML_FTYPE_MOSTLY_Q5_K},
+    {"q6_k", GGML_FTYPE_MOSTLY_Q6_K},
+    {"q4_k_m", GGML_FTYPE_MOSTLY_Q4_K_M},
+    {"q5_k_m", GGML_FTYPE_MOSTLY_Q5_K_M},
 };
 
 void ggml_print_ftypes(FILE * fp) {
@@ -38,7 +45,8 @@ bool ggml_common_quantize_0(
         std::ofstream & fout,
         const ggml_ftype ftype,
         const std::vector<std::string> & to_quant,
-        const std::vector<std::string> & to_skip) {
+        const std::vector<std::string> & to_skip,
+        const std::function<ggml_type(const std::string & name, int n_per_row)> & tensor_type) {
 
     ggml_type qtype = GGML_TYPE_F32;
 
@@ -48,15 +56,25 @@ bool ggml_common_quantize_0(
         case GGML_FTYPE_MOSTLY_Q5_0: qtype = GGML_TYPE_Q5_0; break;
         case GGML_FTYPE_MOSTLY_Q5_1: qtype = GGML_TYPE_Q5_1; break;
         case GGML_FTYPE_MOSTLY_Q8_0: qtype = GGML_TYPE_Q8_0; break;
+        case GGML_FTYPE_MOSTLY_Q2_K: qtype = GGML_TYPE_Q2_K; break;
+        case GGML_FTYPE_MOSTLY_Q3_K: qtype = GGML_TYPE_Q3_K; break;
+        case GGML_FTYPE_MOSTLY_Q4_K: qtype = GGML_TYPE_Q4_K; break;
+        case GGML_FTYPE_MOSTLY_Q5_K: qtype = GGML_TYPE_Q5_K; break;
+        case GGML_FTYPE_MOSTLY_Q6_K: qtype = GGML_TYPE_Q6_K; break;
+        case GGML_FTYPE_MOSTLY_Q4_K_M:
+        case GGML_FTYPE_MOSTLY_Q5_K_M:
+                {
+                    // mixed - the type of each tensor is chosen by the model
+                    if (!tensor_type) {
+                        fprintf(stderr, "%s: model type %d needs the types of the tensors\n", __func__, ftype);
+                        return false;
+                    }
+                    qtype = ggml_ftype_to_ggml_type(ftype);
+                } break;
         case GGML_FTYPE_UNKNOWN:
         case GGML_FTYPE_ALL_F32:
         case GGML_FTYPE_MOSTLY_F16:
         case GGML_FTYPE_MOSTLY_Q4_1_SOME_F16:
-        case GGML_FTYPE_MOSTLY_Q2_K:
-        case GGML_FTYPE_MOSTLY_Q3_K:
-        case GGML_FTYPE_MOSTLY_Q4_K:
-        case GGML_FTYPE_MOSTLY_Q5_K:
-        case GGML_FTYPE_MOSTLY_Q6_K:
                 {
                     fprintf(stderr, "%s: invalid model type %d\n", __func__, ftype);
                     return false;
@@ -68,6 +86,11 @@ bool ggml_common_quantize_0(
         return false;
     }
 
+    if (ggml_type_size(qtype) == 0) {
+        fprintf(stderr, "%s: quantization type %s is not supported by this build\n", __func__, ggml_type_name(qtype));
+        return false;
+    }
+
     size_t total_size_org = 0;
     size_t total_size_new = 0;
 
@@ -143,7 +166,13 @@ bool ggml_common_quantize_0(
                 finp.read(reinterpret_cast<char *>(data_f32.data()), nelements * sizeof(float));
             }
 
-            ttype = qtype;
+            ttype = tensor_type ? tensor_type(name, ne[0]) : qtype;
+
+            if (ne[0] % ggml_blck_size((ggml_type) ttype) != 0) {
+                fprintf(stderr, "%s: the rows of tensor '%s' (%d) are not a multiple of the block size of %s (%d)\n",
+                        __func__, name.c_str(), ne[0], ggml_type_name((ggml_type) ttype), ggml_blck_size((ggml_type) ttype));
+                return false;
+            }
         } else {
             const int bpe = (ttype == 0) ? sizeof(float) : sizeof(uint16_t);
 
@@ -186,17 +215,20 @@ bool ggml_common_quantize_0(
                     {
                         cur_size = ggml_quantize_q8_0(data_f32.data(), work.data(), nelements, ne[0], hist_cur.data());
                     } break;
+                case GGML_TYPE_Q2_K:
+                case GGML_TYPE_Q3_K:
+                case GGML_TYPE_Q4_K:
+                case GGML_TYPE_Q5_K:
+                case GGML_TYPE_Q6_K:
+                    {
+                        cur_size = ggml_quantize_chunk((ggml_type) ttype, data_f32.data(), work.data(), 0, nelements, hist_cur.data());
+                    } break;
                 case GGML_TYPE_F32:
                 case GGML_TYPE_F16:
                 case GGML_TYPE_I8:
                 case GGML_TYPE_I16:
                 case GGML_TYPE_I32:
                 case GGML_TYPE_Q8_1:
-                case GGML_TYPE_Q2_K:
-                case GGML_TYPE_Q3_K:
-                case GGML_TYPE_Q4_K:
-                case GGML_TYPE_Q5_K:
-                case GGML_TYPE_Q6_K:
                 case GGML_TYPE_Q8_K:
                 case GGML_TYPE_COUNT:
                     {
@@ -208,7 +240,7 @@ bool ggml_common_quantize_0(
             fout.write(reinterpret_cast<char *>(work.data()), cur_size);
             total_size_new += cur_size;
 
-            printf("size = %8.2f MB -> %8.2f MB | hist: ", nelements * sizeof(float)/1024.0/1024.0, cur_size/1024.0/1024.0);
+            printf("size = %8.2f MB -> %8.2f MB (%s) | hist: ", nelements * sizeof(float)/1024.0/1024.0, cur_size/1024.0/1024.0, ggml_type_name((ggml_type) ttype));
             for (int i = 0; i < (int) hist_cur.size(); ++i) {
                 hist_all[i] += hist_cur[i];
             }
@@ -3,6 +3,7 @@
 #include "ggml.h"
 
 #include <fstream>
+#include <functional>
 #include <vector>
 #include <string>
 
@@ -10,9 +11,13 @@ enum ggml_ftype ggml_parse_ftype(const char * str);
 
 void ggml_print_ftypes(FILE * fp = stderr);
 
+// tensor_type - the type of each quantized tensor, by its name and the number of values per row. Needed for the
+//               mixed ftypes (GGML_FTYPE_MOSTLY_Q4_K_M, GGML_FTYPE_MOSTLY_Q5_K_M), otherwise all tensors get the type
+//               of the ftype
 bool ggml_common_quantize_0(
         std::ifstream & finp,
         std::ofstream & fout,
         const ggml_ftype ftype,
         const std::vector<std::string> & to_quant,
-        const std::vector<std::string> & to_skip);
+        const std::vector<std::string> & to_skip,
+        const std::function<ggml_type(const std::string & name, int n_per_row)> & tensor_type = nullptr);
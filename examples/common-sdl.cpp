@@ -1,83 +1,65 @@
 #include "common-sdl.h"
 
+#include "common.h"
+
+#ifndef WHISPER_NO_SDL
+#include <SDL.h>
+#include <SDL_audio.h>
+#endif
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+
+static int64_t play_time_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 audio_async::audio_async(int len_ms) {
     m_len_ms = len_ms;
 
     m_running = false;
+
+    m_play_pos_w  = 0;
+    m_play_pos_r  = 0;
+    m_play_t_end  = 0;
+    m_play_flush  = false;
+
+    m_ref_pos_w = 0;
+    m_ref_pos_r = 0;
 }
 
 audio_async::~audio_async() {
-    if (m_dev_id_in) {
-        SDL_CloseAudioDevice(m_dev_id_in);
-    }
+    // stop the callbacks before the buffers are destroyed
+    m_backend.reset();
 }
 
-bool audio_async::init(int capture_id, int sample_rate) {
-    SDL_LogSetPriority(SDL_LOG_CATEGORY_APPLICATION, SDL_LOG_PRIORITY_INFO);
-
-    if (SDL_Init(SDL_INIT_AUDIO) < 0) {
-        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Couldn't initialize SDL: %s\n", SDL_GetError());
+bool audio_async::init(int capture_id, int sample_rate, const audio_backend_params & backend_params) {
+    m_backend = audio_backend_init(backend_params);
+    if (!m_backend) {
+        fprintf(stderr, "%s: unknown or unavailable audio backend '%s'\n", __func__, backend_params.name.c_str());
         return false;
     }
 
-    SDL_SetHintWithPriority(SDL_HINT_AUDIO_RESAMPLING_MODE, "medium", SDL_HINT_OVERRIDE);
-
-    {
-        int nDevices = SDL_GetNumAudioDevices(SDL_TRUE);
-        fprintf(stderr, "%s: found %d capture devices:\n", __func__, nDevices);
-        for (int i = 0; i < nDevices; i++) {
-            fprintf(stderr, "%s:    - Capture device #%d: '%s'\n", __func__, i, SDL_GetAudioDeviceName(i, SDL_TRUE));
-        }
-    }
-
-    SDL_AudioSpec capture_spec_requested;
-    SDL_AudioSpec capture_spec_obtained;
-
-    SDL_zero(capture_spec_requested);
-    SDL_zero(capture_spec_obtained);
-
-    capture_spec_requested.freq     = sample_rate;
-    capture_spec_requested.format   = AUDIO_F32;
-    capture_spec_requested.channels = 1;
-    capture_spec_requested.samples  = 1024;
-    capture_spec_requested.callback = [](void * userdata, uint8_t * stream, int len) {
-        audio_async * audio = (audio_async *) userdata;
-        audio->callback(stream, len);
-    };
-    capture_spec_requested.userdata = this;
+    m_sample_rate = sample_rate;
 
-    if (capture_id >= 0) {
-        fprintf(stderr, "%s: attempt to open capture device %d : '%s' ...\n", __func__, capture_id, SDL_GetAudioDeviceName(capture_id, SDL_TRUE));
-        m_dev_id_in = SDL_OpenAudioDevice(SDL_GetAudioDeviceName(capture_id, SDL_TRUE), SDL_TRUE, &capture_spec_requested, &capture_spec_obtained, 0);
-    } else {
-        fprintf(stderr, "%s: attempt to open default capture device ...\n", __func__);
-        m_dev_id_in = SDL_OpenAudioDevice(nullptr, SDL_TRUE, &capture_spec_requested, &capture_spec_obtained, 0);
-    }
-
-    if (!m_dev_id_in) {
-        fprintf(stderr, "%s: couldn't open an audio device for capture: %s!\n", __func__, SDL_GetError());
-        m_dev_id_in = 0;
+    // the backend does not call back before resume()
+    m_dev_in = m_backend->open_capture(capture_id, m_sample_rate, [this](uint8_t * stream, int len) {
+        callback(stream, len);
+    });
 
+    if (!m_dev_in) {
         return false;
-    } else {
-        fprintf(stderr, "%s: obtained spec for input device (SDL Id = %d):\n", __func__, m_dev_id_in);
-        fprintf(stderr, "%s:     - sample rate:       %d\n",                   __func__, capture_spec_obtained.freq);
-        fprintf(stderr, "%s:     - format:            %d (required: %d)\n",    __func__, capture_spec_obtained.format,
-                capture_spec_requested.format);
-        fprintf(stderr, "%s:     - channels:          %d (required: %d)\n",    __func__, capture_spec_obtained.channels,
-                capture_spec_requested.channels);
-        fprintf(stderr, "%s:     - samples per frame: %d\n",                   __func__, capture_spec_obtained.samples);
     }
 
-    m_sample_rate = capture_spec_obtained.freq;
-
     m_audio.resize((m_sample_rate*m_len_ms)/1000);
 
     return true;
 }
 
 bool audio_async::resume() {
-    if (!m_dev_id_in) {
+    if (!m_dev_in) {
         fprintf(stderr, "%s: no audio device to resume!\n", __func__);
         return false;
     }
@@ -87,10 +69,7 @@ bool audio_async::resume() {
         return false;
     }
 
-    SDL_PauseAudioDevice(m_dev_id_in, 0);
-    if (m_dev_id_out) {
-        SDL_PauseAudioDevice(m_dev_id_out, 0);
-    }
+    m_backend->resume();
 
     m_running = true;
 
@@ -98,7 +77,7 @@ bool audio_async::resume() {
 }
 
 bool audio_async::pause() {
-    if (!m_dev_id_in) {
+    if (!m_dev_in) {
         fprintf(stderr, "%s: no audio device to pause!\n", __func__);
         return false;
     }
@@ -108,10 +87,7 @@ bool audio_async::pause() {
         return false;
     }
 
-    SDL_PauseAudioDevice(m_dev_id_in, 1);
-    if (m_dev_id_out) {
-        SDL_PauseAudioDevice(m_dev_id_out, 0);
-    }
+    m_backend->pause();
 
     m_running = false;
 
@@ -119,7 +95,7 @@ bool audio_async::pause() {
 }
 
 bool audio_async::clear() {
-    if (!m_dev_id_in) {
+    if (!m_dev_in) {
         fprintf(stderr, "%s: no audio device to clear!\n", __func__);
         return false;
     }
@@ -139,7 +115,7 @@ bool audio_async::clear() {
     return true;
 }
 
-// callback to be called by SDL
+// capture callback, called by the audio backend (SDL, ALSA, file or null) with every captured period
 void audio_async::callback(uint8_t * stream, int len) {
     if (!m_running) {
         return;
@@ -150,30 +126,79 @@ void audio_async::callback(uint8_t * stream, int len) {
     m_audio_new.resize(n_samples);
     memcpy(m_audio_new.data(), stream, n_samples * sizeof(float));
 
+    // the played audio of the same period - silence until the playback has delivered enough of it
+    if (!m_ref_buf.empty()) {
+        m_audio_ref_new.assign(n_samples, 0.0f);
+
+        const uint64_t n_buf = m_ref_buf.size();
+
+        uint64_t       pos_r = m_ref_pos_r.load(std::memory_order_relaxed);
+        const uint64_t pos_w = m_ref_pos_w.load(std::memory_order_acquire);
+
+        uint64_t n_avail = pos_w - pos_r;
+
+        // after a stall skip the stale audio
+        if (n_avail > n_buf/2) {
+            pos_r   = pos_w - std::min<uint64_t>(n_samples, n_avail);
+            n_avail = pos_w - pos_r;
+        }
+
+        if (n_avail >= n_samples) {
+            m_ref_primed = true;
+        }
+
+        if (m_ref_primed) {
+            const size_t n = std::min<size_t>(n_samples, n_avail);
+            for (size_t i = 0; i < n; i++) {
+                m_audio_ref_new[i] = m_ref_buf[(pos_r + i) & (n_buf - 1)];
+            }
+
+            // underrun - wait for the playback to get ahead again
+            if (n < n_samples) {
+                m_ref_primed = false;
+            }
+
+            m_ref_pos_r.store(pos_r + n, std::memory_order_release);
+        }
+    }
+
     //fprintf(stderr, "%s: %zu samples, pos %zu, len %zu\n", __func__, n_samples, m_audio_pos, m_audio_len);
 
     {
         std::lock_guard<std::mutex> lock(m_mutex);
 
+        const bool has_ref = !m_audio_ref.empty() && !m_audio_ref_new.empty();
+
         if (m_audio_pos + n_samples > m_audio.size()) {
             const size_t n0 = m_audio.size() - m_audio_pos;
 
-            memcpy(&m_audio[m_audio_pos], stream, n0 * sizeof(float));
-            memcpy(&m_audio[0], &stream[n0], (n_samples - n0) * sizeof(float));
+            memcpy(&m_audio[m_audio_pos], m_audio_new.data(), n0 * sizeof(float));
+            memcpy(&m_audio[0], &m_audio_new[n0], (n_samples - n0) * sizeof(float));
+
+            if (has_ref) {
+                memcpy(&m_audio_ref[m_audio_pos], m_audio_ref_new.data(), n0 * sizeof(float));
+                memcpy(&m_audio_ref[0], &m_audio_ref_new[n0], (n_samples - n0) * sizeof(float));
+            }
 
             m_audio_pos = (m_audio_pos + n_samples) % m_audio.size();
             m_audio_len = m_audio.size();
         } else {
-            memcpy(&m_audio[m_audio_pos], stream, n_samples * sizeof(float));
+            memcpy(&m_audio[m_audio_pos], m_audio_new.data(), n_samples * sizeof(float));
+
+            if (has_ref) {
+                memcpy(&m_audio_ref[m_audio_pos], m_audio_ref_new.data(), n_samples * sizeof(float));
+            }
 
             m_audio_pos = (m_audio_pos + n_samples) % m_audio.size();
             m_audio_len = std::min(m_audio_len + n_samples, m_audio.size());
         }
+
+        m_audio_total += n_samples;
     }
 }
 
 void audio_async::get(int ms, std::vector<float> & result) {
-    if (!m_dev_id_in) {
+    if (!m_dev_in) {
         fprintf(stderr, "%s: no audio device to get audio from!\n", __func__);
         return;
     }
@@ -192,30 +217,84 @@ void audio_async::get(int ms, std::vector<float> & result) {
             ms = m_len_ms;
         }
 
-        size_t n_samples = (m_sample_rate * ms) / 1000;
-        if (n_samples > m_audio_len) {
-            n_samples = m_audio_len;
-        }
+        get_last((m_sample_rate * ms) / 1000, result);
+    }
+}
+
+void audio_async::get_new(uint64_t & n_read, std::vector<float> & result) {
+    result.clear();
 
-        result.resize(n_samples);
+    if (!m_dev_in || !m_running) {
+        return;
+    }
 
-        int s0 = m_audio_pos - n_samples;
-        if (s0 < 0) {
-            s0 += m_audio.size();
-        }
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        // samples that were overwritten before they were read are lost
+        get_last(m_audio_total - std::min(n_read, m_audio_total), result);
+
+        n_read = m_audio_total;
+    }
+}
+
+void audio_async::get_new(uint64_t & n_read, std::vector<float> & result, std::vector<float> & ref) {
+    result.clear();
+    ref.clear();
 
-        if (s0 + n_samples > m_audio.size()) {
-            const size_t n0 = m_audio.size() - s0;
+    if (!m_dev_in || !m_running) {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        const size_t n_samples = m_audio_total - std::min(n_read, m_audio_total);
 
-            memcpy(result.data(), &m_audio[s0], n0 * sizeof(float));
-            memcpy(&result[n0], &m_audio[0], (n_samples - n0) * sizeof(float));
+        get_last(m_audio, n_samples, result);
+
+        if (m_audio_ref.empty()) {
+            ref.assign(result.size(), 0.0f);
         } else {
-            memcpy(result.data(), &m_audio[s0], n_samples * sizeof(float));
+            get_last(m_audio_ref, n_samples, ref);
         }
+
+        n_read = m_audio_total;
+    }
+}
+
+// must be called with m_mutex held
+void audio_async::get_last(size_t n_samples, std::vector<float> & result) {
+    get_last(m_audio, n_samples, result);
+}
+
+// must be called with m_mutex held
+void audio_async::get_last(const std::vector<float> & src, size_t n_samples, std::vector<float> & result) {
+    if (n_samples > m_audio_len) {
+        n_samples = m_audio_len;
+    }
+
+    result.resize(n_samples);
+
+    int s0 = m_audio_pos - n_samples;
+    if (s0 < 0) {
+        s0 += src.size();
+    }
+
+    if (s0 + n_samples > src.size()) {
+        const size_t n0 = src.size() - s0;
+
+        memcpy(result.data(), &src[s0], n0 * sizeof(float));
+        memcpy(&result[n0], &src[0], (n_samples - n0) * sizeof(float));
+    } else {
+        memcpy(result.data(), &src[s0], n_samples * sizeof(float));
     }
 }
 
 bool sdl_poll_events() {
+#ifdef WHISPER_NO_SDL
+    return true;
+#else
     SDL_Event event;
     while (SDL_PollEvent(&event)) {
         switch (event.type) {
@@ -229,86 +308,559 @@ bool sdl_poll_events() {
     }
 
     return true;
+#endif
 }
 
 
 bool audio_async::play_init(int capture_id) {
-    //playback
-    {
-        int nDevices = SDL_GetNumAudioDevices(0);
-        fprintf(stderr, "%s: found %d playback devices:\n", __func__, nDevices);
-        for (int i = 0; i < nDevices; i++) {
-            fprintf(stderr, "%s:    - Capture device #%d: '%s'\n", __func__, i, SDL_GetAudioDeviceName(i, 0));
-        }
+    if (!m_backend) {
+        fprintf(stderr, "%s: init() has to be called first!\n", __func__);
+        return false;
     }
 
-    SDL_AudioSpec playback_spec_requested;
-    SDL_AudioSpec playback_spec_obtained;
+    // the ring buffer must exist before the device starts calling back
+    // 2^19 samples is ~32 seconds of audio, play_write() waits for free space when it is full
+    m_play_buf.assign(1 << 19, 0);
+    m_play_pos_w = 0;
+    m_play_pos_r = 0;
+    m_play_t_end = 0;
 
-    SDL_zero(playback_spec_requested);
-    SDL_zero(playback_spec_obtained);
+    // the played audio is kept next to the captured audio as the reference for echo cancellation
+    m_ref_buf.assign(1 << 14, 0.0f);
+    m_ref_pos_w = 0;
+    m_ref_pos_r = 0;
 
-    playback_spec_requested.freq     = 16000;
-    playback_spec_requested.format   = AUDIO_S16SYS;
-    playback_spec_requested.channels = 1;
-    playback_spec_requested.samples  = 1024;
-    playback_spec_requested.callback = NULL;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
 
-    if (capture_id >= 0) {
-        fprintf(stderr, "%s: attempt to open playback device %d : '%s' ...\n", __func__, capture_id, SDL_GetAudioDeviceName(capture_id, 0));
-        m_dev_id_out = SDL_OpenAudioDevice(SDL_GetAudioDeviceName(capture_id, 0), 0, &playback_spec_requested, &playback_spec_obtained, 0);
-    } else {
-        fprintf(stderr, "%s: attempt to open default playback device ...\n", __func__);
-        m_dev_id_out = SDL_OpenAudioDevice(nullptr, 0, &playback_spec_requested, &playback_spec_obtained, 0);
+        m_audio_ref.assign(m_audio.size(), 0.0f);
     }
 
-    if (!m_dev_id_out) {
-        fprintf(stderr, "%s: couldn't open an audio device for playback: %s!\n", __func__, SDL_GetError());
-        m_dev_id_out = 0;
+    m_play_sample_rate = 16000;
+
+    m_dev_out = m_backend->open_playback(capture_id, m_play_sample_rate, [this](uint8_t * stream, int len) {
+        play_callback(stream, len);
+    });
 
+    if (!m_dev_out) {
         return false;
-    } else {
-        fprintf(stderr, "%s: obtained spec for output device (SDL Id = %d):\n", __func__, m_dev_id_out);
-        fprintf(stderr, "%s:     - sample rate:       %d\n",                   __func__, playback_spec_obtained.freq);
-        fprintf(stderr, "%s:     - format:            %d (required: %d)\n",    __func__, playback_spec_obtained.format,
-                playback_spec_requested.format);
-        fprintf(stderr, "%s:     - channels:          %d (required: %d)\n",    __func__, playback_spec_obtained.channels,
-                playback_spec_requested.channels);
-        fprintf(stderr, "%s:     - samples per frame: %d\n",                   __func__, playback_spec_obtained.samples);
     }
+
+    m_play_samples = m_backend->playback_latency();
+
     return true;
 }
 
 void audio_async::play_write(const char * video_buff, int buff_len) {
-    if (!m_running) {
+    if (!m_running || !m_dev_out || m_play_flush) {
+        return;
+    }
+
+    const int16_t * src = (const int16_t *) video_buff;
+
+    const uint64_t n_buf = m_play_buf.size();
+
+    size_t n_samples = buff_len / sizeof(int16_t);
+
+    uint64_t pos_w = m_play_pos_w.load(std::memory_order_relaxed);
+
+    while (n_samples > 0) {
+        const uint64_t n_free = n_buf - (pos_w - m_play_pos_r.load(std::memory_order_acquire));
+        if (m_play_flush) {
+            return;
+        }
+
+        if (n_free == 0) {
+            // the ring buffer is full - wait for the device to play some of it
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            continue;
+        }
+
+        const size_t i0 = pos_w & (n_buf - 1);
+        const size_t n  = std::min<size_t>({ n_samples, (size_t) n_free, (size_t) (n_buf - i0) });
+
+        memcpy(&m_play_buf[i0], src, n*sizeof(int16_t));
+
+        src       += n;
+        n_samples -= n;
+        pos_w     += n;
+
+        m_play_pos_w.store(pos_w, std::memory_order_release);
+    }
+}
+
+// playback callback, called by the audio backend with the buffer to fill for the next period
+void audio_async::play_callback(uint8_t * stream, int len) {
+    int16_t * dst = (int16_t *) stream;
+
+    const uint64_t n_buf = m_play_buf.size();
+
+    const size_t n_samples = len / sizeof(int16_t);
+
+    uint64_t       pos_r = m_play_pos_r.load(std::memory_order_relaxed);
+    const uint64_t pos_w = m_play_pos_w.load(std::memory_order_acquire);
+
+    if (m_play_flush) {
+        pos_r = pos_w;
+    }
+
+    const size_t n = std::min<size_t>(n_samples, pos_w - pos_r);
+
+    const size_t i0 = pos_r & (n_buf - 1);
+    const size_t n0 = std::min<size_t>(n, n_buf - i0);
+
+    memcpy(dst, &m_play_buf[i0], n0*sizeof(int16_t));
+    memcpy(dst + n0, &m_play_buf[0], (n - n0)*sizeof(int16_t));
+
+    // silence for the rest of the device buffer
+    memset(dst + n, 0, (n_samples - n)*sizeof(int16_t));
+
+    // everything that is played is the echo cancellation reference for the captured audio
+    {
+        const uint64_t n_ref  = m_ref_buf.size();
+        const uint64_t ref_w  = m_ref_pos_w.load(std::memory_order_relaxed);
+        const uint64_t n_free = n_ref - (ref_w - m_ref_pos_r.load(std::memory_order_acquire));
+
+        // drop it when the capture is not running
+        if (n_free >= n_samples) {
+            for (size_t i = 0; i < n_samples; i++) {
+                m_ref_buf[(ref_w + i) & (n_ref - 1)] = dst[i]/32768.0f;
+            }
+
+            m_ref_pos_w.store(ref_w + n_samples, std::memory_order_release);
+        }
+    }
+
+    if (pos_r != m_play_pos_r.load(std::memory_order_relaxed)) {
+        // flushed
+        m_play_pos_r.store(pos_r, std::memory_order_release);
+
+        std::lock_guard<std::mutex> lock(m_play_mutex);
+        m_play_cv.notify_all();
+    }
+
+    if (n == 0) {
         return;
     }
-    // Allocate memory for playback buffer
-    SDL_QueueAudio(m_dev_id_out, video_buff, buff_len);
+
+    // the samples of this buffer are heard after the buffer that the device is currently playing
+    m_play_t_end.store(play_time_us() + (int64_t) (n + m_play_samples)*1000000/m_play_sample_rate, std::memory_order_relaxed);
+    m_play_pos_r.store(pos_r + n, std::memory_order_release);
+
+    if (pos_r + n == pos_w) {
+        // the ring buffer has been drained - wake up play_wait()
+        std::lock_guard<std::mutex> lock(m_play_mutex);
+        m_play_cv.notify_all();
+    }
 }
 
-int audio_async::play_wait() {
-    if (!m_running) {
+int audio_async::play_wait(bool poll_events) {
+    if (!m_running || !m_dev_out) {
         return -1;
     }
-    int ret = 0;
-    int cnt = 0;
 
-    while (SDL_GetQueuedAudioSize(m_dev_id_out) > 2000) {
-        if (sdl_poll_events() == false) {
-            ret = -1;
-            break;
+    const uint64_t pos_end = m_play_pos_w.load(std::memory_order_acquire);
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(m_play_mutex);
+
+            // wake up periodically to handle the SDL events
+            const bool done = m_play_cv.wait_for(lock, std::chrono::milliseconds(100), [&] {
+                return m_play_pos_r.load(std::memory_order_acquire) >= pos_end;
+            });
+
+            if (done) {
+                break;
+            }
         }
-        if (cnt%3 == 0){
-            fprintf(stderr, "SDL_GetQueuedAudioSize: %d\n", SDL_GetQueuedAudioSize(m_dev_id_out));
+
+        if (poll_events && sdl_poll_events() == false) {
+            return -1;
         }
-        cnt++;
-        SDL_Delay(1000);
     }
 
-    SDL_Delay(1000);
-    SDL_ClearQueuedAudio(m_dev_id_out);
-    fprintf(stderr, "SDL_GetQueuedAudioSize: %d\n", SDL_GetQueuedAudioSize(m_dev_id_out));
-    return ret;
+    if (m_play_flush) {
+        m_play_flush = false;
+
+        return 1;
+    }
+
+    // all samples are in the device buffers - wait until the last one has been played
+    const int64_t t_wait = m_play_t_end.load(std::memory_order_relaxed) - play_time_us();
+    if (t_wait > 0) {
+        std::this_thread::sleep_for(std::chrono::microseconds(t_wait));
+    }
+
+    return 0;
+}
+
+void audio_async::play_flush() {
+    m_play_flush = true;
 }
 
+#ifndef WHISPER_NO_SDL
+
+//
+// SDL backend
+//
+
+class audio_backend_sdl : public audio_backend {
+public:
+    ~audio_backend_sdl() override {
+        if (m_dev_id_in) {
+            SDL_CloseAudioDevice(m_dev_id_in);
+        }
+        if (m_dev_id_out) {
+            SDL_CloseAudioDevice(m_dev_id_out);
+        }
+    }
+
+    bool open_capture(int capture_id, int & sample_rate, audio_stream_callback callback) override {
+        SDL_LogSetPriority(SDL_LOG_CATEGORY_APPLICATION, SDL_LOG_PRIORITY_INFO);
+
+        if (SDL_Init(SDL_INIT_AUDIO) < 0) {
+            SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Couldn't initialize SDL: %s\n", SDL_GetError());
+            return false;
+        }
+
+        SDL_SetHintWithPriority(SDL_HINT_AUDIO_RESAMPLING_MODE, "medium", SDL_HINT_OVERRIDE);
+
+        {
+            int nDevices = SDL_GetNumAudioDevices(SDL_TRUE);
+            fprintf(stderr, "%s: found %d capture devices:\n", __func__, nDevices);
+            for (int i = 0; i < nDevices; i++) {
+                fprintf(stderr, "%s:    - Capture device #%d: '%s'\n", __func__, i, SDL_GetAudioDeviceName(i, SDL_TRUE));
+            }
+        }
+
+        m_callback_in = callback;
+
+        SDL_AudioSpec capture_spec_requested;
+        SDL_AudioSpec capture_spec_obtained;
+
+        SDL_zero(capture_spec_requested);
+        SDL_zero(capture_spec_obtained);
+
+        capture_spec_requested.freq     = sample_rate;
+        capture_spec_requested.format   = AUDIO_F32;
+        capture_spec_requested.channels = 1;
+        capture_spec_requested.samples  = 1024;
+        capture_spec_requested.callback = [](void * userdata, uint8_t * stream, int len) {
+            audio_backend_sdl * backend = (audio_backend_sdl *) userdata;
+            backend->m_callback_in(stream, len);
+        };
+        capture_spec_requested.userdata = this;
+
+        if (capture_id >= 0) {
+            fprintf(stderr, "%s: attempt to open capture device %d : '%s' ...\n", __func__, capture_id, SDL_GetAudioDeviceName(capture_id, SDL_TRUE));
+            m_dev_id_in = SDL_OpenAudioDevice(SDL_GetAudioDeviceName(capture_id, SDL_TRUE), SDL_TRUE, &capture_spec_requested, &capture_spec_obtained, 0);
+        } else {
+            fprintf(stderr, "%s: attempt to open default capture device ...\n", __func__);
+            m_dev_id_in = SDL_OpenAudioDevice(nullptr, SDL_TRUE, &capture_spec_requested, &capture_spec_obtained, 0);
+        }
+
+        if (!m_dev_id_in) {
+            fprintf(stderr, "%s: couldn't open an audio device for capture: %s!\n", __func__, SDL_GetError());
+            m_dev_id_in = 0;
+
+            return false;
+        } else {
+            fprintf(stderr, "%s: obtained spec for input device (SDL Id = %d):\n", __func__, m_dev_id_in);
+            fprintf(stderr, "%s:     - sample rate:       %d\n",                   __func__, capture_spec_obtained.freq);
+            fprintf(stderr, "%s:     - format:            %d (required: %d)\n",    __func__, capture_spec_obtained.format,
+                    capture_spec_requested.format);
+            fprintf(stderr, "%s:     - channels:          %d (required: %d)\n",    __func__, capture_spec_obtained.channels,
+                    capture_spec_requested.channels);
+            fprintf(stderr, "%s:     - samples per frame: %d\n",                   __func__, capture_spec_obtained.samples);
+        }
+
+        sample_rate = capture_spec_obtained.freq;
+
+        return true;
+    }
+
+    bool open_playback(int capture_id, int sample_rate, audio_stream_callback callback) override {
+        //playback
+        {
+            int nDevices = SDL_GetNumAudioDevices(0);
+            fprintf(stderr, "%s: found %d playback devices:\n", __func__, nDevices);
+            for (int i = 0; i < nDevices; i++) {
+                fprintf(stderr, "%s:    - Capture device #%d: '%s'\n", __func__, i, SDL_GetAudioDeviceName(i, 0));
+            }
+        }
+
+        m_callback_out = callback;
+
+        SDL_AudioSpec playback_spec_requested;
+        SDL_AudioSpec playback_spec_obtained;
+
+        SDL_zero(playback_spec_requested);
+        SDL_zero(playback_spec_obtained);
+
+        playback_spec_requested.freq     = sample_rate;
+        playback_spec_requested.format   = AUDIO_S16SYS;
+        playback_spec_requested.channels = 1;
+        playback_spec_requested.samples  = 1024;
+        playback_spec_requested.callback = [](void * userdata, uint8_t * stream, int len) {
+            audio_backend_sdl * backend = (audio_backend_sdl *) userdata;
+            backend->m_callback_out(stream, len);
+        };
+        playback_spec_requested.userdata = this;
+
+        if (capture_id >= 0) {
+            fprintf(stderr, "%s: attempt to open playback device %d : '%s' ...\n", __func__, capture_id, SDL_GetAudioDeviceName(capture_id, 0));
+            m_dev_id_out = SDL_OpenAudioDevice(SDL_GetAudioDeviceName(capture_id, 0), 0, &playback_spec_requested, &playback_spec_obtained, 0);
+        } else {
+            fprintf(stderr, "%s: attempt to open default playback device ...\n", __func__);
+            m_dev_id_out = SDL_OpenAudioDevice(nullptr, 0, &playback_spec_requested, &playback_spec_obtained, 0);
+        }
+
+        if (!m_dev_id_out) {
+            fprintf(stderr, "%s: couldn't open an audio device for playback: %s!\n", __func__, SDL_GetError());
+            m_dev_id_out = 0;
+
+            return false;
+        } else {
+            fprintf(stderr, "%s: obtained spec for output device (SDL Id = %d):\n", __func__, m_dev_id_out);
+            fprintf(stderr, "%s:     - sample rate:       %d\n",                   __func__, playback_spec_obtained.freq);
+            fprintf(stderr, "%s:     - format:            %d (required: %d)\n",    __func__, playback_spec_obtained.format,
+                    playback_spec_requested.format);
+            fprintf(stderr, "%s:     - channels:          %d (required: %d)\n",    __func__, playback_spec_obtained.channels,
+                    playback_spec_requested.channels);
+            fprintf(stderr, "%s:     - samples per frame: %d\n",                   __func__, playback_spec_obtained.samples);
+        }
+
+        // no changes were allowed when opening the device, so SDL converts from the requested format and rate
+        m_latency = playback_spec_obtained.samples;
+
+        return true;
+    }
+
+    void resume() override {
+        SDL_PauseAudioDevice(m_dev_id_in, 0);
+        if (m_dev_id_out) {
+            SDL_PauseAudioDevice(m_dev_id_out, 0);
+        }
+    }
+
+    void pause() override {
+        SDL_PauseAudioDevice(m_dev_id_in, 1);
+    }
+
+    int playback_latency() const override {
+        return m_latency;
+    }
+
+private:
+    SDL_AudioDeviceID m_dev_id_in  = 0;
+    SDL_AudioDeviceID m_dev_id_out = 0;
+
+    audio_stream_callback m_callback_in;
+    audio_stream_callback m_callback_out;
+
+    int m_latency = 0;
+};
+
+#endif // WHISPER_NO_SDL
+
+//
+// file / null backend
+//
+// the audio is moved in periods at the pace of the sample rate, so the callers see the same timing as with a device
+//
+
+class audio_backend_file : public audio_backend {
+public:
+    audio_backend_file(const audio_backend_params & params) : m_params(params) {
+        m_running = false;
+        m_capture = false;
+    }
+
+    ~audio_backend_file() override {
+        m_running = false;
+        if (m_worker.joinable()) {
+            m_worker.join();
+        }
+
+        if (m_fout) {
+            // the sizes in the WAV header are known now
+            if (m_wav) {
+                wav_header_write((uint32_t) (ftell(m_fout) - 44));
+            }
+
+            fclose(m_fout);
+        }
+    }
+
+    bool open_capture(int /*capture_id*/, int & sample_rate, audio_stream_callback callback) override {
+        if (!m_params.device_in.empty()) {
+            std::vector<std::vector<float>> pcmf32s;
+            if (!::read_wav(m_params.device_in, m_pcmf32, pcmf32s, false)) {
+                fprintf(stderr, "%s: failed to read '%s'\n", __func__, m_params.device_in.c_str());
+                return false;
+            }
+
+            fprintf(stderr, "%s: capturing '%s' (%.1f s)\n", __func__, m_params.device_in.c_str(), (float) m_pcmf32.size()/COMMON_SAMPLE_RATE);
+        }
+
+        // read_wav() only accepts 16 kHz audio
+        sample_rate = COMMON_SAMPLE_RATE;
+
+        m_sample_rate = sample_rate;
+        m_callback_in = callback;
+
+        return true;
+    }
+
+    bool open_playback(int /*capture_id*/, int sample_rate, audio_stream_callback callback) override {
+        if (sample_rate != m_sample_rate) {
+            fprintf(stderr, "%s: the playback has to use the capture sample rate %d\n", __func__, m_sample_rate);
+            return false;
+        }
+
+        if (!m_params.device_out.empty()) {
+            m_fout = fopen(m_params.device_out.c_str(), "wb");
+            if (!m_fout) {
+                fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, m_params.device_out.c_str());
+                return false;
+            }
+
+            const std::string & fname = m_params.device_out;
+            m_wav = fname.size() > 4 && fname.compare(fname.size() - 4, 4, ".wav") == 0;
+
+            if (m_wav) {
+                wav_header_write(0);
+            }
+        }
+
+        m_callback_out = callback;
+
+        return true;
+    }
+
+    void resume() override {
+        m_capture = true;
+
+        if (!m_running) {
+            m_running = true;
+            m_worker  = std::thread([this]() { run(); });
+        }
+    }
+
+    void pause() override {
+        m_capture = false;
+    }
+
+    int playback_latency() const override {
+        return m_params.period_size;
+    }
+
+    bool capture_ended() const override {
+        return !m_pcmf32.empty() && m_pos >= m_pcmf32.size();
+    }
+
+private:
+    // 16-bit mono PCM, written again with the size of the data when the file is closed
+    void wav_header_write(uint32_t n_data) {
+        const uint32_t byte_rate = m_sample_rate*sizeof(int16_t);
+
+        uint8_t header[44];
+
+        const auto put_u32 = [&](int pos, uint32_t v) { for (int i = 0; i < 4; i++) header[pos + i] = (v >> (8*i)) & 0xff; };
+        const auto put_u16 = [&](int pos, uint16_t v) { for (int i = 0; i < 2; i++) header[pos + i] = (v >> (8*i)) & 0xff; };
+
+        memcpy(header +  0, "RIFF", 4); put_u32( 4, 36 + n_data);
+        memcpy(header +  8, "WAVE", 4);
+        memcpy(header + 12, "fmt ", 4); put_u32(16, 16);
+        put_u16(20, 1);                 // PCM
+        put_u16(22, 1);                 // mono
+        put_u32(24, m_sample_rate);
+        put_u32(28, byte_rate);
+        put_u16(32, sizeof(int16_t));   // block align
+        put_u16(34, 16);                // bits per sample
+        memcpy(header + 36, "data", 4); put_u32(40, n_data);
+
+        fseek(m_fout, 0, SEEK_SET);
+        fwrite(header, 1, sizeof(header), m_fout);
+        fseek(m_fout, 0, SEEK_END);
+    }
+
+    void run() {
+        const int n_period = std::max(1, m_params.period_size);
+
+        std::vector<float>   pcmf32(n_period);
+        std::vector<int16_t> pcm16(n_period);
+
+        auto t_next = std::chrono::steady_clock::now();
+
+        while (m_running) {
+            t_next += std::chrono::microseconds((int64_t) n_period*1000000/m_sample_rate);
+            std::this_thread::sleep_until(t_next);
+
+            if (m_callback_out) {
+                m_callback_out((uint8_t *) pcm16.data(), n_period*sizeof(int16_t));
+
+                if (m_fout) {
+                    fwrite(pcm16.data(), sizeof(int16_t), n_period, m_fout);
+                }
+            }
+
+            if (m_capture) {
+                // silence after the end of the file
+                size_t pos = m_pos;
+                for (int i = 0; i < n_period; i++) {
+                    pcmf32[i] = pos < m_pcmf32.size() ? m_pcmf32[pos++] : 0.0f;
+                }
+                m_pos = pos;
+
+                m_callback_in((uint8_t *) pcmf32.data(), n_period*sizeof(float));
+            }
+        }
+    }
+
+    audio_backend_params m_params;
+
+    int m_sample_rate = 0;
+
+    audio_stream_callback m_callback_in;
+    audio_stream_callback m_callback_out;
+
+    std::vector<float>  m_pcmf32;
+    std::atomic<size_t> m_pos { 0 };
+
+    FILE * m_fout = nullptr;
+    bool   m_wav  = false;
+
+    std::atomic_bool m_running;
+    std::atomic_bool m_capture;
+    std::thread      m_worker;
+};
+
+std::unique_ptr<audio_backend> audio_backend_init(const audio_backend_params & params) {
+#ifndef WHISPER_NO_SDL
+    if (params.name == "sdl") {
+        return std::unique_ptr<audio_backend>(new audio_backend_sdl());
+    }
+#endif
+
+    if (params.name == "file") {
+        return std::unique_ptr<audio_backend>(new audio_backend_file(params));
+    }
+
+    if (params.name == "null") {
+        audio_backend_params params_null = params;
+        params_null.device_in.clear();
+        params_null.device_out.clear();
+
+        return std::unique_ptr<audio_backend>(new audio_backend_file(params_null));
+    }
+
+#ifdef WHISPER_ALSA
+    if (params.name == "alsa") {
+        return audio_backend_alsa_init(params);
+    }
+#endif
+
+    return nullptr;
+}
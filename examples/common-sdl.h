@@ -1,15 +1,70 @@
 #pragma once
 
-#include <SDL.h>
-#include <SDL_audio.h>
-
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
 #include <vector>
 #include <mutex>
 
 //
-// SDL Audio capture
+// Audio device backends
+//
+// The backend moves the audio between the devices and audio_async from its own thread: the capture callback gets
+// mono float samples and the playback callback is asked for mono 16-bit samples at 16 kHz.
+// SDL is the default, ALSA is available when built with WHISPER_ALSA and WHISPER_NO_SDL builds without SDL2 (e.g.
+// headless with the file backend). The file backend captures a WAV file and writes the played audio to a raw 16-bit
+// file (or a WAV file for a .wav name) in real time, without both it is a null device.
+//
+
+typedef std::function<void(uint8_t * stream, int len)> audio_stream_callback;
+
+struct audio_backend_params {
+    std::string name = "sdl";        // sdl, alsa, file or null
+
+    std::string device_in;           // alsa: capture PCM (default: plughw:<capture id> or default), file: WAV to capture
+    std::string device_out;          // alsa: playback PCM, file: raw 16-bit or .wav file for the played audio
+
+    int32_t     period_size = 256;   // alsa, file: frames per period
+    int32_t     n_periods   = 3;     // alsa: periods in the device buffer
+
+    bool        capture_f32 = false; // alsa: capture float samples instead of 16-bit
+};
+
+class audio_backend {
+public:
+    virtual ~audio_backend() {}
+
+    // sample_rate is updated with the rate of the device
+    virtual bool open_capture (int capture_id, int & sample_rate, audio_stream_callback callback) = 0;
+    virtual bool open_playback(int capture_id, int   sample_rate, audio_stream_callback callback) = 0;
+
+    // start / stop the capture, the playback runs from the first resume() on
+    virtual void resume() = 0;
+    virtual void pause()  = 0;
+
+    // samples that are buffered by the playback device (for the latency of the playback)
+    virtual int playback_latency() const = 0;
+
+    // number of overruns / underruns of the devices
+    virtual uint64_t n_xruns() const { return 0; }
+
+    // all audio of a finite source has been captured (file backend)
+    virtual bool capture_ended() const { return false; }
+};
+
+// returns nullptr for an unknown or unavailable backend
+std::unique_ptr<audio_backend> audio_backend_init(const audio_backend_params & params);
+
+#ifdef WHISPER_ALSA
+std::unique_ptr<audio_backend> audio_backend_alsa_init(const audio_backend_params & params);
+#endif
+
+//
+// Audio capture and playback
 //
 
 class audio_async {
@@ -17,27 +72,48 @@ public:
     audio_async(int len_ms);
     ~audio_async();
 
-    bool init(int capture_id, int sample_rate);
+    bool init(int capture_id, int sample_rate, const audio_backend_params & backend_params = audio_backend_params());
 
-    // start capturing audio via the provided SDL callback
+    // start capturing audio via the provided callback
     // keep last len_ms seconds of audio in a circular buffer
     bool resume();
     bool pause();
     bool clear();
 
-    // callback to be called by SDL
+    // callback to be called by the backend
     void callback(uint8_t * stream, int len);
 
     // get audio data from the circular buffer
     void get(int ms, std::vector<float> & audio);
 
+    // get the audio captured since the previous call - n_read is the number of samples read so far, start with 0
+    void get_new(uint64_t & n_read, std::vector<float> & audio);
+
+    // same as above, ref gets the played audio that is aligned with the captured audio (echo cancellation reference)
+    void get_new(uint64_t & n_read, std::vector<float> & audio, std::vector<float> & ref);
+
+    // playback of 16-bit mono audio at 16 kHz via the provided callback
+    // play_write() queues the samples in a ring buffer that is drained by play_callback()
+    // play_wait() blocks until the last queued sample has been played by the device
+    // play_flush() drops the queued audio and the audio written until the next play_wait(), which then returns 1
+    // play_wait() handles the SDL events while it waits unless poll_events is false (when called off the main thread)
     bool play_init(int capture_id);
     void play_write(const char * video_buff, int buff_len);
-    int play_wait();
+    int play_wait(bool poll_events = true);
+    void play_flush();
+
+    // callback to be called by the backend for the playback device
+    void play_callback(uint8_t * stream, int len);
+
+    uint64_t n_xruns() const { return m_backend ? m_backend->n_xruns() : 0; }
+
+    bool capture_ended() const { return m_backend && m_backend->capture_ended(); }
 
 private:
-    SDL_AudioDeviceID m_dev_id_in = 0;
-    SDL_AudioDeviceID m_dev_id_out = 0;
+    std::unique_ptr<audio_backend> m_backend;
+
+    bool m_dev_in  = false;
+    bool m_dev_out = false;
 
     int m_len_ms = 0;
     int m_sample_rate = 0;
@@ -46,9 +122,35 @@ private:
     std::mutex       m_mutex;
 
     std::vector<float> m_audio;
+    std::vector<float> m_audio_ref; // played audio at the same positions as m_audio, only with playback
     std::vector<float> m_audio_new;
+    std::vector<float> m_audio_ref_new;
     size_t             m_audio_pos = 0;
     size_t             m_audio_len = 0;
+    uint64_t           m_audio_total = 0; // number of samples captured since init
+
+    void get_last(size_t n_samples, std::vector<float> & audio);
+    void get_last(const std::vector<float> & src, size_t n_samples, std::vector<float> & audio);
+
+    // single producer (play_write) / single consumer (play_callback) ring buffer
+    // the positions count the samples written / played since play_init and are only increased
+    std::vector<int16_t>  m_play_buf;
+    std::atomic<uint64_t> m_play_pos_w;
+    std::atomic<uint64_t> m_play_pos_r;
+    std::atomic<int64_t>  m_play_t_end; // steady_clock time in us when the device has played the consumed samples
+    std::atomic_bool      m_play_flush;
+
+    // played audio on its way from play_callback() to callback(), also single producer / single consumer
+    std::vector<float>    m_ref_buf;
+    std::atomic<uint64_t> m_ref_pos_w;
+    std::atomic<uint64_t> m_ref_pos_r;
+    bool                  m_ref_primed = false;
+
+    int m_play_sample_rate = 0;
+    int m_play_samples     = 0; // samples buffered by the device
+
+    std::mutex              m_play_mutex;
+    std::condition_variable m_play_cv;
 };
 
 // Return false if need to quit
@@ -86,6 +86,7 @@ struct whisper_params {
     bool print_colors    = false;
     bool print_progress  = false;
     bool no_timestamps   = false;
+    bool kv_q8_0         = false;
 
     std::string language  = "en";
     std::string prompt;
@@ -97,6 +98,8 @@ struct whisper_params {
 
     std::string openvino_encode_device = "CPU";
 
+    std::string fname_profile; // Chrome trace of the graph computations
+
     std::vector<std::string> fname_inp = {};
     std::vector<std::string> fname_out = {};
 };
@@ -158,6 +161,8 @@ bool whisper_params_parse(int argc, char ** argv, whisper_params & params) {
         else if (arg == "-m"    || arg == "--model")           { params.model           = argv[++i]; }
         else if (arg == "-f"    || arg == "--file")            { params.fname_inp.emplace_back(argv[++i]); }
         else if (arg == "-oved" || arg == "--ov-e-device")     { params.openvino_encode_device = argv[++i]; }
+        else if (arg == "-pf"   || arg == "--profile")         { params.fname_profile   = argv[++i]; }
+        else if (arg == "-kvq"  || arg == "--kv-q8-0")         { params.kv_q8_0         = true; }
         else {
             fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
             whisper_print_usage(argc, argv, params);
@@ -211,6 +216,8 @@ void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & para
     fprintf(stderr, "  -m FNAME,  --model FNAME       [%-7s] model path\n",                                     params.model.c_str());
     fprintf(stderr, "  -f FNAME,  --file FNAME        [%-7s] input WAV file path\n",                            "");
     fprintf(stderr, "  -oved D,   --ov-e-device DNAME [%-7s] the OpenVINO device used for encode inference\n",  params.openvino_encode_device.c_str());
+    fprintf(stderr, "  -pf FNAME, --profile FNAME     [%-7s] profile the graph ops and save a Chrome trace\n",    params.fname_profile.c_str());
+    fprintf(stderr, "  -kvq,      --kv-q8-0           [%-7s] store the KV caches as Q8_0 (less memory)\n",       params.kv_q8_0 ? "true" : "false");
     fprintf(stderr, "\n");
 }
 
@@ -813,9 +820,19 @@ int main(int argc, char ** argv) {
         return 3;
     }
 
+    if (params.kv_q8_0 && whisper_ctx_set_kv_q8_0(ctx, true) != 0) {
+        fprintf(stderr, "error: failed to use a Q8_0 KV cache\n");
+        whisper_free(ctx);
+        return 3;
+    }
+
     // initialize openvino encoder. this has no effect on whisper.cpp builds that don't have OpenVINO configured
     whisper_ctx_init_openvino_encoder(ctx, nullptr, params.openvino_encode_device.c_str(), nullptr);
 
+    if (!params.fname_profile.empty()) {
+        whisper_profile_enable(ctx, true);
+    }
+
     for (int f = 0; f < (int) params.fname_inp.size(); ++f) {
         const auto fname_inp = params.fname_inp[f];
 		const auto fname_out = f < (int) params.fname_out.size() && !params.fname_out[f].empty() ? params.fname_out[f] : params.fname_inp[f];
@@ -971,6 +988,12 @@ int main(int argc, char ** argv) {
     }
 
     whisper_print_timings(ctx);
+
+    if (!params.fname_profile.empty()) {
+        whisper_profile_print(ctx);
+        whisper_profile_save_trace(ctx, params.fname_profile.c_str());
+    }
+
     whisper_free(ctx);
 
     return 0;
@@ -1,4 +1,5 @@
 #include "ggml.h"
+#include "whisper.h"
 
 #include "common.h"
 #include "common-ggml.h"
@@ -164,7 +165,12 @@ bool whisper_model_quantize(const std::string & fname_inp, const std::string & f
         "decoder.positional_embedding",
     };
 
-    if (!ggml_common_quantize_0(finp, fout, ftype, { ".*" }, to_skip)) {
+    // the k-quant types depend on the tensor - see whisper_model_tensor_type()
+    const auto tensor_type = [ftype](const std::string & name, int n_per_row) {
+        return (ggml_type) whisper_model_tensor_type(ftype, name.c_str(), n_per_row);
+    };
+
+    if (!ggml_common_quantize_0(finp, fout, ftype, { ".*" }, to_skip, tensor_type)) {
         fprintf(stderr, "%s: failed to quantize model '%s'\n", __func__, fname_inp.c_str());
         return false;
     }
@@ -0,0 +1,195 @@
+# End-to-end latency benchmark of r3_talk
+#
+# Usage: python3 bench-latency.py --prompt hi-whisper.wav --runs 5 cmd1.wav cmd2.wav -- -m ./models/ggml-tiny.en.bin -pm ./voice.onnx
+#
+# The recordings of the commands (16 kHz, mono, 16-bit) are joined into one scenario, separated by enough silence for
+# the replies, which r3_talk captures in real time with the file audio backend once it is ready. The recording of the
+# activation phrase is enrolled as the wake word and r3_talk stays awake, so every command is answered. The chat
+# requests go to a local mock server (mock-chat.py) with a fixed time to the first token and token rate, so the numbers
+# do not depend on the network. Every run appends the latencies of its turns to a JSON lines file, the median
+# and the 90th percentile of every metric over all runs are printed at the end (and written with --summary).
+#
+# The latencies are measured from the end of the spoken command:
+#
+#  - endpoint:    the endpointer has ended the command
+#  - asr:         the command has been transcribed
+#  - first text:  the first piece of the reply has arrived
+#  - first audio: the first synthesized audio is played
+#  - end:         the playback of the reply has ended
+#
+
+import argparse
+import json
+import os
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+import wave
+
+SAMPLE_RATE = 16000
+
+METRICS = ["endpoint_ms", "asr_ms", "first_text_ms", "first_audio_ms", "end_ms"]
+
+script_dir = os.path.dirname(os.path.abspath(__file__))
+
+argv = sys.argv[1:]
+passthrough = []
+if "--" in argv:
+    passthrough = argv[argv.index("--") + 1:]
+    argv        = argv[:argv.index("--")]
+
+parser = argparse.ArgumentParser(description="r3_talk end-to-end latency benchmark, arguments after -- are passed to r3_talk")
+parser.add_argument("commands", nargs="+", help="WAV recordings of the commands")
+parser.add_argument("--prompt",       required=True, help="WAV recording of the activation phrase, enrolled as the wake word")
+parser.add_argument("--r3-talk",      default="./r3_talk")
+parser.add_argument("--runs",         type=int,   default=5)
+parser.add_argument("--lead-s",       type=float, default=1.0, help="silence before the first command")
+parser.add_argument("--gap-s",        type=float, default=8.0, help="silence after every command, long enough for the reply")
+parser.add_argument("--ttfb-ms",      type=float, default=300.0)
+parser.add_argument("--tokens-per-s", type=float, default=40.0)
+parser.add_argument("--reply",        default=None, help="reply of the mock server")
+parser.add_argument("--out-dir",      default=None, help="keep the scenario, the played audio and the logs here")
+parser.add_argument("--summary",      default=None, help="write the aggregated latencies to this JSON file")
+args = parser.parse_args(argv)
+
+
+def read_pcm(fname):
+    with wave.open(fname, "rb") as w:
+        if w.getframerate() != SAMPLE_RATE or w.getnchannels() != 1 or w.getsampwidth() != 2:
+            sys.exit("error: '%s' is not 16 kHz mono 16-bit" % fname)
+        return w.readframes(w.getnframes())
+
+
+def silence(seconds):
+    return b"\0\0"*int(seconds*SAMPLE_RATE)
+
+
+def scenario_write(fname):
+    pcm = silence(args.lead_s)
+    for command in args.commands:
+        pcm += read_pcm(command) + silence(args.gap_s)
+
+    with wave.open(fname, "wb") as w:
+        w.setnchannels(1)
+        w.setsampwidth(2)
+        w.setframerate(SAMPLE_RATE)
+        w.writeframes(pcm)
+
+    return len(pcm)/2/SAMPLE_RATE
+
+
+def port_free():
+    with socket.socket() as s:
+        s.bind(("127.0.0.1", 0))
+        return s.getsockname()[1]
+
+
+def server_wait(port, timeout_s=10.0):
+    t_end = time.time() + timeout_s
+    while time.time() < t_end:
+        try:
+            socket.create_connection(("127.0.0.1", port), timeout=1.0).close()
+            return
+        except OSError:
+            time.sleep(0.1)
+    sys.exit("error: the mock chat server did not start")
+
+
+def percentile(values, p):
+    values = sorted(values)
+    k = (len(values) - 1)*p/100.0
+    i = int(k)
+    if i + 1 >= len(values):
+        return values[i]
+    return values[i] + (values[i + 1] - values[i])*(k - i)
+
+
+out_dir = args.out_dir or tempfile.mkdtemp(prefix="r3_talk-bench-")
+os.makedirs(out_dir, exist_ok=True)
+
+fname_scenario = os.path.join(out_dir, "scenario.wav")
+fname_latency  = os.path.join(out_dir, "latency.jsonl")
+
+# r3_talk only reads 16 kHz recordings, the enrolled one is checked as well
+read_pcm(args.prompt)
+
+duration_s = scenario_write(fname_scenario)
+if os.path.exists(fname_latency):
+    os.remove(fname_latency)
+
+print("bench: scenario of %.1f s with %d commands, %d runs, results in %s" % (duration_s, len(args.commands), args.runs, out_dir))
+
+port = port_free()
+
+mock_cmd = [sys.executable, os.path.join(script_dir, "mock-chat.py"), "--port", str(port),
+            "--ttfb-ms", str(args.ttfb_ms), "--tokens-per-s", str(args.tokens_per_s)]
+if args.reply is not None:
+    mock_cmd += ["--reply", args.reply]
+
+mock = subprocess.Popen(mock_cmd)
+try:
+    server_wait(port)
+
+    env = dict(os.environ, OPENAI_API_KEY="mock")
+
+    n_failed = 0
+
+    for run in range(args.runs):
+        cmd = [args.r3_talk, "-ab", "file", "-ai", fname_scenario, "-ao", os.path.join(out_dir, "played-%d.wav" % run),
+               "-we", args.prompt, "-nkws", "-qe", "-lf", fname_latency, "-cu", "http://127.0.0.1:%d/v1/chat/completions" % port] + passthrough
+
+        with open(os.path.join(out_dir, "run-%d.log" % run), "w") as log:
+            n_lines = sum(1 for _ in open(fname_latency)) if os.path.exists(fname_latency) else 0
+
+            t_start = time.time()
+            try:
+                res = subprocess.run(cmd, env=env, stdout=log, stderr=subprocess.STDOUT, timeout=duration_s + 120)
+            except subprocess.TimeoutExpired:
+                # r3_talk has been killed, the turns it has reported are still in the results
+                print("bench: run %d: failed, r3_talk did not exit in %.0f s, see %s" % (run, duration_s + 120, log.name))
+                n_failed += 1
+                continue
+
+            if res.returncode != 0:
+                sys.exit("error: run %d failed with %d, see %s" % (run, res.returncode, log.name))
+
+            n_turns = (sum(1 for _ in open(fname_latency)) if os.path.exists(fname_latency) else 0) - n_lines
+
+        print("bench: run %d: %d turns in %.1f s" % (run, n_turns, time.time() - t_start))
+finally:
+    mock.terminate()
+    mock.wait()
+
+turns = []
+if os.path.exists(fname_latency):
+    with open(fname_latency) as f:
+        turns = [json.loads(line) for line in f if line.strip()]
+
+if not turns:
+    sys.exit("error: no turns were recorded")
+
+summary = {"runs": args.runs, "failed": n_failed, "turns": len(turns), "interrupted": sum(1 for t in turns if t["interrupted"])}
+
+print()
+print("%-16s %8s %8s %8s" % ("metric", "median", "p90", "n"))
+for metric in METRICS:
+    # a turn that did not reach a point has -1
+    values = [t[metric] for t in turns if t[metric] >= 0]
+    if not values:
+        summary[metric] = None
+        print("%-16s %8s %8s %8d" % (metric, "-", "-", 0))
+        continue
+
+    summary[metric] = {"median": percentile(values, 50), "p90": percentile(values, 90), "n": len(values)}
+    print("%-16s %8.0f %8.0f %8d" % (metric, summary[metric]["median"], summary[metric]["p90"], len(values)))
+
+if args.summary:
+    with open(args.summary, "w") as f:
+        json.dump(summary, f, indent=2)
+        f.write("\n")
+
+# the latencies of the other runs are printed, but the benchmark has failed
+if n_failed > 0:
+    sys.exit("error: %d of %d runs failed" % (n_failed, args.runs))
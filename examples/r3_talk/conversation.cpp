@@ -0,0 +1,208 @@
+#include "conversation.h"
+
+#include <cstdio>
+#include <utility>
+
+namespace {
+
+// tokens the chat format adds to every message and to the start of the reply
+constexpr int k_n_message = 4;
+constexpr int k_n_reply   = 3;
+
+// the commands are remembered in the summary by their first words
+constexpr int k_n_summary_words = 12;
+
+std::string first_words(const std::string & text, int n_words) {
+    size_t pos = 0;
+    for (int i = 0; i < n_words; ++i) {
+        pos = text.find_first_not_of(" \t\n", pos);
+        pos = pos == std::string::npos ? pos : text.find_first_of(" \t\n", pos);
+        if (pos == std::string::npos) {
+            return text;
+        }
+    }
+
+    return text.substr(0, pos) + " ...";
+}
+
+// appends the JSON to a string while it is written, without building a document first
+class json_writer {
+public:
+    json_writer(std::string & out) : m_out(out) {}
+
+    json_writer & object_begin() { separate(); m_out += '{'; m_first = true;  return *this; }
+    json_writer & object_end()   {             m_out += '}'; m_first = false; return *this; }
+    json_writer & array_begin()  { separate(); m_out += '['; m_first = true;  return *this; }
+    json_writer & array_end()    {             m_out += ']'; m_first = false; return *this; }
+
+    // the value that follows is not separated
+    json_writer & key(const std::string & name) {
+        separate();
+        string(name);
+        m_out += ':';
+        m_first = true;
+
+        return *this;
+    }
+
+    json_writer & value(const std::string & str) {
+        separate();
+        string(str);
+
+        return *this;
+    }
+
+    json_writer & value(bool b) {
+        separate();
+        m_out += b ? "true" : "false";
+
+        return *this;
+    }
+
+private:
+    void separate() {
+        if (!m_first) {
+            m_out += ',';
+        }
+        m_first = false;
+    }
+
+    void string(const std::string & str) {
+        static const char * k_hex = "0123456789abcdef";
+
+        m_out += '"';
+        for (const char c : str) {
+            switch (c) {
+                case '"':  m_out += "\\\""; break;
+                case '\\': m_out += "\\\\"; break;
+                case '\b': m_out += "\\b";  break;
+                case '\f': m_out += "\\f";  break;
+                case '\n': m_out += "\\n";  break;
+                case '\r': m_out += "\\r";  break;
+                case '\t': m_out += "\\t";  break;
+                default:
+                    if ((unsigned char) c < 0x20) {
+                        m_out += "\\u00";
+                        m_out += k_hex[(c >> 4) & 0xf];
+                        m_out += k_hex[c & 0xf];
+                    } else {
+                        // UTF-8 is passed through
+                        m_out += c;
+                    }
+            }
+        }
+        m_out += '"';
+    }
+
+    std::string & m_out;
+
+    bool m_first = true;
+};
+
+}
+
+conversation::conversation(const conversation_params & params, token_counter count) : m_params(params), m_count(std::move(count)) {
+    m_system = make_message("system", m_params.system);
+}
+
+conversation::message conversation::make_message(const std::string & role, const std::string & content) const {
+    message msg;
+
+    msg.role     = role;
+    msg.content  = content;
+    msg.n_tokens = k_n_message + m_count(content);
+
+    return msg;
+}
+
+std::string conversation::request(const std::string & text) {
+    const message user = make_message("user", text);
+
+    fit(user.n_tokens);
+
+    std::string body;
+    json_writer writer(body);
+
+    const auto write_message = [&](const message & msg) {
+        writer.object_begin();
+        writer.key("role").value(msg.role);
+        writer.key("content").value(msg.content);
+        writer.object_end();
+    };
+
+    writer.object_begin();
+    writer.key("model").value(m_params.model);
+    writer.key("stream").value(m_params.stream);
+    writer.key("messages").array_begin();
+
+    write_message(m_system);
+    if (m_summary.n_tokens > 0) {
+        write_message(m_summary);
+    }
+    for (const auto & msg : m_history) {
+        write_message(msg);
+    }
+    write_message(user);
+
+    writer.array_end();
+    writer.object_end();
+
+    m_n_request = m_system.n_tokens + m_summary.n_tokens + m_n_history + user.n_tokens + k_n_reply;
+
+    return body;
+}
+
+void conversation::commit(const std::string & text, const std::string & reply) {
+    for (const auto & msg : { make_message("user", text), make_message("assistant", reply) }) {
+        m_n_history += msg.n_tokens;
+        m_history.push_back(msg);
+    }
+}
+
+void conversation::fit(int n_text) {
+    const auto n_total = [&]() {
+        return m_system.n_tokens + m_summary.n_tokens + m_n_history + n_text + k_n_reply;
+    };
+
+    // a turn is dropped together with its reply, its command is remembered in the summary
+    while (n_total() > m_params.n_budget && !m_history.empty()) {
+        do {
+            if (m_history.front().role == "user") {
+                m_dropped.push_back(first_words(m_history.front().content, k_n_summary_words));
+            }
+
+            m_n_history -= m_history.front().n_tokens;
+            m_history.pop_front();
+        } while (!m_history.empty() && m_history.front().role != "user");
+
+        summary_update();
+    }
+
+    if (n_total() > m_params.n_budget && !m_dropped.empty()) {
+        m_dropped.clear();
+        summary_update();
+    }
+
+    if (n_total() > m_params.n_budget) {
+        fprintf(stderr, "%s: the request of %d tokens exceeds the budget of %d tokens\n", __func__, n_total(), m_params.n_budget);
+    }
+}
+
+void conversation::summary_update() {
+    // the oldest commands are forgotten first
+    while (!m_dropped.empty()) {
+        std::string content = "Earlier in this conversation the user asked:";
+        for (size_t i = 0; i < m_dropped.size(); ++i) {
+            content += (i == 0 ? " " : "; ") + m_dropped[i];
+        }
+
+        m_summary = make_message("system", content);
+        if (m_summary.n_tokens <= m_params.n_summary) {
+            return;
+        }
+
+        m_dropped.pop_front();
+    }
+
+    m_summary = message();
+}
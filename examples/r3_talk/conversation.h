@@ -0,0 +1,67 @@
+#pragma once
+
+// Conversation memory of the chat requests
+//
+// The turns of the conversation are kept together with their token counts. Before every request the oldest turns are
+// folded into a short summary until the messages fit into the token budget, so that the requests stay small however
+// long the conversation gets.
+//
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <string>
+
+// the number of tokens of a text, counted with a local tokenizer
+using token_counter = std::function<int(const std::string & text)>;
+
+struct conversation_params {
+    std::string model  = "gpt-3.5-turbo";
+    std::string system = "You are a helpful assistant.";
+
+    int32_t n_budget  = 1024; // tokens of all messages of a request
+    int32_t n_summary = 128;  // tokens of the summary of the dropped turns, part of the budget
+
+    bool stream = true; // the reply is sent as server-sent events while it is generated
+};
+
+class conversation {
+public:
+    conversation(const conversation_params & params, token_counter count);
+
+    // the body of the chat request that answers the command
+    std::string request(const std::string & text);
+
+    // the command has been answered - both become part of the history
+    void commit(const std::string & text, const std::string & reply);
+
+    // tokens of the messages of the last request
+    int n_tokens() const { return m_n_request; }
+
+private:
+    struct message {
+        std::string role;
+        std::string content;
+
+        int n_tokens = 0;
+    };
+
+    message make_message(const std::string & role, const std::string & content) const;
+
+    // drop the oldest turns until the messages and the new command of n_text tokens fit into the budget
+    void fit(int n_text);
+
+    void summary_update();
+
+    const conversation_params m_params;
+    const token_counter       m_count;
+
+    message m_system;
+    message m_summary;
+
+    std::deque<message>     m_history;  // user and assistant messages, oldest first
+    std::deque<std::string> m_dropped;  // the commands of the dropped turns, the summary is made of them
+
+    int m_n_history = 0;
+    int m_n_request = 0;
+};
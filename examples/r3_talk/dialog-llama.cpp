@@ -0,0 +1,288 @@
+#include "dialog.h"
+
+#include "common.h"
+#include "llama.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+namespace {
+
+const std::string k_prompt_llama = R"(Text transcript of a never ending dialog, where {0} interacts with an AI assistant named {1}.
+{1} is helpful, kind, honest, friendly and never fails to answer {0}'s requests immediately and with precision.
+{1} speaks through a loudspeaker, so the answers are one or two short sentences, without lists and markup.
+
+{0}: Hello, {1}!
+{1}: Hello {0}! How may I help you today?
+{0}: What is a cat?
+{1}: A cat is a small domesticated carnivorous mammal. It is the only domesticated species in the family Felidae.
+{0}: Name a color.
+{1}: Blue.
+{0}:)";
+
+// the prompt is evaluated in batches of this size
+constexpr int k_n_batch = 64;
+
+std::vector<llama_token> llama_tokenize(struct llama_context * ctx, const std::string & text, bool add_bos) {
+    std::vector<llama_token> res(text.size() + (int) add_bos);
+    const int n = ::llama_tokenize(ctx, text.c_str(), res.data(), res.size(), add_bos);
+    res.resize(std::max(n, 0));
+
+    return res;
+}
+
+class dialog_llama : public dialog_backend {
+public:
+    dialog_llama(const dialog_llama_params & params) : m_params(params) {}
+
+    ~dialog_llama() override {
+        if (m_ctx) {
+            finish();
+
+            llama_print_timings(m_ctx);
+            llama_free(m_ctx);
+        }
+    }
+
+    bool init();
+
+    bool reply(const std::string & text, const cancel_token & turn, const dialog_text_callback & on_text) override;
+
+    void finish() override;
+
+private:
+    bool eval(std::vector<llama_token> tokens);
+
+    llama_token sample();
+
+    void session_save();
+
+    const dialog_llama_params m_params;
+
+    struct llama_context * m_ctx = nullptr;
+
+    // the evaluated conversation, its keys and values are in the KV cache
+    std::vector<llama_token> m_tokens;
+
+    // the system prompt is kept when the context is full
+    size_t m_n_keep = 0;
+
+    std::vector<llama_token_data> m_candidates;
+
+    // the last reply has not been finished yet, the end of its text that was handed over but not evaluated
+    bool                     m_pending = false;
+    std::vector<llama_token> m_tail;
+};
+
+bool dialog_llama::init() {
+    llama_init_backend();
+
+    auto lparams = llama_context_default_params();
+
+    lparams.n_ctx  = m_params.n_ctx;
+    lparams.seed   = 1;
+    lparams.f16_kv = true;
+
+    m_ctx = llama_init_from_file(m_params.model.c_str(), lparams);
+    if (m_ctx == nullptr) {
+        fprintf(stderr, "%s: failed to load the model '%s'\n", __func__, m_params.model.c_str());
+        return false;
+    }
+
+    std::string prompt = m_params.prompt.empty() ? k_prompt_llama : m_params.prompt;
+
+    // need to have leading ' '
+    prompt.insert(0, 1, ' ');
+
+    prompt = ::replace(prompt, "{0}", m_params.user_name);
+    prompt = ::replace(prompt, "{1}", m_params.bot_name);
+
+    const std::vector<llama_token> prompt_tokens = llama_tokenize(m_ctx, prompt, true);
+
+    m_n_keep = prompt_tokens.size();
+
+    // a session that starts with the same prompt continues the conversation of the last run
+    if (!m_params.session.empty()) {
+        FILE * fp = std::fopen(m_params.session.c_str(), "rb");
+        if (fp != nullptr) {
+            std::fclose(fp);
+
+            std::vector<llama_token> session_tokens(m_params.n_ctx);
+            size_t n_token_count = 0;
+
+            if (!llama_load_session_file(m_ctx, m_params.session.c_str(), session_tokens.data(), session_tokens.size(), &n_token_count)) {
+                fprintf(stderr, "%s: failed to load the session '%s', starting a new one\n", __func__, m_params.session.c_str());
+            } else {
+                session_tokens.resize(n_token_count);
+
+                if (session_tokens.size() >= prompt_tokens.size() && std::equal(prompt_tokens.begin(), prompt_tokens.end(), session_tokens.begin())) {
+                    m_tokens = std::move(session_tokens);
+                    fprintf(stderr, "%s: loaded a session of %d tokens\n", __func__, (int) m_tokens.size());
+                } else {
+                    fprintf(stderr, "%s: the session was started with another prompt, starting a new one\n", __func__);
+                }
+            }
+        }
+    }
+
+    if (m_tokens.empty()) {
+        if (!eval(prompt_tokens)) {
+            return false;
+        }
+
+        session_save();
+    }
+
+    return true;
+}
+
+bool dialog_llama::reply(const std::string & text, const cancel_token & turn, const dialog_text_callback & on_text) {
+    // in case the last reply was not finished by the caller
+    finish();
+
+    if (!eval(llama_tokenize(m_ctx, " " + text + "\n" + m_params.bot_name + ":", false))) {
+        return false;
+    }
+
+    m_pending = true;
+    m_tail.clear();
+
+    // the reply is a single line, every token is handed over as soon as it is sampled and evaluated right after, so the
+    // evaluated conversation is the text that was handed over - the last one is evaluated by finish()
+    for (int i = 0; i < m_params.n_predict && !turn.cancelled(); ++i) {
+        const llama_token id = sample();
+        if (id == llama_token_eos()) {
+            break;
+        }
+
+        std::string piece = llama_token_to_str(m_ctx, id);
+
+        const size_t pos = piece.find('\n');
+        if (pos != std::string::npos) {
+            piece.resize(pos);
+        }
+
+        if (!piece.empty()) {
+            on_text(piece);
+        }
+
+        // the token with the end of the line is not evaluated, only the text before it
+        if (pos != std::string::npos) {
+            if (!piece.empty()) {
+                m_tail = llama_tokenize(m_ctx, piece, false);
+            }
+            break;
+        }
+
+        if (i == m_params.n_predict - 1) {
+            m_tail = { id };
+            break;
+        }
+
+        if (!eval({ id })) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void dialog_llama::finish() {
+    if (!m_pending) {
+        return;
+    }
+
+    m_pending = false;
+
+    // the next command follows the name of the user, also when the reply was interrupted
+    std::vector<llama_token> tokens = llama_tokenize(m_ctx, "\n" + m_params.user_name + ":", false);
+    tokens.insert(tokens.begin(), m_tail.begin(), m_tail.end());
+
+    if (!eval(std::move(tokens))) {
+        return;
+    }
+
+    session_save();
+}
+
+bool dialog_llama::eval(std::vector<llama_token> tokens) {
+    const size_t n_ctx = llama_n_ctx(m_ctx);
+
+    // keep the system prompt and the second half of the conversation, which is evaluated again
+    if (m_tokens.size() + tokens.size() > n_ctx) {
+        const size_t n_left = m_tokens.size() - m_n_keep;
+
+        tokens.insert(tokens.begin(), m_tokens.end() - n_left/2, m_tokens.end());
+        m_tokens.resize(m_n_keep);
+
+        if (m_tokens.size() + tokens.size() > n_ctx) {
+            fprintf(stderr, "%s: the input of %d tokens does not fit into the context\n", __func__, (int) tokens.size());
+            return false;
+        }
+    }
+
+    for (size_t i = 0; i < tokens.size(); i += k_n_batch) {
+        const int n = (int) std::min(tokens.size() - i, (size_t) k_n_batch);
+
+        if (llama_eval(m_ctx, tokens.data() + i, n, (int) m_tokens.size(), m_params.n_threads)) {
+            fprintf(stderr, "%s: failed to eval\n", __func__);
+            return false;
+        }
+
+        m_tokens.insert(m_tokens.end(), tokens.begin() + i, tokens.begin() + i + n);
+    }
+
+    return true;
+}
+
+llama_token dialog_llama::sample() {
+    const float top_k          = 5;
+    const float top_p          = 0.80f;
+    const float temp           = 0.30f;
+    const float repeat_penalty = 1.1764f;
+
+    const int repeat_last_n    = 256;
+
+    const float * logits  = llama_get_logits(m_ctx);
+    const int     n_vocab = llama_n_vocab(m_ctx);
+
+    m_candidates.clear();
+    m_candidates.reserve(n_vocab);
+    for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
+        m_candidates.emplace_back(llama_token_data{token_id, logits[token_id], 0.0f});
+    }
+
+    llama_token_data_array candidates_p = { m_candidates.data(), m_candidates.size(), false };
+
+    const size_t n_last = std::min(m_tokens.size(), (size_t) repeat_last_n);
+
+    llama_sample_repetition_penalty(m_ctx, &candidates_p, m_tokens.data() + m_tokens.size() - n_last, n_last, repeat_penalty);
+
+    llama_sample_top_k(m_ctx, &candidates_p, top_k, 1);
+    llama_sample_top_p(m_ctx, &candidates_p, top_p, 1);
+    llama_sample_temperature(m_ctx, &candidates_p, temp);
+
+    return llama_sample_token(m_ctx, &candidates_p);
+}
+
+void dialog_llama::session_save() {
+    if (m_params.session.empty()) {
+        return;
+    }
+
+    if (!llama_save_session_file(m_ctx, m_params.session.c_str(), m_tokens.data(), m_tokens.size())) {
+        fprintf(stderr, "%s: failed to save the session '%s'\n", __func__, m_params.session.c_str());
+    }
+}
+
+}
+
+std::unique_ptr<dialog_backend> dialog_llama_init(const dialog_llama_params & params) {
+    std::unique_ptr<dialog_llama> backend(new dialog_llama(params));
+    if (!backend->init()) {
+        return nullptr;
+    }
+
+    return backend;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+// Dialog backends
+//
+// A backend answers the commands that are not handled by the local intents. The reply is handed over in pieces as it
+// is produced, so that the synthesis can start with the first sentence while the rest is still generated.
+//
+
+#include "pipeline.h"
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+
+// called with every new piece of the reply
+using dialog_text_callback = std::function<void(const std::string & text)>;
+
+class dialog_backend {
+public:
+    virtual ~dialog_backend() = default;
+
+    // returns false when no reply could be produced, stops early when the turn is cancelled
+    virtual bool reply(const std::string & text, const cancel_token & turn, const dialog_text_callback & on_text) = 0;
+
+    // complete the last reply once all of its text has been handed over, runs while the reply is synthesized and played
+    virtual void finish() {}
+
+    // prepare the first reply at startup, runs in the background
+    virtual void warmup() {}
+};
+
+struct dialog_llama_params {
+    std::string model;
+    std::string session;   // the evaluated conversation is kept in this file between runs
+    std::string prompt;    // system prompt, {0} is replaced with the user name and {1} with the bot name
+
+    std::string user_name = "User";
+    std::string bot_name  = "R3";
+
+    int32_t n_threads = 4;
+    int32_t n_ctx     = 2048;
+    int32_t n_predict = 128; // maximum number of tokens of a reply
+};
+
+// on-device LLaMA model, the conversation stays evaluated in the KV cache between the turns
+std::unique_ptr<dialog_backend> dialog_llama_init(const dialog_llama_params & params);
@@ -0,0 +1,407 @@
+#include "echo-cancel.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <random>
+
+echo_canceller::echo_canceller(const echo_canceller_params & params) : m_params(params) {
+    // the FFT size must be a power of 2
+    int n_bits = 1;
+    while ((1 << n_bits) < 2*m_params.n_block) {
+        n_bits++;
+    }
+    m_params.n_block = (1 << n_bits)/2;
+
+    const int n = m_params.n_block;
+    const int m = 2*n;
+
+    m_n_part = std::max(1, (m_params.tail_ms*m_params.sample_rate/1000 + n - 1)/n);
+
+    m_twiddle.resize(m/2);
+    for (int i = 0; i < m/2; i++) {
+        m_twiddle[i] = std::polar(1.0f, (float) (-2.0*M_PI*i/m));
+    }
+
+    m_bitrev.resize(m);
+    for (int i = 0; i < m; i++) {
+        int r = 0;
+        for (int b = 0; b < n_bits; b++) {
+            r |= ((i >> b) & 1) << (n_bits - 1 - b);
+        }
+        m_bitrev[i] = r;
+    }
+
+    reset();
+}
+
+void echo_canceller::reset() {
+    const int n = m_params.n_block;
+    const int m = 2*n;
+
+    m_w.assign(m_n_part*m, cplx(0.0f));
+    m_x.assign(m_n_part*m, cplx(0.0f));
+    m_x_pow.assign(m, 0.0f);
+    m_x_prev.assign(n, 0.0f);
+    m_x_peak.assign(m_n_part, 0.0f);
+
+    m_mic_pending.clear();
+    m_ref_pending.clear();
+
+    m_buf.resize(m);
+    m_y.resize(m);
+    m_e.resize(m);
+
+    m_e_mic  = 0.0f;
+    m_e_echo = 0.0f;
+    m_e_out  = 0.0f;
+
+    m_erle_mic = 0.0f;
+    m_erle_out = 0.0f;
+}
+
+// in-place radix-2 FFT, the inverse is scaled by 1/size
+void echo_canceller::fft(cplx * data, bool inverse) const {
+    const int m = 2*m_params.n_block;
+
+    for (int i = 0; i < m; i++) {
+        if (i < m_bitrev[i]) {
+            std::swap(data[i], data[m_bitrev[i]]);
+        }
+    }
+
+    for (int len = 2; len <= m; len <<= 1) {
+        const int half = len/2;
+        const int step = m/len;
+
+        for (int i = 0; i < m; i += len) {
+            for (int j = 0; j < half; j++) {
+                const cplx w = inverse ? std::conj(m_twiddle[j*step]) : m_twiddle[j*step];
+                const cplx t = w*data[i + j + half];
+
+                data[i + j + half] = data[i + j] - t;
+                data[i + j]        = data[i + j] + t;
+            }
+        }
+    }
+
+    if (inverse) {
+        const float scale = 1.0f/m;
+        for (int i = 0; i < m; i++) {
+            data[i] *= scale;
+        }
+    }
+}
+
+void echo_canceller::process_block(const float * mic, const float * ref, float * out) {
+    const int n = m_params.n_block;
+    const int m = 2*n;
+
+    // spectrum of the last two reference blocks, the older spectra move one partition back
+    std::move_backward(m_x.begin(), m_x.end() - m, m_x.end());
+    std::move_backward(m_x_peak.begin(), m_x_peak.end() - 1, m_x_peak.end());
+
+    float peak = 0.0f;
+    float ref_sum = 0.0f;
+    for (int i = 0; i < n; i++) {
+        m_buf[i]     = m_x_prev[i];
+        m_buf[n + i] = ref[i];
+
+        peak     = std::max(peak, std::fabs(ref[i]));
+        ref_sum += ref[i]*ref[i];
+    }
+    std::copy(ref, ref + n, m_x_prev.begin());
+
+    fft(m_buf.data(), false);
+    std::copy(m_buf.begin(), m_buf.end(), m_x.begin());
+    m_x_peak[0] = peak;
+
+    for (int k = 0; k < m; k++) {
+        m_x_pow[k] = 0.9f*m_x_pow[k] + 0.1f*std::norm(m_buf[k]);
+    }
+
+    // echo estimate - the last block of the circular convolution is the linear one
+    std::fill(m_y.begin(), m_y.end(), cplx(0.0f));
+    for (int p = 0; p < m_n_part; p++) {
+        const cplx * w = &m_w[p*m];
+        const cplx * x = &m_x[p*m];
+        for (int k = 0; k < m; k++) {
+            m_y[k] += w[k]*x[k];
+        }
+    }
+    fft(m_y.data(), true);
+
+    float mic_sum  = 0.0f;
+    float echo_sum = 0.0f;
+    float out_sum  = 0.0f;
+    float mic_peak = 0.0f;
+
+    for (int i = 0; i < n; i++) {
+        const float y = m_y[n + i].real();
+
+        out[i] = mic[i] - y;
+
+        mic_sum  += mic[i]*mic[i];
+        echo_sum += y*y;
+        out_sum  += out[i]*out[i];
+        mic_peak  = std::max(mic_peak, std::fabs(mic[i]));
+    }
+
+    m_e_mic  = 0.5f*m_e_mic  + 0.5f*mic_sum/n;
+    m_e_echo = 0.5f*m_e_echo + 0.5f*echo_sum/n;
+    m_e_out  = 0.5f*m_e_out  + 0.5f*out_sum/n;
+
+    // no adaptation without reference or while the near-end talks
+    const float ref_peak = *std::max_element(m_x_peak.begin(), m_x_peak.end());
+
+    if (std::sqrt(ref_sum/n) < m_params.ref_min || mic_peak > m_params.dtd_thold*ref_peak) {
+        return;
+    }
+
+    // echo return loss enhancement of the blocks with echo only
+    m_erle_mic = 0.99f*m_erle_mic + 0.01f*mic_sum/n;
+    m_erle_out = 0.99f*m_erle_out + 0.01f*out_sum/n;
+
+    // NLMS update, the gradient of every partition is constrained to the first half to keep the convolution linear
+    std::fill(m_e.begin(), m_e.begin() + n, cplx(0.0f));
+    for (int i = 0; i < n; i++) {
+        m_e[n + i] = out[i];
+    }
+    fft(m_e.data(), false);
+
+    const float delta = m*m_params.ref_min*m_params.ref_min;
+
+    for (int k = 0; k < m; k++) {
+        m_e[k] *= m_params.mu/(m_n_part*m_x_pow[k] + delta);
+    }
+
+    for (int p = 0; p < m_n_part; p++) {
+        cplx * w = &m_w[p*m];
+        const cplx * x = &m_x[p*m];
+
+        for (int k = 0; k < m; k++) {
+            m_buf[k] = std::conj(x[k])*m_e[k];
+        }
+
+        fft(m_buf.data(), true);
+        std::fill(m_buf.begin() + n, m_buf.end(), cplx(0.0f));
+        fft(m_buf.data(), false);
+
+        for (int k = 0; k < m; k++) {
+            w[k] += m_buf[k];
+        }
+    }
+}
+
+void echo_canceller::process(const std::vector<float> & mic, const std::vector<float> & ref, std::vector<float> & out) {
+    const int n = m_params.n_block;
+
+    const size_t n_samples = std::min(mic.size(), ref.size());
+
+    m_mic_pending.insert(m_mic_pending.end(), mic.begin(), mic.begin() + n_samples);
+    m_ref_pending.insert(m_ref_pending.end(), ref.begin(), ref.begin() + n_samples);
+
+    out.resize(m_mic_pending.size() - m_mic_pending.size() % n);
+
+    for (size_t i = 0; i + n <= m_mic_pending.size(); i += n) {
+        process_block(&m_mic_pending[i], &m_ref_pending[i], &out[i]);
+    }
+
+    m_mic_pending.erase(m_mic_pending.begin(), m_mic_pending.begin() + out.size());
+    m_ref_pending.erase(m_ref_pending.begin(), m_ref_pending.begin() + out.size());
+}
+
+barge_in_vad::barge_in_vad(const barge_in_params & params) : m_params(params) {
+    reset();
+}
+
+void barge_in_vad::reset() {
+    m_pcm.clear();
+
+    m_speech.assign(std::max(1, m_params.onset_ms/m_params.frame_ms), false);
+    m_pos = 0;
+
+    m_floor = -1.0f;
+    m_hp    = 0.0f;
+    m_last  = 0.0f;
+}
+
+bool barge_in_vad::push(const std::vector<float> & pcmf32, float energy_echo) {
+    const size_t n_frame = m_params.sample_rate*m_params.frame_ms/1000;
+
+    m_pcm.insert(m_pcm.end(), pcmf32.begin(), pcmf32.end());
+
+    bool detected = false;
+
+    size_t i0 = 0;
+    for (; i0 + n_frame <= m_pcm.size(); i0 += n_frame) {
+        // first order high-pass to ignore rumble and DC
+        float energy = 0.0f;
+        for (size_t i = i0; i < i0 + n_frame; i++) {
+            m_hp   = 0.97f*(m_hp + m_pcm[i] - m_last);
+            m_last = m_pcm[i];
+
+            energy += m_hp*m_hp;
+        }
+        energy /= n_frame;
+
+        // the noise floor follows the quiet frames quickly and rises slowly
+        if (m_floor < 0.0f || energy < m_floor) {
+            m_floor = energy;
+        } else {
+            m_floor *= 1.002f;
+        }
+        m_floor = std::max(m_floor, m_params.floor_min);
+
+        m_speech[m_pos] = energy > m_params.thold*(m_params.echo_leak*energy_echo + m_floor);
+        m_pos = (m_pos + 1) % m_speech.size();
+
+        // most of the last onset_ms has to be speech
+        const size_t n_speech = std::count(m_speech.begin(), m_speech.end(), true);
+        if (5*n_speech >= 4*m_speech.size()) {
+            detected = true;
+        }
+    }
+
+    m_pcm.erase(m_pcm.begin(), m_pcm.begin() + i0);
+
+    return detected;
+}
+
+echo_cancel_sim_result echo_cancel_sim(
+        const std::vector<float> & near,
+        const std::vector<float> & far,
+                             int   near_ms,
+    const echo_canceller_params & aec_params,
+          const barge_in_params & vad_params) {
+    const int sr = aec_params.sample_rate;
+
+    // echo path: 40 ms of device latency and a decaying random room response of 150 ms, about -6 dB
+    std::vector<float> rir(sr*190/1000, 0.0f);
+    {
+        std::mt19937 rng(1234);
+        std::normal_distribution<float> dist(0.0f, 1.0f);
+
+        const int n_delay = sr*40/1000;
+
+        float sum = 0.0f;
+        for (int i = n_delay; i < (int) rir.size(); i++) {
+            rir[i] = dist(rng)*std::exp(-(i - n_delay)/(0.03f*sr));
+            sum += rir[i]*rir[i];
+        }
+        for (auto & v : rir) {
+            v *= 0.5f/std::sqrt(sum);
+        }
+    }
+
+    const size_t n_near0 = (size_t) sr*near_ms/1000;
+    const size_t n_total = std::max(far.size(), n_near0 + near.size());
+
+    std::vector<float> ref(n_total, 0.0f);
+    std::vector<float> mic(n_total, 0.0f);
+
+    std::copy(far.begin(), far.end(), ref.begin());
+
+    std::mt19937 rng(5678);
+    std::normal_distribution<float> noise(0.0f, 1e-3f);
+
+    for (size_t i = 0; i < n_total; i++) {
+        float echo = 0.0f;
+        for (size_t j = 0; j < rir.size() && j <= i; j++) {
+            echo += rir[j]*ref[i - j];
+        }
+
+        mic[i] = echo + noise(rng);
+
+        if (i >= n_near0 && i - n_near0 < near.size()) {
+            mic[i] += near[i - n_near0];
+        }
+    }
+
+    // first 100 ms of the near-end that are louder than its average
+    size_t n_onset = n_total;
+    {
+        const size_t n_win = sr/10;
+
+        float near_mean = 0.0f;
+        for (const auto & v : near) {
+            near_mean += v*v/near.size();
+        }
+
+        for (size_t i = 0; i + n_win <= near.size(); i += n_win/4) {
+            float energy = 0.0f;
+            for (size_t j = i; j < i + n_win; j++) {
+                energy += near[j]*near[j]/n_win;
+            }
+            if (energy > near_mean) {
+                n_onset = n_near0 + i;
+                break;
+            }
+        }
+    }
+
+    echo_canceller aec(aec_params);
+    barge_in_vad   vad(vad_params);
+
+    // feed the audio in chunks, like the capture thread
+    const size_t n_chunk = sr/50;
+
+    std::vector<float> mic_chunk;
+    std::vector<float> ref_chunk;
+    std::vector<float> out;
+
+    double sum_mic = 0.0;
+    double sum_out = 0.0;
+
+    size_t n_done      = 0;
+    size_t n_detected  = 0;
+    int    n_false     = 0;
+
+    for (size_t i = 0; i + n_chunk <= n_total; i += n_chunk) {
+        mic_chunk.assign(mic.begin() + i, mic.begin() + i + n_chunk);
+        ref_chunk.assign(ref.begin() + i, ref.begin() + i + n_chunk);
+
+        aec.process(mic_chunk, ref_chunk, out);
+
+        // the echo return loss enhancement is measured on the second half of the audio before the near-end
+        for (size_t j = 0; j < out.size(); j++) {
+            const size_t k = n_done + j;
+            if (k >= n_onset/2 && k < n_onset) {
+                sum_mic += mic[k]*mic[k];
+                sum_out += out[j]*out[j];
+            }
+        }
+        n_done += out.size();
+
+        // the near-end can only be told apart from the echo once the echo path has been learned
+        if (!aec.converged()) {
+            continue;
+        }
+
+        if (vad.push(out, aec.energy_echo())) {
+            if (n_done < n_onset) {
+                n_false++;
+                vad.reset();
+            } else if (n_detected == 0) {
+                n_detected = n_done;
+            }
+        }
+    }
+
+    echo_cancel_sim_result result;
+
+    result.erle_db   = sum_out > 0.0 ? 10.0*std::log10(sum_mic/sum_out) : 0.0;
+    result.n_false   = n_false;
+    result.detect_ms = n_detected > 0 ? (int) ((n_detected - n_onset)*1000/sr) : -1;
+
+    printf("%s: echo path %d ms, near-end speech at %d ms\n", __func__, (int) (rir.size()*1000/sr), (int) (n_onset*1000/sr));
+    printf("%s: ERLE before the near-end: %.1f dB\n", __func__, result.erle_db);
+    printf("%s: false barge-ins before the near-end: %d\n", __func__, result.n_false);
+    if (n_detected > 0) {
+        printf("%s: barge-in detected at %d ms (%d ms after the onset)\n", __func__, (int) (n_detected*1000/sr), result.detect_ms);
+    } else {
+        printf("%s: barge-in not detected\n", __func__);
+    }
+
+    return result;
+}
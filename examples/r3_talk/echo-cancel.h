@@ -0,0 +1,127 @@
+#pragma once
+
+// Acoustic echo cancellation and near-end speech detection for barge-in
+//
+// The echo of the played audio is removed from the captured audio with a partitioned-block frequency-domain NLMS
+// filter (overlap-save). The reference is the playback stream as it was handed to the device, aligned with the
+// capture by audio_async - the filter has to cover the device latencies and the echo tail of the room.
+// Adaptation is frozen while the near-end talks (Geigel double-talk detector), so the echo path is not unlearned
+// when the user interrupts.
+//
+
+#include <complex>
+#include <cstdint>
+#include <vector>
+
+struct echo_canceller_params {
+    int32_t sample_rate = 16000;
+    int32_t n_block     = 256;   // samples per block, the FFT size is twice this
+    int32_t tail_ms     = 300;   // length of the echo path that is modeled
+
+    float mu            = 0.5f;  // step size of the NLMS update
+    float dtd_thold     = 0.6f;  // freeze the adaptation when |mic| > dtd_thold*max|ref|
+    float ref_min       = 1e-4f; // no adaptation when the reference is quieter than this (rms)
+};
+
+class echo_canceller {
+public:
+    echo_canceller(const echo_canceller_params & params);
+
+    // remove the echo of ref from mic - both have the same length and the output has the same length
+    // audio that does not fill a block is kept and processed with the next call
+    void process(const std::vector<float> & mic, const std::vector<float> & ref, std::vector<float> & out);
+
+    // forget the echo path
+    void reset();
+
+    // energy of the last processed blocks (mean square, smoothed)
+    float energy_mic()  const { return m_e_mic; }
+    float energy_echo() const { return m_e_echo; }
+    float energy_out()  const { return m_e_out; }
+
+    // the echo is attenuated by at least 6 dB
+    bool converged() const { return m_erle_mic > 4.0f*m_erle_out; }
+
+private:
+    typedef std::complex<float> cplx;
+
+    void process_block(const float * mic, const float * ref, float * out);
+
+    void fft(cplx * data, bool inverse) const;
+
+    echo_canceller_params m_params;
+
+    int m_n_part = 0; // number of filter partitions
+
+    std::vector<cplx> m_twiddle;
+    std::vector<int>  m_bitrev;
+
+    std::vector<cplx>  m_w;       // [n_part][2*n_block] filter
+    std::vector<cplx>  m_x;       // [n_part][2*n_block] spectra of the last reference blocks, newest first
+    std::vector<float> m_x_pow;   // [2*n_block] smoothed power of the reference spectra
+    std::vector<float> m_x_prev;  // previous reference block
+    std::vector<float> m_x_peak;  // [n_part] peak of the last reference blocks, newest first
+
+    std::vector<float> m_mic_pending;
+    std::vector<float> m_ref_pending;
+
+    // work buffers
+    std::vector<cplx> m_buf;
+    std::vector<cplx> m_y;
+    std::vector<cplx> m_e;
+
+    float m_e_mic  = 0.0f;
+    float m_e_echo = 0.0f;
+    float m_e_out  = 0.0f;
+
+    float m_erle_mic = 0.0f;
+    float m_erle_out = 0.0f;
+};
+
+struct barge_in_params {
+    int32_t sample_rate = 16000;
+    int32_t frame_ms    = 16;
+    int32_t onset_ms    = 250;   // speech needed in the echo-cancelled audio before the playback is interrupted
+
+    float thold         = 4.0f;  // a frame is speech when its energy is above thold*(residual echo + noise floor)
+    float echo_leak     = 0.1f;  // expected fraction of the echo energy that is left after the cancellation
+    float floor_min     = 1e-6f; // lower bound of the noise floor (mean square)
+};
+
+// detects the start of near-end speech in the output of the echo canceller
+class barge_in_vad {
+public:
+    barge_in_vad(const barge_in_params & params);
+
+    // feed echo-cancelled audio and the energy of the echo estimate, returns true once speech has started
+    bool push(const std::vector<float> & pcmf32, float energy_echo);
+
+    void reset();
+
+private:
+    barge_in_params m_params;
+
+    std::vector<float> m_pcm; // pushed audio that does not fill a frame yet
+
+    std::vector<bool> m_speech; // decisions of the last onset_ms frames
+    size_t            m_pos = 0;
+
+    float m_floor = -1.0f;
+    float m_hp    = 0.0f;     // high-pass filter state
+    float m_last  = 0.0f;
+};
+
+struct echo_cancel_sim_result {
+    float erle_db   = 0.0f; // echo return loss enhancement before the near-end starts
+    int   n_false   = 0;    // barge-ins detected before the near-end starts
+    int   detect_ms = -1;   // barge-in latency after the onset of the near-end, -1 when it was not detected
+};
+
+// offline test with synthetic echo: far is played through a simulated echo path and mixed with near, which starts at
+// near_ms - prints the echo return loss enhancement before near starts and when the barge-in is detected
+echo_cancel_sim_result echo_cancel_sim(
+        const std::vector<float> & near,
+        const std::vector<float> & far,
+                             int   near_ms,
+    const echo_canceller_params & aec_params,
+          const barge_in_params & vad_params);
@@ -0,0 +1,134 @@
+#include "endpointer.h"
+
+#include <algorithm>
+
+endpointer::endpointer(const endpointer_params & params) : m_params(params) {
+    m_n_frame = std::max(1, m_params.sample_rate*m_params.frame_ms/1000);
+
+    reset();
+}
+
+void endpointer::reset() {
+    m_pcm.clear();
+    m_pre_roll.clear();
+    m_utterance.clear();
+
+    m_in_speech = false;
+    m_ended     = false;
+
+    m_n_speech  = 0;
+    m_n_silence = 0;
+    m_n_voiced  = 0;
+
+    // the noise floor is kept - it describes the room, not the utterance
+    m_hp   = 0.0f;
+    m_last = 0.0f;
+}
+
+bool endpointer::step(const float * frame) {
+    const int n_onset    = std::max(1, m_params.onset_ms/m_params.frame_ms);
+    const int n_hangover = std::max(1, m_params.hangover_ms/m_params.frame_ms);
+    const int n_min      = m_params.min_ms/m_params.frame_ms;
+
+    const size_t n_pre_roll = (size_t) m_params.sample_rate*m_params.pre_roll_ms/1000;
+    const size_t n_max      = (size_t) m_params.sample_rate*m_params.max_ms/1000;
+
+    // first order high-pass to ignore rumble and DC
+    float energy = 0.0f;
+    for (int i = 0; i < m_n_frame; i++) {
+        m_hp   = 0.97f*(m_hp + frame[i] - m_last);
+        m_last = frame[i];
+
+        energy += m_hp*m_hp;
+    }
+    energy /= m_n_frame;
+
+    if (m_floor < 0.0f) {
+        m_floor = energy;
+    }
+
+    const bool is_speech = energy > m_params.thold*std::max(m_floor, m_params.floor_min);
+
+    // the noise floor follows the quiet frames quickly and rises slowly, even slower during speech
+    if (energy < m_floor) {
+        m_floor = 0.5f*m_floor + 0.5f*energy;
+    } else {
+        m_floor *= is_speech ? 1.002f : 1.01f;
+    }
+
+    if (!m_in_speech) {
+        m_n_speech = is_speech ? m_n_speech + 1 : 0;
+
+        m_pre_roll.insert(m_pre_roll.end(), frame, frame + m_n_frame);
+
+        if (m_n_speech < n_onset) {
+            // keep the pre-roll and the frames of a possible onset
+            while (m_pre_roll.size() > n_pre_roll + (size_t) m_n_speech*m_n_frame) {
+                m_pre_roll.pop_front();
+            }
+            return false;
+        }
+
+        m_in_speech = true;
+        m_n_silence = 0;
+        m_n_voiced  = m_n_speech;
+
+        m_utterance.assign(m_pre_roll.begin(), m_pre_roll.end());
+        m_pre_roll.clear();
+
+        return false;
+    }
+
+    m_utterance.insert(m_utterance.end(), frame, frame + m_n_frame);
+
+    if (is_speech) {
+        m_n_silence = 0;
+        m_n_voiced++;
+    } else {
+        m_n_silence++;
+    }
+
+    if (m_n_silence < n_hangover && m_utterance.size() < n_max) {
+        return false;
+    }
+
+    m_in_speech = false;
+    m_n_speech  = 0;
+
+    // too short - a click or a cough
+    if (m_n_voiced < n_min) {
+        m_utterance.clear();
+        return false;
+    }
+
+    // drop most of the trailing silence
+    if (m_n_silence > 0) {
+        const size_t n_keep = (size_t) std::min(m_n_silence, std::max(1, n_hangover/4))*m_n_frame;
+        m_utterance.resize(m_utterance.size() - (size_t) m_n_silence*m_n_frame + n_keep);
+    }
+
+    return true;
+}
+
+bool endpointer::push(const std::vector<float> & pcmf32) {
+    if (m_ended) {
+        m_ended = false;
+        m_utterance.clear();
+    }
+
+    m_pcm.insert(m_pcm.end(), pcmf32.begin(), pcmf32.end());
+
+    size_t i0 = 0;
+    for (; i0 + m_n_frame <= m_pcm.size(); i0 += m_n_frame) {
+        if (step(&m_pcm[i0])) {
+            m_ended = true;
+            i0 += m_n_frame;
+            break;
+        }
+    }
+
+    // the audio after the end of the utterance belongs to the next one
+    m_pcm.erase(m_pcm.begin(), m_pcm.begin() + i0);
+
+    return m_ended;
+}
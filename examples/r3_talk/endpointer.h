@@ -0,0 +1,71 @@
+#pragma once
+
+// End-of-utterance detection
+//
+// The captured audio is pushed continuously and classified in short frames against an adaptive noise floor.
+// An utterance starts after onset_ms of speech and ends after hangover_ms of silence (or at max_ms), so it can be
+// transcribed as soon as the user stops talking. The utterance includes pre_roll_ms of audio before the onset.
+//
+
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+struct endpointer_params {
+    int32_t sample_rate = 16000;
+    int32_t frame_ms    = 20;
+
+    int32_t onset_ms    = 100;   // speech needed to start an utterance
+    int32_t hangover_ms = 700;   // silence needed to end an utterance
+    int32_t min_ms      = 300;   // shorter utterances are dropped
+    int32_t max_ms      = 10000; // longer utterances are cut
+    int32_t pre_roll_ms = 300;   // audio before the onset that is part of the utterance
+
+    float thold         = 4.0f;  // a frame is speech when its energy is above thold*noise floor
+    float floor_min     = 1e-6f; // lower bound of the noise floor (mean square)
+};
+
+class endpointer {
+public:
+    endpointer(const endpointer_params & params);
+
+    // feed newly captured audio, returns true when an utterance has ended - it is in utterance() until the next push
+    bool push(const std::vector<float> & pcmf32);
+
+    // an utterance has started and not ended yet
+    bool in_speech() const { return m_in_speech; }
+
+    const std::vector<float> & utterance() const { return m_utterance; }
+
+    // the audio pushed after the last speech of the ended utterance, the delay of the end of the utterance
+    int trailing_ms() const {
+        return (int) (((int64_t) m_n_silence*m_n_frame + (int64_t) m_pcm.size())*1000/m_params.sample_rate);
+    }
+
+    // forget the pushed audio, e.g. after the captured audio was cleared
+    void reset();
+
+private:
+    // classify one frame and advance the state, returns true when the utterance has ended
+    bool step(const float * frame);
+
+    endpointer_params m_params;
+
+    int m_n_frame = 0; // samples per frame
+
+    std::vector<float> m_pcm;     // pushed audio that does not fill a frame yet
+    std::deque<float>  m_pre_roll;
+
+    std::vector<float> m_utterance;
+
+    bool m_in_speech = false;
+    bool m_ended     = false;
+
+    int m_n_speech  = 0; // consecutive speech frames before the onset
+    int m_n_silence = 0; // consecutive silence frames in the utterance
+    int m_n_voiced  = 0; // speech frames in the utterance
+
+    float m_floor = -1.0f;
+    float m_hp    = 0.0f;  // high-pass filter state
+    float m_last  = 0.0f;
+};
@@ -0,0 +1,92 @@
+# Local mock of the chat completions API for the r3_talk latency benchmark
+#
+# Usage: python3 mock-chat.py --port 8080 --ttfb-ms 300 --tokens-per-s 40
+#
+# Every request is answered with the same reply after the given time to the first token, the reply is streamed word by
+# word at the given rate as server-sent events (or sent at once when the request does not ask for a stream).
+#
+#  ./build/bin/r3_talk ... -cu http://127.0.0.1:8080/v1/chat/completions
+#
+
+import argparse
+import json
+import sys
+import time
+
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+parser = argparse.ArgumentParser(description="mock chat completions server")
+parser.add_argument("--host",         default="127.0.0.1")
+parser.add_argument("--port",         type=int,   default=8080)
+parser.add_argument("--ttfb-ms",      type=float, default=300.0, help="time to the first token in milliseconds")
+parser.add_argument("--tokens-per-s", type=float, default=40.0,  help="rate of the streamed tokens")
+parser.add_argument("--reply",        default="Sure, here is a short answer. It has a second sentence as well.")
+args = parser.parse_args()
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    # the connection warm-up of r3_talk
+    def do_HEAD(self):
+        self.send_response(200)
+        self.send_header("Content-Length", "0")
+        self.end_headers()
+
+    def do_GET(self):
+        self.do_HEAD()
+
+    def do_POST(self):
+        body = self.rfile.read(int(self.headers.get("Content-Length", 0)))
+        try:
+            stream = json.loads(body).get("stream", False)
+        except ValueError:
+            self.send_error(400)
+            return
+
+        time.sleep(args.ttfb_ms/1000.0)
+
+        if not stream:
+            data = json.dumps({"choices": [{"index": 0, "message": {"role": "assistant", "content": args.reply}}]}).encode()
+
+            self.send_response(200)
+            self.send_header("Content-Type", "application/json")
+            self.send_header("Content-Length", str(len(data)))
+            self.end_headers()
+            self.wfile.write(data)
+            return
+
+        self.send_response(200)
+        self.send_header("Content-Type", "text/event-stream")
+        self.send_header("Transfer-Encoding", "chunked")
+        self.end_headers()
+
+        # a token per word, the first one is sent right away
+        words = args.reply.split(" ")
+        for i, word in enumerate(words):
+            if i > 0:
+                time.sleep(1.0/args.tokens_per_s)
+                word = " " + word
+
+            self.send_event(json.dumps({"choices": [{"index": 0, "delta": {"content": word}}]}))
+
+        self.send_event("[DONE]")
+        self.wfile.write(b"0\r\n\r\n")
+        self.wfile.flush()
+
+    def send_event(self, data):
+        event = ("data: " + data + "\n\n").encode()
+        self.wfile.write(b"%x\r\n%s\r\n" % (len(event), event))
+        self.wfile.flush()
+
+    def log_message(self, format, *args):
+        pass
+
+
+server = ThreadingHTTPServer((args.host, args.port), Handler)
+print("mock-chat: listening on http://%s:%d" % (args.host, server.server_address[1]), file=sys.stderr, flush=True)
+
+try:
+    server.serve_forever()
+except KeyboardInterrupt:
+    pass
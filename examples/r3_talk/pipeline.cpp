@@ -0,0 +1,28 @@
+#include "pipeline.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+std::thread stage_start(const stage_params & params, std::function<void()> fn) {
+    return std::thread([params, fn]() {
+#ifdef __linux__
+        // thread names are limited to 15 characters
+        pthread_setname_np(pthread_self(), params.name.substr(0, 15).c_str());
+
+        // on Linux the nice value of a thread can be set on its own
+        if (params.nice != 0 && setpriority(PRIO_PROCESS, (id_t) syscall(SYS_gettid), params.nice) != 0) {
+            fprintf(stderr, "%s: failed to set the priority of '%s' to %d: %s\n", __func__, params.name.c_str(), params.nice, strerror(errno));
+        }
+#endif
+
+        fn();
+    });
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+// Building blocks of the staged conversation loop
+//
+// Every stage runs on its own thread and hands its results to the next stage through a bounded queue, so a slow
+// stage makes the previous one wait instead of letting the work pile up. Every turn of the conversation carries a
+// cancellation token - cancelling it (barge-in, new command, shutdown) makes all stages drop the work of the turn.
+//
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+class cancel_token {
+public:
+    cancel_token() : m_flag(std::make_shared<std::atomic_bool>(false)) {}
+
+    void cancel()          { *m_flag = true; }
+    bool cancelled() const { return *m_flag; }
+
+    // copies of a token belong to the same turn
+    bool operator==(const cancel_token & other) const { return m_flag == other.m_flag; }
+    bool operator!=(const cancel_token & other) const { return m_flag != other.m_flag; }
+
+private:
+    std::shared_ptr<std::atomic_bool> m_flag;
+};
+
+template <typename T>
+class pipeline_queue {
+public:
+    pipeline_queue(size_t capacity) : m_capacity(capacity) {}
+
+    // blocks while the queue is full, returns false when the queue has been closed
+    bool push(T item) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cv_push.wait(lock, [&] { return m_closed || m_items.size() < m_capacity; });
+
+        if (m_closed) {
+            return false;
+        }
+
+        m_items.push_back(std::move(item));
+        m_cv_pop.notify_one();
+
+        return true;
+    }
+
+    // blocks while the queue is empty, returns false when the queue has been closed and drained
+    bool pop(T & item) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cv_pop.wait(lock, [&] { return m_closed || !m_items.empty(); });
+
+        if (m_items.empty()) {
+            return false;
+        }
+
+        item = std::move(m_items.front());
+        m_items.pop_front();
+        m_cv_push.notify_one();
+
+        return true;
+    }
+
+    bool empty() const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_items.empty();
+    }
+
+    // wake up all waiting stages, push() fails from now on
+    void close() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_closed = true;
+        m_cv_push.notify_all();
+        m_cv_pop.notify_all();
+    }
+
+private:
+    const size_t m_capacity;
+
+    mutable std::mutex      m_mutex;
+    std::condition_variable m_cv_push;
+    std::condition_variable m_cv_pop;
+
+    std::deque<T> m_items;
+
+    bool m_closed = false;
+};
+
+struct stage_params {
+    std::string name;
+
+    int32_t nice = 0; // scheduling priority of the stage thread, lower is more urgent (< 0 needs privileges)
+};
+
+// start the thread of a stage - the name and the priority are applied where the platform supports them
+std::thread stage_start(const stage_params & params, std::function<void()> fn);
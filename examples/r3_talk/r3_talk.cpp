@@ -3,10 +3,20 @@
 
 #include "common.h"
 #include "common-sdl.h"
+#include "conversation.h"
+#include "dialog.h"
+#include "echo-cancel.h"
+#include "endpointer.h"
+#include "grammar-parser.h"
+#include "pipeline.h"
+#include "wake-word.h"
 #include "whisper.h"
 
 #include <cassert>
+#include <cctype>
 #include <cstdio>
+#include <cstdlib>
+#include <ctime>
 #include <fstream>
 #include <regex>
 #include <string>
@@ -18,11 +28,13 @@
 #include <condition_variable>
 #include <filesystem>
 #include <functional>
+#include <future>
 #include <iostream>
 #include <mutex>
 #include <sstream>
 #include <stdexcept>
 #include <algorithm>
+#include <atomic>
 
 #ifdef _MSC_VER
 #define WIN32_LEAN_AND_MEAN
@@ -34,6 +46,11 @@
 #include <mach-o/dyld.h>
 #endif
 
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 #include "piper.hpp"
 
 #include <curl/curl.h>
@@ -167,13 +184,135 @@ void parseArgs(int argc, char *argv[], RunConfig &runConfig) {
 
 
 // Function to make HTTP POST request to OpenAI API
-size_t WriteCallback(char* contents, size_t size, size_t nmemb, std::string* output){
+// the streamed reply arrives as server-sent events, every "data: " line carries a JSON chunk of the reply
+struct ChatStream {
+    std::string buffer;   // the line that has not been received completely
+    std::string response; // everything else - the body of an error or of a reply that is not streamed
+    std::string content;
+
+    const dialog_text_callback* on_text = nullptr;
+};
+
+void ChatStreamEvent(ChatStream* stream, const std::string& data) {
+    if (data == "[DONE]") {
+        return;
+    }
+
+    try {
+        const nlohmann::json chunk = nlohmann::json::parse(data);
+
+        const auto choices = chunk.find("choices");
+        if (choices == chunk.end() || !choices->is_array() || choices->empty()) {
+            return;
+        }
+
+        const auto delta = (*choices)[0].find("delta");
+        if (delta == (*choices)[0].end() || !delta->contains("content") || !(*delta)["content"].is_string()) {
+            return;
+        }
+
+        const std::string piece = (*delta)["content"];
+        if (piece.empty()) {
+            return;
+        }
+
+        stream->content += piece;
+        if (stream->on_text) {
+            (*stream->on_text)(piece);
+        }
+    } catch (const std::exception& e) {
+        fprintf(stderr, "%s: invalid event: %s\n", __func__, e.what());
+    }
+}
+
+size_t WriteCallback(char* contents, size_t size, size_t nmemb, ChatStream* stream){
     size_t totalSize = size * nmemb;
-    output->append((char*) contents, totalSize);
+    stream->buffer.append((char*) contents, totalSize);
+
+    size_t pos;
+    while ((pos = stream->buffer.find('\n')) != std::string::npos) {
+        std::string line = stream->buffer.substr(0, pos);
+        stream->buffer.erase(0, pos + 1);
+
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+
+        if (line.compare(0, 6, "data: ") == 0) {
+            ChatStreamEvent(stream, line.substr(6));
+        } else {
+            stream->response += line + "\n";
+        }
+    }
+
     return totalSize;
 }
 
-std::string makeOpenAIRequest(const std::string& prompt) {
+// abort the request when the turn has been cancelled
+int XferInfoCallback(void* clientp, curl_off_t, curl_off_t, curl_off_t, curl_off_t) {
+    const cancel_token* turn = static_cast<const cancel_token*>(clientp);
+    return turn->cancelled() ? 1 : 0;
+}
+
+// DNS cache, TLS sessions and open connections are shared by all requests, so only the first one pays for them
+CURLSH* s_curl_share = nullptr;
+std::mutex s_curl_share_mutex;
+
+void CurlShareLock(CURL*, curl_lock_data, curl_lock_access, void*) {
+    s_curl_share_mutex.lock();
+}
+
+void CurlShareUnlock(CURL*, curl_lock_data, void*) {
+    s_curl_share_mutex.unlock();
+}
+
+void http_init() {
+    // the global init is not thread-safe, it must run before any request
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+
+    s_curl_share = curl_share_init();
+    if (s_curl_share) {
+        curl_share_setopt(s_curl_share, CURLSHOPT_LOCKFUNC, CurlShareLock);
+        curl_share_setopt(s_curl_share, CURLSHOPT_UNLOCKFUNC, CurlShareUnlock);
+        curl_share_setopt(s_curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(s_curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+        curl_share_setopt(s_curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+    }
+}
+
+void http_free() {
+    if (s_curl_share) {
+        curl_share_cleanup(s_curl_share);
+        s_curl_share = nullptr;
+    }
+    curl_global_cleanup();
+}
+
+// resolve the API host and open a TLS connection to it, the first command then reuses the connection
+void http_warmup(const std::string& url) {
+    CURL* curl = curl_easy_init();
+    if (curl) {
+        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+        curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 5);
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT, 10);
+        if (s_curl_share) {
+            curl_easy_setopt(curl, CURLOPT_SHARE, s_curl_share);
+        }
+
+        // without a key the answer is an error, only the connection matters
+        CURLcode res = curl_easy_perform(curl);
+        if (res != CURLE_OK) {
+            fprintf(stderr, "%s: failed to connect to the API: %s\n", __func__, curl_easy_strerror(res));
+        }
+
+        curl_easy_cleanup(curl);
+    }
+}
+
+// data is the JSON body of the chat request, on_text gets the pieces of a streamed reply as they arrive
+std::string makeOpenAIRequest(const std::string& endpoint, const std::string& data, const cancel_token* turn = nullptr,
+                              const dialog_text_callback* on_text = nullptr) {
     // Set your OpenAI API key
     std::string content;
     std::string apiKey;
@@ -187,11 +326,8 @@ std::string makeOpenAIRequest(const std::string& prompt) {
         throw runtime_error("Please set your OPENAI_API_KEY");
     }
 
-    // Set the endpoint for Chat API
-    std::string endpoint = "https://api.openai.com/v1/chat/completions";
     // Set the input parameters
     std::string apiKeyArg = "Authorization: Bearer " + apiKey;
-    std::string data = R"({"model": "gpt-3.5-turbo", "messages": [{"role": "system", "content": "You are a helpful assistant."}, {"role": "user", "content": ")"+prompt+R"("}]})";
 
     CURL* curl = curl_easy_init();
     if (curl) {
@@ -208,22 +344,49 @@ std::string makeOpenAIRequest(const std::string& prompt) {
         // Set POST data
         curl_easy_setopt(curl, CURLOPT_POSTFIELDS, data.c_str());
         curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 5);
-        curl_easy_setopt(curl, CURLOPT_TIMEOUT, 10);
+        if (on_text != nullptr) {
+            // a streamed reply takes as long as it is spoken, the request only fails when the stream stalls
+            curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+            curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 10L);
+        } else {
+            curl_easy_setopt(curl, CURLOPT_TIMEOUT, 10);
+        }
+        if (s_curl_share) {
+            curl_easy_setopt(curl, CURLOPT_SHARE, s_curl_share);
+        }
         // Set the write callback function to handle the response
-        std::string response;
+        ChatStream stream;
+        stream.on_text = on_text;
         curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &stream);
+
+        if (turn != nullptr) {
+            curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+            curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, XferInfoCallback);
+            curl_easy_setopt(curl, CURLOPT_XFERINFODATA, const_cast<cancel_token *>(turn));
+        }
         
         // Perform the request
         res = curl_easy_perform(curl);
+
+        // Clean up
+        curl_easy_cleanup(curl);
+        curl_slist_free_all(headers);
         
         // Check for errors
-        if (res != CURLE_OK) {
+        if (res == CURLE_ABORTED_BY_CALLBACK) {
+            return content;
+        }
+        else if (res != CURLE_OK) {
             fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
             return content;
         }
+        else if (!stream.content.empty()) {
+            return stream.content;
+        }
         else {
             // Print the response
+            std::string response = stream.response + stream.buffer;
             string::size_type index = response.find("choices");
             if (index != string::npos) {
                 //fprintf(stderr, "find response choices\n");
@@ -232,42 +395,103 @@ std::string makeOpenAIRequest(const std::string& prompt) {
                 fprintf(stdout, "response url: %s\n", response.c_str());
                 return content;
             }
-        }
 
-        nlohmann::json jsonData = nlohmann::json::parse(response);
-        // Get the 'content' of 'assistant' in 'message'
-        content = jsonData["choices"][0]["message"]["content"];
+            // the server did not stream the reply
+            nlohmann::json jsonData = nlohmann::json::parse(response);
+            // Get the 'content' of 'assistant' in 'message'
+            content = jsonData["choices"][0]["message"]["content"];
 
-        // Clean up
-        curl_easy_cleanup(curl);
-        curl_slist_free_all(headers);
+            if (on_text && !content.empty()) {
+                (*on_text)(content);
+            }
+        }
     }
     return content;
 }
 
+// the previous turns are sent with every command, as far as they fit into the token budget
+class dialog_openai : public dialog_backend {
+public:
+    dialog_openai(const std::string & url, const conversation_params & params, token_counter count) :
+        m_url(url), m_conversation(params, std::move(count)) {}
+
+    bool reply(const std::string & text, const cancel_token & turn, const dialog_text_callback & on_text) override {
+        const std::string content = makeOpenAIRequest(m_url, m_conversation.request(text), &turn, &on_text);
+        if (content.empty()) {
+            return false;
+        }
+
+        m_conversation.commit(text, content);
+
+        return true;
+    }
+
+    void warmup() override {
+        http_warmup(m_url);
+    }
+
+private:
+    const std::string m_url;
+
+    conversation m_conversation;
+};
+
 // command-line parameters
 struct whisper_params {
     int32_t n_threads  = std::min(4, (int32_t) std::thread::hardware_concurrency());
     int32_t prompt_ms  = 5000;
-    int32_t voice_ms   = 8000;
+    int32_t voice_ms   = 15000;
     int32_t capture_id = -1;
     int32_t max_tokens = 32;
     int32_t audio_ctx  = 0;
+    int32_t wake_timeout_ms = 10000;
+    int32_t ep_hangover_ms  = 700;
+    int32_t spec_step_ms    = 1000;
+    int32_t tts_threads     = 0;
+    int32_t chat_budget     = 1024;
+
+    // nice values of the endpoint, asr, dialog, tts and playback stages
+    std::vector<int32_t> stage_nice = { 0, 0, 0, 5, 0 };
 
     float vad_thold    = 0.6f;
     float freq_thold   = 100.0f;
+    float ep_thold     = 4.0f;
+
+    float grammar_penalty = 100.0f;
+    float intent_thold    = 0.70f;
+
+    float wake_thold         = 0.90f;
+    float wake_confirm_thold = 0.80f;
 
     bool speed_up      = false;
     bool translate     = false;
     bool print_special = false;
     bool print_energy  = false;
     bool no_timestamps = true;
+    bool no_intents    = false;
+    bool no_kws        = false;
+    bool kv_q8_0       = false;
+    bool barge_in      = false;
+    bool speculative   = false;
+    bool quit_at_end   = false;
 
     std::string language  = "en";
     std::string model_wsp = "models/ggml-base.en.bin";
     std::string light     = "./examples/r3_talk/light";
     std::string fname_out;
     std::string prompt_word = "hi whisper";
+    std::string grammar;
+    std::string chat_url = "https://api.openai.com/v1/chat/completions";
+    std::string latency_file;
+
+    // on-device dialog backend, the chat API is used without a model
+    std::string model_llama;
+    std::string llama_session;
+    std::string llama_prompt;
+
+    std::vector<std::string> wake_enroll;
+
+    audio_backend_params audio_backend;
 };
 
 void whisper_print_usage(int argc, char ** argv, const whisper_params & params);
@@ -283,6 +507,8 @@ bool whisper_params_parse(int argc, char ** argv, whisper_params & params) {
         else if (arg == "-t"   || arg == "--threads")       { params.n_threads     = std::stoi(argv[++i]); }
         else if (arg == "-pms" || arg == "--prompt-ms")     { params.prompt_ms     = std::stoi(argv[++i]); }
         else if (arg == "-vms" || arg == "--voice-ms")      { params.voice_ms      = std::stoi(argv[++i]); }
+        else if (arg == "-eph" || arg == "--ep-hangover")   { params.ep_hangover_ms = std::stoi(argv[++i]); }
+        else if (arg == "-epth" || arg == "--ep-thold")     { params.ep_thold      = std::stof(argv[++i]); }
         else if (arg == "-c"   || arg == "--capture")       { params.capture_id    = std::stoi(argv[++i]); }
         else if (arg == "-mt"  || arg == "--max-tokens")    { params.max_tokens    = std::stoi(argv[++i]); }
         else if (arg == "-ac"  || arg == "--audio-ctx")     { params.audio_ctx     = std::stoi(argv[++i]); }
@@ -297,6 +523,48 @@ bool whisper_params_parse(int argc, char ** argv, whisper_params & params) {
         else if (arg == "-ld"  || arg == "--light")         { params.light         = argv[++i]; }
         else if (arg == "-f"   || arg == "--file")          { params.fname_out     = argv[++i]; }
         else if (arg == "-pw"  || arg == "--prompt")        { params.prompt_word   = argv[++i]; }
+        else if (arg == "-gr"  || arg == "--grammar")       { params.grammar       = argv[++i]; }
+        else if (arg == "-gp"  || arg == "--grammar-penalty") { params.grammar_penalty = std::stof(argv[++i]); }
+        else if (arg == "-ith" || arg == "--intent-thold")  { params.intent_thold  = std::stof(argv[++i]); }
+        else if (arg == "-ni"  || arg == "--no-intents")    { params.no_intents    = true; }
+        else if (arg == "-we"  || arg == "--wake-enroll")   { params.wake_enroll.push_back(argv[++i]); }
+        else if (arg == "-wth" || arg == "--wake-thold")    { params.wake_thold    = std::stof(argv[++i]); }
+        else if (arg == "-wct" || arg == "--wake-confirm-thold") { params.wake_confirm_thold = std::stof(argv[++i]); }
+        else if (arg == "-wto" || arg == "--wake-timeout")  { params.wake_timeout_ms = std::stoi(argv[++i]); }
+        else if (arg == "-nkws" || arg == "--no-kws")       { params.no_kws        = true; }
+        else if (arg == "-kvq" || arg == "--kv-q8-0")       { params.kv_q8_0       = true; }
+        else if (arg == "-bi"  || arg == "--barge-in")      { params.barge_in      = true; }
+        else if (arg == "-sp"  || arg == "--speculative")   { params.speculative   = true; }
+        else if (arg == "-sps" || arg == "--spec-step")     { params.spec_step_ms  = std::stoi(argv[++i]); }
+        else if (arg == "-tt"  || arg == "--tts-threads")   { params.tts_threads   = std::stoi(argv[++i]); }
+        else if (arg == "-cb"  || arg == "--chat-budget")   { params.chat_budget   = std::stoi(argv[++i]); }
+        else if (arg == "-cu"  || arg == "--chat-url")      { params.chat_url      = argv[++i]; }
+        else if (arg == "-lf"  || arg == "--latency-file")  { params.latency_file  = argv[++i]; }
+        else if (arg == "-qe"  || arg == "--quit-at-end")   { params.quit_at_end   = true; }
+        else if (arg == "-ml"  || arg == "--model-llama")   { params.model_llama   = argv[++i]; }
+        else if (arg == "-ls"  || arg == "--llama-session") { params.llama_session = argv[++i]; }
+        else if (arg == "-lp"  || arg == "--llama-prompt")  { params.llama_prompt  = argv[++i]; }
+        else if (arg == "-sn"  || arg == "--stage-nice") {
+            std::stringstream ss(argv[++i]);
+            std::string nice;
+
+            params.stage_nice.clear();
+            while (std::getline(ss, nice, ',')) {
+                params.stage_nice.push_back(std::stoi(nice));
+            }
+
+            if (params.stage_nice.size() != 5) {
+                fprintf(stderr, "error: --stage-nice needs 5 values\n");
+                whisper_print_usage(argc, argv, params);
+                exit(0);
+            }
+        }
+        else if (arg == "-ab"  || arg == "--audio-backend") { params.audio_backend.name        = argv[++i]; }
+        else if (arg == "-ai"  || arg == "--audio-in")      { params.audio_backend.device_in   = argv[++i]; }
+        else if (arg == "-ao"  || arg == "--audio-out")     { params.audio_backend.device_out  = argv[++i]; }
+        else if (arg == "-ap"  || arg == "--audio-period")  { params.audio_backend.period_size = std::stoi(argv[++i]); }
+        else if (arg == "-anp" || arg == "--audio-periods") { params.audio_backend.n_periods   = std::stoi(argv[++i]); }
+        else if (arg == "-af32" || arg == "--audio-f32")    { params.audio_backend.capture_f32 = true; }
     }
 
     return true;
@@ -310,7 +578,9 @@ void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & para
     fprintf(stderr, "  -h,       --help          [default] show this help message and exit\n");
     fprintf(stderr, "  -t N,     --threads N     [%-7d] number of threads to use during computation\n", params.n_threads);
     fprintf(stderr, "  -pms N,   --prompt-ms N   [%-7d] prompt duration in milliseconds\n",             params.prompt_ms);
-    fprintf(stderr, "  -vms N,   --voice-ms N    [%-7d] voice duration in milliseconds\n",              params.voice_ms);
+    fprintf(stderr, "  -vms N,   --voice-ms N    [%-7d] maximum command duration in milliseconds\n",    params.voice_ms);
+    fprintf(stderr, "  -eph N,   --ep-hangover N [%-7d] silence in milliseconds that ends a command\n",   params.ep_hangover_ms);
+    fprintf(stderr, "  -epth N,  --ep-thold N    [%-7.2f] energy above the noise floor that is speech\n", params.ep_thold);
     fprintf(stderr, "  -c ID,    --capture ID    [%-7d] capture device ID\n",                           params.capture_id);
     fprintf(stderr, "  -mt N,    --max-tokens N  [%-7d] maximum number of tokens per audio chunk\n",    params.max_tokens);
     fprintf(stderr, "  -ac N,    --audio-ctx N   [%-7d] audio context size (0 - all)\n",                params.audio_ctx);
@@ -325,15 +595,40 @@ void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & para
     fprintf(stderr, "  -ld FILE, --light led     [%-7s] command for light\n",                           params.light.c_str());
     fprintf(stderr, "  -f FNAME, --file FNAME    [%-7s] text output file name\n",                       params.fname_out.c_str());
     fprintf(stderr, "  -pw LANG, --prompt LANG   [%-7s] prompt word\n",                                 params.prompt_word.c_str());
+    fprintf(stderr, "  -gr FILE, --grammar FILE  [%-7s] GBNF grammar of the local voice intents (default: built-in)\n", params.grammar.c_str());
+    fprintf(stderr, "  -gp N,    --grammar-penalty N [%-7.1f] logit penalty of tokens outside the grammar\n", params.grammar_penalty);
+    fprintf(stderr, "  -ith N,   --intent-thold N [%-7.2f] min avg token probability of the command to run an intent locally\n", params.intent_thold);
+    fprintf(stderr, "  -ni,      --no-intents    [%-7s] send every request to the chat backend\n",     params.no_intents ? "true" : "false");
+    fprintf(stderr, "  -we FILE, --wake-enroll FILE [%-4s] WAV recording of the prompt to enroll (can be repeated)\n", "");
+    fprintf(stderr, "  -wth N,   --wake-thold N  [%-7.2f] wake word score to wake up without confirmation\n", params.wake_thold);
+    fprintf(stderr, "  -wct N,   --wake-confirm-thold N [%-4.2f] wake word score to confirm with whisper\n", params.wake_confirm_thold);
+    fprintf(stderr, "  -wto N,   --wake-timeout N [%-7d] go back to sleep after this long without a command\n", params.wake_timeout_ms);
+    fprintf(stderr, "  -nkws,    --no-kws        [%-7s] stay awake after the prompt instead of waiting for the wake word\n", params.no_kws ? "true" : "false");
+    fprintf(stderr, "  -kvq,     --kv-q8-0       [%-7s] store the whisper KV caches as Q8_0 (less memory)\n", params.kv_q8_0 ? "true" : "false");
+    fprintf(stderr, "  -bi,      --barge-in      [%-7s] interrupt the reply when the user starts speaking (echo cancellation)\n", params.barge_in ? "true" : "false");
+    fprintf(stderr, "  -sp,      --speculative   [%-7s] transcribe the command while it is spoken\n",      params.speculative ? "true" : "false");
+    fprintf(stderr, "  -sps N,   --spec-step N   [%-7d] speech in milliseconds between the partial transcriptions\n", params.spec_step_ms);
+    fprintf(stderr, "  -tt N,    --tts-threads N [%-7d] number of threads of the speech synthesis (0 - onnxruntime default)\n", params.tts_threads);
+    fprintf(stderr, "  -sn LIST, --stage-nice LIST [%d,%d,%d,%d,%d] nice values of the endpoint, asr, dialog, tts and playback stages\n",
+            params.stage_nice[0], params.stage_nice[1], params.stage_nice[2], params.stage_nice[3], params.stage_nice[4]);
+    fprintf(stderr, "  -cb N,    --chat-budget N [%-7d] tokens of the conversation history sent with a chat request\n", params.chat_budget);
+    fprintf(stderr, "  -cu URL,  --chat-url URL  [%-7s] chat completions endpoint\n", params.chat_url.c_str());
+    fprintf(stderr, "  -lf FILE, --latency-file FILE [%-3s] append the latencies of every turn as JSON lines\n", params.latency_file.c_str());
+    fprintf(stderr, "  -qe,      --quit-at-end   [%-7s] quit when the capture file has been played and the last turn is answered\n", params.quit_at_end ? "true" : "false");
+    fprintf(stderr, "  -ml FILE, --model-llama FILE [%-4s] LLaMA model file of the on-device dialog (default: chat API)\n", params.model_llama.c_str());
+    fprintf(stderr, "  -ls FILE, --llama-session FILE [%-2s] file to keep the evaluated conversation in between runs\n", params.llama_session.c_str());
+    fprintf(stderr, "  -lp FILE, --llama-prompt FILE [%-3s] system prompt of the on-device dialog (default: built-in)\n", params.llama_prompt.c_str());
+    fprintf(stderr, "  -ab NAME, --audio-backend NAME [%-4s] audio backend: sdl, alsa, file or null\n", params.audio_backend.name.c_str());
+    fprintf(stderr, "  -ai DEV,  --audio-in DEV  [%-7s] capture device (alsa: PCM name, file: WAV file)\n", params.audio_backend.device_in.c_str());
+    fprintf(stderr, "  -ao DEV,  --audio-out DEV [%-7s] playback device (alsa: PCM name, file: raw 16-bit or .wav output file)\n", params.audio_backend.device_out.c_str());
+    fprintf(stderr, "  -ap N,    --audio-period N [%-7d] frames per period (alsa, file)\n", params.audio_backend.period_size);
+    fprintf(stderr, "  -anp N,   --audio-periods N [%-6d] periods in the device buffer (alsa)\n", params.audio_backend.n_periods);
+    fprintf(stderr, "  -af32,    --audio-f32     [%-7s] capture float samples instead of 16-bit (alsa)\n", params.audio_backend.capture_f32 ? "true" : "false");
     fprintf(stderr, "\n");
 }
 
-std::string transcribe(whisper_context * ctx, const whisper_params & params, const std::vector<float> & pcmf32, float & prob, int64_t & t_ms) {
-    const auto t_start = std::chrono::high_resolution_clock::now();
-
-    prob = 0.0f;
-    t_ms = 0;
-
+// when grammar is not null, the decoding is constrained to the sentences of the grammar
+whisper_full_params transcribe_params(const whisper_params & params) {
     whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
 
     wparams.print_progress   = false;
@@ -350,6 +645,28 @@ std::string transcribe(whisper_context * ctx, const whisper_params & params, con
     wparams.audio_ctx        = params.audio_ctx;
     wparams.speed_up         = params.speed_up;
 
+    return wparams;
+}
+
+std::string transcribe(whisper_context * ctx, const whisper_params & params, const std::vector<float> & pcmf32, float & prob, int64_t & t_ms,
+                       const grammar_parser::parse_state * grammar = nullptr) {
+    const auto t_start = std::chrono::high_resolution_clock::now();
+
+    prob = 0.0f;
+    t_ms = 0;
+
+    whisper_full_params wparams = transcribe_params(params);
+
+    std::vector<const whisper_grammar_element *> grammar_rules;
+    if (grammar != nullptr && !grammar->rules.empty()) {
+        grammar_rules = grammar->c_rules();
+
+        wparams.grammar_rules   = grammar_rules.data();
+        wparams.n_grammar_rules = grammar_rules.size();
+        wparams.i_start_rule    = grammar->symbol_ids.at("root");
+        wparams.grammar_penalty = params.grammar_penalty;
+    }
+
     if (whisper_full(ctx, wparams, pcmf32.data(), pcmf32.size()) != 0) {
         return "";
     }
@@ -382,6 +699,65 @@ std::string transcribe(whisper_context * ctx, const whisper_params & params, con
     return result;
 }
 
+int whisper_count_tokens(whisper_context * ctx, const std::string & text) {
+    std::vector<whisper_token> tokens(text.size() + 1);
+
+    return std::max(0, whisper_tokenize(ctx, text.c_str(), tokens.data(), tokens.size()));
+}
+
+// the committed text of the speculative transcription - the stream only keeps the recent committed tokens, so the new
+// ones are read after each step
+struct stream_text {
+    int         n_read = 0;
+    std::string text;
+    float       prob_sum = 0.0f;
+};
+
+void stream_text_update(whisper_context * ctx, whisper_stream * stream, stream_text & st) {
+    for (; st.n_read < whisper_stream_n_committed(stream); ++st.n_read) {
+        const auto token = whisper_stream_get_committed(stream, st.n_read);
+
+        st.text     += whisper_token_to_str(ctx, token.id);
+        st.prob_sum += token.p;
+    }
+}
+
+// finish the speculative transcription of the command - only the audio after the committed tokens is transcribed
+std::string transcribe_flush(whisper_context * ctx, whisper_stream * stream, stream_text & st, float & prob, int64_t & t_ms) {
+    const auto t_start = std::chrono::high_resolution_clock::now();
+
+    prob = 0.0f;
+    t_ms = 0;
+
+    if (whisper_stream_flush(stream) < 0) {
+        return "";
+    }
+
+    stream_text_update(ctx, stream, st);
+
+    const std::string result = st.text;
+
+    if (st.n_read > 0) {
+        prob = st.prob_sum/st.n_read;
+    }
+
+    const auto t_end = std::chrono::high_resolution_clock::now();
+    t_ms = std::chrono::duration_cast<std::chrono::milliseconds>(t_end - t_start).count();
+
+    return result;
+}
+
+// lowercase letters only, cut to about the length of the prompt
+std::string prompt_text(std::string txt, const std::string & prompt) {
+    txt = std::regex_replace(::trim(txt), std::regex("[^a-zA-Z\\s]"), "");
+    transform(txt.begin(), txt.end(), txt.begin(),::tolower);
+
+    if (txt.length() > prompt.length()+3) {
+        txt = txt.substr(0, prompt.length()+3);
+    }
+
+    return txt;
+}
 
 audio_async audio(30*1000);
 
@@ -431,74 +807,6 @@ void reduceVolume(std::vector<int16_t>& pcmData, double factor) {
     }
 }
 
-void rawOutputProc(vector<int16_t> &sharedAudioBuffer, mutex &mutAudio, condition_variable &cvAudio,
-                     bool &audioReady, bool &audioFinished, int volume) {
-    vector<int16_t> internalAudioBuffer;
-    bool is_running  = true;
-    while (is_running) {
-        // handle Ctrl + C
-        is_running = sdl_poll_events();
-
-        if (!is_running) {
-            audio.pause();
-            light_set(CLOSE);
-            throw runtime_error("sdl_interrupt");
-        }
-
-        unique_lock lockAudio{mutAudio};
-        cvAudio.wait(lockAudio, [&audioReady] { return audioReady; });
-        reduceVolume(sharedAudioBuffer, (volume*1.5)/200.0);
-
-        if (sharedAudioBuffer.empty() && audioFinished) {
-            break;
-        }
-
-        copy(sharedAudioBuffer.begin(), sharedAudioBuffer.end(), back_inserter(internalAudioBuffer));
-
-        sharedAudioBuffer.clear();
-        if (!audioFinished) {
-            audioReady = false;
-        }
-
-        fprintf(stderr, "%s: play_write  %ld buff\n", __func__, sizeof(int16_t) * internalAudioBuffer.size());
-        audio.play_write((const char *)internalAudioBuffer.data(), sizeof(int16_t) * internalAudioBuffer.size());
-        internalAudioBuffer.clear();
-    }
-
-} // rawOutputProc
-
-int piper_tts(piper::PiperConfig &piperConfig, piper::Voice &piperVoice, std::string text_to_speak, int volume) {
-    piper::SynthesisResult result;
-    mutex mutAudio;
-    condition_variable cvAudio;
-    bool audioReady = false;
-    bool audioFinished = false;
-    vector<int16_t> audioBuffer;
-    vector<int16_t> sharedAudioBuffer;
-
-    thread rawOutputThread(rawOutputProc, ref(sharedAudioBuffer), ref(mutAudio), ref(cvAudio),
-                             ref(audioReady),ref(audioFinished), ref(volume));
-    auto audioCallback = [&audioBuffer, &sharedAudioBuffer, &mutAudio, &cvAudio, &audioReady]() {
-        unique_lock lockAudio(mutAudio);
-        copy(audioBuffer.begin(), audioBuffer.end(), back_inserter(sharedAudioBuffer));
-        audioReady = true;
-        fprintf(stderr, "%s: audioReady\n", __func__);
-        cvAudio.notify_one();
-    };
-
-    piper::textToAudio(piperConfig, piperVoice, text_to_speak, audioBuffer, result, audioCallback);
-    // Signal thread that there is no more audio
-    {
-        unique_lock lockAudio(mutAudio);
-        audioReady = true;
-        audioFinished = true;
-        cvAudio.notify_one();
-    }
-    rawOutputThread.join();
-    return audio.play_wait();
-}
-
-
 void piper_init(RunConfig &runConfig, piper::PiperConfig &piperConfig, piper::Voice &piperVoice) {
     fprintf(stderr, "%s: piper loadVoice\n", __func__);
     loadVoice(piperConfig, runConfig.modelPath.string(),
@@ -572,228 +880,1328 @@ auto exePath = filesystem::canonical("/proc/self/exe");
 
 }
 // ----------------------------------------------------------------------------
+// local voice intents
+//
+// when the transcription of a short command names an intent, the command is decoded again constrained to the intent
+// grammar - if both transcriptions agree and the unconstrained one is confident enough, the intent is executed on the
+// device and the chat backend is not contacted at all
+
+const std::string k_intent_grammar = R"(
+root    ::= " " intent [.!?]?
+intent  ::= volume | stop | time
+volume  ::= [Vv] "olume " ("up" | "down" | number) | [Tt] "urn it " ("up" | "down") | [Ss] "et the volume to " number
+stop    ::= [Ss] "top" | [Bb] "e quiet" | [Ss] "hut up"
+time    ::= [Ww] "hat time is it" | [Ww] "hat's the time"
+number  ::= [0-9] [0-9]? [0-9]? (" percent" | "%")?
+)";
+
+// the intents are short phrases, longer commands are not decoded with the grammar
+constexpr int k_intent_max_ms = 3000;
+
+// min similarity of the constrained and the unconstrained transcription of an intent
+constexpr float k_intent_min_sim = 0.75f;
+
+enum IntentType { INTENT_NONE, INTENT_VOLUME_UP, INTENT_VOLUME_DOWN, INTENT_VOLUME_SET, INTENT_STOP, INTENT_TIME };
+
+struct Intent {
+    IntentType type  = INTENT_NONE;
+    int        value = 0;
+};
 
-int main(int argc, char ** argv) {
-    whisper_params params;
-    if (whisper_params_parse(argc, argv, params) == false) {
-        return 1;
+// lowercase words, to compare the transcriptions of an intent
+std::string intent_words(const std::string & text) {
+    std::string txt = std::regex_replace(text, std::regex("[^a-zA-Z0-9'\\s]"), "");
+    transform(txt.begin(), txt.end(), txt.begin(), ::tolower);
+
+    return ::trim(txt);
+}
+
+// map a transcription to an intent
+// custom grammars are supported as long as their sentences contain the same key phrases
+Intent intent_match(const std::string & text) {
+    Intent intent;
+
+    const std::string txt = intent_words(text);
+
+    std::smatch match;
+    if (std::regex_search(txt, match, std::regex("volume( to)? (\\d+)"))) {
+        intent.type  = INTENT_VOLUME_SET;
+        intent.value = std::stoi(match[2].str());
+    } else if (std::regex_search(txt, std::regex("(volume|turn it) up|louder"))) {
+        intent.type = INTENT_VOLUME_UP;
+    } else if (std::regex_search(txt, std::regex("(volume|turn it) down|quieter"))) {
+        intent.type = INTENT_VOLUME_DOWN;
+    } else if (std::regex_search(txt, std::regex("\\bstop\\b|be quiet|shut up"))) {
+        intent.type = INTENT_STOP;
+    } else if (std::regex_search(txt, std::regex("what time|the time"))) {
+        intent.type = INTENT_TIME;
     }
 
-    if (whisper_lang_id(params.language.c_str()) == -1) {
-        fprintf(stderr, "error: unknown language '%s'\n", params.language.c_str());
-        whisper_print_usage(argc, argv, params);
-        exit(0);
+    return intent;
+}
+
+// execute the intent and return the reply to speak (empty for no reply)
+std::string intent_run(const Intent & intent, int & volume) {
+    switch (intent.type) {
+        case INTENT_VOLUME_UP:
+            volume = std::min(100, volume + 10);
+            return "Volume " + std::to_string(volume) + ".";
+        case INTENT_VOLUME_DOWN:
+            volume = std::max(0, volume - 10);
+            return "Volume " + std::to_string(volume) + ".";
+        case INTENT_VOLUME_SET:
+            volume = std::max(0, std::min(100, intent.value));
+            return "Volume " + std::to_string(volume) + ".";
+        case INTENT_TIME:
+            {
+                const time_t now = time(nullptr);
+                char buf[32];
+                strftime(buf, sizeof(buf), "%H:%M", localtime(&now));
+                return std::string("It is ") + buf + ".";
+            }
+        case INTENT_STOP:
+        case INTENT_NONE:
+            break;
     }
 
-    // piper init
-    RunConfig runConfig;
-    parseArgs(argc, argv, runConfig);
+    return "";
+}
 
-    fprintf(stderr, "%s: piper init start\n", __func__);
-    piper::PiperConfig piperConfig;
-    piper::Voice piperVoice;
-    piper_init(runConfig, piperConfig, piperVoice);
-    fprintf(stderr, "%s: piper init finished\n\n", __func__);
+// ----------------------------------------------------------------------------
+// conversation pipeline
+//
+//   capture -> endpoint -> asr -> dialog -> tts -> playback
+//
+// The endpoint stage reads the captured audio and detects the wake word, the end of the commands and the barge-in.
+// The commands are transcribed by the asr stage, answered by the local intents or the chat backend in the dialog
+// stage, synthesized sentence by sentence by the tts stage and played by the playback stage. The endpoint stage
+// never waits for the others, so the user is heard while the reply is prepared - a new command cancels the turn of
+// the previous one. Whisper is only used from the asr stage.
+
+struct asr_result {
+    std::string text;
+    int64_t     t_ms = 0;
+};
 
-    // whisper init
+struct asr_job {
+    enum kind_t {
+        PROMPT,       // transcribe the prompt phrase, the result is returned to the endpoint stage
+        WAKE_CONFIRM, // transcribe a possible wake word, the result is returned to the endpoint stage
+        COMMAND_PART, // audio of the command that is spoken (speculative transcription)
+        COMMAND,      // the whole command
+    };
 
-    struct whisper_context * ctx_wsp = whisper_init_from_file(params.model_wsp.c_str());
+    kind_t kind = COMMAND;
 
-    // print some info about the processing
-    {
-        fprintf(stderr, "\n");
-        if (!whisper_is_multilingual(ctx_wsp)) {
-            if (params.language != "en" || params.translate) {
-                params.language = "en";
-                params.translate = false;
-                fprintf(stderr, "%s: WARNING: model is not multilingual, ignoring language and translation options\n", __func__);
-            }
-        }
-        fprintf(stderr, "%s: processing, %d threads, lang = %s, task = %s, timestamps = %d ...\n",
-                __func__,
-                params.n_threads,
-                params.language.c_str(),
-                params.translate ? "translate" : "transcribe",
-                params.no_timestamps ? 0 : 1);
+    cancel_token turn;      // COMMAND: the turn that answers the command
+    cancel_token utterance; // COMMAND_PART, COMMAND: the spoken command, cancelled when it is dropped
 
-        fprintf(stderr, "\n");
-    }
+    std::vector<float> pcmf32;
 
-    // init audio
-    fprintf(stderr, "%s: init audio\n", __func__);
-    //audio_async audio(30*1000);
-    if (!audio.init(params.capture_id, WHISPER_SAMPLE_RATE)) {
-        fprintf(stderr, "%s: audio.init() failed!\n", __func__);
-        return 1;
-    }
+    std::promise<asr_result> result;
+};
 
-    if (!audio.play_init(params.capture_id)) {
-        fprintf(stderr, "%s: audio.play_init() failed!\n", __func__);
-        return 1;
-    }
-    s_light = params.light;
+struct dialog_job {
+    cancel_token turn;
 
-    audio.resume();
+    std::string text;
+    Intent      intent;
+};
 
-    // wait for 1 second to avoid any buffered noise
-    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
-    audio.clear();
+struct tts_job {
+    cancel_token turn;
 
-    bool is_running  = true;
-    bool have_prompt = false;
-    bool ask_prompt  = true;
-    bool is_listening = false;
-    float prob0 = 0.0f;
+    std::string text;
+    bool        last = true; // the last part of the reply
+};
 
-    std::vector<float> pcmf32_cur;
-    std::vector<float> pcmf32_prompt;
+struct play_chunk {
+    cancel_token turn;
 
-    const std::string k_prompt = params.prompt_word;
+    std::vector<int16_t> pcm;
+    bool                 last = false; // the end of the reply
+};
 
-    fprintf(stderr, "\n%s: main loop\n", __func__);
-    // main loop
-    while (is_running) {
-        // handle Ctrl + C
-        is_running = sdl_poll_events();
+// the points in time of a turn, the latencies are reported from the end of the spoken command
+struct turn_latency {
+    using time_point = std::chrono::steady_clock::time_point;
 
-        if (!is_running) {
-            break;
-        }
+    cancel_token turn;
 
-        // delay
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    time_point t_speech_end;  // estimated with the silence the endpointer has waited for
+    time_point t_endpoint;    // the endpointer has ended the command
+    time_point t_asr;         // the command has been transcribed
+    time_point t_first_text;  // the first piece of the reply is there
+    time_point t_first_audio; // the first synthesized audio is played
+    time_point t_play_end;    // the playback of the reply has ended
+};
 
-        if (ask_prompt) {
-            fprintf(stdout, "\n%s: Say the following phrase: '%s%s%s'\n\n", __func__, "\033[1m", k_prompt.c_str(), "\033[0m");
+struct talk_pipeline {
+    talk_pipeline(whisper_params & params) : params(params) {}
 
-            ask_prompt = false;
-        } else if (is_listening) {
-            fprintf(stdout, "\n%s: Listening ... \n\n", __func__);
-            is_listening = false;
-            light_set(BLUE);
-        }
+    whisper_params & params;
 
-        {
-            audio.get(2000, pcmf32_cur);
+    struct whisper_context * ctx_wsp    = nullptr;
+    struct whisper_stream  * stream_wsp = nullptr;
 
-            if (::vad_simple(pcmf32_cur, WHISPER_SAMPLE_RATE, 1000, params.vad_thold, params.freq_thold, params.print_energy)) {
-                fprintf(stdout, "%s: Speech detected! Processing ...\n", __func__);
-                const auto t_start = std::chrono::high_resolution_clock::now();
+    const grammar_parser::parse_state * grammar = nullptr;
 
-                int64_t t_ms = 0;
-                std::string text_to_speak;
+    piper::PiperConfig * piper_config = nullptr;
+    piper::Voice       * piper_voice  = nullptr;
 
-                if (!have_prompt) {
-                    // wait for activation phrase
-                    audio.get(params.prompt_ms, pcmf32_cur);
+    dialog_backend * dialog = nullptr;
 
-                    auto txt = ::trim(::transcribe(ctx_wsp, params, pcmf32_cur, prob0, t_ms));
+    // the endpoint stage keeps at most one command part queued, so it does not block on the asr stage
+    pipeline_queue<asr_job>    q_asr    { 4 };
+    pipeline_queue<dialog_job> q_dialog { 4 };
+    pipeline_queue<tts_job>    q_tts    { 4 };
+    pipeline_queue<play_chunk> q_play   { 4 }; // sentences synthesized ahead of the playback
 
-                    txt = std::regex_replace(txt, std::regex("[^a-zA-Z\\s]"), "");
-                    transform(txt.begin(), txt.end(), txt.begin(),::tolower);
-                    fprintf(stdout, "%s: Heard '%s%s%s', (t = %d ms)\n", __func__, "\033[1m", txt.c_str(), "\033[0m", (int) t_ms);
+    std::atomic_bool running { true };
+    std::atomic_int  volume  { 50 };
 
-                    if (txt.length() > params.prompt_word.length()+3) {
-                        txt = txt.substr(0, params.prompt_word.length()+3);
-                    }
+    // the turn that is answered and the state of its playback
+    std::mutex   mutex;
+    cancel_token turn;
+    bool         speaking = false; // the playback has started
+    bool         flushed  = false; // the playback has been flushed and is reset by the next play_wait()
 
-                    const float sim = similarity(txt, k_prompt);
-
-                    if (txt.length() < 0.6*k_prompt.length() || txt.length() > 1.4*k_prompt.length() || sim < 0.6f) {
-                        fprintf(stdout, "%s: WARNING: prompt not recognized, try again\n", __func__);
-                        ask_prompt = true;
-                    } else {
-                        fprintf(stdout, "\n");
-                        fprintf(stdout, "%s: The prompt has been recognized!\n", __func__);
-                        fprintf(stdout, "%s: Waiting for voice commands ...\n", __func__);
-                        fprintf(stdout, "\n");
-
-                        // save the audio for the prompt
-                        pcmf32_prompt = pcmf32_cur;
-                        have_prompt = true;
-                        is_listening = true;
-                    }
-                    audio.clear();
-                    continue;
-                } else {
-                    light_set(GREEN_BLUE);
-                    // we have heard the activation phrase
-                    audio.get(params.voice_ms, pcmf32_cur);
-
-                    std::string text_heard;
-                    text_heard = ::trim(::transcribe(ctx_wsp, params, pcmf32_cur, prob0, t_ms));
-                    fprintf(stdout, "%s: Text '%s%s%s', (t = %d ms)\n", __func__, "\033[1m", text_heard.c_str(), "\033[0m", (int) t_ms);
-
-                    // remove text between brackets using regex
-                    {
-                        std::regex re("\\[.*?\\]");
-                        text_heard = std::regex_replace(text_heard, re, "");
-                    }
+    // the latency of the current turn, reported when the turn ends (and written to fout_latency)
+    turn_latency latency;
+    FILE *       fout_latency = nullptr;
+    int          n_turns      = 0;
+};
 
-                    // remove text between brackets using regex
-                    {
-                        std::regex re("\\(.*?\\)");
-                        text_heard = std::regex_replace(text_heard, re, "");
-                    }
+// must be called with pl.mutex held
+static void turn_cancel_locked(talk_pipeline & pl) {
+    pl.turn.cancel();
 
-                    // remove all characters, except for letters, numbers, punctuation and ':', '\'', '-', ' '
-                    text_heard = std::regex_replace(text_heard, std::regex("[^a-zA-Z0-9\\.,\\?!\\s\\:\\'\\-]"), "");
+    if (pl.speaking && !pl.flushed) {
+        audio.play_flush();
+        pl.flushed = true;
+    }
+}
 
-                    // take first line
-                    text_heard = text_heard.substr(0, text_heard.find_first_of('\n'));
+// stop answering the current command, also stops the playback of the reply
+void turn_cancel(talk_pipeline & pl) {
+    std::lock_guard<std::mutex> lock(pl.mutex);
+    turn_cancel_locked(pl);
+}
 
-                    // remove leading and trailing whitespace
-                    text_heard = std::regex_replace(text_heard, std::regex("^\\s+"), "");
-                    text_heard = std::regex_replace(text_heard, std::regex("\\s+$"), "");
+// the user has started speaking over the reply - stop it at once, the captured audio is the next command from now on
+// the playback stage drops the rest of the cancelled turn and resets the flushed playback on its own
+void turn_interrupt(talk_pipeline & pl) {
+    std::lock_guard<std::mutex> lock(pl.mutex);
+    turn_cancel_locked(pl);
 
-                    if (text_heard.empty()) {
-                        fprintf(stdout, "%s: Heard nothing, skipping ...\n", __func__);
-                        audio.clear();
-                        is_listening = true;
-                        continue;
-                    }
+    pl.speaking = false;
+}
 
-                    fprintf(stdout, "%s: Heard '%s%s%s', (t = %d ms)\n", __func__, "\033[1m", text_heard.c_str(), "\033[0m", (int) t_ms);
+// cancel the current turn and start a new one
+cancel_token turn_begin(talk_pipeline & pl) {
+    std::lock_guard<std::mutex> lock(pl.mutex);
+    turn_cancel_locked(pl);
 
-                    text_to_speak = makeOpenAIRequest(text_heard.c_str());
-                    fprintf(stdout, "%s: Response '%s%s%s'\n", __func__, "\033[1m", text_to_speak.c_str(), "\033[0m");
+    pl.turn = cancel_token();
 
-                    if (text_to_speak.empty()) {
-                        fprintf(stdout, "%s: No response, skipping ...\n", __func__);
-                        audio.clear();
-                        is_listening = true;
-                        continue;
-                    }
+    return pl.turn;
+}
 
-                    if (sdl_poll_events() == false) {
-                        break;
-                    }
-                }
-                int volume = 50;
-                if (runConfig.volume) {
-                    volume = runConfig.volume.value();
-                }
-                light_set(RED_GREEN_BLUE);
-                const auto t_end = std::chrono::high_resolution_clock::now();
-                int64_t t_transform_ms = std::chrono::duration_cast<std::chrono::milliseconds>(t_end - t_start).count();
-                fprintf(stdout, "%s: before piper start (t_transform_ms = %d ms)\n", __func__, (int) t_transform_ms);
-                if(piper_tts(piperConfig, piperVoice, text_to_speak, volume) == -1) {
+void latency_begin(talk_pipeline & pl, const cancel_token & turn, int trailing_ms) {
+    const auto t_now = std::chrono::steady_clock::now();
+
+    std::lock_guard<std::mutex> lock(pl.mutex);
+
+    pl.latency = turn_latency();
+    pl.latency.turn         = turn;
+    pl.latency.t_endpoint   = t_now;
+    pl.latency.t_speech_end = t_now - std::chrono::milliseconds(trailing_ms);
+}
+
+// the turn has reached a point - only the first time is kept
+void latency_mark(talk_pipeline & pl, const cancel_token & turn, turn_latency::time_point turn_latency::* t) {
+    const auto t_now = std::chrono::steady_clock::now();
+
+    std::lock_guard<std::mutex> lock(pl.mutex);
+
+    if (pl.latency.turn == turn && pl.latency.*t == turn_latency::time_point()) {
+        pl.latency.*t = t_now;
+    }
+}
+
+// the turn has ended - after its playback or without a reply
+void latency_report(talk_pipeline & pl, const cancel_token & turn) {
+    turn_latency latency;
+    {
+        std::lock_guard<std::mutex> lock(pl.mutex);
+
+        if (pl.latency.turn != turn) {
+            return;
+        }
+
+        latency = pl.latency;
+        latency.t_play_end = std::chrono::steady_clock::now();
+
+        pl.latency = turn_latency();
+    }
+
+    // -1 for the points the turn has not reached
+    const auto ms = [&](turn_latency::time_point t) {
+        return t == turn_latency::time_point() ? -1 : (int) std::chrono::duration_cast<std::chrono::milliseconds>(t - latency.t_speech_end).count();
+    };
+
+    const int n_turn = ++pl.n_turns;
+
+    fprintf(stdout, "%s: Turn %d latency: endpoint %d ms, asr %d ms, first text %d ms, first audio %d ms, end %d ms%s\n", __func__, n_turn,
+            ms(latency.t_endpoint), ms(latency.t_asr), ms(latency.t_first_text), ms(latency.t_first_audio), ms(latency.t_play_end),
+            turn.cancelled() ? " (interrupted)" : "");
+
+    if (pl.fout_latency) {
+        fprintf(pl.fout_latency, "{\"turn\": %d, \"endpoint_ms\": %d, \"asr_ms\": %d, \"first_text_ms\": %d, \"first_audio_ms\": %d, \"end_ms\": %d, \"interrupted\": %s}\n",
+                n_turn, ms(latency.t_endpoint), ms(latency.t_asr), ms(latency.t_first_text), ms(latency.t_first_audio), ms(latency.t_play_end),
+                turn.cancelled() ? "true" : "false");
+        fflush(pl.fout_latency);
+    }
+}
+
+// a turn has been started and has not ended yet
+bool latency_pending(talk_pipeline & pl) {
+    std::lock_guard<std::mutex> lock(pl.mutex);
+
+    return pl.latency.t_endpoint != turn_latency::time_point() && !pl.latency.turn.cancelled();
+}
+
+bool is_speaking(talk_pipeline & pl) {
+    std::lock_guard<std::mutex> lock(pl.mutex);
+    return pl.speaking;
+}
+
+// transcribe on the asr stage and wait for the result
+bool asr_request(talk_pipeline & pl, asr_job::kind_t kind, std::vector<float> pcmf32, asr_result & result) {
+    asr_job job;
+    job.kind   = kind;
+    job.pcmf32 = std::move(pcmf32);
+
+    std::future<asr_result> future = job.result.get_future();
+
+    if (!pl.q_asr.push(std::move(job))) {
+        return false;
+    }
+
+    try {
+        result = future.get();
+    } catch (const std::future_error &) {
+        // the asr stage has been stopped
+        return false;
+    }
+
+    return true;
+}
+
+void endpoint_stage(talk_pipeline & pl, wake_word & kws) {
+    whisper_params & params = pl.params;
+
+    const std::string k_prompt = params.prompt_word;
+
+    bool have_prompt  = kws.n_templates() > 0;
+    bool ask_prompt   = !have_prompt;
+    bool is_listening = false;
+    bool is_awake     = false;
+    bool was_speaking = false;
+    bool barged_in    = false;
+
+    auto t_awake = std::chrono::high_resolution_clock::now();
+
+    // the commands end when the user stops talking
+    endpointer_params ep_params;
+    ep_params.max_ms      = params.voice_ms;
+    ep_params.hangover_ms = params.ep_hangover_ms;
+    ep_params.thold       = params.ep_thold;
+
+    endpointer ep(ep_params);
+
+    // echo canceller for the barge-in, the echo path is kept from one reply to the next
+    echo_canceller_params aec_params;
+    echo_canceller aec(aec_params);
+
+    barge_in_params vad_params;
+    barge_in_vad vad(vad_params);
+
+    uint64_t n_read = 0; // captured samples already read
+
+    std::vector<float> pcmf32_mic;
+    std::vector<float> pcmf32_ref;
+    std::vector<float> pcmf32_aec;
+    std::vector<float> pcmf32_barge_in; // start of the command that interrupted the last reply
+    std::vector<float> pcmf32_cur;
+
+    // speculative transcription of the command that is being spoken
+    cancel_token utterance;
+    size_t       n_spec_sent = 0; // samples of the utterance sent to the asr stage
+
+    while (pl.running) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+        audio.get_new(n_read, pcmf32_mic, pcmf32_ref);
+
+        // the captured audio has the echo of the reply - it is only checked for a barge-in
+        if (is_speaking(pl)) {
+            if (!was_speaking) {
+                was_speaking = true;
+                barged_in    = false;
+
+                vad.reset();
+                pcmf32_barge_in.clear();
+            }
+
+            if (params.barge_in && !barged_in) {
+                aec.process(pcmf32_mic, pcmf32_ref, pcmf32_aec);
+
+                // keep the last second of echo-cancelled audio, it has the start of the interruption
+                pcmf32_barge_in.insert(pcmf32_barge_in.end(), pcmf32_aec.begin(), pcmf32_aec.end());
+                if (pcmf32_barge_in.size() > WHISPER_SAMPLE_RATE) {
+                    pcmf32_barge_in.erase(pcmf32_barge_in.begin(), pcmf32_barge_in.end() - WHISPER_SAMPLE_RATE);
+                }
+
+                // the near-end can only be told apart from the echo once the echo path has been learned
+                // the captured audio goes to the endpointer from the next period, without waiting for the playback to end
+                if (aec.converged() && vad.push(pcmf32_aec, aec.energy_echo())) {
+                    fprintf(stdout, "%s: Interrupted\n", __func__);
+
+                    turn_interrupt(pl);
+                    barged_in = true;
+                }
+            }
+
+            continue;
+        }
+
+        if (was_speaking) {
+            was_speaking = false;
+
+            kws.reset();
+            ep.reset();
+
+            utterance.cancel();
+            utterance   = cancel_token();
+            n_spec_sent = 0;
+
+            light_set(CLOSE);
+            is_listening = true;
+
+            if (barged_in) {
+                // the rest of the command follows without the wake word
+                is_awake = true;
+                t_awake  = std::chrono::high_resolution_clock::now();
+            } else {
+                pcmf32_barge_in.clear();
+            }
+        }
+
+        if (ask_prompt) {
+            fprintf(stdout, "\n%s: Say the following phrase: '%s%s%s'\n\n", __func__, "\033[1m", k_prompt.c_str(), "\033[0m");
+
+            ask_prompt = false;
+        } else if (is_listening) {
+            if (is_awake || params.no_kws) {
+                fprintf(stdout, "\n%s: Listening ... \n\n", __func__);
+                light_set(BLUE);
+            } else {
+                fprintf(stdout, "\n%s: Waiting for '%s%s%s' ... \n\n", __func__, "\033[1m", k_prompt.c_str(), "\033[0m");
+
+                // start matching from the audio captured after the last command
+                kws.reset();
+            }
+            is_listening = false;
+        }
+
+        if (!have_prompt) {
+            // the prompt is recognized in a fixed window
+            audio.get(2000, pcmf32_cur);
+
+            if (!::vad_simple(pcmf32_cur, WHISPER_SAMPLE_RATE, 1000, params.vad_thold, params.freq_thold, params.print_energy)) {
+                continue;
+            }
+
+            fprintf(stdout, "%s: Speech detected! Processing ...\n", __func__);
+
+            // wait for activation phrase
+            audio.get(params.prompt_ms, pcmf32_cur);
+
+            asr_result res;
+            if (!asr_request(pl, asr_job::PROMPT, pcmf32_cur, res)) {
+                break;
+            }
+
+            const auto txt = prompt_text(res.text, k_prompt);
+
+            fprintf(stdout, "%s: Heard '%s%s%s', (t = %d ms)\n", __func__, "\033[1m", txt.c_str(), "\033[0m", (int) res.t_ms);
+
+            const float sim = similarity(txt, k_prompt);
+
+            if (txt.length() < 0.6*k_prompt.length() || txt.length() > 1.4*k_prompt.length() || sim < 0.6f) {
+                fprintf(stdout, "%s: WARNING: prompt not recognized, try again\n", __func__);
+                ask_prompt = true;
+            } else {
+                fprintf(stdout, "\n");
+                fprintf(stdout, "%s: The prompt has been recognized!\n", __func__);
+                fprintf(stdout, "%s: Waiting for voice commands ...\n", __func__);
+                fprintf(stdout, "\n");
+
+                // use the audio of the prompt as the wake word template from now on
+                if (!params.no_kws && !kws.enroll(pcmf32_cur)) {
+                    fprintf(stdout, "%s: WARNING: failed to enroll the prompt, staying awake\n", __func__);
+                    params.no_kws = true;
+                }
+
+                have_prompt  = true;
+                is_listening = true;
+                is_awake     = true;
+                t_awake      = std::chrono::high_resolution_clock::now();
+            }
+
+            audio.clear();
+            continue;
+        }
+
+        // match the wake word on the captured audio - whisper only runs for scores near the threshold
+        if (!params.no_kws && !is_awake) {
+            const float score = kws.push(pcmf32_mic);
+
+            bool detected = score >= params.wake_thold;
+
+            if (!detected && score >= params.wake_confirm_thold) {
+                audio.get(kws.window_ms(), pcmf32_cur);
+
+                asr_result res;
+                if (!asr_request(pl, asr_job::WAKE_CONFIRM, pcmf32_cur, res)) {
                     break;
                 }
 
-                light_set(CLOSE);
+                const auto txt = prompt_text(res.text, k_prompt);
+
+                detected = similarity(txt, k_prompt) >= 0.6f;
+
+                fprintf(stdout, "%s: Confirming wake word (score = %.2f): heard '%s', (t = %d ms)\n", __func__, score, txt.c_str(), (int) res.t_ms);
+
+                // do not confirm the same utterance again
+                kws.reset();
+            }
+
+            if (detected) {
+                fprintf(stdout, "%s: Wake word detected (score = %.2f)\n", __func__, score);
+
+                is_awake     = true;
                 is_listening = true;
-                audio.clear();
+                t_awake      = std::chrono::high_resolution_clock::now();
+
+                // the command starts after the wake word
+                ep.reset();
             }
+
+            continue;
         }
+
+        if (!params.no_kws && is_awake) {
+            const auto t_now = std::chrono::high_resolution_clock::now();
+            if (std::chrono::duration_cast<std::chrono::milliseconds>(t_now - t_awake).count() > params.wake_timeout_ms && !ep.in_speech()) {
+                fprintf(stdout, "%s: No command, going back to sleep\n", __func__);
+
+                is_awake     = false;
+                is_listening = true;
+                light_set(CLOSE);
+
+                pcmf32_barge_in.clear();
+
+                continue;
+            }
+        }
+
+        const bool speech_ended = ep.push(pcmf32_mic);
+
+        if (pl.stream_wsp != nullptr) {
+            if (ep.in_speech() || speech_ended) {
+                // only one part is queued at a time - the asr stage gets everything that was captured meanwhile
+                if (pl.q_asr.empty()) {
+                    const auto & pcmf32_utt = ep.utterance();
+
+                    asr_job job;
+                    job.kind      = asr_job::COMMAND_PART;
+                    job.utterance = utterance;
+
+                    // the command started while the last reply was playing
+                    if (n_spec_sent == 0) {
+                        job.pcmf32 = pcmf32_barge_in;
+                    }
+
+                    if (pcmf32_utt.size() > n_spec_sent) {
+                        job.pcmf32.insert(job.pcmf32.end(), pcmf32_utt.begin() + n_spec_sent, pcmf32_utt.end());
+                        n_spec_sent = pcmf32_utt.size();
+                    }
+
+                    if (!job.pcmf32.empty() && !pl.q_asr.push(std::move(job))) {
+                        break;
+                    }
+                }
+            } else if (n_spec_sent > 0) {
+                // the utterance was too short and has been dropped
+                utterance.cancel();
+                utterance   = cancel_token();
+                n_spec_sent = 0;
+            }
+        }
+
+        if (!speech_ended) {
+            continue;
+        }
+
+        fprintf(stdout, "%s: Speech detected! Processing ...\n", __func__);
+
+        light_set(GREEN_BLUE);
+
+        // we have heard the activation phrase - every command needs a new one
+        is_awake     = false;
+        is_listening = true;
+
+        asr_job job;
+        job.kind      = asr_job::COMMAND;
+        job.turn      = turn_begin(pl);
+        job.utterance = utterance;
+        job.pcmf32    = ep.utterance();
+
+        latency_begin(pl, job.turn, ep.trailing_ms());
+
+        fprintf(stdout, "%s: Command of %d ms\n", __func__, (int) (job.pcmf32.size()*1000/WHISPER_SAMPLE_RATE));
+
+        // the command started while the last reply was playing
+        if (!pcmf32_barge_in.empty()) {
+            job.pcmf32.insert(job.pcmf32.begin(), pcmf32_barge_in.begin(), pcmf32_barge_in.end());
+            pcmf32_barge_in.clear();
+        }
+
+        if (!pl.q_asr.push(std::move(job))) {
+            break;
+        }
+
+        utterance   = cancel_token();
+        n_spec_sent = 0;
+    }
+}
+
+// remove the text that is not spoken - annotations, special characters and everything after the first line
+std::string command_text(std::string text) {
+    text = std::regex_replace(text, std::regex("\\[.*?\\]"), "");
+    text = std::regex_replace(text, std::regex("\\(.*?\\)"), "");
+
+    // remove all characters, except for letters, numbers, punctuation and ':', '\'', '-', ' '
+    text = std::regex_replace(text, std::regex("[^a-zA-Z0-9\\.,\\?!\\s\\:\\'\\-]"), "");
+
+    text = text.substr(0, text.find_first_of('\n'));
+
+    text = std::regex_replace(text, std::regex("^\\s+"), "");
+    text = std::regex_replace(text, std::regex("\\s+$"), "");
+
+    return text;
+}
+
+void asr_stage(talk_pipeline & pl) {
+    const whisper_params & params = pl.params;
+
+    const size_t n_spec_step = (size_t) params.spec_step_ms*WHISPER_SAMPLE_RATE/1000;
+
+    // the utterance in the stream of the speculative transcription
+    cancel_token stream_utterance;
+    size_t       n_stream_pushed = 0; // samples of the utterance pushed to the stream
+    size_t       n_stream_new    = 0; // samples pushed since the last partial transcription
+    stream_text  stream_committed;
+
+    float prob = 0.0f;
+
+    asr_job job;
+    while (pl.q_asr.pop(job)) {
+        asr_result res;
+
+        if (job.kind == asr_job::PROMPT || job.kind == asr_job::WAKE_CONFIRM) {
+            res.text = ::transcribe(pl.ctx_wsp, params, job.pcmf32, prob, res.t_ms);
+            job.result.set_value(res);
+            continue;
+        }
+
+        if (pl.stream_wsp != nullptr && job.utterance != stream_utterance) {
+            whisper_stream_reset(pl.stream_wsp);
+
+            stream_utterance = job.utterance;
+            n_stream_pushed  = 0;
+            n_stream_new     = 0;
+            stream_committed = stream_text();
+        }
+
+        if (job.kind == asr_job::COMMAND_PART) {
+            if (job.utterance.cancelled()) {
+                continue;
+            }
+
+            whisper_stream_push(pl.stream_wsp, job.pcmf32.data(), job.pcmf32.size());
+            n_stream_pushed += job.pcmf32.size();
+            n_stream_new    += job.pcmf32.size();
+
+            // skip the partial transcription when the end of the command is already waiting
+            if (n_stream_new >= n_spec_step && pl.q_asr.empty()) {
+                if (whisper_stream_process(pl.stream_wsp) < 0) {
+                    fprintf(stderr, "%s: failed to transcribe the partial command\n", __func__);
+                }
+                stream_text_update(pl.ctx_wsp, pl.stream_wsp, stream_committed);
+                n_stream_new = 0;
+            }
+            continue;
+        }
+
+        // every turn that ends without a reply is reported, so that it is not left pending
+        if (job.turn.cancelled()) {
+            latency_report(pl, job.turn);
+            continue;
+        }
+
+        dialog_job reply;
+        reply.turn = job.turn;
+
+        // the unconstrained transcription comes first, the intents are matched on it - with the speculative transcription
+        // only the audio that was not pushed yet is transcribed
+        if (pl.stream_wsp != nullptr) {
+            if (job.pcmf32.size() > n_stream_pushed) {
+                whisper_stream_push(pl.stream_wsp, job.pcmf32.data() + n_stream_pushed, job.pcmf32.size() - n_stream_pushed);
+            }
+            res.text = ::trim(::transcribe_flush(pl.ctx_wsp, pl.stream_wsp, stream_committed, prob, res.t_ms));
+
+            whisper_stream_reset(pl.stream_wsp);
+            stream_utterance = cancel_token();
+        } else {
+            res.text = ::trim(::transcribe(pl.ctx_wsp, params, job.pcmf32, prob, res.t_ms));
+        }
+
+        // try the local intents first, the chat backend is only contacted when none of them matches
+        // the grammar pass only runs for short commands whose text names an intent, the other commands are decoded once
+        const Intent intent_text = intent_match(res.text);
+
+        const bool try_intents = pl.grammar != nullptr && !pl.grammar->rules.empty() && intent_text.type != INTENT_NONE &&
+            job.pcmf32.size() <= (size_t) k_intent_max_ms*WHISPER_SAMPLE_RATE/1000;
+
+        if (try_intents) {
+            float   prob_intent = 0.0f;
+            int64_t t_intent_ms = 0;
+
+            const std::string text_intent = ::trim(::transcribe(pl.ctx_wsp, params, job.pcmf32, prob_intent, t_intent_ms, pl.grammar));
+            const Intent intent = intent_match(text_intent);
+
+            // the grammar renormalizes the probabilities, so that anything is confidently decoded as the closest intent -
+            // the intent is accepted when the unconstrained transcription is confident and says the same
+            const float sim = similarity(intent_words(text_intent), intent_words(res.text));
+
+            fprintf(stdout, "%s: Intent '%s%s%s', (p = %.3f, sim = %.2f, t = %d ms)\n", __func__, "\033[1m", text_intent.c_str(), "\033[0m", prob, sim, (int) t_intent_ms);
+
+            if (intent.type == intent_text.type && intent.value == intent_text.value && prob >= params.intent_thold && sim >= k_intent_min_sim) {
+                reply.intent = intent;
+            }
+        }
+
+        if (reply.intent.type == INTENT_NONE) {
+            fprintf(stdout, "%s: Text '%s%s%s', (t = %d ms)\n", __func__, "\033[1m", res.text.c_str(), "\033[0m", (int) res.t_ms);
+
+            reply.text = command_text(res.text);
+
+            if (reply.text.empty()) {
+                fprintf(stdout, "%s: Heard nothing, skipping ...\n", __func__);
+                latency_report(pl, job.turn);
+                continue;
+            }
+
+            fprintf(stdout, "%s: Heard '%s%s%s', (t = %d ms)\n", __func__, "\033[1m", reply.text.c_str(), "\033[0m", (int) res.t_ms);
+        }
+
+        latency_mark(pl, reply.turn, &turn_latency::t_asr);
+
+        if (!pl.q_dialog.push(std::move(reply))) {
+            break;
+        }
+    }
+}
+
+// the length of the complete sentences at the start of the text - a sentence is complete when the next one starts
+size_t sentences_len(const std::string & text) {
+    size_t n = 0;
+    for (size_t i = 1; i < text.size(); ++i) {
+        if ((text[i - 1] == '.' || text[i - 1] == '!' || text[i - 1] == '?') && isspace((unsigned char) text[i])) {
+            n = i;
+        }
+    }
+
+    return n;
+}
+
+void dialog_stage(talk_pipeline & pl) {
+    dialog_job job;
+    while (pl.q_dialog.pop(job)) {
+        if (job.turn.cancelled()) {
+            latency_report(pl, job.turn);
+            continue;
+        }
+
+        tts_job reply;
+        reply.turn = job.turn;
+
+        if (job.intent.type != INTENT_NONE) {
+            int volume = pl.volume;
+            reply.text = intent_run(job.intent, volume);
+            pl.volume = volume;
+
+            latency_mark(pl, job.turn, &turn_latency::t_first_text);
+
+            if (reply.text.empty()) {
+                latency_report(pl, job.turn);
+                continue;
+            }
+        } else {
+            const auto t_start = std::chrono::high_resolution_clock::now();
+
+            // the reply is synthesized sentence by sentence while it is generated
+            std::string text;
+            int n_parts = 0;
+
+            auto on_text = [&](const std::string & piece) {
+                if (text.empty()) {
+                    latency_mark(pl, job.turn, &turn_latency::t_first_text);
+                }
+
+                text       += piece;
+                reply.text += piece;
+
+                const size_t n = sentences_len(reply.text);
+                if (n == 0) {
+                    return;
+                }
+
+                tts_job part;
+                part.turn = job.turn;
+                part.text = reply.text.substr(0, n);
+                part.last = false;
+
+                reply.text.erase(0, n);
+
+                if (pl.q_tts.push(std::move(part))) {
+                    ++n_parts;
+                }
+            };
+
+            try {
+                pl.dialog->reply(job.text, job.turn, on_text);
+            } catch (const std::exception & e) {
+                fprintf(stderr, "%s: %s\n", __func__, e.what());
+            }
+
+            const auto t_end = std::chrono::high_resolution_clock::now();
+            fprintf(stdout, "%s: Response '%s%s%s', (t = %d ms)\n", __func__, "\033[1m", text.c_str(), "\033[0m",
+                    (int) std::chrono::duration_cast<std::chrono::milliseconds>(t_end - t_start).count());
+
+            // the parts that have been handed over are ended also when the rest is empty
+            if (n_parts == 0 && ::trim(reply.text).empty()) {
+                fprintf(stdout, "%s: No response, skipping ...\n", __func__);
+                pl.dialog->finish();
+                latency_report(pl, job.turn);
+                continue;
+            }
+        }
+
+        if (!pl.q_tts.push(std::move(reply))) {
+            break;
+        }
+
+        // the backend completes the reply while its last sentence is synthesized
+        if (job.intent.type == INTENT_NONE) {
+            pl.dialog->finish();
+        }
+    }
+}
+
+struct tts_interrupted {};
+
+void tts_stage(talk_pipeline & pl) {
+    piper::SynthesisResult result;
+    std::vector<int16_t> audioBuffer;
+
+    tts_job job;
+    while (pl.q_tts.pop(job)) {
+        // a cancelled turn is not synthesized, but the end of its playback is still handed over
+        if (!job.turn.cancelled() && !::trim(job.text).empty()) {
+            // hand over every sentence as soon as it is synthesized, stop when the turn is cancelled
+            auto audioCallback = [&]() {
+                if (job.turn.cancelled()) {
+                    throw tts_interrupted();
+                }
+
+                play_chunk chunk;
+                chunk.turn = job.turn;
+                chunk.pcm  = audioBuffer;
+
+                if (!pl.q_play.push(std::move(chunk))) {
+                    throw tts_interrupted();
+                }
+            };
+
+            try {
+                piper::textToAudio(*pl.piper_config, *pl.piper_voice, job.text, audioBuffer, result, audioCallback);
+            } catch (const tts_interrupted &) {
+                fprintf(stderr, "%s: synthesis interrupted\n", __func__);
+            }
+            audioBuffer.clear();
+        }
+
+        if (!job.last) {
+            continue;
+        }
+
+        // the playback stage ends the playback of the turn with this, also when it was cancelled
+        play_chunk chunk;
+        chunk.turn = job.turn;
+        chunk.last = true;
+
+        if (!pl.q_play.push(std::move(chunk))) {
+            break;
+        }
+    }
+}
+
+void playback_stage(talk_pipeline & pl) {
+    bool is_playing = false;
+
+    auto playback_end = [&]() {
+        // resets a flushed playback
+        audio.play_wait(false);
+
+        std::lock_guard<std::mutex> lock(pl.mutex);
+        pl.speaking = false;
+        pl.flushed  = false;
+
+        is_playing = false;
+    };
+
+    play_chunk chunk;
+    while (pl.q_play.pop(chunk)) {
+        if (!is_playing) {
+            {
+                std::lock_guard<std::mutex> lock(pl.mutex);
+
+                // a turn that is cancelled from now on flushes the playback
+                if (!chunk.turn.cancelled() && !chunk.last) {
+                    pl.speaking = true;
+                    is_playing  = true;
+                }
+            }
+
+            if (!is_playing) {
+                if (chunk.last) {
+                    latency_report(pl, chunk.turn);
+                }
+                continue;
+            }
+
+            light_set(RED_GREEN_BLUE);
+        }
+
+        if (!chunk.pcm.empty()) {
+            reduceVolume(chunk.pcm, (pl.volume*1.5)/200.0);
+            audio.play_write((const char *) chunk.pcm.data(), sizeof(int16_t)*chunk.pcm.size());
+
+            latency_mark(pl, chunk.turn, &turn_latency::t_first_audio);
+        }
+
+        if (chunk.last) {
+            playback_end();
+            latency_report(pl, chunk.turn);
+        }
+    }
+
+    if (is_playing) {
+        playback_end();
+    }
+}
+
+// ----------------------------------------------------------------------------
+
+// ----------------------------------------------------------------------------
+// startup
+
+// ask the kernel to read the file in the background, so that the loaders find it in the page cache
+void file_prefetch(const std::string & fname) {
+#ifdef __linux__
+    const int fd = open(fname.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
+#else
+    (void) fname;
+#endif
+}
+
+bool whisper_load(const whisper_params & params, whisper_context *& ctx_wsp, whisper_stream *& stream_wsp) {
+    ctx_wsp = whisper_init_from_file(params.model_wsp.c_str());
+    if (ctx_wsp == nullptr) {
+        fprintf(stderr, "%s: error: failed to load the model '%s'\n", __func__, params.model_wsp.c_str());
+        return false;
+    }
+
+    if (params.kv_q8_0 && whisper_ctx_set_kv_q8_0(ctx_wsp, true) != 0) {
+        fprintf(stderr, "%s: error: failed to use a Q8_0 KV cache\n", __func__);
+        return false;
+    }
+
+    // the commands are transcribed while they are spoken in a separate state
+    if (params.speculative) {
+        whisper_stream_params sparams = whisper_stream_default_params(WHISPER_SAMPLING_GREEDY);
+
+        sparams.wparams        = transcribe_params(params);
+        sparams.audio_ctx_auto = params.audio_ctx == 0;
+
+        stream_wsp = whisper_stream_init(ctx_wsp, sparams);
+        if (stream_wsp == nullptr) {
+            fprintf(stderr, "%s: error: failed to initialize the speculative transcription\n", __func__);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// run every model once, so that the first command does not pay for the page faults and the lazy allocations
+void whisper_warmup(const whisper_params & params, whisper_context * ctx_wsp, whisper_stream * stream_wsp) {
+    const std::vector<float> pcmf32(WHISPER_SAMPLE_RATE, 0.0f);
+
+    // all weights are used for any audio context, a short one is enough
+    whisper_full_params wparams = transcribe_params(params);
+
+    wparams.print_timestamps = false;
+    wparams.max_tokens       = 1;
+    wparams.audio_ctx        = params.audio_ctx > 0 ? params.audio_ctx : 64;
+
+    if (whisper_full(ctx_wsp, wparams, pcmf32.data(), pcmf32.size()) != 0) {
+        fprintf(stderr, "%s: failed to warm up the model\n", __func__);
+    }
+
+    if (stream_wsp != nullptr) {
+        whisper_stream_push(stream_wsp, pcmf32.data(), pcmf32.size());
+        whisper_stream_process(stream_wsp);
+        whisper_stream_reset(stream_wsp);
+    }
+
+    // the warm-up does not count
+    whisper_reset_timings(ctx_wsp);
+}
+
+void piper_warmup(piper::PiperConfig & piperConfig, piper::Voice & piperVoice) {
+    piper::SynthesisResult result;
+    std::vector<int16_t> audioBuffer;
+
+    try {
+        piper::textToAudio(piperConfig, piperVoice, "Hello.", audioBuffer, result, nullptr);
+    } catch (const std::exception & e) {
+        fprintf(stderr, "%s: failed to warm up the voice: %s\n", __func__, e.what());
+    }
+}
+
+int main(int argc, char ** argv) {
+    whisper_params params;
+    if (whisper_params_parse(argc, argv, params) == false) {
+        return 1;
+    }
+
+    if (whisper_lang_id(params.language.c_str()) == -1) {
+        fprintf(stderr, "error: unknown language '%s'\n", params.language.c_str());
+        whisper_print_usage(argc, argv, params);
+        exit(0);
+    }
+
+    // piper init
+    RunConfig runConfig;
+    parseArgs(argc, argv, runConfig);
+
+    s_light = params.light;
+    light_set(RED);
+
+    const auto t_boot = std::chrono::high_resolution_clock::now();
+
+    // the models are read from the storage while the rest is initialized
+    file_prefetch(params.model_wsp);
+    file_prefetch(runConfig.modelPath.string());
+
+    http_init();
+
+    // the whisper model, the piper voice and the dialog model are loaded in parallel
+    piper::PiperConfig piperConfig;
+    piper::Voice piperVoice;
+    piperConfig.numThreads = params.tts_threads;
+
+    auto piper_loaded = std::async(std::launch::async, [&]() {
+        piper_init(runConfig, piperConfig, piperVoice);
+    });
+
+    struct whisper_context * ctx_wsp    = nullptr;
+    struct whisper_stream  * stream_wsp = nullptr;
+
+    auto whisper_loaded = std::async(std::launch::async, [&]() {
+        return whisper_load(params, ctx_wsp, stream_wsp);
+    });
+
+    std::unique_ptr<dialog_backend> dialog;
+    std::future<std::unique_ptr<dialog_backend>> dialog_loaded;
+
+    if (!params.model_llama.empty()) {
+        dialog_llama_params lparams;
+
+        lparams.model     = params.model_llama;
+        lparams.session   = params.llama_session;
+        lparams.n_threads = params.n_threads;
+
+        if (!params.llama_prompt.empty()) {
+            std::ifstream fin(params.llama_prompt);
+            if (!fin) {
+                fprintf(stderr, "%s: failed to open the prompt file '%s'\n", __func__, params.llama_prompt.c_str());
+                return 1;
+            }
+            lparams.prompt.assign(std::istreambuf_iterator<char>(fin), std::istreambuf_iterator<char>());
+        }
+
+        dialog_loaded = std::async(std::launch::async, dialog_llama_init, lparams);
+    }
+
+    // local intents grammar
+    grammar_parser::parse_state grammar_parsed;
+    if (!params.no_intents) {
+        std::string grammar_src = k_intent_grammar;
+        if (!params.grammar.empty()) {
+            std::ifstream fin(params.grammar);
+            if (!fin) {
+                fprintf(stderr, "%s: failed to open grammar file '%s'\n", __func__, params.grammar.c_str());
+                return 1;
+            }
+            grammar_src.assign(std::istreambuf_iterator<char>(fin), std::istreambuf_iterator<char>());
+        }
+
+        grammar_parsed = grammar_parser::parse(grammar_src.c_str());
+        if (grammar_parsed.rules.empty() || grammar_parsed.symbol_ids.find("root") == grammar_parsed.symbol_ids.end()) {
+            fprintf(stderr, "%s: invalid intent grammar, the grammar must define a 'root' rule\n", __func__);
+            return 1;
+        }
+    }
+
+    // init audio
+    fprintf(stderr, "%s: init audio\n", __func__);
+    //audio_async audio(30*1000);
+    if (!audio.init(params.capture_id, WHISPER_SAMPLE_RATE, params.audio_backend)) {
+        fprintf(stderr, "%s: audio.init() failed!\n", __func__);
+        return 1;
+    }
+
+    if (!audio.play_init(params.capture_id)) {
+        fprintf(stderr, "%s: audio.play_init() failed!\n", __func__);
+        return 1;
+    }
+
+    // a replayed file starts when r3_talk is ready, so that its timing does not depend on the startup
+    const bool replay = params.audio_backend.name == "file";
+    if (!replay) {
+        audio.resume();
+    }
+
+    const auto t_audio = std::chrono::high_resolution_clock::now();
+
+    try {
+        piper_loaded.get();
+    } catch (const std::exception & e) {
+        fprintf(stderr, "%s: piper init failed: %s\n", __func__, e.what());
+        return 1;
+    }
+    fprintf(stderr, "%s: piper init finished\n\n", __func__);
+
+    if (!whisper_loaded.get()) {
+        return 1;
+    }
+
+    if (dialog_loaded.valid()) {
+        dialog = dialog_loaded.get();
+        if (!dialog) {
+            return 1;
+        }
+    } else {
+        conversation_params cparams;
+
+        cparams.n_budget  = params.chat_budget;
+        cparams.n_summary = params.chat_budget/8;
+
+        // the whisper tokenizer is a GPT-2 BPE, close enough to the one of the chat model to keep the requests in budget
+        dialog.reset(new dialog_openai(params.chat_url, cparams, [ctx_wsp](const std::string & text) {
+            return whisper_count_tokens(ctx_wsp, text);
+        }));
+    }
+
+    const auto t_loaded = std::chrono::high_resolution_clock::now();
+
+    // print some info about the processing
+    {
+        fprintf(stderr, "\n");
+        if (!whisper_is_multilingual(ctx_wsp)) {
+            if (params.language != "en" || params.translate) {
+                params.language = "en";
+                params.translate = false;
+                fprintf(stderr, "%s: WARNING: model is not multilingual, ignoring language and translation options\n", __func__);
+            }
+        }
+        fprintf(stderr, "%s: processing, %d threads, lang = %s, task = %s, timestamps = %d ...\n",
+                __func__,
+                params.n_threads,
+                params.language.c_str(),
+                params.translate ? "translate" : "transcribe",
+                params.no_timestamps ? 0 : 1);
+
+        fprintf(stderr, "\n");
+    }
+
+    if (!params.no_intents) {
+        fprintf(stderr, "%s: local intents grammar:\n", __func__);
+        grammar_parser::print_grammar(stderr, grammar_parsed);
+        fprintf(stderr, "\n");
+    }
+
+    // warm up the models in parallel, the dialog backend is prepared meanwhile without delaying the start
+    auto dialog_warm = std::async(std::launch::async, [&]() {
+        dialog->warmup();
+    });
+    {
+        auto piper_warm = std::async(std::launch::async, [&]() {
+            piper_warmup(piperConfig, piperVoice);
+        });
+
+        whisper_warmup(params, ctx_wsp, stream_wsp);
+        piper_warm.wait();
+    }
+
+    // the audio captured during the startup is buffered noise, at least one second of it is dropped
+    if (replay) {
+        audio.resume();
+    } else {
+        std::this_thread::sleep_until(t_audio + std::chrono::milliseconds(1000));
+        audio.clear();
+    }
+
+    {
+        const auto t_ready = std::chrono::high_resolution_clock::now();
+
+        const auto ms = [](std::chrono::high_resolution_clock::time_point t0, std::chrono::high_resolution_clock::time_point t1) {
+            return (int) std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count();
+        };
+
+        fprintf(stderr, "%s: ready in %d ms (audio %d ms, models %d ms, warm-up %d ms)\n", __func__,
+                ms(t_boot, t_ready), ms(t_boot, t_audio), ms(t_boot, t_loaded), ms(t_loaded, t_ready));
+    }
+
+    light_set(GREEN);
+
+    // wake-word detector, enrolled with the given recordings or with the first recognized prompt
+    wake_word_params kws_params;
+    wake_word kws(ctx_wsp, kws_params);
+
+    for (const auto & fname : params.wake_enroll) {
+        std::vector<float> pcmf32;
+        std::vector<std::vector<float>> pcmf32s;
+
+        if (!::read_wav(fname, pcmf32, pcmf32s, false) || !kws.enroll(pcmf32)) {
+            fprintf(stderr, "%s: failed to enroll wake word recording '%s'\n", __func__, fname.c_str());
+            return 1;
+        }
+    }
+
+    // the conversation runs in the pipeline stages, the main thread handles the SDL events
+    talk_pipeline pl(params);
+
+    pl.ctx_wsp      = ctx_wsp;
+    pl.stream_wsp   = stream_wsp;
+    pl.grammar      = &grammar_parsed;
+    pl.piper_config = &piperConfig;
+    pl.piper_voice  = &piperVoice;
+    pl.dialog       = dialog.get();
+    pl.volume       = runConfig.volume.value_or(50);
+
+    if (!params.latency_file.empty()) {
+        pl.fout_latency = fopen(params.latency_file.c_str(), "a");
+        if (pl.fout_latency == nullptr) {
+            fprintf(stderr, "%s: failed to open the latency file '%s'\n", __func__, params.latency_file.c_str());
+            return 1;
+        }
+    }
+
+    fprintf(stderr, "\n%s: main loop\n", __func__);
+
+    std::vector<std::thread> workers;
+    workers.push_back(stage_start({ "endpoint", params.stage_nice[0] }, [&]() { endpoint_stage(pl, kws); }));
+    workers.push_back(stage_start({ "asr",      params.stage_nice[1] }, [&]() { asr_stage(pl); }));
+    workers.push_back(stage_start({ "dialog",   params.stage_nice[2] }, [&]() { dialog_stage(pl); }));
+    workers.push_back(stage_start({ "tts",      params.stage_nice[3] }, [&]() { tts_stage(pl); }));
+    workers.push_back(stage_start({ "playback", params.stage_nice[4] }, [&]() { playback_stage(pl); }));
+
+    // handle Ctrl + C
+    std::chrono::steady_clock::time_point t_capture_end;
+    while (sdl_poll_events()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+        // replay: quit when the captured file has ended and its last command has been answered, the endpoint stage
+        // gets a second to pick up the end of the audio
+        if (params.quit_at_end && audio.capture_ended()) {
+            const auto t_now = std::chrono::steady_clock::now();
+            if (t_capture_end == std::chrono::steady_clock::time_point()) {
+                t_capture_end = t_now;
+            }
+
+            if (t_now - t_capture_end >= std::chrono::seconds(1) && !latency_pending(pl) && !is_speaking(pl)) {
+                fprintf(stderr, "%s: the captured audio has ended, quitting\n", __func__);
+                break;
+            }
+        }
+    }
+
+    // the current turn is cancelled, so that no stage waits for the playback or the chat backend
+    pl.running = false;
+    turn_cancel(pl);
+
+    pl.q_asr.close();
+    pl.q_dialog.close();
+    pl.q_tts.close();
+    pl.q_play.close();
+
+    for (auto & worker : workers) {
+        worker.join();
     }
 
     audio.pause();
     light_set(CLOSE);
 
+    if (pl.fout_latency) {
+        fclose(pl.fout_latency);
+    }
+
+    if (audio.n_xruns() > 0) {
+        fprintf(stderr, "%s: audio xruns: %d\n", __func__, (int) audio.n_xruns());
+    }
+
     whisper_print_timings(ctx_wsp);
+    whisper_stream_free(stream_wsp);
     whisper_free(ctx_wsp);
 
+    dialog_warm.wait();
+    dialog.reset();
+
+    http_free();
+
     return 0;
 }
 
@@ -0,0 +1,210 @@
+#include "wake-word.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+wake_word::wake_word(struct whisper_context * ctx, const wake_word_params & params) : m_ctx(ctx), m_params(params) {
+}
+
+bool wake_word::features(const float * samples, int n_samples, feats & out) {
+    const int n_len_max = n_samples/WHISPER_HOP_LENGTH;
+
+    out.n_frames = 0;
+    out.data.clear();
+
+    // only the frames that are fully covered by the audio
+    const int n_len = n_samples < WHISPER_N_FFT ? 0 : (n_samples - WHISPER_N_FFT)/WHISPER_HOP_LENGTH + 1;
+    if (n_len == 0) {
+        return true;
+    }
+
+    m_mel.resize(WHISPER_N_MEL*n_len_max);
+
+    if (whisper_pcm_to_mel_data(m_ctx, samples, n_samples, m_params.n_threads, m_mel.data(), n_len_max) < n_len) {
+        return false;
+    }
+
+    out.n_frames = n_len;
+    out.data.resize(n_len*WHISPER_N_MEL);
+
+    // remove the per-frame mean (gain) and normalize the frames, so that the distance between two frames is the
+    // cosine distance of their spectral shapes
+    for (int i = 0; i < n_len; ++i) {
+        float * row = out.data.data() + i*WHISPER_N_MEL;
+
+        float mean = 0.0f;
+        for (int j = 0; j < WHISPER_N_MEL; ++j) {
+            row[j] = m_mel[j*n_len_max + i];
+            mean += row[j];
+        }
+        mean /= WHISPER_N_MEL;
+
+        float norm = 0.0f;
+        for (int j = 0; j < WHISPER_N_MEL; ++j) {
+            row[j] -= mean;
+            norm += row[j]*row[j];
+        }
+        norm = 1.0f/std::max(sqrtf(norm), 1e-6f);
+
+        for (int j = 0; j < WHISPER_N_MEL; ++j) {
+            row[j] *= norm;
+        }
+    }
+
+    return true;
+}
+
+bool wake_word::enroll(const std::vector<float> & pcmf32) {
+    const int n_hop   = WHISPER_HOP_LENGTH;
+    const int n_frame = (int) pcmf32.size()/n_hop;
+
+    if (n_frame == 0) {
+        return false;
+    }
+
+    // trim the silence around the phrase
+    std::vector<float> energy(n_frame, 0.0f);
+    for (int i = 0; i < n_frame; ++i) {
+        for (int j = 0; j < n_hop; ++j) {
+            energy[i] += pcmf32[i*n_hop + j]*pcmf32[i*n_hop + j];
+        }
+    }
+
+    const float energy_max   = *std::max_element(energy.begin(), energy.end());
+    const float energy_thold = m_params.energy_thold*energy_max;
+
+    int i0 = 0;
+    int i1 = n_frame - 1;
+    while (i0 < i1 && energy[i0] < energy_thold) ++i0;
+    while (i1 > i0 && energy[i1] < energy_thold) --i1;
+
+    const int n_max = (m_params.max_ms*WHISPER_SAMPLE_RATE)/(1000*n_hop);
+
+    i1 = std::min(i1 + 1, i0 + n_max);
+
+    // at least 200 ms of speech
+    if (energy_max <= 0.0f || i1 - i0 < 20) {
+        fprintf(stderr, "%s: not enough speech in the recording\n", __func__);
+        return false;
+    }
+
+    feats tmpl;
+    if (!features(pcmf32.data() + i0*n_hop, std::min((int) pcmf32.size() - i0*n_hop, (i1 - i0)*n_hop + WHISPER_N_FFT), tmpl) || tmpl.n_frames == 0) {
+        return false;
+    }
+
+    m_templates.push_back(std::move(tmpl));
+    m_columns.emplace_back();
+
+    fprintf(stderr, "%s: enrolled template %d, %d ms\n", __func__, (int) m_templates.size(), (i1 - i0)*10);
+
+    return true;
+}
+
+int wake_word::window_ms() const {
+    int n_frames = 0;
+    for (const auto & tmpl : m_templates) {
+        n_frames = std::max(n_frames, tmpl.n_frames);
+    }
+
+    return (n_frames*10*3)/2 + 300;
+}
+
+// subsequence DTW - a path may start at any query frame
+// the score is 1 minus the average cost along the best path ending at the current frame
+float wake_word::step(const feats & tmpl, dtw_column & col, const float * frame) {
+    const int m = tmpl.n_frames;
+
+    m_cost.resize(m);
+    m_len .resize(m);
+
+    if (col.empty) {
+        col.cost.assign(m, 0.0f);
+        col.len .assign(m, 0);
+    }
+
+    for (int i = 0; i < m; ++i) {
+        const float * t = tmpl.data.data() + i*WHISPER_N_MEL;
+
+        float dot = 0.0f;
+        for (int k = 0; k < WHISPER_N_MEL; ++k) {
+            dot += t[k]*frame[k];
+        }
+
+        const float d = 1.0f - dot;
+
+        if (i == 0) {
+            // free start
+            m_cost[i] = d;
+            m_len [i] = 1;
+            continue;
+        }
+
+        // vertical step - the template is stretched
+        float c = m_cost[i - 1] + d + m_params.stretch_cost;
+        int   l = m_len [i - 1] + 1;
+
+        if (!col.empty) {
+            // diagonal step
+            if ((col.cost[i - 1] + d)/(col.len[i - 1] + 1) < c/l) {
+                c = col.cost[i - 1] + d;
+                l = col.len [i - 1] + 1;
+            }
+
+            // horizontal step - the query is stretched
+            if ((col.cost[i] + d + m_params.stretch_cost)/(col.len[i] + 1) < c/l) {
+                c = col.cost[i] + d + m_params.stretch_cost;
+                l = col.len [i] + 1;
+            }
+        }
+
+        m_cost[i] = c;
+        m_len [i] = l;
+    }
+
+    col.cost.swap(m_cost);
+    col.len .swap(m_len);
+    col.empty = false;
+
+    // require the path to cover at least half of the template length in the query
+    if (col.len[m - 1] < m/2) {
+        return 0.0f;
+    }
+
+    return std::max(0.0f, std::min(1.0f, 1.0f - col.cost[m - 1]/col.len[m - 1]));
+}
+
+float wake_word::push(const std::vector<float> & pcmf32) {
+    if (m_templates.empty()) {
+        return 0.0f;
+    }
+
+    m_pcm.insert(m_pcm.end(), pcmf32.begin(), pcmf32.end());
+
+    feats query;
+    if (!features(m_pcm.data(), m_pcm.size(), query)) {
+        return 0.0f;
+    }
+
+    // keep the samples of the frames that are not computed yet
+    m_pcm.erase(m_pcm.begin(), m_pcm.begin() + query.n_frames*WHISPER_HOP_LENGTH);
+
+    float result = 0.0f;
+
+    for (int j = 0; j < query.n_frames; ++j) {
+        for (size_t i = 0; i < m_templates.size(); ++i) {
+            result = std::max(result, step(m_templates[i], m_columns[i], query.data.data() + j*WHISPER_N_MEL));
+        }
+    }
+
+    return result;
+}
+
+void wake_word::reset() {
+    m_pcm.clear();
+
+    for (auto & col : m_columns) {
+        col.empty = true;
+    }
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+// Enrolled wake-word detector
+//
+// A few recordings of the wake phrase are enrolled as templates of log mel frames. The captured audio is pushed
+// continuously and every new frame advances a subsequence DTW against each template, so the cost per frame is
+// constant and a lot lower than a transcription. The score is in [0, 1] - higher means a better match.
+//
+
+#include "whisper.h"
+
+#include <vector>
+
+struct wake_word_params {
+    int32_t n_threads    = 1;
+    int32_t max_ms       = 2500;  // templates are truncated to this length
+
+    float energy_thold   = 0.1f;  // frames below this fraction of the peak energy are trimmed from the templates
+    float stretch_cost   = 0.1f;  // extra cost of the non-diagonal DTW steps
+};
+
+class wake_word {
+public:
+    wake_word(struct whisper_context * ctx, const wake_word_params & params);
+
+    // add a recording of the wake phrase, returns false if the recording has no usable speech
+    bool enroll(const std::vector<float> & pcmf32);
+
+    int n_templates() const { return (int) m_templates.size(); }
+
+    // length of audio that contains the longest template with some slack
+    int window_ms() const;
+
+    // feed newly captured audio, returns the best score of a match ending in the new audio
+    float push(const std::vector<float> & pcmf32);
+
+    // forget the pushed audio, e.g. after the wake word was detected
+    void reset();
+
+private:
+    struct feats {
+        int n_frames = 0;
+        std::vector<float> data; // [n_frames][WHISPER_N_MEL], zero-mean unit-length rows
+    };
+
+    // DTW state of one template - the last column of the cost matrix
+    struct dtw_column {
+        std::vector<float> cost;
+        std::vector<int>   len;
+        bool               empty = true;
+    };
+
+    bool features(const float * samples, int n_samples, feats & out);
+
+    // advance the DTW by one query frame, returns the score of the best path ending at this frame
+    float step(const feats & tmpl, dtw_column & col, const float * frame);
+
+    struct whisper_context * m_ctx;
+
+    wake_word_params m_params;
+
+    std::vector<feats>      m_templates;
+    std::vector<dtw_column> m_columns;
+
+    std::vector<float> m_pcm; // pushed audio that is not fully covered by frames yet
+
+    // work buffers
+    std::vector<float> m_mel;
+    std::vector<float> m_cost;
+    std::vector<int>   m_len;
+};
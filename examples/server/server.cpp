@@ -0,0 +1,595 @@
+// Multi-stream transcription server
+//
+// Every client connection is an independent audio stream. The audio of a stream is cut into utterances with a
+// simple VAD and every utterance is transcribed as a separate job. The jobs of all streams are scheduled on a fixed
+// number of workers that check out a whisper_state from a shared pool, so all streams share one copy of the model.
+//
+// See the README.md for the protocol
+//
+
+#include "common.h"
+
+#include "whisper.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// command-line parameters
+struct whisper_params {
+    int32_t n_threads  = 2;
+    int32_t n_states   = std::max(1, (int32_t) std::thread::hardware_concurrency()/2);
+    int32_t port       = 0;
+    int32_t min_ms     = 1000;
+    int32_t max_ms     = 15000;
+    int32_t silence_ms = 800;
+    int32_t max_tokens = 0;
+    int32_t audio_ctx  = 0;
+
+    float vad_thold    = 0.6f;
+    float freq_thold   = 100.0f;
+    float energy_thold = 1e-5f;
+
+    bool translate     = false;
+    bool pcm_f32       = false;
+    bool no_context    = false;
+
+    std::string language = "en";
+    std::string model    = "models/ggml-base.en.bin";
+    std::string socket   = "/tmp/whisper-server.sock";
+    std::string host     = "127.0.0.1";
+};
+
+void whisper_print_usage(int argc, char ** argv, const whisper_params & params);
+
+bool whisper_params_parse(int argc, char ** argv, whisper_params & params) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+
+        if (arg == "-h" || arg == "--help") {
+            whisper_print_usage(argc, argv, params);
+            exit(0);
+        }
+        else if (arg == "-t"    || arg == "--threads")      { params.n_threads    = std::stoi(argv[++i]); }
+        else if (arg == "-ns"   || arg == "--states")       { params.n_states     = std::stoi(argv[++i]); }
+        else if (arg == "-p"    || arg == "--port")         { params.port         = std::stoi(argv[++i]); }
+        else if (arg == "-H"    || arg == "--host")         { params.host         = argv[++i]; }
+        else if (arg == "-s"    || arg == "--socket")       { params.socket       = argv[++i]; }
+        else if (arg == "-min"  || arg == "--min-ms")       { params.min_ms       = std::stoi(argv[++i]); }
+        else if (arg == "-max"  || arg == "--max-ms")       { params.max_ms       = std::stoi(argv[++i]); }
+        else if (arg == "-sms"  || arg == "--silence-ms")   { params.silence_ms   = std::stoi(argv[++i]); }
+        else if (arg == "-mt"   || arg == "--max-tokens")   { params.max_tokens   = std::stoi(argv[++i]); }
+        else if (arg == "-ac"   || arg == "--audio-ctx")    { params.audio_ctx    = std::stoi(argv[++i]); }
+        else if (arg == "-vth"  || arg == "--vad-thold")    { params.vad_thold    = std::stof(argv[++i]); }
+        else if (arg == "-fth"  || arg == "--freq-thold")   { params.freq_thold   = std::stof(argv[++i]); }
+        else if (arg == "-eth"  || arg == "--energy-thold") { params.energy_thold = std::stof(argv[++i]); }
+        else if (arg == "-tr"   || arg == "--translate")    { params.translate    = true; }
+        else if (arg == "-f32"  || arg == "--pcm-f32")      { params.pcm_f32      = true; }
+        else if (arg == "-nc"   || arg == "--no-context")   { params.no_context   = true; }
+        else if (arg == "-l"    || arg == "--language")     { params.language     = argv[++i]; }
+        else if (arg == "-m"    || arg == "--model")        { params.model        = argv[++i]; }
+        else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            whisper_print_usage(argc, argv, params);
+            exit(0);
+        }
+    }
+
+    return true;
+}
+
+void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & params) {
+    fprintf(stderr, "\n");
+    fprintf(stderr, "usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -h,        --help           [default] show this help message and exit\n");
+    fprintf(stderr, "  -t N,      --threads N      [%-7d] number of threads per transcription\n",                params.n_threads);
+    fprintf(stderr, "  -ns N,     --states N       [%-7d] number of pooled states (concurrent transcriptions)\n", params.n_states);
+    fprintf(stderr, "  -p N,      --port N         [%-7d] TCP port to listen on (0 - use the unix socket)\n",   params.port);
+    fprintf(stderr, "  -H ADDR,   --host ADDR      [%-7s] TCP address to listen on\n",                          params.host.c_str());
+    fprintf(stderr, "  -s PATH,   --socket PATH    [%-7s] unix socket path\n",                                  params.socket.c_str());
+    fprintf(stderr, "  -min N,    --min-ms N       [%-7d] minimum utterance length in milliseconds\n",          params.min_ms);
+    fprintf(stderr, "  -max N,    --max-ms N       [%-7d] maximum utterance length in milliseconds\n",          params.max_ms);
+    fprintf(stderr, "  -sms N,    --silence-ms N   [%-7d] trailing silence that ends an utterance\n",           params.silence_ms);
+    fprintf(stderr, "  -mt N,     --max-tokens N   [%-7d] maximum number of tokens per audio chunk\n",          params.max_tokens);
+    fprintf(stderr, "  -ac N,     --audio-ctx N    [%-7d] audio context size (0 - all)\n",                      params.audio_ctx);
+    fprintf(stderr, "  -vth N,    --vad-thold N    [%-7.2f] voice activity detection threshold\n",              params.vad_thold);
+    fprintf(stderr, "  -fth N,    --freq-thold N   [%-7.2f] high-pass frequency cutoff\n",                      params.freq_thold);
+    fprintf(stderr, "  -eth N,    --energy-thold N [%-7.0e] utterances below this mean energy are dropped\n",   params.energy_thold);
+    fprintf(stderr, "  -tr,       --translate      [%-7s] translate from source language to english\n",         params.translate ? "true" : "false");
+    fprintf(stderr, "  -f32,      --pcm-f32        [%-7s] clients send 32-bit float instead of 16-bit PCM\n",   params.pcm_f32 ? "true" : "false");
+    fprintf(stderr, "  -nc,       --no-context     [%-7s] do not prompt with the previous utterance\n",         params.no_context ? "true" : "false");
+    fprintf(stderr, "  -l LANG,   --language LANG  [%-7s] spoken language\n",                                   params.language.c_str());
+    fprintf(stderr, "  -m FNAME,  --model FNAME    [%-7s] model path\n",                                        params.model.c_str());
+    fprintf(stderr, "\n");
+}
+
+static std::atomic<bool> g_is_running(true);
+
+static void signal_handler(int /*signal*/) {
+    g_is_running = false;
+}
+
+static std::string json_escape(const std::string & s) {
+    std::string res;
+    res.reserve(s.size() + 2);
+
+    for (const unsigned char c : s) {
+        switch (c) {
+            case '"':  res += "\\\""; break;
+            case '\\': res += "\\\\"; break;
+            case '\n': res += "\\n";  break;
+            case '\r': res += "\\r";  break;
+            case '\t': res += "\\t";  break;
+            default:
+                if (c < 0x20) {
+                    char buf[8];
+                    snprintf(buf, sizeof(buf), "\\u%04x", c);
+                    res += buf;
+                } else {
+                    res += (char) c;
+                }
+        }
+    }
+
+    return res;
+}
+
+static bool send_all(int fd, const std::string & data) {
+    size_t n_sent = 0;
+    while (n_sent < data.size()) {
+        const ssize_t n = send(fd, data.data() + n_sent, data.size() - n_sent, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return false;
+        }
+        n_sent += n;
+    }
+
+    return true;
+}
+
+// one client connection
+struct server_stream {
+    int id = 0;
+    int fd = -1;
+
+    std::mutex mutex;
+
+    std::vector<float> pcmf32;        // audio that has not been scheduled yet
+    int64_t            n_scheduled = 0; // number of samples already scheduled (stream time of pcmf32[0])
+    int64_t            n_checked   = 0; // buffer size at the last utterance end check
+
+    bool busy = false; // a job of this stream is queued or running - the jobs of a stream run in order
+    bool eof  = false; // the client will not send any more audio
+
+    std::string prompt; // text of the previous utterance
+
+    ~server_stream() {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+};
+
+// the thread that receives the audio of a stream, joined by the accept loop as soon as it is done
+struct server_reader {
+    std::thread                       thread;
+    std::shared_ptr<std::atomic_bool> done;
+};
+
+struct server_job {
+    std::shared_ptr<server_stream> stream;
+
+    std::vector<float> pcmf32;
+    int64_t            t0_ms;
+    std::string        prompt;
+
+    std::chrono::steady_clock::time_point t_queued;
+};
+
+struct server_context {
+    const whisper_params & params;
+
+    whisper_context    * ctx  = nullptr;
+    whisper_state_pool * pool = nullptr;
+
+    std::mutex              mutex;
+    std::condition_variable cv;
+    std::deque<server_job>  jobs;
+
+    explicit server_context(const whisper_params & params) : params(params) {}
+};
+
+// cut the buffered audio of the stream into a job if an utterance has ended
+// must be called with the stream mutex held
+static void schedule_stream(server_context & sctx, const std::shared_ptr<server_stream> & stream) {
+    const auto & params = sctx.params;
+
+    if (stream->busy || stream->pcmf32.empty()) {
+        return;
+    }
+
+    const int64_t n_samples = stream->pcmf32.size();
+    const int64_t n_min     = (params.min_ms    *WHISPER_SAMPLE_RATE)/1000;
+    const int64_t n_max     = (params.max_ms    *WHISPER_SAMPLE_RATE)/1000;
+    const int64_t n_step    = (100              *WHISPER_SAMPLE_RATE)/1000;
+
+    bool ready = stream->eof || n_samples >= n_max;
+
+    if (!ready && n_samples >= n_min && n_samples - stream->n_checked >= n_step) {
+        stream->n_checked = n_samples;
+
+        // vad_simple filters the audio in-place
+        std::vector<float> pcmf32_vad(stream->pcmf32);
+        ready = ::vad_simple(pcmf32_vad, WHISPER_SAMPLE_RATE, params.silence_ms, params.vad_thold, params.freq_thold, false);
+    }
+
+    if (!ready) {
+        return;
+    }
+
+    server_job job;
+    job.stream   = stream;
+    job.t0_ms    = (stream->n_scheduled*1000)/WHISPER_SAMPLE_RATE;
+    job.prompt   = params.no_context ? "" : stream->prompt;
+    job.t_queued = std::chrono::steady_clock::now();
+    job.pcmf32.swap(stream->pcmf32);
+
+    stream->n_scheduled += n_samples;
+    stream->n_checked    = 0;
+
+    // drop silence
+    double energy = 0.0;
+    for (const float v : job.pcmf32) {
+        energy += v*v;
+    }
+    energy /= job.pcmf32.size();
+
+    if (energy < params.energy_thold) {
+        return;
+    }
+
+    stream->busy = true;
+
+    {
+        std::lock_guard<std::mutex> lock(sctx.mutex);
+        sctx.jobs.push_back(std::move(job));
+    }
+    sctx.cv.notify_one();
+}
+
+static void worker_thread(server_context & sctx) {
+    const auto & params = sctx.params;
+
+    while (true) {
+        server_job job;
+        {
+            std::unique_lock<std::mutex> lock(sctx.mutex);
+            sctx.cv.wait(lock, [&sctx] { return !sctx.jobs.empty() || !g_is_running; });
+
+            if (sctx.jobs.empty()) {
+                break;
+            }
+
+            job = std::move(sctx.jobs.front());
+            sctx.jobs.pop_front();
+        }
+
+        const auto t_start = std::chrono::steady_clock::now();
+
+        whisper_state * state = whisper_state_pool_acquire(sctx.pool);
+
+        whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+
+        wparams.print_progress   = false;
+        wparams.print_realtime   = false;
+        wparams.print_timestamps = false;
+        wparams.translate        = params.translate;
+        wparams.no_context       = true;
+        wparams.max_tokens       = params.max_tokens;
+        wparams.audio_ctx        = params.audio_ctx;
+        wparams.language         = params.language.c_str();
+        wparams.n_threads        = params.n_threads;
+        wparams.initial_prompt   = job.prompt.empty() ? nullptr : job.prompt.c_str();
+
+        std::string response;
+        std::string text_all;
+
+        if (whisper_full_with_state(sctx.ctx, state, wparams, job.pcmf32.data(), job.pcmf32.size()) != 0) {
+            fprintf(stderr, "%s: stream %d: failed to process audio\n", __func__, job.stream->id);
+        } else {
+            const int n_segments = whisper_full_n_segments_from_state(state);
+            for (int i = 0; i < n_segments; ++i) {
+                const std::string text = whisper_full_get_segment_text_from_state(state, i);
+
+                const int64_t t0 = job.t0_ms + 10*whisper_full_get_segment_t0_from_state(state, i);
+                const int64_t t1 = job.t0_ms + 10*whisper_full_get_segment_t1_from_state(state, i);
+
+                response += "{\"t0\": " + std::to_string(t0) + ", \"t1\": " + std::to_string(t1) + ", \"text\": \"" + json_escape(text) + "\"}\n";
+                text_all += text;
+            }
+        }
+
+        whisper_state_pool_release(sctx.pool, state);
+
+        const auto t_end = std::chrono::steady_clock::now();
+
+        fprintf(stderr, "%s: stream %d: %5.2f s of audio, queued %5d ms, processed %5d ms\n", __func__,
+                job.stream->id, float(job.pcmf32.size())/WHISPER_SAMPLE_RATE,
+                (int) std::chrono::duration_cast<std::chrono::milliseconds>(t_start - job.t_queued).count(),
+                (int) std::chrono::duration_cast<std::chrono::milliseconds>(t_end   - t_start).count());
+
+        {
+            std::lock_guard<std::mutex> lock(job.stream->mutex);
+
+            if (!response.empty()) {
+                send_all(job.stream->fd, response);
+            }
+
+            job.stream->prompt = text_all;
+            job.stream->busy   = false;
+
+            // audio that arrived while the job was running
+            schedule_stream(sctx, job.stream);
+        }
+    }
+}
+
+static void reader_thread(server_context & sctx, std::shared_ptr<server_stream> stream, std::shared_ptr<std::atomic_bool> done) {
+    const size_t bytes_per_sample = sctx.params.pcm_f32 ? sizeof(float) : sizeof(int16_t);
+
+    std::vector<uint8_t> buf(16*1024);
+    size_t n_buf = 0;
+
+    while (g_is_running) {
+        struct pollfd pfd = { stream->fd, POLLIN, 0 };
+        const int rc = poll(&pfd, 1, 100);
+        if (rc < 0) {
+            break;
+        }
+        if (rc == 0) {
+            continue;
+        }
+
+        const ssize_t n = recv(stream->fd, buf.data() + n_buf, buf.size() - n_buf, 0);
+        if (n <= 0) {
+            break;
+        }
+        n_buf += n;
+
+        const size_t n_samples = n_buf/bytes_per_sample;
+
+        {
+            std::lock_guard<std::mutex> lock(stream->mutex);
+
+            auto & pcmf32 = stream->pcmf32;
+            const size_t n0 = pcmf32.size();
+            pcmf32.resize(n0 + n_samples);
+
+            if (sctx.params.pcm_f32) {
+                memcpy(pcmf32.data() + n0, buf.data(), n_samples*sizeof(float));
+            } else {
+                for (size_t i = 0; i < n_samples; ++i) {
+                    int16_t v;
+                    memcpy(&v, buf.data() + i*sizeof(int16_t), sizeof(int16_t));
+                    pcmf32[n0 + i] = float(v)/32768.0f;
+                }
+            }
+
+            schedule_stream(sctx, stream);
+        }
+
+        // keep the bytes of an incomplete sample
+        const size_t n_used = n_samples*bytes_per_sample;
+        memmove(buf.data(), buf.data() + n_used, n_buf - n_used);
+        n_buf -= n_used;
+    }
+
+    // the client is done sending - flush the remaining audio
+    {
+        std::lock_guard<std::mutex> lock(stream->mutex);
+        stream->eof = true;
+        shutdown(stream->fd, SHUT_RD);
+        schedule_stream(sctx, stream);
+    }
+
+    fprintf(stderr, "%s: stream %d: end of audio\n", __func__, stream->id);
+
+    // the connection is closed when the last job of the stream releases it
+    *done = true;
+}
+
+// join the readers of the streams whose audio has ended
+static void readers_reap(std::vector<server_reader> & readers) {
+    for (auto it = readers.begin(); it != readers.end();) {
+        if (*it->done) {
+            it->thread.join();
+            it = readers.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+static int open_listen_socket(const whisper_params & params) {
+    int fd = -1;
+
+    if (params.port > 0) {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) {
+            fprintf(stderr, "%s: socket() failed: %s\n", __func__, strerror(errno));
+            return -1;
+        }
+
+        const int yes = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+        struct sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port   = htons(params.port);
+        if (inet_pton(AF_INET, params.host.c_str(), &addr.sin_addr) != 1) {
+            fprintf(stderr, "%s: invalid address '%s'\n", __func__, params.host.c_str());
+            close(fd);
+            return -1;
+        }
+
+        if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+            fprintf(stderr, "%s: bind(%s:%d) failed: %s\n", __func__, params.host.c_str(), params.port, strerror(errno));
+            close(fd);
+            return -1;
+        }
+    } else {
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+            fprintf(stderr, "%s: socket() failed: %s\n", __func__, strerror(errno));
+            return -1;
+        }
+
+        struct sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        if (params.socket.size() >= sizeof(addr.sun_path)) {
+            fprintf(stderr, "%s: socket path is too long\n", __func__);
+            close(fd);
+            return -1;
+        }
+        strncpy(addr.sun_path, params.socket.c_str(), sizeof(addr.sun_path) - 1);
+
+        unlink(params.socket.c_str());
+
+        if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+            fprintf(stderr, "%s: bind(%s) failed: %s\n", __func__, params.socket.c_str(), strerror(errno));
+            close(fd);
+            return -1;
+        }
+    }
+
+    if (listen(fd, 64) != 0) {
+        fprintf(stderr, "%s: listen() failed: %s\n", __func__, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int main(int argc, char ** argv) {
+    whisper_params params;
+
+    if (whisper_params_parse(argc, argv, params) == false) {
+        return 1;
+    }
+
+    if (params.language != "auto" && whisper_lang_id(params.language.c_str()) == -1) {
+        fprintf(stderr, "error: unknown language '%s'\n", params.language.c_str());
+        whisper_print_usage(argc, argv, params);
+        exit(0);
+    }
+
+    server_context sctx(params);
+
+    // the model weights are loaded once and shared by all pooled states
+    sctx.ctx = whisper_init_from_file_no_state(params.model.c_str());
+    if (sctx.ctx == nullptr) {
+        fprintf(stderr, "error: failed to initialize whisper context\n");
+        return 2;
+    }
+
+    sctx.pool = whisper_state_pool_init(sctx.ctx, params.n_states);
+    if (sctx.pool == nullptr) {
+        fprintf(stderr, "error: failed to initialize the state pool\n");
+        whisper_free(sctx.ctx);
+        return 3;
+    }
+
+    const int fd_listen = open_listen_socket(params);
+    if (fd_listen < 0) {
+        whisper_state_pool_free(sctx.pool);
+        whisper_free(sctx.ctx);
+        return 4;
+    }
+
+    signal(SIGINT,  signal_handler);
+    signal(SIGTERM, signal_handler);
+
+    fprintf(stderr, "\n");
+    fprintf(stderr, "%s: %d states x %d threads, %s\n", __func__, params.n_states, params.n_threads, whisper_print_system_info());
+    if (params.port > 0) {
+        fprintf(stderr, "%s: listening on %s:%d\n", __func__, params.host.c_str(), params.port);
+    } else {
+        fprintf(stderr, "%s: listening on %s\n", __func__, params.socket.c_str());
+    }
+
+    std::vector<std::thread> workers;
+    for (int i = 0; i < params.n_states; ++i) {
+        workers.emplace_back(worker_thread, std::ref(sctx));
+    }
+
+    std::vector<server_reader> readers;
+
+    int n_streams = 0;
+
+    while (g_is_running) {
+        readers_reap(readers);
+
+        struct pollfd pfd = { fd_listen, POLLIN, 0 };
+        if (poll(&pfd, 1, 100) <= 0) {
+            continue;
+        }
+
+        const int fd = accept(fd_listen, nullptr, nullptr);
+        if (fd < 0) {
+            continue;
+        }
+
+        auto stream = std::make_shared<server_stream>();
+        stream->id = n_streams++;
+        stream->fd = fd;
+
+        fprintf(stderr, "%s: stream %d: connected\n", __func__, stream->id);
+
+        server_reader reader;
+        reader.done   = std::make_shared<std::atomic_bool>(false);
+        reader.thread = std::thread(reader_thread, std::ref(sctx), stream, reader.done);
+
+        readers.push_back(std::move(reader));
+    }
+
+    fprintf(stderr, "\n%s: shutting down\n", __func__);
+
+    close(fd_listen);
+    if (params.port == 0) {
+        unlink(params.socket.c_str());
+    }
+
+    for (auto & reader : readers) {
+        reader.thread.join();
+    }
+
+    sctx.cv.notify_all();
+    for (auto & worker : workers) {
+        worker.join();
+    }
+
+    whisper_state_pool_free(sctx.pool);
+    whisper_free(sctx.ctx);
+
+    return 0;
+}
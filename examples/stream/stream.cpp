@@ -9,6 +9,7 @@
 
 #include <cassert>
 #include <cstdio>
+#include <cstring>
 #include <string>
 #include <thread>
 #include <vector>
@@ -47,6 +48,7 @@ struct whisper_params {
     bool print_special = false;
     bool no_context    = true;
     bool no_timestamps = false;
+    bool local_agreement = false;
 
     std::string language  = "en";
     std::string model     = "models/ggml-base.en.bin";
@@ -77,6 +79,7 @@ bool whisper_params_parse(int argc, char ** argv, whisper_params & params) {
         else if (arg == "-nf"  || arg == "--no-fallback")   { params.no_fallback   = true; }
         else if (arg == "-ps"  || arg == "--print-special") { params.print_special = true; }
         else if (arg == "-kc"  || arg == "--keep-context")  { params.no_context    = false; }
+        else if (arg == "-la"  || arg == "--local-agreement") { params.local_agreement = true; }
         else if (arg == "-l"   || arg == "--language")      { params.language      = argv[++i]; }
         else if (arg == "-m"   || arg == "--model")         { params.model         = argv[++i]; }
         else if (arg == "-f"   || arg == "--file")          { params.fname_out     = argv[++i]; }
@@ -110,6 +113,7 @@ void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & para
     fprintf(stderr, "  -nf,      --no-fallback   [%-7s] do not use temperature fallback while decoding\n", params.no_fallback ? "true" : "false");
     fprintf(stderr, "  -ps,      --print-special [%-7s] print special tokens\n",                           params.print_special ? "true" : "false");
     fprintf(stderr, "  -kc,      --keep-context  [%-7s] keep context between audio chunks\n",              params.no_context ? "false" : "true");
+    fprintf(stderr, "  -la,      --local-agreement [%-5s] commit the stable prefix of consecutive hypotheses\n", params.local_agreement ? "true" : "false");
     fprintf(stderr, "  -l LANG,  --language LANG [%-7s] spoken language\n",                                params.language.c_str());
     fprintf(stderr, "  -m FNAME, --model FNAME   [%-7s] model path\n",                                     params.model.c_str());
     fprintf(stderr, "  -f FNAME, --file FNAME    [%-7s] text output file name\n",                          params.fname_out.c_str());
@@ -165,6 +169,11 @@ int main(int argc, char ** argv) {
 
     std::vector<whisper_token> prompt_tokens;
 
+    // with local agreement, the audio is transcribed incrementally and only the stable prefix is printed as final
+    struct whisper_stream * stream = nullptr;
+    std::string line_committed;
+    int n_committed = 0;
+
     // print some info about the processing
     {
         fprintf(stderr, "\n");
@@ -186,7 +195,9 @@ int main(int argc, char ** argv) {
                 params.translate ? "translate" : "transcribe",
                 params.no_timestamps ? 0 : 1);
 
-        if (!use_vad) {
+        if (!use_vad && params.local_agreement) {
+            fprintf(stderr, "%s: using local agreement, the committed text is final\n", __func__);
+        } else if (!use_vad) {
             fprintf(stderr, "%s: n_new_line = %d, no_context = %d\n", __func__, n_new_line, params.no_context);
         } else {
             fprintf(stderr, "%s: using VAD, will transcribe on speech activity\n", __func__);
@@ -195,6 +206,27 @@ int main(int argc, char ** argv) {
         fprintf(stderr, "\n");
     }
 
+    if (!use_vad && params.local_agreement) {
+        whisper_stream_params sparams = whisper_stream_default_params(WHISPER_SAMPLING_GREEDY);
+
+        sparams.wparams.print_special   = params.print_special;
+        sparams.wparams.translate       = params.translate;
+        sparams.wparams.language        = params.language.c_str();
+        sparams.wparams.n_threads       = params.n_threads;
+        sparams.wparams.audio_ctx       = params.audio_ctx;
+        sparams.wparams.speed_up        = params.speed_up;
+        sparams.wparams.temperature_inc = params.no_fallback ? 0.0f : sparams.wparams.temperature_inc;
+
+        sparams.margin_ms     = params.keep_ms;
+        sparams.max_buffer_ms = std::min(params.length_ms, 25000);
+
+        stream = whisper_stream_init(ctx, sparams);
+        if (stream == nullptr) {
+            fprintf(stderr, "%s: failed to initialize the stream\n", __func__);
+            return 1;
+        }
+    }
+
     int n_iter = 0;
 
     bool is_running = true;
@@ -243,6 +275,43 @@ int main(int argc, char ** argv) {
                 std::this_thread::sleep_for(std::chrono::milliseconds(1));
             }
 
+            if (stream) {
+                if (whisper_stream_push(stream, pcmf32_new.data(), pcmf32_new.size()) != 0 || whisper_stream_process(stream) < 0) {
+                    fprintf(stderr, "%s: failed to process audio\n", argv[0]);
+                    return 6;
+                }
+
+                // the committed text is final - print it once and show the tentative text after it
+                std::string text_committed;
+                for (; n_committed < whisper_stream_n_committed(stream); ++n_committed) {
+                    text_committed += whisper_token_to_str(ctx, whisper_stream_get_committed(stream, n_committed).id);
+                }
+
+                std::string text_tentative;
+                for (int i = 0; i < whisper_stream_n_tentative(stream); ++i) {
+                    text_tentative += whisper_token_to_str(ctx, whisper_stream_get_tentative(stream, i).id);
+                }
+
+                if (params.fname_out.length() > 0) {
+                    fout << text_committed;
+                }
+
+                line_committed += text_committed;
+
+                printf("\33[2K\r%s\33[2m%s\33[0m", line_committed.c_str(), text_tentative.c_str());
+
+                if (line_committed.size() > 80) {
+                    printf("\33[2K\r%s\n", line_committed.c_str());
+                    line_committed.clear();
+                }
+
+                fflush(stdout);
+
+                ++n_iter;
+
+                continue;
+            }
+
             const int n_samples_new = pcmf32_new.size();
 
             // take up to params.length_ms audio from previous iteration
@@ -389,6 +458,23 @@ int main(int argc, char ** argv) {
 
     audio.pause();
 
+    if (stream) {
+        whisper_stream_flush(stream);
+
+        std::string text_committed;
+        for (; n_committed < whisper_stream_n_committed(stream); ++n_committed) {
+            text_committed += whisper_token_to_str(ctx, whisper_stream_get_committed(stream, n_committed).id);
+        }
+
+        if (params.fname_out.length() > 0) {
+            fout << text_committed << std::endl;
+        }
+
+        printf("\33[2K\r%s%s\n", line_committed.c_str(), text_committed.c_str());
+
+        whisper_stream_free(stream);
+    }
+
     whisper_print_timings(ctx);
     whisper_free(ctx);
 
@@ -8,6 +8,8 @@
 
 #include <cassert>
 #include <cstdio>
+#include <cstdlib>
+#include <ctime>
 #include <fstream>
 #include <regex>
 #include <string>
@@ -124,6 +124,26 @@ typedef void* thread_ret_t;
 #define GGML_SOFT_MAX_UNROLL 4
 #define GGML_VEC_DOT_UNROLL  2
 
+// quantized mul_mat: register tile of the gemm_q kernels, rows of src0 per cache block and the src1 batch from
+// which the blocked path is used
+#define GGML_GEMM_Q_RM       4
+#define GGML_GEMM_Q_RN       2
+#define GGML_GEMM_Q_BLCK     32
+#define GGML_GEMM_Q_MIN_N    32
+
+// flash attention: query rows per block and keys per tile
+#define GGML_FLASH_ATTN_BQ   16
+#define GGML_FLASH_ATTN_BK   128
+
+// fewer query rows than this are computed one row at a time
+#define GGML_FLASH_ATTN_MIN_N 4
+
+// floats of work buffer per thread of the fp16 / quantized flash attention for head size D and M keys
+#define GGML_FLASH_ATTN_WSIZE(D) \
+    (2*GGML_FLASH_ATTN_BQ*(D) + GGML_FLASH_ATTN_BK*GGML_FLASH_ATTN_BQ + 2*GGML_FLASH_ATTN_BK*(D) + 3*GGML_FLASH_ATTN_BQ)
+#define GGML_FLASH_ATTN_WSIZE_ROWS(D, M) \
+    (2*ggml_up((M), GGML_SOFT_MAX_UNROLL) + 2*(D))
+
 //
 // logging
 //
@@ -434,11 +454,17 @@ static ggml_fp16_t table_gelu_quick_f16[1 << 16];
 // precomputed silu table for f16 (128 KB)
 static ggml_fp16_t table_silu_f16[1 << 16];
 
+// the tables used by the kernels are shared with the kernel variants - see GGML_CPU_VARIANT
+#ifdef GGML_CPU_VARIANT
+extern ggml_fp16_t ggml_table_exp_f16[1 << 16];
+extern float       ggml_table_f32_f16[1 << 16];
+#else
 // precomputed exp table for f16 (128 KB)
-static ggml_fp16_t table_exp_f16[1 << 16];
+ggml_fp16_t ggml_table_exp_f16[1 << 16];
 
 // precomputed f32 table for f16 (256 KB)
-static float table_f32_f16[1 << 16];
+float ggml_table_f32_f16[1 << 16];
+#endif
 
 #if defined(__ARM_NEON) || defined(__wasm_simd128__)
 #define B1(c,s,n)  0x ## n ## c ,  0x ## n ## s
@@ -463,7 +489,7 @@ static const uint64_t table_b2b_1[1 << 8] = { B8(10, 00) }; // (!b) << 4
 inline static float ggml_lookup_fp16_to_fp32(ggml_fp16_t f) {
     uint16_t s;
     memcpy(&s, &f, sizeof(uint16_t));
-    return table_f32_f16[s];
+    return ggml_table_f32_f16[s];
 }
 
 #define GGML_FP16_TO_FP32(x) ggml_lookup_fp16_to_fp32(x)
@@ -471,6 +497,7 @@ inline static float ggml_lookup_fp16_to_fp32(ggml_fp16_t f) {
 
 #endif
 
+#ifndef GGML_CPU_VARIANT
 // note: do not use these inside ggml.c
 // these are meant to be used via the ggml.h API
 float ggml_fp16_to_fp32(ggml_fp16_t x) {
@@ -480,14 +507,24 @@ float ggml_fp16_to_fp32(ggml_fp16_t x) {
 ggml_fp16_t ggml_fp32_to_fp16(float x) {
     return GGML_FP32_TO_FP16(x);
 }
+#endif
 
-void ggml_fp16_to_fp32_row(const ggml_fp16_t * x, float * y, size_t n) {
-    for (size_t i = 0; i < n; i++) {
+// the row conversions are kernels - ggml_fp16_to_fp32_row() and ggml_fp32_to_fp16_row() call the selected variant
+inline static void ggml_fp16_to_fp32_row_impl(const ggml_fp16_t * x, float * y, size_t n) {
+    size_t i = 0;
+#if defined(__F16C__)
+    for (; i + 7 < n; i += 8) {
+        __m128i x_vec = _mm_loadu_si128((const __m128i *)(x + i));
+        __m256 y_vec = _mm256_cvtph_ps(x_vec);
+        _mm256_storeu_ps(y + i, y_vec);
+    }
+#endif
+    for (; i < n; i++) {
         y[i] = GGML_FP16_TO_FP32(x[i]);
     }
 }
 
-void ggml_fp32_to_fp16_row(const float * x, ggml_fp16_t * y, size_t n) {
+inline static void ggml_fp32_to_fp16_row_impl(const float * x, ggml_fp16_t * y, size_t n) {
     size_t i = 0;
 #if defined(__F16C__)
     for (; i + 7 < n; i += 8) {
@@ -506,6 +543,8 @@ void ggml_fp32_to_fp16_row(const float * x, ggml_fp16_t * y, size_t n) {
     }
 }
 
+#ifndef GGML_CPU_VARIANT
+
 //
 // timing
 //
@@ -585,6 +624,8 @@ int64_t ggml_cycles_per_ms(void) {
 
 static const size_t CACHE_LINE_SIZE_F32 = CACHE_LINE_SIZE/sizeof(float);
 
+#endif // GGML_CPU_VARIANT
+
 //
 // quantization
 //
@@ -1293,6 +1334,7 @@ static void quantize_row_q8_0(const float * restrict x, void * restrict vy, int
     }
 #else
     // scalar
+    UNUSED(nb);
     quantize_row_q8_0_reference(x, y, k);
 #endif
 }
@@ -1511,6 +1553,7 @@ static void quantize_row_q8_1(const float * restrict x, void * restrict vy, int
     }
 #else
     // scalar
+    UNUSED(nb);
     quantize_row_q8_1_reference(x, y, k);
 #endif
 }
@@ -1633,6 +1676,27 @@ static void ggml_vec_dot_q5_0_q8_0(const int n, float * restrict s, const void *
 static void ggml_vec_dot_q5_1_q8_1(const int n, float * restrict s, const void * restrict vx, const void * restrict vy);
 static void ggml_vec_dot_q8_0_q8_0(const int n, float * restrict s, const void * restrict vx, const void * restrict vy);
 
+// a GGML_GEMM_Q_RM x GGML_GEMM_Q_RN tile of vec_dot_q results: s[c*bs + r] = dot(x + r*bx, y + c*by)
+typedef void (*gemm_q_t)(const int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by);
+
+#if defined(__AVX2__)
+static void ggml_gemm_q4_0_q8_0(const int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by);
+static void ggml_gemm_q5_0_q8_0(const int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by);
+static void ggml_gemm_q8_0_q8_0(const int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by);
+#else
+#define ggml_gemm_q4_0_q8_0 NULL
+#define ggml_gemm_q5_0_q8_0 NULL
+#define ggml_gemm_q8_0_q8_0 NULL
+#endif
+
+// the tile kernels of the blocked mul_mat path (AVX2 only for now) - NULL for the types and CPUs without one, which
+// use vec_dot_q in the same cache blocking
+static const gemm_q_t gemm_q_fns[GGML_TYPE_COUNT] = {
+    [GGML_TYPE_Q4_0] = ggml_gemm_q4_0_q8_0,
+    [GGML_TYPE_Q5_0] = ggml_gemm_q5_0_q8_0,
+    [GGML_TYPE_Q8_0] = ggml_gemm_q8_0_q8_0,
+};
+
 static const quantize_fns_t quantize_fns[GGML_TYPE_COUNT] = {
     [GGML_TYPE_Q4_0] = {
         .dequantize_row_q         = (dequantize_row_q_t) dequantize_row_q4_0,
@@ -1726,13 +1790,6 @@ static const quantize_fns_t quantize_fns[GGML_TYPE_COUNT] = {
 #endif
 };
 
-// For internal test use
-quantize_fns_t ggml_internal_get_quantize_fn(size_t i) {
-    GGML_ASSERT(i < GGML_TYPE_COUNT);
-    return quantize_fns[i];
-}
-
-
 //
 // simd mappings
 //
@@ -3342,6 +3399,107 @@ static void ggml_vec_dot_q8_0_q8_0(const int n, float * restrict s, const void *
 #endif
 }
 
+#if defined(__AVX2__)
+// the quants of block i of a q4_0, q5_0 or q8_0 row as 32 signed bytes
+inline static __m256i ggml_gemm_q_unpack(const enum ggml_type type, const void * restrict vx, const int i) {
+    switch (type) {
+        case GGML_TYPE_Q4_0:
+            {
+                const block_q4_0 * restrict x = vx;
+
+                return _mm256_sub_epi8(bytes_from_nibbles_32(x[i].qs), _mm256_set1_epi8(8));
+            }
+        case GGML_TYPE_Q5_0:
+            {
+                const block_q5_0 * restrict x = vx;
+
+                const __m256i bxhi = _mm256_andnot_si256(bytes_from_bits_32(x[i].qh), _mm256_set1_epi8((char)0xF0));
+
+                return _mm256_or_si256(bytes_from_nibbles_32(x[i].qs), bxhi);
+            }
+        default:
+            {
+                const block_q8_0 * restrict x = vx;
+
+                return _mm256_loadu_si256((const __m256i *) x[i].qs);
+            }
+    }
+}
+
+inline static float ggml_gemm_q_scale(const enum ggml_type type, const void * restrict vx, const int i) {
+    switch (type) {
+        case GGML_TYPE_Q4_0: return GGML_FP16_TO_FP32(((const block_q4_0 *) vx)[i].d);
+        case GGML_TYPE_Q5_0: return GGML_FP16_TO_FP32(((const block_q5_0 *) vx)[i].d);
+        default:             return GGML_FP16_TO_FP32(((const block_q8_0 *) vx)[i].d);
+    }
+}
+
+// GGML_GEMM_Q_RM x GGML_GEMM_Q_RN tile of vec_dot_q results: s[c*bs + r] = x_r . y_c
+// the rows of x are bx bytes apart, the q8_0 rows of y are by bytes apart
+//
+// each block of x is unpacked once for all the columns and each block of y is loaded once for all the rows,
+// the accumulation order is the same as in ggml_vec_dot_q*_q8_0 so the results are identical
+inline static void ggml_gemm_q_q8_0(const enum ggml_type type, const int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by) {
+    const int nb = n / QK8_0;
+
+    assert(n % QK8_0 == 0);
+
+    __m256 acc[GGML_GEMM_Q_RM][GGML_GEMM_Q_RN];
+
+    for (int r = 0; r < GGML_GEMM_Q_RM; ++r) {
+        for (int c = 0; c < GGML_GEMM_Q_RN; ++c) {
+            acc[r][c] = _mm256_setzero_ps();
+        }
+    }
+
+    for (int i = 0; i < nb; ++i) {
+        __m256i qy[GGML_GEMM_Q_RN];
+        float   dy[GGML_GEMM_Q_RN];
+
+        for (int c = 0; c < GGML_GEMM_Q_RN; ++c) {
+            const block_q8_0 * restrict y = (const block_q8_0 *) ((const char *) vy + c*by);
+
+            qy[c] = _mm256_loadu_si256((const __m256i *) y[i].qs);
+            dy[c] = GGML_FP16_TO_FP32(y[i].d);
+        }
+
+        for (int r = 0; r < GGML_GEMM_Q_RM; ++r) {
+            const void * restrict x = (const char *) vx + r*bx;
+
+            const __m256i qx = ggml_gemm_q_unpack(type, x, i);
+            const float   dx = ggml_gemm_q_scale (type, x, i);
+
+            // absolute values of x, see mul_sum_i8_pairs_float
+            const __m256i ax = _mm256_sign_epi8(qx, qx);
+
+            for (int c = 0; c < GGML_GEMM_Q_RN; ++c) {
+                const __m256 q = mul_sum_us8_pairs_float(ax, _mm256_sign_epi8(qy[c], qx));
+
+                acc[r][c] = _mm256_fmadd_ps(_mm256_set1_ps(dx*dy[c]), q, acc[r][c]);
+            }
+        }
+    }
+
+    for (int r = 0; r < GGML_GEMM_Q_RM; ++r) {
+        for (int c = 0; c < GGML_GEMM_Q_RN; ++c) {
+            s[c*bs + r] = hsum_float_8(acc[r][c]);
+        }
+    }
+}
+
+static void ggml_gemm_q4_0_q8_0(const int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by) {
+    ggml_gemm_q_q8_0(GGML_TYPE_Q4_0, n, s, bs, vx, bx, vy, by);
+}
+
+static void ggml_gemm_q5_0_q8_0(const int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by) {
+    ggml_gemm_q_q8_0(GGML_TYPE_Q5_0, n, s, bs, vx, bx, vy, by);
+}
+
+static void ggml_gemm_q8_0_q8_0(const int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by) {
+    ggml_gemm_q_q8_0(GGML_TYPE_Q8_0, n, s, bs, vx, bx, vy, by);
+}
+#endif
+
 // compute GGML_VEC_DOT_UNROLL dot products at once
 // xs - x row stride in bytes
 inline static void ggml_vec_dot_f16_unroll(const int n, const int xs, float * restrict s, void * restrict xv, ggml_fp16_t * restrict y) {
@@ -3613,6 +3771,135 @@ inline static void ggml_vec_max_f32(const int n, float * s, const float * x) {
 #endif
 }
 
+// y = exp(x - max), 0 where x is -INFINITY - returns the sum of y
+inline static ggml_float ggml_vec_soft_max_f32(const int n, float * y, const float * x, float max) {
+    ggml_float sum = 0.0;
+
+    uint16_t scvt;
+    for (int i = 0; i < n; i++) {
+        if (x[i] == -INFINITY) {
+            y[i] = 0.0f;
+        } else {
+            // const float val = (x[i] == -INFINITY) ? 0.0 : exp(x[i] - max);
+            ggml_fp16_t s = GGML_FP32_TO_FP16(x[i] - max);
+            memcpy(&scvt, &s, sizeof(scvt));
+            const float val = GGML_FP16_TO_FP32(ggml_table_exp_f16[scvt]);
+            sum += (ggml_float)val;
+            y[i] = val;
+        }
+    }
+
+    return sum;
+}
+
+// flash attention tiles, see ggml_compute_forward_flash_attn_f16
+// the GGML_FLASH_ATTN_BQ query rows of a block are the SIMD lanes, so there are no horizontal sums
+
+#if defined(GGML_SIMD)
+#define GGML_FLASH_ATTN_NV (GGML_FLASH_ATTN_BQ/GGML_F32_EPR) // registers per lane group
+#define GGML_FLASH_ATTN_NU (8/GGML_FLASH_ATTN_NV)            // keys / output rows per step
+#endif
+
+// S[j][:] = sum_d K[j][d]*Qt[d][:] for j < nk, the rows of K are ks floats apart
+inline static void ggml_vec_flash_attn_qk_f32(const int D, const int nk, float * restrict S, const float * restrict K, const int ks, const float * restrict Qt) {
+    const int BQ = GGML_FLASH_ATTN_BQ;
+
+    int j = 0;
+
+#if defined(GGML_SIMD)
+    for (; j + GGML_FLASH_ATTN_NU <= nk; j += GGML_FLASH_ATTN_NU) {
+        GGML_F32_VEC acc[GGML_FLASH_ATTN_NU][GGML_FLASH_ATTN_NV];
+
+        for (int u = 0; u < GGML_FLASH_ATTN_NU; ++u) {
+            for (int v = 0; v < GGML_FLASH_ATTN_NV; ++v) {
+                acc[u][v] = GGML_F32_VEC_ZERO;
+            }
+        }
+
+        for (int d = 0; d < D; ++d) {
+            GGML_F32_VEC qv[GGML_FLASH_ATTN_NV];
+
+            for (int v = 0; v < GGML_FLASH_ATTN_NV; ++v) {
+                qv[v] = GGML_F32_VEC_LOAD(Qt + d*BQ + v*GGML_F32_EPR);
+            }
+
+            for (int u = 0; u < GGML_FLASH_ATTN_NU; ++u) {
+                const GGML_F32_VEC kv = GGML_F32_VEC_SET1(K[(j + u)*ks + d]);
+
+                for (int v = 0; v < GGML_FLASH_ATTN_NV; ++v) {
+                    acc[u][v] = GGML_F32_VEC_FMA(acc[u][v], qv[v], kv);
+                }
+            }
+        }
+
+        for (int u = 0; u < GGML_FLASH_ATTN_NU; ++u) {
+            for (int v = 0; v < GGML_FLASH_ATTN_NV; ++v) {
+                GGML_F32_VEC_STORE(S + (j + u)*BQ + v*GGML_F32_EPR, acc[u][v]);
+            }
+        }
+    }
+#endif
+
+    // leftovers
+    for (; j < nk; ++j) {
+        float * Sj = S + j*BQ;
+
+        ggml_vec_set_f32(BQ, Sj, 0.0f);
+
+        for (int d = 0; d < D; ++d) {
+            ggml_vec_mad_f32(BQ, Sj, Qt + d*BQ, K[j*ks + d]);
+        }
+    }
+}
+
+// Ot[d][:] += sum_j V[d][j]*S[j][:] for d < D, V[d][j] is at V[d*vsd + j*vsj]
+inline static void ggml_vec_flash_attn_sv_f32(const int D, const int nk, float * restrict Ot, const float * restrict V, const int vsd, const int vsj, const float * restrict S) {
+    const int BQ = GGML_FLASH_ATTN_BQ;
+
+    int d = 0;
+
+#if defined(GGML_SIMD)
+    for (; d + GGML_FLASH_ATTN_NU <= D; d += GGML_FLASH_ATTN_NU) {
+        GGML_F32_VEC acc[GGML_FLASH_ATTN_NU][GGML_FLASH_ATTN_NV];
+
+        for (int u = 0; u < GGML_FLASH_ATTN_NU; ++u) {
+            for (int v = 0; v < GGML_FLASH_ATTN_NV; ++v) {
+                acc[u][v] = GGML_F32_VEC_LOAD(Ot + (d + u)*BQ + v*GGML_F32_EPR);
+            }
+        }
+
+        for (int j = 0; j < nk; ++j) {
+            GGML_F32_VEC sv[GGML_FLASH_ATTN_NV];
+
+            for (int v = 0; v < GGML_FLASH_ATTN_NV; ++v) {
+                sv[v] = GGML_F32_VEC_LOAD(S + j*BQ + v*GGML_F32_EPR);
+            }
+
+            for (int u = 0; u < GGML_FLASH_ATTN_NU; ++u) {
+                const GGML_F32_VEC vv = GGML_F32_VEC_SET1(V[(d + u)*vsd + j*vsj]);
+
+                for (int v = 0; v < GGML_FLASH_ATTN_NV; ++v) {
+                    acc[u][v] = GGML_F32_VEC_FMA(acc[u][v], sv[v], vv);
+                }
+            }
+        }
+
+        for (int u = 0; u < GGML_FLASH_ATTN_NU; ++u) {
+            for (int v = 0; v < GGML_FLASH_ATTN_NV; ++v) {
+                GGML_F32_VEC_STORE(Ot + (d + u)*BQ + v*GGML_F32_EPR, acc[u][v]);
+            }
+        }
+    }
+#endif
+
+    // leftovers
+    for (; d < D; ++d) {
+        for (int j = 0; j < nk; ++j) {
+            ggml_vec_mad_f32(BQ, Ot + d*BQ, S + j*BQ, V[d*vsd + j*vsj]);
+        }
+    }
+}
+
 inline static void ggml_vec_norm_inv_f32(const int n, float * s, const float * x) {
     ggml_vec_norm_f32(n, s, x);
     *s = 1.f/(*s);
@@ -3629,89 +3916,334 @@ inline static void ggml_vec_argmax_f32(const int n, int * s, const float * x) {
 }
 
 //
-// data types
+// runtime kernel selection
+//
+// with GGML_CPU_DISPATCH, the code above is compiled once more for each of the instruction sets that the CPU might
+// support, with GGML_CPU_VARIANT set to the name of the set (see CMakeLists.txt). Each variant exports a table of its
+// hot kernels and ggml_init() selects the best table for the CPU. Without GGML_CPU_DISPATCH, the table of this
+// translation unit is used
 //
 
-static const int GGML_BLCK_SIZE[GGML_TYPE_COUNT] = {
-    [GGML_TYPE_F32]  = 1,
-    [GGML_TYPE_F16]  = 1,
-    [GGML_TYPE_Q4_0] = QK4_0,
-    [GGML_TYPE_Q4_1] = QK4_1,
-    [GGML_TYPE_Q5_0] = QK5_0,
-    [GGML_TYPE_Q5_1] = QK5_1,
-    [GGML_TYPE_Q8_0] = QK8_0,
-    [GGML_TYPE_Q8_1] = QK8_1,
-#ifdef GGML_USE_K_QUANTS
-    [GGML_TYPE_Q2_K] = QK_K,
-    [GGML_TYPE_Q3_K] = QK_K,
-    [GGML_TYPE_Q4_K] = QK_K,
-    [GGML_TYPE_Q5_K] = QK_K,
-    [GGML_TYPE_Q6_K] = QK_K,
-    [GGML_TYPE_Q8_K] = QK_K,
-#endif
-    [GGML_TYPE_I8]   = 1,
-    [GGML_TYPE_I16]  = 1,
-    [GGML_TYPE_I32]  = 1,
+enum ggml_cpu_feature {
+    GGML_CPU_SSE3        = 1 << 0,
+    GGML_CPU_AVX         = 1 << 1,
+    GGML_CPU_AVX2        = 1 << 2,
+    GGML_CPU_AVX512      = 1 << 3,
+    GGML_CPU_AVX512_VBMI = 1 << 4,
+    GGML_CPU_AVX512_VNNI = 1 << 5,
+    GGML_CPU_FMA         = 1 << 6,
+    GGML_CPU_F16C        = 1 << 7,
+    GGML_CPU_NEON        = 1 << 8,
+    GGML_CPU_ARM_FMA     = 1 << 9,
+    GGML_CPU_FP16_VA     = 1 << 10,
+    GGML_CPU_WASM_SIMD   = 1 << 11,
+    GGML_CPU_VSX         = 1 << 12,
 };
-static_assert(GGML_TYPE_COUNT == 19, "GGML_BLCK_SIZE is outdated");
 
-static const size_t GGML_TYPE_SIZE[GGML_TYPE_COUNT] = {
-    [GGML_TYPE_F32]  = sizeof(float),
-    [GGML_TYPE_F16]  = sizeof(ggml_fp16_t),
-    [GGML_TYPE_Q4_0] = sizeof(block_q4_0),
-    [GGML_TYPE_Q4_1] = sizeof(block_q4_1),
-    [GGML_TYPE_Q5_0] = sizeof(block_q5_0),
-    [GGML_TYPE_Q5_1] = sizeof(block_q5_1),
-    [GGML_TYPE_Q8_0] = sizeof(block_q8_0),
-    [GGML_TYPE_Q8_1] = sizeof(block_q8_1),
-#ifdef GGML_USE_K_QUANTS
-    [GGML_TYPE_Q2_K] = sizeof(block_q2_K),
-    [GGML_TYPE_Q3_K] = sizeof(block_q3_K),
-    [GGML_TYPE_Q4_K] = sizeof(block_q4_K),
-    [GGML_TYPE_Q5_K] = sizeof(block_q5_K),
-    [GGML_TYPE_Q6_K] = sizeof(block_q6_K),
-    [GGML_TYPE_Q8_K] = sizeof(block_q8_K),
+// instruction sets used by the kernels of this translation unit
+enum {
+    GGML_CPU_FEATURES = 0
+#if defined(__SSE3__)
+        | GGML_CPU_SSE3
+#endif
+#if defined(__AVX__)
+        | GGML_CPU_AVX
+#endif
+#if defined(__AVX2__)
+        | GGML_CPU_AVX2
+#endif
+#if defined(__AVX512F__)
+        | GGML_CPU_AVX512
+#endif
+#if defined(__AVX512VBMI__)
+        | GGML_CPU_AVX512_VBMI
+#endif
+#if defined(__AVX512VNNI__)
+        | GGML_CPU_AVX512_VNNI
+#endif
+#if defined(__FMA__)
+        | GGML_CPU_FMA
+#endif
+#if defined(__F16C__)
+        | GGML_CPU_F16C
+#endif
+#if defined(__ARM_NEON)
+        | GGML_CPU_NEON
+#endif
+#if defined(__ARM_FEATURE_FMA)
+        | GGML_CPU_ARM_FMA
+#endif
+#if defined(__ARM_FEATURE_FP16_VECTOR_ARITHMETIC)
+        | GGML_CPU_FP16_VA
+#endif
+#if defined(__wasm_simd128__)
+        | GGML_CPU_WASM_SIMD
+#endif
+#if defined(__POWER9_VECTOR__)
+        | GGML_CPU_VSX
 #endif
-    [GGML_TYPE_I8]   = sizeof(int8_t),
-    [GGML_TYPE_I16]  = sizeof(int16_t),
-    [GGML_TYPE_I32]  = sizeof(int32_t),
 };
-static_assert(GGML_TYPE_COUNT == 19, "GGML_TYPE_SIZE is outdated");
 
+#if defined(__AVX512F__)
+#define GGML_CPU_NAME "avx512"
+#elif defined(__AVX2__)
+#define GGML_CPU_NAME "avx2"
+#elif defined(__AVX__)
+#define GGML_CPU_NAME "avx"
+#elif defined(__SSE3__)
+#define GGML_CPU_NAME "sse3"
+#elif defined(__ARM_FEATURE_DOTPROD)
+#define GGML_CPU_NAME "armv8.2"
+#elif defined(__ARM_NEON)
+#define GGML_CPU_NAME "neon"
+#elif defined(__wasm_simd128__)
+#define GGML_CPU_NAME "wasm_simd"
+#elif defined(__POWER9_VECTOR__)
+#define GGML_CPU_NAME "power9"
+#else
+#define GGML_CPU_NAME "generic"
+#endif
 
-static const char * GGML_TYPE_NAME[GGML_TYPE_COUNT] = {
-    [GGML_TYPE_F32]  = "f32",
-    [GGML_TYPE_F16]  = "f16",
-    [GGML_TYPE_Q4_0] = "q4_0",
-    [GGML_TYPE_Q4_1] = "q4_1",
-    [GGML_TYPE_Q5_0] = "q5_0",
-    [GGML_TYPE_Q5_1] = "q5_1",
-    [GGML_TYPE_Q8_0] = "q8_0",
-    [GGML_TYPE_Q8_1] = "q8_1",
-    [GGML_TYPE_Q2_K] = "q2_K",
-    [GGML_TYPE_Q3_K] = "q3_K",
-    [GGML_TYPE_Q4_K] = "q4_K",
-    [GGML_TYPE_Q5_K] = "q5_K",
-    [GGML_TYPE_Q6_K] = "q6_K",
-    [GGML_TYPE_Q8_K] = "q8_K",
-    [GGML_TYPE_I8]   = "i8",
-    [GGML_TYPE_I16]  = "i16",
-    [GGML_TYPE_I32]  = "i32",
+struct ggml_cpu_kernels {
+    const char * name;
+    int          features; // GGML_CPU_*
+
+    void       (*vec_dot_f32)       (const int n, float * restrict s, const float * restrict x, const float * restrict y);
+    void       (*vec_dot_f16)       (const int n, float * restrict s, ggml_fp16_t * restrict x, ggml_fp16_t * restrict y);
+    void       (*vec_dot_f16_unroll)(const int n, const int xs, float * restrict s, void * restrict xv, ggml_fp16_t * restrict y);
+    void       (*vec_mad_f32)       (const int n, float * restrict y, const float * restrict x, const float v);
+    ggml_float (*vec_soft_max_f32)  (const int n, float * y, const float * x, float max);
+
+    void       (*flash_attn_qk_f32)(const int D, const int nk, float * restrict S, const float * restrict K, const int ks, const float * restrict Qt);
+    void       (*flash_attn_sv_f32)(const int D, const int nk, float * restrict Ot, const float * restrict V, const int vsd, const int vsj, const float * restrict S);
+
+    void       (*fp16_to_fp32_row)(const ggml_fp16_t * x, float * y, size_t n);
+    void       (*fp32_to_fp16_row)(const float * x, ggml_fp16_t * y, size_t n);
+
+    const quantize_fns_t * quantize_fns; // [GGML_TYPE_COUNT]
+    const gemm_q_t       * gemm_q;       // [GGML_TYPE_COUNT], optional
 };
-static_assert(GGML_TYPE_COUNT == 19, "GGML_TYPE_NAME is outdated");
 
-static bool GGML_IS_QUANTIZED[GGML_TYPE_COUNT] = {
-    [GGML_TYPE_F32]  = false,
-    [GGML_TYPE_F16]  = false,
-    [GGML_TYPE_Q4_0] = true,
-    [GGML_TYPE_Q4_1] = true,
-    [GGML_TYPE_Q5_0] = true,
-    [GGML_TYPE_Q5_1] = true,
-    [GGML_TYPE_Q8_0] = true,
-    [GGML_TYPE_Q8_1] = true,
-    [GGML_TYPE_Q2_K] = true,
-    [GGML_TYPE_Q3_K] = true,
-    [GGML_TYPE_Q4_K] = true,
+#define GGML_CPU_KERNELS_INIT {                          \
+    /*.name               =*/ GGML_CPU_NAME,              \
+    /*.features           =*/ GGML_CPU_FEATURES,          \
+    /*.vec_dot_f32        =*/ ggml_vec_dot_f32,           \
+    /*.vec_dot_f16        =*/ ggml_vec_dot_f16,           \
+    /*.vec_dot_f16_unroll =*/ ggml_vec_dot_f16_unroll,    \
+    /*.vec_mad_f32        =*/ ggml_vec_mad_f32,           \
+    /*.vec_soft_max_f32   =*/ ggml_vec_soft_max_f32,      \
+    /*.flash_attn_qk_f32  =*/ ggml_vec_flash_attn_qk_f32, \
+    /*.flash_attn_sv_f32  =*/ ggml_vec_flash_attn_sv_f32, \
+    /*.fp16_to_fp32_row   =*/ ggml_fp16_to_fp32_row_impl, \
+    /*.fp32_to_fp16_row   =*/ ggml_fp32_to_fp16_row_impl, \
+    /*.quantize_fns       =*/ quantize_fns,               \
+    /*.gemm_q             =*/ gemm_q_fns,                 \
+}
+
+#define GGML_CPU_KERNELS_NAME_(variant) ggml_cpu_kernels_ ## variant
+#define GGML_CPU_KERNELS_NAME(variant)  GGML_CPU_KERNELS_NAME_(variant)
+
+#ifdef GGML_CPU_VARIANT
+
+// the rest of ggml.c is compiled only once
+const struct ggml_cpu_kernels GGML_CPU_KERNELS_NAME(GGML_CPU_VARIANT) = GGML_CPU_KERNELS_INIT;
+
+#else // GGML_CPU_VARIANT
+
+// the kernels in use
+static struct ggml_cpu_kernels ggml_cpu = GGML_CPU_KERNELS_INIT;
+
+#if defined(GGML_CPU_DISPATCH)
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <cpuid.h>
+
+extern const struct ggml_cpu_kernels ggml_cpu_kernels_avx;
+extern const struct ggml_cpu_kernels ggml_cpu_kernels_avx2;
+extern const struct ggml_cpu_kernels ggml_cpu_kernels_avx512;
+
+static void ggml_cpu_init(void) {
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return;
+    }
+
+    const bool has_fma     = ecx & (1u << 12);
+    const bool has_osxsave = ecx & (1u << 27);
+    const bool has_avx     = ecx & (1u << 28);
+    const bool has_f16c    = ecx & (1u << 29);
+
+    if (!has_osxsave) {
+        return;
+    }
+
+    // the OS must save the AVX (and AVX512) registers
+    uint32_t xcr0_lo, xcr0_hi;
+    __asm__ __volatile__("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+
+    const bool os_avx    = (xcr0_lo & 0x06) == 0x06;
+    const bool os_avx512 = (xcr0_lo & 0xe6) == 0xe6;
+
+    bool has_avx2    = false;
+    bool has_avx512f = false;
+
+    if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+        has_avx2    = ebx & (1u << 5);
+        has_avx512f = ebx & (1u << 16);
+    }
+
+    if (!os_avx || !has_avx) {
+        return;
+    }
+
+    // the fp16 kernels need F16C to be faster than the baseline
+    if (!has_f16c) {
+        return;
+    }
+
+    if (has_avx2 && has_fma) {
+        ggml_cpu = os_avx512 && has_avx512f ? ggml_cpu_kernels_avx512 : ggml_cpu_kernels_avx2;
+    } else {
+        ggml_cpu = ggml_cpu_kernels_avx;
+    }
+}
+
+#elif defined(__aarch64__) && defined(__linux__)
+
+#include <sys/auxv.h>
+
+#ifndef HWCAP_ASIMDHP
+#define HWCAP_ASIMDHP (1 << 10)
+#endif
+#ifndef HWCAP_ASIMDDP
+#define HWCAP_ASIMDDP (1 << 20)
+#endif
+
+extern const struct ggml_cpu_kernels ggml_cpu_kernels_armv82;
+
+static void ggml_cpu_init(void) {
+    const unsigned long hwcap = getauxval(AT_HWCAP);
+
+    if ((hwcap & HWCAP_ASIMDHP) && (hwcap & HWCAP_ASIMDDP)) {
+        ggml_cpu = ggml_cpu_kernels_armv82;
+    }
+}
+
+#else
+#error "GGML_CPU_DISPATCH is not supported on this platform"
+#endif
+
+#else
+
+static void ggml_cpu_init(void) {
+}
+
+#endif // GGML_CPU_DISPATCH
+
+const char * ggml_cpu_variant(void) {
+    return ggml_cpu.name;
+}
+
+void ggml_fp16_to_fp32_row(const ggml_fp16_t * x, float * y, size_t n) {
+    ggml_cpu.fp16_to_fp32_row(x, y, n);
+}
+
+void ggml_fp32_to_fp16_row(const float * x, ggml_fp16_t * y, size_t n) {
+    ggml_cpu.fp32_to_fp16_row(x, y, n);
+}
+
+// For internal test use
+quantize_fns_t ggml_internal_get_quantize_fn(size_t i) {
+    GGML_ASSERT(i < GGML_TYPE_COUNT);
+    return ggml_cpu.quantize_fns[i];
+}
+
+//
+// data types
+//
+
+static const int GGML_BLCK_SIZE[GGML_TYPE_COUNT] = {
+    [GGML_TYPE_F32]  = 1,
+    [GGML_TYPE_F16]  = 1,
+    [GGML_TYPE_Q4_0] = QK4_0,
+    [GGML_TYPE_Q4_1] = QK4_1,
+    [GGML_TYPE_Q5_0] = QK5_0,
+    [GGML_TYPE_Q5_1] = QK5_1,
+    [GGML_TYPE_Q8_0] = QK8_0,
+    [GGML_TYPE_Q8_1] = QK8_1,
+#ifdef GGML_USE_K_QUANTS
+    [GGML_TYPE_Q2_K] = QK_K,
+    [GGML_TYPE_Q3_K] = QK_K,
+    [GGML_TYPE_Q4_K] = QK_K,
+    [GGML_TYPE_Q5_K] = QK_K,
+    [GGML_TYPE_Q6_K] = QK_K,
+    [GGML_TYPE_Q8_K] = QK_K,
+#endif
+    [GGML_TYPE_I8]   = 1,
+    [GGML_TYPE_I16]  = 1,
+    [GGML_TYPE_I32]  = 1,
+};
+static_assert(GGML_TYPE_COUNT == 19, "GGML_BLCK_SIZE is outdated");
+
+static const size_t GGML_TYPE_SIZE[GGML_TYPE_COUNT] = {
+    [GGML_TYPE_F32]  = sizeof(float),
+    [GGML_TYPE_F16]  = sizeof(ggml_fp16_t),
+    [GGML_TYPE_Q4_0] = sizeof(block_q4_0),
+    [GGML_TYPE_Q4_1] = sizeof(block_q4_1),
+    [GGML_TYPE_Q5_0] = sizeof(block_q5_0),
+    [GGML_TYPE_Q5_1] = sizeof(block_q5_1),
+    [GGML_TYPE_Q8_0] = sizeof(block_q8_0),
+    [GGML_TYPE_Q8_1] = sizeof(block_q8_1),
+#ifdef GGML_USE_K_QUANTS
+    [GGML_TYPE_Q2_K] = sizeof(block_q2_K),
+    [GGML_TYPE_Q3_K] = sizeof(block_q3_K),
+    [GGML_TYPE_Q4_K] = sizeof(block_q4_K),
+    [GGML_TYPE_Q5_K] = sizeof(block_q5_K),
+    [GGML_TYPE_Q6_K] = sizeof(block_q6_K),
+    [GGML_TYPE_Q8_K] = sizeof(block_q8_K),
+#endif
+    [GGML_TYPE_I8]   = sizeof(int8_t),
+    [GGML_TYPE_I16]  = sizeof(int16_t),
+    [GGML_TYPE_I32]  = sizeof(int32_t),
+};
+static_assert(GGML_TYPE_COUNT == 19, "GGML_TYPE_SIZE is outdated");
+
+
+static const char * GGML_TYPE_NAME[GGML_TYPE_COUNT] = {
+    [GGML_TYPE_F32]  = "f32",
+    [GGML_TYPE_F16]  = "f16",
+    [GGML_TYPE_Q4_0] = "q4_0",
+    [GGML_TYPE_Q4_1] = "q4_1",
+    [GGML_TYPE_Q5_0] = "q5_0",
+    [GGML_TYPE_Q5_1] = "q5_1",
+    [GGML_TYPE_Q8_0] = "q8_0",
+    [GGML_TYPE_Q8_1] = "q8_1",
+    [GGML_TYPE_Q2_K] = "q2_K",
+    [GGML_TYPE_Q3_K] = "q3_K",
+    [GGML_TYPE_Q4_K] = "q4_K",
+    [GGML_TYPE_Q5_K] = "q5_K",
+    [GGML_TYPE_Q6_K] = "q6_K",
+    [GGML_TYPE_Q8_K] = "q8_K",
+    [GGML_TYPE_I8]   = "i8",
+    [GGML_TYPE_I16]  = "i16",
+    [GGML_TYPE_I32]  = "i32",
+};
+static_assert(GGML_TYPE_COUNT == 19, "GGML_TYPE_NAME is outdated");
+
+static bool GGML_IS_QUANTIZED[GGML_TYPE_COUNT] = {
+    [GGML_TYPE_F32]  = false,
+    [GGML_TYPE_F16]  = false,
+    [GGML_TYPE_Q4_0] = true,
+    [GGML_TYPE_Q4_1] = true,
+    [GGML_TYPE_Q5_0] = true,
+    [GGML_TYPE_Q5_1] = true,
+    [GGML_TYPE_Q8_0] = true,
+    [GGML_TYPE_Q8_1] = true,
+    [GGML_TYPE_Q2_K] = true,
+    [GGML_TYPE_Q3_K] = true,
+    [GGML_TYPE_Q4_K] = true,
     [GGML_TYPE_Q5_K] = true,
     [GGML_TYPE_Q6_K] = true,
     [GGML_TYPE_Q8_K] = true,
@@ -3752,10 +4284,12 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "SILU",
     "SILU_BACK",
     "NORM",
+    "NORM_AFFINE",
     "RMS_NORM",
     "RMS_NORM_BACK",
 
     "MUL_MAT",
+    "MUL_MAT_BIAS",
     "OUT_PROD",
 
     "SCALE",
@@ -3781,6 +4315,7 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "CONV_2D",
 
     "FLASH_ATTN",
+    "FLASH_ATTN_EXT",
     "FLASH_FF",
     "FLASH_ATTN_BACK",
     "WIN_PART",
@@ -3797,7 +4332,7 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "CROSS_ENTROPY_LOSS_BACK",
 };
 
-static_assert(GGML_OP_COUNT == 66, "GGML_OP_COUNT != 66");
+static_assert(GGML_OP_COUNT == 69, "GGML_OP_COUNT != 69");
 
 static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "none",
@@ -3830,10 +4365,12 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "silu(x)",
     "silu_back(x)",
     "norm(x)",
+    "norm(x)*w+b",
     "rms_norm(x)",
     "rms_norm_back(x)",
 
     "X*Y",
+    "X*Y+b",
     "X*Y",
 
     "x*v",
@@ -3859,6 +4396,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "conv_2d(x)",
 
     "flash_attn(x)",
+    "flash_attn_ext(x)",
     "flash_ff(x)",
     "flash_attn_back(x)",
     "win_part(x)",
@@ -3875,7 +4413,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "cross_entropy_loss_back(x,y)",
 };
 
-static_assert(GGML_OP_COUNT == 66, "GGML_OP_COUNT != 66");
+static_assert(GGML_OP_COUNT == 69, "GGML_OP_COUNT != 69");
 
 static_assert(sizeof(struct ggml_object)%GGML_MEM_ALIGN == 0, "ggml_object size must be a multiple of GGML_MEM_ALIGN");
 static_assert(sizeof(struct ggml_tensor)%GGML_MEM_ALIGN == 0, "ggml_tensor size must be a multiple of GGML_MEM_ALIGN");
@@ -3896,6 +4434,7 @@ static void ggml_setup_op_has_task_pass(void) {
 
         p[GGML_OP_ACC                    ] = true;
         p[GGML_OP_MUL_MAT                ] = true;
+        p[GGML_OP_MUL_MAT_BIAS           ] = true;
         p[GGML_OP_OUT_PROD               ] = true;
         p[GGML_OP_SET                    ] = true;
         p[GGML_OP_GET_ROWS_BACK          ] = true;
@@ -4189,6 +4728,8 @@ enum ggml_type ggml_ftype_to_ggml_type(enum ggml_ftype ftype) {
         case GGML_FTYPE_MOSTLY_Q4_K:          wtype = GGML_TYPE_Q4_K;  break;
         case GGML_FTYPE_MOSTLY_Q5_K:          wtype = GGML_TYPE_Q5_K;  break;
         case GGML_FTYPE_MOSTLY_Q6_K:          wtype = GGML_TYPE_Q6_K;  break;
+        case GGML_FTYPE_MOSTLY_Q4_K_M:        wtype = GGML_TYPE_Q4_K;  break;
+        case GGML_FTYPE_MOSTLY_Q5_K_M:        wtype = GGML_TYPE_Q5_K;  break;
         case GGML_FTYPE_UNKNOWN:              wtype = GGML_TYPE_COUNT; break;
         case GGML_FTYPE_MOSTLY_Q4_1_SOME_F16: wtype = GGML_TYPE_COUNT; break;
     }
@@ -4288,6 +4829,9 @@ struct ggml_context * ggml_init(struct ggml_init_params params) {
         // initialize time system (required on Windows)
         ggml_time_init();
 
+        // select the kernels for this CPU
+        ggml_cpu_init();
+
         // initialize GELU, Quick GELU, SILU and EXP F32 tables
         {
             const uint64_t t_start = ggml_time_us(); UNUSED(t_start);
@@ -4296,11 +4840,11 @@ struct ggml_context * ggml_init(struct ggml_init_params params) {
             for (int i = 0; i < (1 << 16); ++i) {
                 uint16_t ui = i;
                 memcpy(&ii, &ui, sizeof(ii));
-                const float f = table_f32_f16[i] = GGML_COMPUTE_FP16_TO_FP32(ii);
+                const float f = ggml_table_f32_f16[i] = GGML_COMPUTE_FP16_TO_FP32(ii);
                 table_gelu_f16[i] = GGML_FP32_TO_FP16(ggml_gelu_f32(f));
                 table_gelu_quick_f16[i] = GGML_FP32_TO_FP16(ggml_gelu_quick_f32(f));
                 table_silu_f16[i] = GGML_FP32_TO_FP16(ggml_silu_f32(f));
-                table_exp_f16[i]  = GGML_FP32_TO_FP16(expf(f));
+                ggml_table_exp_f16[i]  = GGML_FP32_TO_FP16(expf(f));
             }
 
             const uint64_t t_end = ggml_time_us(); UNUSED(t_end);
@@ -4488,7 +5032,8 @@ struct ggml_tensor * ggml_new_tensor_impl(
         enum   ggml_type type,
         int    n_dims,
         const int64_t* ne,
-        void*  data) {
+        struct ggml_tensor * view_src,
+        size_t view_offs) {
     // always insert objects at the end of the context's memory pool
     struct ggml_object * obj_cur = ctx->objects_end;
 
@@ -4496,9 +5041,18 @@ struct ggml_tensor * ggml_new_tensor_impl(
     const size_t cur_size = obj_cur == NULL ? 0 : obj_cur->size;
     const size_t cur_end  = cur_offs + cur_size;
 
+    // a view of a view shares the data of the original tensor
+    if (view_src != NULL && view_src->view_src != NULL) {
+        view_offs += view_src->view_offs;
+        view_src   = view_src->view_src;
+    }
+
+    // the data of a view is not known yet if the original tensor has not been allocated (see ggml_allocr)
+    void * data = view_src != NULL && view_src->data != NULL ? (char *) view_src->data + view_offs : NULL;
+
     size_t size_needed = 0;
 
-    if (data == NULL && !ctx->no_alloc) {
+    if (view_src == NULL && !ctx->no_alloc) {
         size_needed += GGML_TYPE_SIZE[type]*(ne[0]/GGML_BLCK_SIZE[type]);
         for (int i = 1; i < n_dims; i++) {
             size_needed *= ne[i];
@@ -4510,7 +5064,7 @@ struct ggml_tensor * ggml_new_tensor_impl(
     char * const mem_buffer = ctx->mem_buffer;
     struct ggml_object * const obj_new = (struct ggml_object *)(mem_buffer + cur_end);
 
-    if (ctx->scratch.data == NULL || data != NULL) {
+    if (ctx->scratch.data == NULL || view_src != NULL) {
         size_needed += GGML_TENSOR_SIZE;
 
         if (cur_end + size_needed + GGML_OBJECT_SIZE > ctx->mem_size) {
@@ -4584,7 +5138,9 @@ struct ggml_tensor * ggml_new_tensor_impl(
         /*.perf_runs    =*/ 0,
         /*.perf_cycles  =*/ 0,
         /*.perf_time_us =*/ 0,
-        /*.data         =*/ (data == NULL && !ctx->no_alloc) ? (void *)(result + 1) : data,
+        /*.data         =*/ (view_src == NULL && data == NULL && !ctx->no_alloc) ? (void *)(result + 1) : data,
+        /*.view_src     =*/ view_src,
+        /*.view_offs    =*/ view_offs,
         /*.name         =*/ { 0 },
         /*.extra        =*/ NULL,
         /*.pad          =*/ { 0 },
@@ -4613,7 +5169,7 @@ struct ggml_tensor * ggml_new_tensor(
         enum   ggml_type type,
         int    n_dims,
         const int64_t * ne) {
-    return ggml_new_tensor_impl(ctx, type, n_dims, ne, NULL);
+    return ggml_new_tensor_impl(ctx, type, n_dims, ne, NULL, 0);
 }
 
 struct ggml_tensor * ggml_new_tensor_1d(
@@ -4678,7 +5234,7 @@ struct ggml_tensor * ggml_new_f32(struct ggml_context * ctx, float value) {
 }
 
 struct ggml_tensor * ggml_dup_tensor(struct ggml_context * ctx, const struct ggml_tensor * src) {
-    return ggml_new_tensor_impl(ctx, src->type, src->n_dims, src->ne, NULL);
+    return ggml_new_tensor_impl(ctx, src->type, src->n_dims, src->ne, NULL, 0);
 }
 
 struct ggml_tensor * ggml_set_zero(struct ggml_tensor * tensor) {
@@ -4959,8 +5515,8 @@ struct ggml_tensor * ggml_format_name(struct ggml_tensor * tensor, const char *
 
 struct ggml_tensor * ggml_view_tensor(
         struct ggml_context * ctx,
-        const struct ggml_tensor * src) {
-    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, src->type, src->n_dims, src->ne, src->data);
+        struct ggml_tensor  * src) {
+    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, src->type, src->n_dims, src->ne, src, 0);
     ggml_format_name(result, "%s (view)", src->name);
 
     result->nb[0] = src->nb[0];
@@ -5031,7 +5587,9 @@ struct ggml_tensor * ggml_add_impl(
         struct ggml_tensor * a,
         struct ggml_tensor * b,
         bool inplace) {
-    GGML_ASSERT(ggml_are_same_shape(a, b));
+    // b is broadcast across a - only for F32 a and b unless the shapes are the same
+    GGML_ASSERT(ggml_can_repeat(b, a));
+    GGML_ASSERT(ggml_are_same_shape(a, b) || (a->type == GGML_TYPE_F32 && b->type == GGML_TYPE_F32));
 
     bool is_node = false;
 
@@ -5952,6 +6510,34 @@ struct ggml_tensor * ggml_norm_inplace(
     return ggml_norm_impl(ctx, a, true);
 }
 
+// ggml_norm_affine
+
+struct ggml_tensor * ggml_norm_affine(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * w,
+        struct ggml_tensor  * b) {
+    GGML_ASSERT(w->type == GGML_TYPE_F32 && ggml_is_contiguous(w) && ggml_nelements(w) == a->ne[0]);
+    GGML_ASSERT(b->type == GGML_TYPE_F32 && ggml_is_contiguous(b) && ggml_nelements(b) == a->ne[0]);
+
+    bool is_node = false;
+
+    if (a->grad || w->grad || b->grad) {
+        GGML_ASSERT(false); // TODO: implement backward
+        is_node = true;
+    }
+
+    struct ggml_tensor * result = ggml_dup_tensor(ctx, a);
+
+    result->op     = GGML_OP_NORM_AFFINE;
+    result->grad   = is_node ? ggml_dup_tensor(ctx, result) : NULL;
+    result->src0   = a;
+    result->src1   = w;
+    result->opt[0] = b;
+
+    return result;
+}
+
 struct ggml_tensor * ggml_rms_norm_impl(
         struct ggml_context * ctx,
         struct ggml_tensor  * a,
@@ -6032,6 +6618,52 @@ struct ggml_tensor * ggml_mul_mat(
     return result;
 }
 
+// ggml_mul_mat_bias
+
+static struct ggml_tensor * ggml_mul_mat_bias_impl(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b,
+        struct ggml_tensor  * c,
+        bool gelu) {
+    GGML_ASSERT(c->type == GGML_TYPE_F32 && ggml_is_contiguous(c) && ggml_nelements(c) == a->ne[1]);
+
+#if defined(GGML_USE_CUBLAS)
+    // the CUDA backend does not know the fused op - keep the matrix multiplication on the GPU
+    struct ggml_tensor * cur = ggml_add(ctx, ggml_mul_mat(ctx, a, b), c);
+
+    return gelu ? ggml_gelu(ctx, cur) : cur;
+#else
+    if (a->grad || b->grad || c->grad) {
+        GGML_ASSERT(false); // TODO: implement backward
+    }
+
+    struct ggml_tensor * result = ggml_mul_mat(ctx, a, b);
+
+    result->op     = GGML_OP_MUL_MAT_BIAS;
+    result->opt[0] = c;
+    result->opt[1] = ggml_new_i32(ctx, gelu ? 1 : 0);
+
+    return result;
+#endif
+}
+
+struct ggml_tensor * ggml_mul_mat_bias(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b,
+        struct ggml_tensor  * c) {
+    return ggml_mul_mat_bias_impl(ctx, a, b, c, false);
+}
+
+struct ggml_tensor * ggml_mul_mat_bias_gelu(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b,
+        struct ggml_tensor  * c) {
+    return ggml_mul_mat_bias_impl(ctx, a, b, c, true);
+}
+
 // ggml_out_prod
 
 struct ggml_tensor * ggml_out_prod(
@@ -6299,7 +6931,7 @@ struct ggml_tensor * ggml_reshape(
         //GGML_ASSERT(false);
     }
 
-    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, b->n_dims, b->ne, a->data);
+    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, b->n_dims, b->ne, a, 0);
     ggml_format_name(result, "%s (reshaped)", a->name);
 
     result->op   = GGML_OP_RESHAPE;
@@ -6324,7 +6956,7 @@ struct ggml_tensor * ggml_reshape_1d(
     }
 
     const int64_t ne[1] = { ne0 };
-    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 1, ne, a->data);
+    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 1, ne, a, 0);
     ggml_format_name(result, "%s (reshaped)", a->name);
 
     result->op   = GGML_OP_RESHAPE;
@@ -6350,7 +6982,7 @@ struct ggml_tensor * ggml_reshape_2d(
     }
 
     const int64_t ne[2] = { ne0, ne1 };
-    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 2, ne, a->data);
+    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 2, ne, a, 0);
     ggml_format_name(result, "%s (reshaped)", a->name);
 
     result->op   = GGML_OP_RESHAPE;
@@ -6377,7 +7009,7 @@ struct ggml_tensor * ggml_reshape_3d(
     }
 
     const int64_t ne[3] = { ne0, ne1, ne2 };
-    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 3, ne, a->data);
+    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 3, ne, a, 0);
     ggml_format_name(result, "%s (reshaped)", a->name);
 
     result->op   = GGML_OP_RESHAPE;
@@ -6406,7 +7038,7 @@ struct ggml_tensor * ggml_reshape_4d(
     }
 
     const int64_t ne[4] = { ne0, ne1, ne2, ne3 };
-    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 4, ne, a->data);
+    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 4, ne, a, 0);
     ggml_format_name(result, "%s (reshaped)", a->name);
 
     result->op   = GGML_OP_RESHAPE;
@@ -6431,7 +7063,7 @@ struct ggml_tensor * ggml_view_1d(
         is_node = true;
     }
 
-    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 1, &ne0, (char *) a->data + offset);
+    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 1, &ne0, a, offset);
     ggml_format_name(result, "%s (view)", a->name);
 
     ggml_scratch_save(ctx);
@@ -6469,7 +7101,7 @@ struct ggml_tensor * ggml_view_2d(
 
     const int64_t ne[GGML_MAX_DIMS] = { ne0, ne1, 1, 1 };
 
-    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 2, ne, (char *) a->data + offset);
+    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 2, ne, a, offset);
     ggml_format_name(result, "%s (view)", a->name);
 
     ggml_scratch_save(ctx);
@@ -6513,7 +7145,7 @@ struct ggml_tensor * ggml_view_3d(
 
     const int64_t ne[GGML_MAX_DIMS] = { ne0, ne1, ne2, 1 };
 
-    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 3, ne, (char *) a->data + offset);
+    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 3, ne, a, offset);
     ggml_format_name(result, "%s (view)", a->name);
 
     ggml_scratch_save(ctx);
@@ -6559,7 +7191,7 @@ struct ggml_tensor * ggml_view_4d(
 
     const int64_t ne[GGML_MAX_DIMS] = { ne0, ne1, ne2, ne3 };
 
-    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 4, ne, (char *) a->data + offset);
+    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 4, ne, a, offset);
     ggml_format_name(result, "%s (view)", a->name);
 
     ggml_scratch_save(ctx);
@@ -7235,6 +7867,38 @@ struct ggml_tensor * ggml_flash_attn(
     return result;
 }
 
+// ggml_flash_attn_ext
+
+struct ggml_tensor * ggml_flash_attn_ext(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * q,
+        struct ggml_tensor  * k,
+        struct ggml_tensor  * v,
+        int                   n_past) {
+    GGML_ASSERT(ggml_can_mul_mat(k, q));
+    GGML_ASSERT(ggml_are_same_shape(k, v));
+    GGML_ASSERT(q->type == GGML_TYPE_F32 || q->type == GGML_TYPE_F16);
+    GGML_ASSERT(k->type == GGML_TYPE_F16 || ggml_is_quantized(k->type));
+    GGML_ASSERT(v->type == GGML_TYPE_F16 || ggml_is_quantized(v->type));
+    GGML_ASSERT(q->ne[0] % GGML_BLCK_SIZE[k->type] == 0);
+    GGML_ASSERT(q->ne[0] % GGML_BLCK_SIZE[v->type] == 0);
+
+    if (q->grad || k->grad || v->grad) {
+        GGML_ASSERT(false); // TODO: implement backward
+    }
+
+    struct ggml_tensor * result = ggml_new_tensor(ctx, GGML_TYPE_F32, 4, q->ne);
+
+    result->op   = GGML_OP_FLASH_ATTN_EXT;
+    result->grad = NULL;
+    result->src0 = q;
+    result->src1 = k;
+    result->opt[0] = v;
+    result->opt[1] = ggml_new_i32(ctx, n_past);
+
+    return result;
+}
+
 // ggml_flash_ff
 
 struct ggml_tensor * ggml_flash_ff(
@@ -7826,7 +8490,7 @@ static void ggml_compute_forward_dup_f16(
                     }
                 }
             } else if (ggml_is_quantized(dst->type)) {
-                quantize_row_q_t const quantize_row_q = quantize_fns[dst->type].quantize_row_q;
+                quantize_row_q_t const quantize_row_q = ggml_cpu.quantize_fns[dst->type].quantize_row_q;
                 float * src0_f32 = (float *) params->wdata + (ne00 + CACHE_LINE_SIZE_F32) * ith;
 
                 size_t id = 0;
@@ -8097,7 +8761,7 @@ static void ggml_compute_forward_dup_f32(
                     }
                 }
             } else if (ggml_is_quantized(dst->type)) {
-                quantize_row_q_t const quantize_row_q = quantize_fns[dst->type].quantize_row_q;
+                quantize_row_q_t const quantize_row_q = ggml_cpu.quantize_fns[dst->type].quantize_row_q;
 
                 size_t id = 0;
                 size_t rs = nb0 * (ne00 / GGML_BLCK_SIZE[dst->type]);
@@ -8311,7 +8975,7 @@ static void ggml_compute_forward_add_f32(
         const struct ggml_tensor * src0,
         const struct ggml_tensor * src1,
         struct ggml_tensor * dst) {
-    GGML_ASSERT(ggml_are_same_shape(src0, src1) && ggml_are_same_shape(src0, dst));
+    GGML_ASSERT(ggml_can_repeat(src1, src0) && ggml_are_same_shape(src0, dst));
 
     if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
         return;
@@ -8334,41 +8998,62 @@ static void ggml_compute_forward_add_f32(
     const int ir0 = dr*ith;
     const int ir1 = MIN(ir0 + dr, nr);
 
-    if (nb10 == sizeof(float)) {
+    if (nb10 == sizeof(float) && ne10 == ne00) {
         for (int ir = ir0; ir < ir1; ++ir) {
-            // src0, src1 and dst are same shape => same indices
+            // src0 and dst are same shape => same indices
+            // src1 is broadcastable across src0 and dst in i1, i2, i3
             const int i3 = ir/(ne2*ne1);
             const int i2 = (ir - i3*ne2*ne1)/ne1;
             const int i1 = (ir - i3*ne2*ne1 - i2*ne1);
 
+            const int i13 = i3 % ne13;
+            const int i12 = i2 % ne12;
+            const int i11 = i1 % ne11;
 
 #ifdef GGML_USE_ACCELERATE
             vDSP_vadd(
                     (float *) ((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01), 1,
-                    (float *) ((char *) src1->data + i3*nb13 + i2*nb12 + i1*nb11), 1,
+                    (float *) ((char *) src1->data + i13*nb13 + i12*nb12 + i11*nb11), 1,
                     (float *) ((char *) dst->data  + i3*nb3  + i2*nb2  + i1*nb1 ), 1,
                     ne0);
 #else
             ggml_vec_add_f32(ne0,
                     (float *) ((char *) dst->data  + i3*nb3  + i2*nb2  + i1*nb1 ),
                     (float *) ((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01),
-                    (float *) ((char *) src1->data + i3*nb13 + i2*nb12 + i1*nb11));
+                    (float *) ((char *) src1->data + i13*nb13 + i12*nb12 + i11*nb11));
 #endif
-                // }
-            // }
+        }
+    } else if (ne10 == 1) {
+        // one value of src1 per row (e.g. per-channel bias of a convolution)
+        for (int ir = ir0; ir < ir1; ++ir) {
+            const int i3 = ir/(ne2*ne1);
+            const int i2 = (ir - i3*ne2*ne1)/ne1;
+            const int i1 = (ir - i3*ne2*ne1 - i2*ne1);
+
+            const int i13 = i3 % ne13;
+            const int i12 = i2 % ne12;
+            const int i11 = i1 % ne11;
+
+            ggml_vec_add1_f32(ne0,
+                    (float *) ((char *) dst->data  + i3*nb3  + i2*nb2  + i1*nb1 ),
+                    (float *) ((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01),
+                    *(float *) ((char *) src1->data + i13*nb13 + i12*nb12 + i11*nb11));
         }
     } else {
-        // src1 is not contiguous
+        // src1 is not contiguous or is repeated within the rows
         for (int ir = ir0; ir < ir1; ++ir) {
-            // src0, src1 and dst are same shape => same indices
             const int i3 = ir/(ne2*ne1);
             const int i2 = (ir - i3*ne2*ne1)/ne1;
             const int i1 = (ir - i3*ne2*ne1 - i2*ne1);
 
+            const int i13 = i3 % ne13;
+            const int i12 = i2 % ne12;
+            const int i11 = i1 % ne11;
+
             float * dst_ptr  = (float *) ((char *) dst->data  + i3*nb3  + i2*nb2  + i1*nb1 );
             float * src0_ptr = (float *) ((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01);
             for (int i0 = 0; i0 < ne0; i0++) {
-                float * src1_ptr = (float *) ((char *) src1->data + i3*nb13 + i2*nb12 + i1*nb11 + i0*nb10);
+                float * src1_ptr = (float *) ((char *) src1->data + i13*nb13 + i12*nb12 + i11*nb11 + (i0 % ne10)*nb10);
 
                 dst_ptr[i0] = src0_ptr[i0] + *src1_ptr;
             }
@@ -8503,8 +9188,8 @@ static void ggml_compute_forward_add_q_f32(
     const int nth = params->nth;
 
     const enum ggml_type type = src0->type;
-    dequantize_row_q_t const dequantize_row_q = quantize_fns[type].dequantize_row_q;
-    quantize_row_q_t const quantize_row_q = quantize_fns[type].quantize_row_q;
+    dequantize_row_q_t const dequantize_row_q = ggml_cpu.quantize_fns[type].dequantize_row_q;
+    quantize_row_q_t const quantize_row_q = ggml_cpu.quantize_fns[type].quantize_row_q;
 
     // we don't support permuted src0 or src1
     GGML_ASSERT(nb00 == GGML_TYPE_SIZE[type]);
@@ -8777,8 +9462,8 @@ static void ggml_compute_forward_add1_q_f32(
     GGML_TENSOR_UNARY_OP_LOCALS;
 
     const enum ggml_type type = src0->type;
-    dequantize_row_q_t const dequantize_row_q = quantize_fns[type].dequantize_row_q;
-    quantize_row_q_t const quantize_row_q = quantize_fns[type].quantize_row_q;
+    dequantize_row_q_t const dequantize_row_q = ggml_cpu.quantize_fns[type].dequantize_row_q;
+    quantize_row_q_t const quantize_row_q = ggml_cpu.quantize_fns[type].quantize_row_q;
 
     // we don't support permuted src0
     GGML_ASSERT(nb00 == GGML_TYPE_SIZE[type]);
@@ -10244,9 +10929,12 @@ static void ggml_compute_forward_silu_back(
 
 // ggml_compute_forward_norm
 
+// w and b are NULL for GGML_OP_NORM
 static void ggml_compute_forward_norm_f32(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
+        const struct ggml_tensor * w,
+        const struct ggml_tensor * b,
         struct ggml_tensor * dst) {
     GGML_ASSERT(ggml_are_same_shape(src0, dst));
 
@@ -10289,6 +10977,13 @@ static void ggml_compute_forward_norm_f32(
                 const float scale = 1.0f/sqrtf(variance + eps);
 
                 ggml_vec_scale_f32(ne00, y, scale);
+
+                // the same operations as ggml_mul and ggml_add, in separate passes over the row, so that the compiler
+                // cannot contract them into an FMA and the result is identical to the unfused graph
+                if (w != NULL) {
+                    ggml_vec_mul_f32(ne00, y, y, (const float *) w->data);
+                    ggml_vec_add_f32(ne00, y, y, (const float *) b->data);
+                }
             }
         }
     }
@@ -10301,7 +10996,7 @@ static void ggml_compute_forward_norm(
     switch (src0->type) {
         case GGML_TYPE_F32:
             {
-                ggml_compute_forward_norm_f32(params, src0, dst);
+                ggml_compute_forward_norm_f32(params, src0, NULL, NULL, dst);
             } break;
         default:
             {
@@ -10310,12 +11005,32 @@ static void ggml_compute_forward_norm(
     }
 }
 
-static void ggml_compute_forward_rms_norm_f32(
+// ggml_compute_forward_norm_affine
+
+static void ggml_compute_forward_norm_affine(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+        const struct ggml_tensor * opt0,
         struct ggml_tensor * dst) {
-    GGML_ASSERT(ggml_are_same_shape(src0, dst));
-
+    switch (src0->type) {
+        case GGML_TYPE_F32:
+            {
+                ggml_compute_forward_norm_f32(params, src0, src1, opt0, dst);
+            } break;
+        default:
+            {
+                GGML_ASSERT(false);
+            } break;
+    }
+}
+
+static void ggml_compute_forward_rms_norm_f32(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        struct ggml_tensor * dst) {
+    GGML_ASSERT(ggml_are_same_shape(src0, dst));
+
     if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
         return;
     }
@@ -10578,6 +11293,52 @@ static bool ggml_compute_forward_mul_mat_use_blas(
 }
 #endif
 
+// GGML_OP_MUL_MAT_BIAS: add the bias of src0 row i01 (and apply the GELU) to the n results of that row,
+// which are stride floats apart in dst, while they are still in the cache
+inline static void ggml_compute_forward_mul_mat_epilogue_row(
+        const struct ggml_tensor * dst,
+        float * y,
+        int64_t n,
+        int64_t stride,
+        int64_t i01) {
+    if (dst->op != GGML_OP_MUL_MAT_BIAS) {
+        return;
+    }
+
+    const float bias = ((const float   *) dst->opt[0]->data)[i01];
+    const bool  gelu = ((const int32_t *) dst->opt[1]->data)[0] != 0;
+
+    for (int64_t i = 0; i < n; ++i) {
+        y[i*stride] += bias;
+        if (gelu) {
+            ggml_vec_gelu_f32(1, &y[i*stride], &y[i*stride]);
+        }
+    }
+}
+
+// same for the whole result, after the BLAS paths
+static void ggml_compute_forward_mul_mat_epilogue(
+        const struct ggml_tensor * dst) {
+    if (dst->op != GGML_OP_MUL_MAT_BIAS) {
+        return;
+    }
+
+    const float * bias = (const float *) dst->opt[0]->data;
+    const bool    gelu = ((const int32_t *) dst->opt[1]->data)[0] != 0;
+
+    const int64_t ne0 = dst->ne[0];
+    const int64_t nr  = ggml_nrows(dst);
+
+    for (int64_t ir = 0; ir < nr; ++ir) {
+        float * y = (float *) ((char *) dst->data + ir*dst->nb[1]);
+
+        ggml_vec_add_f32(ne0, y, y, bias);
+        if (gelu) {
+            ggml_vec_gelu_f32(ne0, y, y);
+        }
+    }
+}
+
 static void ggml_compute_forward_mul_mat_f32(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
@@ -10618,6 +11379,7 @@ static void ggml_compute_forward_mul_mat_f32(
     if (ggml_cl_can_mul_mat(src0, src1, dst)) {
         if (params->ith == 0 && params->type == GGML_TASK_COMPUTE) {
             ggml_cl_mul_mat(src0, src1, dst, params->wdata, params->wsize);
+            ggml_compute_forward_mul_mat_epilogue(dst);
         }
         return;
     }
@@ -10652,6 +11414,8 @@ static void ggml_compute_forward_mul_mat_f32(
         }
         //printf("CBLAS F32 = %f ms, %d x %d x %d x %d\n", (ggml_perf_time_us() - t0)/1000.0, ne0, ne1, ne2, ne3);
 
+        ggml_compute_forward_mul_mat_epilogue(dst);
+
         return;
     }
 #endif
@@ -10694,11 +11458,14 @@ static void ggml_compute_forward_mul_mat_f32(
             const int i2 = i02;
             const int i3 = i03;
 
-            ggml_vec_dot_f32(ne00,
+            ggml_cpu.vec_dot_f32(ne00,
                     (float *) ((char *)  dst->data + (i0*nb0 + i1*nb1 + i2*nb2 + i3*nb3)),
                     (float *) ((char *) src0->data + (i01*nb01 + i02*nb02 + i03*nb03)),
                     (float *) ((char *) src1->data + (i11*nb11 + i12*nb12 + i13*nb13)));
         }
+
+        ggml_compute_forward_mul_mat_epilogue_row(dst,
+                (float *) ((char *) dst->data + (i01*nb0 + i02*nb2 + i03*nb3)), ne11, nb1/sizeof(float), i01);
     }
 
     //int64_t t1 = ggml_perf_time_us();
@@ -10756,6 +11523,7 @@ static void ggml_compute_forward_mul_mat_f16_f32(
     if (ggml_cl_can_mul_mat(src0, src1, dst)) {
         if (params->ith == 0 && params->type == GGML_TASK_COMPUTE) {
             ggml_cl_mul_mat(src0, src1, dst, params->wdata, params->wsize);
+            ggml_compute_forward_mul_mat_epilogue(dst);
         }
         return;
     }
@@ -10807,6 +11575,8 @@ static void ggml_compute_forward_mul_mat_f16_f32(
 
         /*printf("CBLAS F16 = %f ms, %d x %d x %d x %d\n", (ggml_perf_time_us() - t0)/1000.0, ne0, ne1, ne2, ne3);*/
 
+        ggml_compute_forward_mul_mat_epilogue(dst);
+
         return;
     }
 #endif
@@ -10818,6 +11588,11 @@ static void ggml_compute_forward_mul_mat_f16_f32(
         for (int64_t i13 = 0; i13 < ne13; ++i13) {
             for (int64_t i12 = 0; i12 < ne12; ++i12) {
                 for (int64_t i11 = 0; i11 < ne11; ++i11) {
+                    if (nb10 == sizeof(float)) {
+                        ggml_fp32_to_fp16_row((float *)((char *) src1->data + i13*nb13 + i12*nb12 + i11*nb11), wdata + id, ne10);
+                        id += ne10;
+                        continue;
+                    }
                     for (int64_t i10 = 0; i10 < ne10; ++i10) {
                         wdata[id++] = GGML_FP32_TO_FP16(*(float *)((char *) src1->data + i13*nb13 + i12*nb12 + i11*nb11 + i10*nb10));
                     }
@@ -10871,8 +11646,10 @@ static void ggml_compute_forward_mul_mat_f16_f32(
         float * dst_col = (float *) ((char *) dst->data + (i0*nb0 + 0*nb1 + i2*nb2 + i3*nb3));
 
         for (int64_t ic = 0; ic < ne11; ++ic) {
-            ggml_vec_dot_f16(ne00, &dst_col[ic*ne0], src0_row, src1_col + ic*ne00);
+            ggml_cpu.vec_dot_f16(ne00, &dst_col[ic*ne0], src0_row, src1_col + ic*ne00);
         }
+
+        ggml_compute_forward_mul_mat_epilogue_row(dst, dst_col, ne11, ne0, i01);
     }
 
     //int64_t t1 = ggml_time_us();
@@ -10907,9 +11684,10 @@ static void ggml_compute_forward_mul_mat_q_f32(
     GGML_ASSERT(ne3  == ne13);
 
     const enum ggml_type type = src0->type;
-    quantize_row_q_t const quantize_row_q_dot = quantize_fns[type].quantize_row_q_dot;
-    vec_dot_q_t      const vec_dot_q          = quantize_fns[type].vec_dot_q;
-    enum ggml_type   const vec_dot_type       = quantize_fns[type].vec_dot_type;
+    quantize_row_q_t const quantize_row_q_dot = ggml_cpu.quantize_fns[type].quantize_row_q_dot;
+    vec_dot_q_t      const vec_dot_q          = ggml_cpu.quantize_fns[type].vec_dot_q;
+    gemm_q_t         const gemm_q             = ggml_cpu.gemm_q[type];
+    enum ggml_type   const vec_dot_type       = ggml_cpu.quantize_fns[type].vec_dot_type;
 
     // we don't support permuted src0 or src1
     GGML_ASSERT(nb00 == GGML_TYPE_SIZE[type]);
@@ -10933,6 +11711,7 @@ static void ggml_compute_forward_mul_mat_q_f32(
     if (ggml_cl_can_mul_mat(src0, src1, dst)) {
         if (params->ith == 0 && params->type == GGML_TASK_COMPUTE) {
             ggml_cl_mul_mat(src0, src1, dst, params->wdata, params->wsize);
+            ggml_compute_forward_mul_mat_epilogue(dst);
         }
         return;
     }
@@ -10953,7 +11732,7 @@ static void ggml_compute_forward_mul_mat_q_f32(
         }
 
         float * const wdata = params->wdata;
-        dequantize_row_q_t const dequantize_row_q = quantize_fns[type].dequantize_row_q;
+        dequantize_row_q_t const dequantize_row_q = ggml_cpu.quantize_fns[type].dequantize_row_q;
 
         for (int64_t i03 = 0; i03 < ne03; i03++) {
             for (int64_t i02 = 0; i02 < ne02; i02++) {
@@ -10983,6 +11762,8 @@ static void ggml_compute_forward_mul_mat_q_f32(
 
         //printf("CBLAS = %f ms, %d x %d x %d x %d\n", (ggml_perf_time_us() - t0)/1000.0, ne0, ne1, ne2, ne3);
 
+        ggml_compute_forward_mul_mat_epilogue(dst);
+
         return;
     }
 #endif
@@ -11022,6 +11803,55 @@ static void ggml_compute_forward_mul_mat_q_f32(
     void * wdata = params->wdata;
     const size_t row_size = ne00*GGML_TYPE_SIZE[vec_dot_type]/GGML_BLCK_SIZE[vec_dot_type];
 
+    if (ne11 >= GGML_GEMM_Q_MIN_N) {
+        // large batch (e.g. the encoder) - blocks of GGML_GEMM_Q_BLCK src0 rows stay in the cache while all the
+        // columns of src1 stream past them, in tiles of GGML_GEMM_Q_RM x GGML_GEMM_Q_RN dot products
+        // the full tiles use gemm_q when the type has a kernel on this CPU, everything else vec_dot_q
+        for (int ir = ir0; ir < ir1; ) {
+            const int i03 = ir/(ne02*ne01);
+            const int i02 = (ir - i03*ne02*ne01)/ne01;
+            const int i01 = (ir - i03*ne02*ne01 - i02*ne01);
+
+            // the rows of a block share i02 and i03
+            const int nrb = MIN(MIN(ir1 - ir, ne01 - i01), GGML_GEMM_Q_BLCK);
+
+            const char * src0_row = (const char *) src0->data + (i01*nb01 + i02*nb02 + i03*nb03);
+            const char * src1_col = (const char *)      wdata + ((0 + i02*ne11 + i03*ne12*ne11)*row_size);
+
+            float * dst_col = (float *) ((char *) dst->data + (i01*nb0 + 0*nb1 + i02*nb2 + i03*nb3));
+
+            assert(ne00 % 32 == 0);
+
+            for (int64_t ic = 0; ic < ne11; ic += GGML_GEMM_Q_RN) {
+                const int nc = MIN(ne11 - ic, GGML_GEMM_Q_RN);
+
+                for (int r = 0; r < nrb; r += GGML_GEMM_Q_RM) {
+                    const int nrr = MIN(nrb - r, GGML_GEMM_Q_RM);
+
+                    if (gemm_q && nrr == GGML_GEMM_Q_RM && nc == GGML_GEMM_Q_RN) {
+                        gemm_q(ne00, &dst_col[ic*ne0 + r], ne0, src0_row + r*nb01, nb01, src1_col + ic*row_size, row_size);
+                        continue;
+                    }
+
+                    // edges of the tiles, or no kernel for this type / CPU
+                    for (int c = 0; c < nc; ++c) {
+                        for (int rr = 0; rr < nrr; ++rr) {
+                            vec_dot_q(ne00, &dst_col[(ic + c)*ne0 + r + rr], src0_row + (r + rr)*nb01, src1_col + (ic + c)*row_size);
+                        }
+                    }
+                }
+            }
+
+            for (int r = 0; r < nrb; ++r) {
+                ggml_compute_forward_mul_mat_epilogue_row(dst, dst_col + r, ne11, ne0, i01 + r);
+            }
+
+            ir += nrb;
+        }
+
+        return;
+    }
+
     for (int ir = ir0; ir < ir1; ++ir) {
         // src0 indices
         const int i03 = ir/(ne02*ne01);
@@ -11045,6 +11875,8 @@ static void ggml_compute_forward_mul_mat_q_f32(
         for (int64_t ic = 0; ic < ne11; ++ic) {
             vec_dot_q(ne00, &dst_col[ic*ne0], src0_row, (void *) (src1_col + ic*row_size));
         }
+
+        ggml_compute_forward_mul_mat_epilogue_row(dst, dst_col, ne11, ne0, i01);
     }
 
     //int64_t t1 = ggml_time_us();
@@ -11184,7 +12016,7 @@ static void ggml_compute_forward_out_prod_f32(
             float * s1 = (float *) ((char *) src1->data + (i1*nb10 + i11*nb11 + i12*nb12 + i13*nb13));
             float * d  = (float *) ((char *)  dst->data + (          i1*nb1 + i2*nb2 + i3*nb3));
 
-            ggml_vec_mad_f32(ne0, d, s0, *s1);
+            ggml_cpu.vec_mad_f32(ne0, d, s0, *s1);
             // for (int64_t i0 = 0; i0 < ne0; ++i0) {
             //     d[i0] += s0[i0] * s1[i1];
             // }
@@ -11483,7 +12315,7 @@ static void ggml_compute_forward_get_rows_q(
     const int nc = src0->ne[0];
     const int nr = ggml_nelements(src1);
     const enum ggml_type type = src0->type;
-    dequantize_row_q_t const dequantize_row_q = quantize_fns[type].dequantize_row_q;
+    dequantize_row_q_t const dequantize_row_q = ggml_cpu.quantize_fns[type].dequantize_row_q;
 
     assert( dst->ne[0] == nc);
     assert( dst->ne[1] == nr);
@@ -11909,21 +12741,7 @@ static void ggml_compute_forward_soft_max_f32(
         float max = -INFINITY;
         ggml_vec_max_f32(nc, &max, sp);
 
-        ggml_float sum = 0.0;
-
-        uint16_t scvt;
-        for (int i = 0; i < nc; i++) {
-            if (sp[i] == -INFINITY) {
-                dp[i] = 0.0f;
-            } else {
-                // const float val = (sp[i] == -INFINITY) ? 0.0 : exp(sp[i] - max);
-                ggml_fp16_t s = GGML_FP32_TO_FP16(sp[i] - max);
-                memcpy(&scvt, &s, sizeof(scvt));
-                const float val = GGML_FP16_TO_FP32(table_exp_f16[scvt]);
-                sum += (ggml_float)val;
-                dp[i] = val;
-            }
-        }
+        ggml_float sum = ggml_cpu.vec_soft_max_f32(nc, dp, sp, max);
 
         assert(sum > 0.0);
 
@@ -12877,7 +13695,7 @@ static void ggml_compute_forward_conv_1d_s1_ph_f16_f32(
             dst_data[i0] = 0;
             for (int k = -nh; k <= nh; k++) {
                 float v = 0.0f;
-                ggml_vec_dot_f16(ew0, &v,
+                ggml_cpu.vec_dot_f16(ew0, &v,
                         (ggml_fp16_t *) params->wdata +   i1*ew0*ne00 +      (nh + k)*ew0,
                         (ggml_fp16_t *) params->wdata + ne02*ew0*ne00 + (i0 + nh + k)*ew0);
 
@@ -12968,7 +13786,7 @@ static void ggml_compute_forward_conv_1d_s1_ph_f32(
             dst_data[i0] = 0;
             for (int k = -nh; k <= nh; k++) {
                 float v = 0.0f;
-                ggml_vec_dot_f32(ew0, &v,
+                ggml_cpu.vec_dot_f32(ew0, &v,
                         (float *) params->wdata +   i1*ew0*ne00 +      (nh + k)*ew0,
                         (float *) params->wdata + ne02*ew0*ne00 + (i0 + nh + k)*ew0);
 
@@ -13080,7 +13898,7 @@ static void ggml_compute_forward_conv_1d_s2_ph_f16_f32(
             dst_data[i0/2] = 0;
             for (int k = -nh; k <= nh; k++) {
                 float v = 0.0f;
-                ggml_vec_dot_f16(ew0, &v,
+                ggml_cpu.vec_dot_f16(ew0, &v,
                         (ggml_fp16_t *) params->wdata +   i1*ew0*ne00 +      (nh + k)*ew0,
                         (ggml_fp16_t *) params->wdata + ne02*ew0*ne00 + (i0 + nh + k)*ew0);
 
@@ -13171,7 +13989,7 @@ static void ggml_compute_forward_conv_1d_s2_ph_f32(
             dst_data[i0/2] = 0;
             for (int k = -nh; k <= nh; k++) {
                 float v = 0.0f;
-                ggml_vec_dot_f32(ew0, &v,
+                ggml_cpu.vec_dot_f32(ew0, &v,
                         (float *) params->wdata +   i1*ew0*ne00 +      (nh + k)*ew0,
                         (float *) params->wdata + ne02*ew0*ne00 + (i0 + nh + k)*ew0);
 
@@ -13301,7 +14119,7 @@ static void ggml_compute_forward_conv_2d_sk_p0_f16_f32(
 
         for (int i1 = 0; i1 < ne1; ++i1) {
             for (int i0 = 0; i0 < ne0; ++i0) {
-                ggml_vec_dot_f16(ew0, dst_data + i1*ne0 + i0,
+                ggml_cpu.vec_dot_f16(ew0, dst_data + i1*ne0 + i0,
                         (ggml_fp16_t *) ((char *) src0->data + i2*nb03),
                         (ggml_fp16_t *)                wdata + (i1*ne0 + i0)*ew0);
             }
@@ -13457,7 +14275,7 @@ static void ggml_compute_forward_flash_attn_f32(
             // S indices
             const int i1 = ik1;
 
-            ggml_vec_dot_f32(neq0,
+            ggml_cpu.vec_dot_f32(neq0,
                     S + i1,
                     (float *) ((char *) k->data + (ik1*nbk1 + ik2*nbk2 + ik3*nbk3)),
                     (float *) ((char *) q->data + (iq1*nbq1 + iq2*nbq2 + iq3*nbq3)));
@@ -13499,7 +14317,7 @@ static void ggml_compute_forward_flash_attn_f32(
                         } else {
                             ggml_fp16_t s = GGML_FP32_TO_FP16(SS[j] - max);
                             memcpy(&scvt[j], &s, sizeof(uint16_t));
-                            const float val = GGML_FP16_TO_FP32(table_exp_f16[scvt[j]]);
+                            const float val = GGML_FP16_TO_FP32(ggml_table_exp_f16[scvt[j]]);
                             sump[j] += (ggml_float)val;
                             SS[j] = val;
                         }
@@ -13531,7 +14349,7 @@ static void ggml_compute_forward_flash_attn_f32(
             const int i2 = iq2;
             const int i3 = iq3;
 
-            ggml_vec_dot_f32(nek1,
+            ggml_cpu.vec_dot_f32(nek1,
                     (float *) ((char *) dst->data + (ic*nb0 + i1*nb1  + i2*nb2  + i3*nb3)),
                     (float *) ((char *) v->data   + (         ic*nbv1 + i2*nbv2 + i3*nbv3)),
                     S);
@@ -13539,12 +14357,27 @@ static void ggml_compute_forward_flash_attn_f32(
     }
 }
 
-static void ggml_compute_forward_flash_attn_f16(
+// converts a row of n fp16 or quantized K or V values to fp32
+inline static void ggml_flash_attn_row_to_f32(const enum ggml_type type, const void * restrict x, float * restrict y, const int n) {
+    if (type == GGML_TYPE_F16) {
+        ggml_cpu.fp16_to_fp32_row((const ggml_fp16_t *) x, y, n);
+    } else {
+        ggml_cpu.quantize_fns[type].dequantize_row_q(x, y, n);
+    }
+}
+
+// flash attention one query row at a time with fp16 or quantized K and V - for a few rows (e.g. decoding), where the
+// tiles of ggml_compute_forward_flash_attn_f16 would mostly compute padding
+//
+// v_trans: V is transposed - [M, D, H] (ggml_flash_attn) instead of one row per key [D, M, H] (ggml_flash_attn_ext)
+// n_past:  query row i attends to the keys up to n_past + i, all the keys if negative
+static void ggml_compute_forward_flash_attn_f16_rows(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * q,
         const struct ggml_tensor * k,
         const struct ggml_tensor * v,
-        const bool masked,
+        const bool v_trans,
+        const int64_t n_past,
              struct ggml_tensor * dst) {
     int64_t t0 = ggml_perf_time_us();
     UNUSED(t0);
@@ -13563,26 +14396,29 @@ static void ggml_compute_forward_flash_attn_f16(
 
     const int64_t D = neq0;
     const int64_t N = neq1;
-    const int64_t P = nek1 - N;
-    const int64_t M = P + N;
+    const int64_t M = nek1;
 
     const int Mup = ggml_up(M, GGML_SOFT_MAX_UNROLL);
 
     GGML_ASSERT(ne0 == D);
     GGML_ASSERT(ne1 == N);
-    GGML_ASSERT(P >= 0);
 
-    GGML_ASSERT(nbq0 == sizeof(ggml_fp16_t));
-    GGML_ASSERT(nbk0 == sizeof(ggml_fp16_t));
-    GGML_ASSERT(nbv0 == sizeof(ggml_fp16_t));
+    GGML_ASSERT(nbq0 == ggml_type_size(q->type));
+    GGML_ASSERT(nbk0 == ggml_type_size(k->type));
+    GGML_ASSERT(nbv0 == ggml_type_size(v->type));
 
     GGML_ASSERT(neq0 == D);
     GGML_ASSERT(nek0 == D);
-    GGML_ASSERT(nev1 == D);
 
-    GGML_ASSERT(neq1 == N);
-    GGML_ASSERT(nek1 == N + P);
-    GGML_ASSERT(nev1 == D);
+    if (v_trans) {
+        GGML_ASSERT(k->type == GGML_TYPE_F16);
+        GGML_ASSERT(v->type == GGML_TYPE_F16);
+        GGML_ASSERT(nev0 == M);
+        GGML_ASSERT(nev1 == D);
+    } else {
+        GGML_ASSERT(nev0 == D);
+        GGML_ASSERT(nev1 == M);
+    }
 
     // dst cannot be transposed or permuted
     GGML_ASSERT(nb0 == sizeof(float));
@@ -13598,7 +14434,7 @@ static void ggml_compute_forward_flash_attn_f16(
         return;
     }
 
-    // parallelize by q rows using ggml_vec_dot_f32
+    // parallelize by q rows using ggml_vec_dot_f16 or the vec_dot_q of the K type
 
     // total rows in q
     const int nr = neq1*neq2*neq3;
@@ -13612,7 +14448,7 @@ static void ggml_compute_forward_flash_attn_f16(
 
     const float scale = 1.0f/sqrtf(D);
 
-    //printf("P=%d N=%d D=%d ir0=%d ir1=%d scale = %f\n", P, N, D, ir0, ir1, scale);
+    //printf("n_past=%d N=%d D=%d ir0=%d ir1=%d scale = %f\n", n_past, N, D, ir0, ir1, scale);
 
     for (int ir = ir0; ir < ir1; ++ir) {
         // q indices
@@ -13620,53 +14456,62 @@ static void ggml_compute_forward_flash_attn_f16(
         const int iq2 = (ir - iq3*neq2*neq1)/neq1;
         const int iq1 = (ir - iq3*neq2*neq1 - iq2*neq1);
 
-        float * S = (float *) params->wdata + ith*(2*Mup + CACHE_LINE_SIZE_F32);
+        // see GGML_FLASH_ATTN_WSIZE_ROWS
+        float * S  = (float *) params->wdata + ith*(GGML_FLASH_ATTN_WSIZE_ROWS(D, M) + CACHE_LINE_SIZE_F32);
+        void  * Qd = S + 2*Mup;         // the q row in the vec_dot type of K
+        float * Vf = S + 2*Mup + D;     // a V row in fp32
 
-        for (int i = M; i < Mup; ++i) {
-            S[i] = -INFINITY;
-        }
+        char * q_row = (char *) q->data + (iq1*nbq1 + iq2*nbq2 + iq3*nbq3);
 
-        if (GGML_VEC_DOT_UNROLL > 2 || nek1 % GGML_VEC_DOT_UNROLL != 0) {
-            for (int64_t ic = 0; ic < nek1; ++ic) {
-                // k indices
-                const int ik3 = iq3;
-                const int ik2 = iq2;
-                const int ik1 = ic;
+        // keys this row attends to - the masked ones are not computed
+        const int64_t nk = n_past < 0 ? M : MIN(M, n_past + iq1 + 1);
 
-                // S indices
-                const int i1 = ik1;
+        if (k->type == GGML_TYPE_F16) {
+            ggml_fp16_t * Q16 = (ggml_fp16_t *) Qd;
 
-                ggml_vec_dot_f16(neq0,
-                        S + i1,
-                        (ggml_fp16_t *) ((char *) k->data + (ik1*nbk1 + ik2*nbk2 + ik3*nbk3)),
-                        (ggml_fp16_t *) ((char *) q->data + (iq1*nbq1 + iq2*nbq2 + iq3*nbq3)));
+            if (q->type == GGML_TYPE_F16) {
+                Q16 = (ggml_fp16_t *) q_row;
+            } else {
+                ggml_cpu.fp32_to_fp16_row((const float *) q_row, Q16, D);
+            }
+
+            if (GGML_VEC_DOT_UNROLL > 2 || nk % GGML_VEC_DOT_UNROLL != 0) {
+                for (int64_t ic = 0; ic < nk; ++ic) {
+                    ggml_cpu.vec_dot_f16(neq0,
+                            S + ic,
+                            (ggml_fp16_t *) ((char *) k->data + (ic*nbk1 + iq2*nbk2 + iq3*nbk3)),
+                            Q16);
+                }
+            } else {
+                for (int64_t ic = 0; ic < nk; ic += GGML_VEC_DOT_UNROLL) {
+                    ggml_cpu.vec_dot_f16_unroll(neq0, nbk1,
+                            S + ic,
+                            ((char *) k->data + (ic*nbk1 + iq2*nbk2 + iq3*nbk3)),
+                            Q16);
+                }
             }
         } else {
-            for (int64_t ic = 0; ic < nek1; ic += GGML_VEC_DOT_UNROLL) {
-                // k indices
-                const int ik3 = iq3;
-                const int ik2 = iq2;
-                const int ik1 = ic;
+            const quantize_fns_t * qf = &ggml_cpu.quantize_fns[k->type];
 
-                // S indices
-                const int i1 = ik1;
+            const float * Q32 = (const float *) q_row;
 
-                ggml_vec_dot_f16_unroll(neq0, nbk1,
-                        S + i1,
-                        ((char *) k->data + (ik1*nbk1 + ik2*nbk2 + ik3*nbk3)),
-                        (ggml_fp16_t *) ((char *) q->data + (iq1*nbq1 + iq2*nbq2 + iq3*nbq3)));
+            if (q->type == GGML_TYPE_F16) {
+                ggml_cpu.fp16_to_fp32_row((const ggml_fp16_t *) q_row, Vf, D);
+                Q32 = Vf;
+            }
+
+            qf->quantize_row_q_dot(Q32, Qd, D);
+
+            for (int64_t ic = 0; ic < nk; ++ic) {
+                qf->vec_dot_q(neq0, S + ic, (const char *) k->data + (ic*nbk1 + iq2*nbk2 + iq3*nbk3), Qd);
             }
         }
 
         // scale
-        ggml_vec_scale_f32(nek1, S, scale);
+        ggml_vec_scale_f32(nk, S, scale);
 
-        if (masked) {
-            for (int64_t i = P; i < M; i++) {
-                if (i > P + iq1) {
-                    S[i] = -INFINITY;
-                }
-            }
+        for (int64_t i = nk; i < Mup; ++i) {
+            S[i] = -INFINITY;
         }
 
         // softmax
@@ -13694,7 +14539,7 @@ static void ggml_compute_forward_flash_attn_f16(
                         } else {
                             ggml_fp16_t s = GGML_FP32_TO_FP16(SS[j] - max);
                             memcpy(&scvt[j], &s, sizeof(uint16_t));
-                            const float val = GGML_FP16_TO_FP32(table_exp_f16[scvt[j]]);
+                            const float val = GGML_FP16_TO_FP32(ggml_table_exp_f16[scvt[j]]);
                             sump[j] += (ggml_float)val;
                             SS[j] = val;
                         }
@@ -13720,115 +14565,101 @@ static void ggml_compute_forward_flash_attn_f16(
 #endif
         }
 
-        ggml_fp16_t * S16 = (ggml_fp16_t *) ((float *) params->wdata + ith*(2*Mup + CACHE_LINE_SIZE_F32) + Mup);
+        float * dst_row = (float *) ((char *) dst->data + (iq1*nb1 + iq2*nb2 + iq3*nb3));
 
-        for (int64_t i = 0; i < M; i++) {
+        if (!v_trans) {
+            // dst = sum_j S[j]*V[j]
+            ggml_vec_set_f32(D, dst_row, 0.0f);
+
+            for (int64_t ic = 0; ic < nk; ++ic) {
+                if (S[ic] == 0.0f) {
+                    continue;
+                }
+
+                ggml_flash_attn_row_to_f32(v->type, (const char *) v->data + (ic*nbv1 + iq2*nbv2 + iq3*nbv3), Vf, D);
+                ggml_cpu.vec_mad_f32(D, dst_row, Vf, S[ic]);
+            }
+
+            continue;
+        }
+
+        ggml_fp16_t * S16 = (ggml_fp16_t *) (S + Mup);
+
+        for (int64_t i = 0; i < nk; i++) {
             S16[i] = GGML_FP32_TO_FP16(S[i]);
         }
 
         if (GGML_VEC_DOT_UNROLL == 1 || (nev1 % GGML_VEC_DOT_UNROLL != 0)) {
             for (int64_t ic = 0; ic < nev1; ++ic) {
-                // dst indices
-                const int i1 = iq1;
-                const int i2 = iq2;
-                const int i3 = iq3;
-
-                ggml_vec_dot_f16(nek1,
-                        (float *)       ((char *) dst->data + (ic*nb0 + i1*nb1  + i2*nb2  + i3*nb3)),
-                        (ggml_fp16_t *) ((char *) v->data   + (         ic*nbv1 + i2*nbv2 + i3*nbv3)),
+                ggml_cpu.vec_dot_f16(nk,
+                        dst_row + ic,
+                        (ggml_fp16_t *) ((char *) v->data + (ic*nbv1 + iq2*nbv2 + iq3*nbv3)),
                         S16);
             }
         } else {
             for (int64_t ic = 0; ic < nev1; ic += GGML_VEC_DOT_UNROLL) {
-                // dst indices
-                const int i1 = iq1;
-                const int i2 = iq2;
-                const int i3 = iq3;
-
-                ggml_vec_dot_f16_unroll(nek1, nbv1,
-                        (float *) ((char *) dst->data + (ic*nb0 + i1*nb1  + i2*nb2  + i3*nb3)),
-                        ((char *) v->data   + (         ic*nbv1 + i2*nbv2 + i3*nbv3)),
+                ggml_cpu.vec_dot_f16_unroll(nk, nbv1,
+                        dst_row + ic,
+                        ((char *) v->data + (ic*nbv1 + iq2*nbv2 + iq3*nbv3)),
                         S16);
             }
         }
     }
 }
-
-static void ggml_compute_forward_flash_attn(
+// tiled flash attention with fp16 or quantized K and V (Q fp16 or fp32) - the scores and the output are accumulated
+// in fp32
+//
+// each task takes blocks of GGML_FLASH_ATTN_BQ query rows of one head and runs them over tiles of
+// GGML_FLASH_ATTN_BK keys. the K and V tiles are converted once and reused by all the rows of the block while
+// they are in the cache. the softmax is computed online: the running max and sum of each row rescale the
+// accumulated output whenever a tile raises the max, so the full KQ rows are never stored
+//
+// v_trans and n_past as in ggml_compute_forward_flash_attn_f16_rows
+static void ggml_compute_forward_flash_attn_f16(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * q,
         const struct ggml_tensor * k,
         const struct ggml_tensor * v,
-        const bool masked,
-        struct ggml_tensor * dst) {
-    switch (q->type) {
-        case GGML_TYPE_F16:
-            {
-                ggml_compute_forward_flash_attn_f16(params, q, k, v, masked, dst);
-            } break;
-        case GGML_TYPE_F32:
-            {
-                ggml_compute_forward_flash_attn_f32(params, q, k, v, masked, dst);
-            } break;
-        default:
-            {
-                GGML_ASSERT(false);
-            } break;
-    }
-}
-
-// ggml_compute_forward_flash_ff
-
-static void ggml_compute_forward_flash_ff_f16(
-        const struct ggml_compute_params * params,
-        const struct ggml_tensor * a,  // F16
-        const struct ggml_tensor * b0, // F16 fc_w
-        const struct ggml_tensor * b1, // F32 fc_b
-        const struct ggml_tensor * c0, // F16 proj_w
-        const struct ggml_tensor * c1, // F32 proj_b
-        struct ggml_tensor * dst) {
+        const bool v_trans,
+        const int64_t n_past,
+             struct ggml_tensor * dst) {
     int64_t t0 = ggml_perf_time_us();
     UNUSED(t0);
 
-    GGML_TENSOR_LOCALS(int64_t, nea,  a,   ne);
-    GGML_TENSOR_LOCALS(size_t,  nba,  a,   nb);
-    GGML_TENSOR_LOCALS(int64_t, neb0, b0,  ne);
-    GGML_TENSOR_LOCALS(size_t,  nbb0, b0,  nb);
-    GGML_TENSOR_LOCALS(int64_t, neb1, b1,  ne);
-    GGML_TENSOR_LOCALS(size_t,  nbb1, b1,  nb);
-    GGML_TENSOR_LOCALS(int64_t, nec0, c0,  ne);
-    GGML_TENSOR_LOCALS(size_t,  nbc0, c0,  nb);
-    GGML_TENSOR_LOCALS(int64_t, nec1, c1,  ne);
-    GGML_TENSOR_LOCALS(size_t,  nbc1, c1,  nb);
-    GGML_TENSOR_LOCALS(int64_t, ne,   dst, ne);
-    GGML_TENSOR_LOCALS(size_t,  nb,   dst, nb);
+    GGML_TENSOR_LOCALS(int64_t, neq, q,   ne);
+    GGML_TENSOR_LOCALS(size_t,  nbq, q,   nb);
+    GGML_TENSOR_LOCALS(int64_t, nek, k,   ne);
+    GGML_TENSOR_LOCALS(size_t,  nbk, k,   nb);
+    GGML_TENSOR_LOCALS(int64_t, nev, v,   ne);
+    GGML_TENSOR_LOCALS(size_t,  nbv, v,   nb);
+    GGML_TENSOR_LOCALS(int64_t, ne,  dst, ne);
+    GGML_TENSOR_LOCALS(size_t,  nb,  dst, nb);
 
     const int ith = params->ith;
     const int nth = params->nth;
 
-    const int64_t D = nea0;
-    //const int64_t N = nea1;
-    const int64_t M = neb01;
+    const int64_t D = neq0;
+    const int64_t N = neq1;
+    const int64_t M = nek1;
 
-    GGML_ASSERT(ne0 == nea0);
-    GGML_ASSERT(ne1 == nea1);
-    GGML_ASSERT(ne2 == nea2);
+    GGML_ASSERT(ne0 == D);
+    GGML_ASSERT(ne1 == N);
 
-    GGML_ASSERT(nba0  == sizeof(ggml_fp16_t));
-    GGML_ASSERT(nbb00 == sizeof(ggml_fp16_t));
-    GGML_ASSERT(nbb10 == sizeof(float));
-    GGML_ASSERT(nbc00 == sizeof(ggml_fp16_t));
-    GGML_ASSERT(nbc10 == sizeof(float));
+    GGML_ASSERT(nbq0 == ggml_type_size(q->type));
+    GGML_ASSERT(nbk0 == ggml_type_size(k->type));
+    GGML_ASSERT(nbv0 == ggml_type_size(v->type));
 
-    GGML_ASSERT(neb00 == D);
-    GGML_ASSERT(neb01 == M);
-    GGML_ASSERT(neb10 == M);
-    GGML_ASSERT(neb11 == 1);
+    GGML_ASSERT(neq0 == D);
+    GGML_ASSERT(nek0 == D);
 
-    GGML_ASSERT(nec00 == M);
-    GGML_ASSERT(nec01 == D);
-    GGML_ASSERT(nec10 == D);
-    GGML_ASSERT(nec11 == 1);
+    if (v_trans) {
+        GGML_ASSERT(v->type == GGML_TYPE_F16);
+        GGML_ASSERT(nev0 == M);
+        GGML_ASSERT(nev1 == D);
+    } else {
+        GGML_ASSERT(nev0 == D);
+        GGML_ASSERT(nev1 == M);
+    }
 
     // dst cannot be transposed or permuted
     GGML_ASSERT(nb0 == sizeof(float));
@@ -13844,47 +14675,317 @@ static void ggml_compute_forward_flash_ff_f16(
         return;
     }
 
-    // parallelize by a rows using ggml_vec_dot_f32
+    const int BQ = GGML_FLASH_ATTN_BQ;
+    const int BK = GGML_FLASH_ATTN_BK;
 
-    // total rows in a
-    const int nr = nea1*nea2*nea3;
+    // parallelize by blocks of q rows of the same head
 
-    // rows per thread
+    // blocks per head
+    const int nbh = (N + BQ - 1)/BQ;
+
+    // total blocks
+    const int nr = nbh*neq2*neq3;
+
+    // blocks per thread
     const int dr = (nr + nth - 1)/nth;
 
-    // row range for this thread
+    // block range for this thread
     const int ir0 = dr*ith;
     const int ir1 = MIN(ir0 + dr, nr);
 
+    const float scale = 1.0f/sqrtf(D);
+
+    // work buffer of this thread, see GGML_FLASH_ATTN_WSIZE
+    float * Qt = (float *) params->wdata + ith*(GGML_FLASH_ATTN_WSIZE(D) + CACHE_LINE_SIZE_F32);
+    float * S  = Qt + D*BQ; // [BK][BQ] scores, then probabilities
+    float * Kf = S  + BK*BQ; // [BK][D]  K tile
+    float * Vf = Kf + BK*D;  // [D][BK]  V tile (transposed) - [BK][D] if V has one row per key
+    float * Ot = Vf + D*BK;  // [D][BQ]  output accumulators
+    float * m  = Ot + D*BQ;  // [BQ]     running max
+    float * l  = m  + BQ;    // [BQ]     running sum
+    float * ms = l  + BQ;    // [BQ]     rescale of the output
+
     for (int ir = ir0; ir < ir1; ++ir) {
-        // a indices
-        const int ia3 = ir/(nea2*nea1);
-        const int ia2 = (ir - ia3*nea2*nea1)/nea1;
-        const int ia1 = (ir - ia3*nea2*nea1 - ia2*nea1);
+        // q indices
+        const int iq3 = ir/(neq2*nbh);
+        const int iq2 = (ir - iq3*neq2*nbh)/nbh;
+        const int iq1 = (ir - iq3*neq2*nbh - iq2*nbh)*BQ;
 
-        float * S = (float *) params->wdata + ith*(2*M + CACHE_LINE_SIZE_F32);
+        // rows of the block, the other lanes are computed with zero queries and ignored
+        const int nq = MIN(BQ, N - iq1);
 
-        for (int64_t ic = 0; ic < neb01; ++ic) {
-            // b0 indices
-            const int ib03 = ia3;
-            const int ib02 = ia2;
-            const int ib01 = ic;
+        for (int r = 0; r < BQ; ++r) {
+            const char * q_row = (const char *) q->data + ((iq1 + r)*nbq1 + iq2*nbq2 + iq3*nbq3);
 
-            // S indices
-            const int i1 = ib01;
+            for (int64_t d = 0; d < D; ++d) {
+                float qd = 0.0f;
+                if (r < nq) {
+                    qd = q->type == GGML_TYPE_F16 ? GGML_FP16_TO_FP32(((const ggml_fp16_t *) q_row)[d]) : ((const float *) q_row)[d];
+                }
+                Qt[d*BQ + r] = qd*scale;
+            }
 
-            ggml_vec_dot_f16(nea0,
-                    S + i1,
-                    (ggml_fp16_t *) ((char *) b0->data + (ib01*nbb01 + ib02*nbb02 + ib03*nbb03)),
-                    (ggml_fp16_t *) ((char *)  a->data + ( ia1*nba1  +  ia2*nba2  +  ia3*nba3)));
+            m[r] = -INFINITY;
+            l[r] = 0.0f;
         }
 
-        ggml_vec_add_f32(neb01, S, S, (float *) b1->data);
-        //ggml_vec_gelu_f32(neb01, S, S);
+        ggml_vec_set_f32(D*BQ, Ot, 0.0f);
 
-        ggml_fp16_t * S16 = (ggml_fp16_t *) ((float *) params->wdata + ith*(2*M + CACHE_LINE_SIZE_F32) + M);
+        // with the causal mask, row iq1 + r sees the keys up to n_past + iq1 + r
+        const int64_t nk = n_past < 0 ? M : MIN(M, n_past + iq1 + nq);
 
-        for (int64_t i = 0; i < M; i++) {
+        for (int64_t ik0 = 0; ik0 < nk; ik0 += BK) {
+            const int kn = MIN(BK, nk - ik0);
+
+            for (int j = 0; j < kn; ++j) {
+                ggml_flash_attn_row_to_f32(k->type, (const char *) k->data + ((ik0 + j)*nbk1 + iq2*nbk2 + iq3*nbk3), Kf + j*D, D);
+            }
+
+            ggml_cpu.flash_attn_qk_f32(D, kn, S, Kf, D, Qt);
+
+            if (n_past >= 0 && ik0 + kn > n_past + iq1 + 1) {
+                for (int j = 0; j < kn; ++j) {
+                    for (int r = 0; r < BQ; ++r) {
+                        if (ik0 + j > n_past + iq1 + r) {
+                            S[j*BQ + r] = -INFINITY;
+                        }
+                    }
+                }
+            }
+
+            // online softmax - the first key is never masked, so the max of each row is finite
+            bool rescale = false;
+
+            for (int r = 0; r < BQ; ++r) {
+                float max = m[r];
+                for (int j = 0; j < kn; ++j) {
+                    max = MAX(max, S[j*BQ + r]);
+                }
+
+                ms[r] = max == m[r] ? 1.0f : expf(m[r] - max);
+                m [r] = max;
+
+                rescale = rescale || ms[r] != 1.0f;
+            }
+
+            for (int r = 0; r < BQ; ++r) {
+                ggml_float sum = 0.0;
+
+                uint16_t scvt;
+                for (int j = 0; j < kn; ++j) {
+                    float * s = S + j*BQ + r;
+                    if (*s == -INFINITY) {
+                        *s = 0.0f;
+                    } else {
+                        ggml_fp16_t h = GGML_FP32_TO_FP16(*s - m[r]);
+                        memcpy(&scvt, &h, sizeof(scvt));
+                        *s = GGML_FP16_TO_FP32(ggml_table_exp_f16[scvt]);
+                        sum += (ggml_float) *s;
+                    }
+                }
+
+                l[r] = l[r]*ms[r] + (float) sum;
+            }
+
+            if (rescale) {
+                for (int64_t d = 0; d < D; ++d) {
+                    ggml_vec_mul_f32(BQ, Ot + d*BQ, Ot + d*BQ, ms);
+                }
+            }
+
+            // O += P V
+            if (v_trans) {
+                for (int64_t d = 0; d < D; ++d) {
+                    ggml_cpu.fp16_to_fp32_row((const ggml_fp16_t *) ((const char *) v->data + (ik0*nbv0 + d*nbv1 + iq2*nbv2 + iq3*nbv3)), Vf + d*BK, kn);
+                }
+
+                ggml_cpu.flash_attn_sv_f32(D, kn, Ot, Vf, BK, 1, S);
+            } else {
+                for (int j = 0; j < kn; ++j) {
+                    ggml_flash_attn_row_to_f32(v->type, (const char *) v->data + ((ik0 + j)*nbv1 + iq2*nbv2 + iq3*nbv3), Vf + j*D, D);
+                }
+
+                ggml_cpu.flash_attn_sv_f32(D, kn, Ot, Vf, 1, D, S);
+            }
+        }
+
+        for (int r = 0; r < nq; ++r) {
+            assert(l[r] > 0.0f);
+
+            float * dst_row = (float *) ((char *) dst->data + ((iq1 + r)*nb1 + iq2*nb2 + iq3*nb3));
+
+            const float il = 1.0f/l[r];
+
+            for (int64_t d = 0; d < D; ++d) {
+                dst_row[d] = Ot[d*BQ + r]*il;
+            }
+        }
+    }
+}
+
+static void ggml_compute_forward_flash_attn(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * q,
+        const struct ggml_tensor * k,
+        const struct ggml_tensor * v,
+        const bool masked,
+        struct ggml_tensor * dst) {
+    switch (q->type) {
+        case GGML_TYPE_F16:
+        case GGML_TYPE_F32:
+            {
+                // the causal mask of ggml_flash_attn lets the last row of q see all the keys
+                const int64_t n_past = masked ? k->ne[1] - q->ne[1] : -1;
+
+                if (k->type != GGML_TYPE_F16) {
+                    ggml_compute_forward_flash_attn_f32(params, q, k, v, masked, dst);
+                } else if (q->ne[1] < GGML_FLASH_ATTN_MIN_N) {
+                    ggml_compute_forward_flash_attn_f16_rows(params, q, k, v, true, n_past, dst);
+                } else {
+                    ggml_compute_forward_flash_attn_f16(params, q, k, v, true, n_past, dst);
+                }
+            } break;
+        default:
+            {
+                GGML_ASSERT(false);
+            } break;
+    }
+}
+
+// ggml_compute_forward_flash_attn_ext
+
+static void ggml_compute_forward_flash_attn_ext(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * q,
+        const struct ggml_tensor * k,
+        const struct ggml_tensor * v,
+        const int64_t n_past,
+        struct ggml_tensor * dst) {
+    switch (q->type) {
+        case GGML_TYPE_F16:
+        case GGML_TYPE_F32:
+            {
+                if (q->ne[1] < GGML_FLASH_ATTN_MIN_N) {
+                    ggml_compute_forward_flash_attn_f16_rows(params, q, k, v, false, n_past, dst);
+                } else {
+                    ggml_compute_forward_flash_attn_f16(params, q, k, v, false, n_past, dst);
+                }
+            } break;
+        default:
+            {
+                GGML_ASSERT(false);
+            } break;
+    }
+}
+
+// ggml_compute_forward_flash_ff
+
+static void ggml_compute_forward_flash_ff_f16(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * a,  // F16
+        const struct ggml_tensor * b0, // F16 fc_w
+        const struct ggml_tensor * b1, // F32 fc_b
+        const struct ggml_tensor * c0, // F16 proj_w
+        const struct ggml_tensor * c1, // F32 proj_b
+        struct ggml_tensor * dst) {
+    int64_t t0 = ggml_perf_time_us();
+    UNUSED(t0);
+
+    GGML_TENSOR_LOCALS(int64_t, nea,  a,   ne);
+    GGML_TENSOR_LOCALS(size_t,  nba,  a,   nb);
+    GGML_TENSOR_LOCALS(int64_t, neb0, b0,  ne);
+    GGML_TENSOR_LOCALS(size_t,  nbb0, b0,  nb);
+    GGML_TENSOR_LOCALS(int64_t, neb1, b1,  ne);
+    GGML_TENSOR_LOCALS(size_t,  nbb1, b1,  nb);
+    GGML_TENSOR_LOCALS(int64_t, nec0, c0,  ne);
+    GGML_TENSOR_LOCALS(size_t,  nbc0, c0,  nb);
+    GGML_TENSOR_LOCALS(int64_t, nec1, c1,  ne);
+    GGML_TENSOR_LOCALS(size_t,  nbc1, c1,  nb);
+    GGML_TENSOR_LOCALS(int64_t, ne,   dst, ne);
+    GGML_TENSOR_LOCALS(size_t,  nb,   dst, nb);
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int64_t D = nea0;
+    //const int64_t N = nea1;
+    const int64_t M = neb01;
+
+    GGML_ASSERT(ne0 == nea0);
+    GGML_ASSERT(ne1 == nea1);
+    GGML_ASSERT(ne2 == nea2);
+
+    GGML_ASSERT(nba0  == sizeof(ggml_fp16_t));
+    GGML_ASSERT(nbb00 == sizeof(ggml_fp16_t));
+    GGML_ASSERT(nbb10 == sizeof(float));
+    GGML_ASSERT(nbc00 == sizeof(ggml_fp16_t));
+    GGML_ASSERT(nbc10 == sizeof(float));
+
+    GGML_ASSERT(neb00 == D);
+    GGML_ASSERT(neb01 == M);
+    GGML_ASSERT(neb10 == M);
+    GGML_ASSERT(neb11 == 1);
+
+    GGML_ASSERT(nec00 == M);
+    GGML_ASSERT(nec01 == D);
+    GGML_ASSERT(nec10 == D);
+    GGML_ASSERT(nec11 == 1);
+
+    // dst cannot be transposed or permuted
+    GGML_ASSERT(nb0 == sizeof(float));
+    GGML_ASSERT(nb0 <= nb1);
+    GGML_ASSERT(nb1 <= nb2);
+    GGML_ASSERT(nb2 <= nb3);
+
+    if (params->type == GGML_TASK_INIT) {
+        return;
+    }
+
+    if (params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    // parallelize by a rows using ggml_vec_dot_f32
+
+    // total rows in a
+    const int nr = nea1*nea2*nea3;
+
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
+
+    for (int ir = ir0; ir < ir1; ++ir) {
+        // a indices
+        const int ia3 = ir/(nea2*nea1);
+        const int ia2 = (ir - ia3*nea2*nea1)/nea1;
+        const int ia1 = (ir - ia3*nea2*nea1 - ia2*nea1);
+
+        float * S = (float *) params->wdata + ith*(2*M + CACHE_LINE_SIZE_F32);
+
+        for (int64_t ic = 0; ic < neb01; ++ic) {
+            // b0 indices
+            const int ib03 = ia3;
+            const int ib02 = ia2;
+            const int ib01 = ic;
+
+            // S indices
+            const int i1 = ib01;
+
+            ggml_cpu.vec_dot_f16(nea0,
+                    S + i1,
+                    (ggml_fp16_t *) ((char *) b0->data + (ib01*nbb01 + ib02*nbb02 + ib03*nbb03)),
+                    (ggml_fp16_t *) ((char *)  a->data + ( ia1*nba1  +  ia2*nba2  +  ia3*nba3)));
+        }
+
+        ggml_vec_add_f32(neb01, S, S, (float *) b1->data);
+        //ggml_vec_gelu_f32(neb01, S, S);
+
+        ggml_fp16_t * S16 = (ggml_fp16_t *) ((float *) params->wdata + ith*(2*M + CACHE_LINE_SIZE_F32) + M);
+
+        for (int64_t i = 0; i < M; i++) {
             S16[i] = GGML_FP32_TO_FP16(S[i]);
         }
 
@@ -13898,7 +14999,7 @@ static void ggml_compute_forward_flash_ff_f16(
 
             for (int64_t ic = 0; ic < nec01; ++ic) {
 
-                ggml_vec_dot_f16(neb01,
+                ggml_cpu.vec_dot_f16(neb01,
                         (float *)       ((char *) dst->data + (ic*nb0 + i1*nb1   + i2*nb2   + i3*nb3)),
                         (ggml_fp16_t *) ((char *) c0->data  + (         ic*nbc01 + i2*nbc02 + i3*nbc03)),
                         S16);
@@ -14047,7 +15148,7 @@ static void ggml_compute_forward_flash_attn_back_f32(
                 // S indices
                 const int i1 = ik1;
 
-                ggml_vec_dot_f32(neq0,
+                ggml_cpu.vec_dot_f32(neq0,
                         S + i1,
                         (float *) ((char *) k->data + (ik1*nbk1 + ik2*nbk2 + ik3*nbk3)),
                         (float *) ((char *) q->data + (iq1*nbq1 + iq2*nbq2 + iq3*nbq3)));
@@ -14090,7 +15191,7 @@ static void ggml_compute_forward_flash_attn_back_f32(
                             } else {
                                 ggml_fp16_t s = GGML_FP32_TO_FP16(SR[j] - max);
                                 memcpy(&scvt[j], &s, sizeof(uint16_t));
-                                const float val = GGML_FP16_TO_FP32(table_exp_f16[scvt[j]]);
+                                const float val = GGML_FP16_TO_FP32(ggml_table_exp_f16[scvt[j]]);
                                 sump[j] += (ggml_float)val;
                                 SW[j] = val;
                             }
@@ -14181,7 +15282,7 @@ static void ggml_compute_forward_flash_attn_back_f32(
                 const int i2 = iq2;
                 const int i3 = iq3;
 
-                ggml_vec_mad_f32(M,
+                ggml_cpu.vec_mad_f32(M,
                         S,
                          (float *) ((char *) v->data + (          ic*nbv1 + i2*nbv2 + i3*nbv3)),
                         *(float *) ((char *) d->data + (ic*nbd0 + i1*nbd1 + i2*nbd2 + i3*nbd3)));
@@ -14240,7 +15341,7 @@ static void ggml_compute_forward_flash_attn_back_f32(
                 const int i2 = iq2;
                 const int i3 = iq3;
 
-                ggml_vec_mad_f32(D,
+                ggml_cpu.vec_mad_f32(D,
                         (float *) ((char *) grad_q  + (i1*nbgq1  + i2*nbgq2  + i3*nbgq3)),
                         (float *) ((char *) k->data + (ic*nbk1   + i2*nbk2   + i3*nbk3)),
                         S[ic]);
@@ -14258,7 +15359,7 @@ static void ggml_compute_forward_flash_attn_back_f32(
                 // ggml_vec_set_f32(D,
                 //         (float *) ((char *) grad_k  + (ic*nbgk1  + i2*nbgk2  + i3*nbgk3)),
                 //         0);
-                ggml_vec_mad_f32(D,
+                ggml_cpu.vec_mad_f32(D,
                         (float *) ((char *) grad_k  + (ic*nbgk1  + i2*nbgk2  + i3*nbgk3)),
                         (float *) ((char *) q->data + (i1*nbq1   + i2*nbq2   + i3*nbq3)),
                         S[ic]);
@@ -14276,7 +15377,7 @@ static void ggml_compute_forward_flash_attn_back_f32(
                 // ggml_vec_set_f32(M,
                 //         (float *) ((char *) grad_v   + (          ic*nbgv1 + i2*nbgv2 + i3*nbgv3)),
                 //         0);
-                ggml_vec_mad_f32(M,
+                ggml_cpu.vec_mad_f32(M,
                         (float *) ((char *) grad_v   + (          ic*nbgv1 + i2*nbgv2 + i3*nbgv3)),
                         SM,
                         *(float *) ((char *) d->data + (ic*nbd0 + i1*nbd1  + i2*nbd2  + i3*nbd3)));
@@ -14704,7 +15805,7 @@ static void ggml_compute_forward_cross_entropy_loss_f32(
                     // const float val = (s0[i] == -INFINITY) ? 0.0 : exp(s0[i] - max);
                     ggml_fp16_t s = GGML_FP32_TO_FP16(s0[i] - max);
                     memcpy(&scvt, &s, sizeof(scvt));
-                    const float val = GGML_FP16_TO_FP32(table_exp_f16[scvt]);
+                    const float val = GGML_FP16_TO_FP32(ggml_table_exp_f16[scvt]);
                     sum += (ggml_float)val;
                     st[i] = val;
                 }
@@ -14861,7 +15962,7 @@ static void ggml_compute_forward_cross_entropy_loss_back_f32(
                     // const float val = (s0[i] == -INFINITY) ? 0.0 : exp(s0[i] - max);
                     ggml_fp16_t s = GGML_FP32_TO_FP16(s0[i] - max);
                     memcpy(&scvt, &s, sizeof(scvt));
-                    const float val = GGML_FP16_TO_FP32(table_exp_f16[scvt]);
+                    const float val = GGML_FP16_TO_FP32(ggml_table_exp_f16[scvt]);
                     sum += (ggml_float)val;
                     sm[i] = val;
                 }
@@ -15039,6 +16140,10 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
             {
                 ggml_compute_forward_norm(params, tensor->src0, tensor);
             } break;
+        case GGML_OP_NORM_AFFINE:
+            {
+                ggml_compute_forward_norm_affine(params, tensor->src0, tensor->src1, tensor->opt[0], tensor);
+            } break;
         case GGML_OP_RMS_NORM:
             {
                 ggml_compute_forward_rms_norm(params, tensor->src0, tensor);
@@ -15048,6 +16153,7 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
                 ggml_compute_forward_rms_norm_back(params, tensor->src0, tensor->src1, tensor);
             } break;
         case GGML_OP_MUL_MAT:
+        case GGML_OP_MUL_MAT_BIAS:
             {
                 ggml_compute_forward_mul_mat(params, tensor->src0, tensor->src1, tensor);
             } break;
@@ -15146,6 +16252,11 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
                 const bool masked = t != 0;
                 ggml_compute_forward_flash_attn(params, tensor->src0, tensor->src1, tensor->opt[0], masked, tensor);
             } break;
+        case GGML_OP_FLASH_ATTN_EXT:
+            {
+                const int32_t n_past = ggml_get_i32_1d(tensor->opt[1], 0);
+                ggml_compute_forward_flash_attn_ext(params, tensor->src0, tensor->src1, tensor->opt[0], n_past, tensor);
+            } break;
         case GGML_OP_FLASH_FF:
             {
                 ggml_compute_forward_flash_ff(params, tensor->src0, tensor->src1, tensor->opt[0], tensor->opt[1], tensor->opt[2], tensor);
@@ -15235,7 +16346,12 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
                     src0->grad = ggml_add_impl(ctx, src0->grad, tensor->grad, inplace);
                 }
                 if (src1->grad) {
-                    src1->grad = ggml_add_impl(ctx, src1->grad, tensor->grad, inplace);
+                    if (ggml_are_same_shape(src0, src1)) {
+                        src1->grad = ggml_add_impl(ctx, src1->grad, tensor->grad, inplace);
+                    } else {
+                        // src1 was broadcast - sum the gradient over the repetitions
+                        src1->grad = ggml_add_impl(ctx, src1->grad, ggml_repeat_back(ctx, tensor->grad, src1), inplace);
+                    }
                 }
             } break;
         case GGML_OP_ADD1:
@@ -15482,6 +16598,7 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
                 GGML_ASSERT(false); // TODO: not implemented
             } break;
         case GGML_OP_NORM:
+        case GGML_OP_NORM_AFFINE:
             {
                 GGML_ASSERT(false); // TODO: not implemented
             } break;
@@ -15545,6 +16662,7 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
                                 inplace);
                 }
             } break;
+        case GGML_OP_MUL_MAT_BIAS:
         case GGML_OP_OUT_PROD:
             {
                 GGML_ASSERT(false); // TODO: not implemented
@@ -15996,6 +17114,10 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
                             inplace);
                 }
             } break;
+        case GGML_OP_FLASH_ATTN_EXT:
+            {
+                GGML_ASSERT(false); // not supported
+            } break;
         case GGML_OP_FLASH_FF:
             {
                 GGML_ASSERT(false); // not supported
@@ -16134,6 +17256,8 @@ struct ggml_cgraph ggml_build_forward(struct ggml_tensor * tensor) {
         /*.nodes        =*/ { NULL },
         /*.grads        =*/ { NULL },
         /*.leafs        =*/ { NULL },
+        /*.profile_cb   =*/ NULL,
+        /*.profile_data =*/ NULL,
         /*.perf_runs    =*/ 0,
         /*.perf_cycles  =*/ 0,
         /*.perf_time_us =*/ 0,
@@ -16332,6 +17456,8 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
     struct ggml_compute_state * state = (struct ggml_compute_state *) data;
     struct ggml_cgraph * cgraph = state->shared->cgraph;
 
+    const ggml_graph_profile_callback profile_cb = cgraph->profile_cb;
+
     const int n_threads = state->shared->n_threads;
     set_numa_thread_affinity(state->ith, n_threads);
 
@@ -16353,9 +17479,15 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
                 /* FINALIZE */
                 struct ggml_tensor * node = state->shared->cgraph->nodes[node_n];
                 if (GGML_OP_HAS_FINALIZE[node->op]) {
+                    const int64_t t_start_us = profile_cb ? ggml_time_us() : 0;
+
                     params.nth = node->n_tasks;
                     ggml_compute_forward(&params, node);
                     ggml_graph_compute_perf_stats_node(node, state->shared);
+
+                    if (profile_cb) {
+                        profile_cb(node_n, state->ith, t_start_us, ggml_time_us(), cgraph->profile_data);
+                    }
                 }
             }
 
@@ -16368,6 +17500,8 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
                 state->shared->perf_node_start_cycles  = ggml_perf_cycles();
                 state->shared->perf_node_start_time_us = ggml_perf_time_us();
 
+                const int64_t t_start_us = profile_cb ? ggml_time_us() : 0;
+
                 params.nth = node->n_tasks;
 
                 /* INIT */
@@ -16387,7 +17521,14 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
                         ggml_compute_forward(&params, node);
                         ggml_graph_compute_perf_stats_node(node, state->shared);
                     }
+
+                    if (profile_cb) {
+                        profile_cb(node_n, state->ith, t_start_us, ggml_time_us(), cgraph->profile_data);
+                    }
                 } else {
+                    if (profile_cb && GGML_OP_HAS_INIT[node->op]) {
+                        profile_cb(node_n, state->ith, t_start_us, ggml_time_us(), cgraph->profile_data);
+                    }
                     break;
                 }
             }
@@ -16418,361 +17559,390 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
         };
 
         if (state->ith < node->n_tasks) {
+            const int64_t t_start_us = profile_cb ? ggml_time_us() : 0;
+
             ggml_compute_forward(&params, node);
+
+            if (profile_cb) {
+                profile_cb(node_n, state->ith, t_start_us, ggml_time_us(), cgraph->profile_data);
+            }
         }
     }
 
     return 0;
 }
 
-void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph) {
+// plan the thread scheduling of the nodes and return the size of the work buffer needed by the computation
+static size_t ggml_graph_plan_tasks(struct ggml_cgraph * cgraph) {
     const int n_threads = cgraph->n_threads;
 
-    struct ggml_compute_state_shared state_shared = {
-        /*.cgraph                  =*/ cgraph,
-        /*.perf_node_start_cycles  =*/ 0,
-        /*.perf_node_start_time_us =*/ 0,
-        /*.n_threads               =*/ n_threads,
-        /*.n_active                =*/ n_threads,
-        /*.node_n                  =*/ -1,
-    };
-    struct ggml_compute_state * workers = alloca(sizeof(struct ggml_compute_state)*n_threads);
+    size_t work_size = 0;
 
-    // initialize tasks + work buffer
-    {
-        size_t work_size = 0;
+    // thread scheduling for the different operations
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        struct ggml_tensor * node = cgraph->nodes[i];
 
-        // thread scheduling for the different operations
-        for (int i = 0; i < cgraph->n_nodes; i++) {
-            struct ggml_tensor * node = cgraph->nodes[i];
+        switch (node->op) {
+            case GGML_OP_CPY:
+            case GGML_OP_DUP:
+                {
+                    node->n_tasks = n_threads;
 
-            switch (node->op) {
-                case GGML_OP_CPY:
-                case GGML_OP_DUP:
-                    {
-                        node->n_tasks = n_threads;
+                    size_t cur = 0;
+                    if (ggml_is_quantized(node->type)) {
+                        cur = GGML_TYPE_SIZE[GGML_TYPE_F32] * node->ne[0] * n_threads;
+                    }
 
-                        size_t cur = 0;
-                        if (ggml_is_quantized(node->type)) {
-                            cur = GGML_TYPE_SIZE[GGML_TYPE_F32] * node->ne[0] * n_threads;
-                        }
+                    work_size = MAX(work_size, cur);
+                } break;
+            case GGML_OP_ADD:
+            case GGML_OP_ADD1:
+                {
+                    node->n_tasks = n_threads;
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_ADD:
-                case GGML_OP_ADD1:
-                    {
-                        node->n_tasks = n_threads;
+                    size_t cur = 0;
 
-                        size_t cur = 0;
+                    if (ggml_is_quantized(node->src0->type)) {
+                        cur = GGML_TYPE_SIZE[GGML_TYPE_F32] * node->src0->ne[0] * n_threads;
+                    }
 
-                        if (ggml_is_quantized(node->src0->type)) {
-                            cur = GGML_TYPE_SIZE[GGML_TYPE_F32] * node->src0->ne[0] * n_threads;
-                        }
+                    work_size = MAX(work_size, cur);
+                } break;
+            case GGML_OP_ACC:
+                {
+                    node->n_tasks = n_threads;
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_ACC:
-                    {
-                        node->n_tasks = n_threads;
+                    size_t cur = 0;
 
-                        size_t cur = 0;
+                    if (ggml_is_quantized(node->src0->type)) {
+                        cur = GGML_TYPE_SIZE[GGML_TYPE_F32] * node->src1->ne[0] * n_threads;
+                    }
 
-                        if (ggml_is_quantized(node->src0->type)) {
-                            cur = GGML_TYPE_SIZE[GGML_TYPE_F32] * node->src1->ne[0] * n_threads;
-                        }
+                    work_size = MAX(work_size, cur);
+                } break;
+            case GGML_OP_SUB:
+            case GGML_OP_DIV:
+            case GGML_OP_SQR:
+            case GGML_OP_SQRT:
+            case GGML_OP_LOG:
+            case GGML_OP_SUM:
+            case GGML_OP_SUM_ROWS:
+            case GGML_OP_MEAN:
+            case GGML_OP_ARGMAX:
+            case GGML_OP_REPEAT:
+            case GGML_OP_REPEAT_BACK:
+            case GGML_OP_ABS:
+            case GGML_OP_SGN:
+            case GGML_OP_NEG:
+            case GGML_OP_STEP:
+            case GGML_OP_TANH:
+            case GGML_OP_ELU:
+            case GGML_OP_RELU:
+                {
+                    node->n_tasks = 1;
+                } break;
+            case GGML_OP_MUL:
+            case GGML_OP_GELU:
+            case GGML_OP_GELU_QUICK:
+            case GGML_OP_SILU:
+            case GGML_OP_SILU_BACK:
+            case GGML_OP_NORM:
+            case GGML_OP_NORM_AFFINE:
+            case GGML_OP_RMS_NORM:
+            case GGML_OP_RMS_NORM_BACK:
+                {
+                    node->n_tasks = n_threads;
+                } break;
+            case GGML_OP_MUL_MAT:
+            case GGML_OP_MUL_MAT_BIAS:
+            case GGML_OP_OUT_PROD:
+                {
+                    node->n_tasks = n_threads;
+
+                    // TODO: use different scheduling for different matrix sizes
+                    //const int nr0 = ggml_nrows(node->src0);
+                    //const int nr1 = ggml_nrows(node->src1);
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_SUB:
-                case GGML_OP_DIV:
-                case GGML_OP_SQR:
-                case GGML_OP_SQRT:
-                case GGML_OP_LOG:
-                case GGML_OP_SUM:
-                case GGML_OP_SUM_ROWS:
-                case GGML_OP_MEAN:
-                case GGML_OP_ARGMAX:
-                case GGML_OP_REPEAT:
-                case GGML_OP_REPEAT_BACK:
-                case GGML_OP_ABS:
-                case GGML_OP_SGN:
-                case GGML_OP_NEG:
-                case GGML_OP_STEP:
-                case GGML_OP_TANH:
-                case GGML_OP_ELU:
-                case GGML_OP_RELU:
-                    {
-                        node->n_tasks = 1;
-                    } break;
-                case GGML_OP_MUL:
-                case GGML_OP_GELU:
-                case GGML_OP_GELU_QUICK:
-                case GGML_OP_SILU:
-                case GGML_OP_SILU_BACK:
-                case GGML_OP_NORM:
-                case GGML_OP_RMS_NORM:
-                case GGML_OP_RMS_NORM_BACK:
-                    {
-                        node->n_tasks = n_threads;
-                    } break;
-                case GGML_OP_MUL_MAT:
-                case GGML_OP_OUT_PROD:
-                    {
-                        node->n_tasks = n_threads;
-
-                        // TODO: use different scheduling for different matrix sizes
-                        //const int nr0 = ggml_nrows(node->src0);
-                        //const int nr1 = ggml_nrows(node->src1);
-
-                        //node->n_tasks = MIN(n_threads, MAX(1, nr0/128));
-                        //printf("nr0 = %8d, nr1 = %8d, nr0*nr1 = %8d, n_tasks = %d\n", nr0, nr1, nr0*nr1, node->n_tasks);
-
-                        size_t cur = 0;
+                    //node->n_tasks = MIN(n_threads, MAX(1, nr0/128));
+                    //printf("nr0 = %8d, nr1 = %8d, nr0*nr1 = %8d, n_tasks = %d\n", nr0, nr1, nr0*nr1, node->n_tasks);
+
+                    size_t cur = 0;
 
 #if defined(GGML_USE_CUBLAS)
-                        if (ggml_cuda_can_mul_mat(node->src0, node->src1, node)) {
-                            node->n_tasks = 1; // TODO: this actually is doing nothing
-                                                //       the threads are still spinning
-                        }
-                        else
+                    if (ggml_cuda_can_mul_mat(node->src0, node->src1, node)) {
+                        node->n_tasks = 1; // TODO: this actually is doing nothing
+                                            //       the threads are still spinning
+                    }
+                    else
 #elif defined(GGML_USE_CLBLAST)
-                        if (ggml_cl_can_mul_mat(node->src0, node->src1, node)) {
-                            node->n_tasks = 1; // TODO: this actually is doing nothing
-                                                //       the threads are still spinning
-                            cur = ggml_cl_mul_mat_get_wsize(node->src0, node->src1, node);
-                        }
-                        else
+                    if (ggml_cl_can_mul_mat(node->src0, node->src1, node)) {
+                        node->n_tasks = 1; // TODO: this actually is doing nothing
+                                            //       the threads are still spinning
+                        cur = ggml_cl_mul_mat_get_wsize(node->src0, node->src1, node);
+                    }
+                    else
 #endif
-                        if (node->src0->type == GGML_TYPE_F16 && node->src1->type == GGML_TYPE_F32) {
+                    if (node->src0->type == GGML_TYPE_F16 && node->src1->type == GGML_TYPE_F32) {
 #if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
-                            if (ggml_compute_forward_mul_mat_use_blas(node->src0, node->src1, node)) {
-                                node->n_tasks = 1; // TODO: this actually is doing nothing
-                                                   //       the threads are still spinning
-                                // here we need memory just for single 2D matrix from src0
-                                cur = GGML_TYPE_SIZE[GGML_TYPE_F32]*(node->src0->ne[0]*node->src0->ne[1]);
-                            } else {
-                                cur = GGML_TYPE_SIZE[GGML_TYPE_F16]*ggml_nelements(node->src1);
-                            }
-#else
+                        if (ggml_compute_forward_mul_mat_use_blas(node->src0, node->src1, node)) {
+                            node->n_tasks = 1; // TODO: this actually is doing nothing
+                                               //       the threads are still spinning
+                            // here we need memory just for single 2D matrix from src0
+                            cur = GGML_TYPE_SIZE[GGML_TYPE_F32]*(node->src0->ne[0]*node->src0->ne[1]);
+                        } else {
                             cur = GGML_TYPE_SIZE[GGML_TYPE_F16]*ggml_nelements(node->src1);
+                        }
+#else
+                        cur = GGML_TYPE_SIZE[GGML_TYPE_F16]*ggml_nelements(node->src1);
 #endif
-                        } else if (node->src0->type == GGML_TYPE_F32 && node->src1->type == GGML_TYPE_F32) {
-                            cur = 0;
+                    } else if (node->src0->type == GGML_TYPE_F32 && node->src1->type == GGML_TYPE_F32) {
+                        cur = 0;
 #if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
-                            if (ggml_compute_forward_mul_mat_use_blas(node->src0, node->src1, node)) {
-                                node->n_tasks = 1;
-                            }
+                        if (ggml_compute_forward_mul_mat_use_blas(node->src0, node->src1, node)) {
+                            node->n_tasks = 1;
+                        }
 #endif
-                        } else if (ggml_is_quantized(node->src0->type) && node->src1->type == GGML_TYPE_F32) {
+                    } else if (ggml_is_quantized(node->src0->type) && node->src1->type == GGML_TYPE_F32) {
 #if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
-                            if (ggml_compute_forward_mul_mat_use_blas(node->src0, node->src1, node)) {
-                                node->n_tasks = 1;
-                                cur = GGML_TYPE_SIZE[GGML_TYPE_F32]*(node->src0->ne[0]*node->src0->ne[1]);
-                            } else
+                        if (ggml_compute_forward_mul_mat_use_blas(node->src0, node->src1, node)) {
+                            node->n_tasks = 1;
+                            cur = GGML_TYPE_SIZE[GGML_TYPE_F32]*(node->src0->ne[0]*node->src0->ne[1]);
+                        } else
 #endif
-                            {
-                                const enum ggml_type type_q = quantize_fns[node->src0->type].vec_dot_type;
-                                cur = GGML_TYPE_SIZE[type_q]*ggml_nelements(node->src1)/GGML_BLCK_SIZE[type_q];
-                            }
-                        } else {
-                            GGML_ASSERT(false);
+                        {
+                            const enum ggml_type type_q = ggml_cpu.quantize_fns[node->src0->type].vec_dot_type;
+                            cur = GGML_TYPE_SIZE[type_q]*ggml_nelements(node->src1)/GGML_BLCK_SIZE[type_q];
                         }
+                    } else {
+                        GGML_ASSERT(false);
+                    }
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_SCALE:
-                    {
-                        node->n_tasks = 1;
-                    } break;
-                case GGML_OP_SET:
-                case GGML_OP_CONT:
-                case GGML_OP_RESHAPE:
-                case GGML_OP_VIEW:
-                case GGML_OP_PERMUTE:
-                case GGML_OP_TRANSPOSE:
-                case GGML_OP_GET_ROWS:
-                case GGML_OP_GET_ROWS_BACK:
-                case GGML_OP_DIAG:
-                case GGML_OP_DIAG_MASK_ZERO:
-                    {
-                        node->n_tasks = 1;
-                    } break;
-                case GGML_OP_DIAG_MASK_INF:
-                case GGML_OP_SOFT_MAX:
-                case GGML_OP_SOFT_MAX_BACK:
-                case GGML_OP_ROPE:
-                case GGML_OP_ROPE_BACK:
-                    {
-                        node->n_tasks = n_threads;
-                    } break;
-                case GGML_OP_ALIBI:
-                    {
-                        node->n_tasks = 1; //TODO
-                    } break;
-                case GGML_OP_CLAMP:
-                    {
-                        node->n_tasks = 1; //TODO
-                    } break;
-                case GGML_OP_CONV_1D:
-                    {
-                        node->n_tasks = n_threads;
-
-                        GGML_ASSERT(node->src0->ne[3] == 1);
-                        GGML_ASSERT(node->src1->ne[2] == 1);
-                        GGML_ASSERT(node->src1->ne[3] == 1);
-
-                        size_t cur = 0;
-                        const int nk = node->src0->ne[0];
-
-                        if (node->src0->type == GGML_TYPE_F16 &&
-                            node->src1->type == GGML_TYPE_F32) {
-                            cur = sizeof(ggml_fp16_t)*(
-                                    nk*ggml_up32(node->src0->ne[1])*node->src0->ne[2] +
-                                    ( 2*(nk/2) + node->src1->ne[0])*node->src1->ne[1]
-                                    );
-                        } else if (node->src0->type == GGML_TYPE_F32 &&
-                                   node->src1->type == GGML_TYPE_F32) {
-                            cur = sizeof(float)*(
-                                    nk*ggml_up32(node->src0->ne[1])*node->src0->ne[2] +
-                                    ( 2*(nk/2) + node->src1->ne[0])*node->src1->ne[1]
-                                    );
-                        } else {
-                            GGML_ASSERT(false);
-                        }
+                    work_size = MAX(work_size, cur);
+                } break;
+            case GGML_OP_SCALE:
+                {
+                    node->n_tasks = 1;
+                } break;
+            case GGML_OP_SET:
+            case GGML_OP_CONT:
+            case GGML_OP_RESHAPE:
+            case GGML_OP_VIEW:
+            case GGML_OP_PERMUTE:
+            case GGML_OP_TRANSPOSE:
+            case GGML_OP_GET_ROWS:
+            case GGML_OP_GET_ROWS_BACK:
+            case GGML_OP_DIAG:
+            case GGML_OP_DIAG_MASK_ZERO:
+                {
+                    node->n_tasks = 1;
+                } break;
+            case GGML_OP_DIAG_MASK_INF:
+            case GGML_OP_SOFT_MAX:
+            case GGML_OP_SOFT_MAX_BACK:
+            case GGML_OP_ROPE:
+            case GGML_OP_ROPE_BACK:
+                {
+                    node->n_tasks = n_threads;
+                } break;
+            case GGML_OP_ALIBI:
+                {
+                    node->n_tasks = 1; //TODO
+                } break;
+            case GGML_OP_CLAMP:
+                {
+                    node->n_tasks = 1; //TODO
+                } break;
+            case GGML_OP_CONV_1D:
+                {
+                    node->n_tasks = n_threads;
+
+                    GGML_ASSERT(node->src0->ne[3] == 1);
+                    GGML_ASSERT(node->src1->ne[2] == 1);
+                    GGML_ASSERT(node->src1->ne[3] == 1);
+
+                    size_t cur = 0;
+                    const int nk = node->src0->ne[0];
+
+                    if (node->src0->type == GGML_TYPE_F16 &&
+                        node->src1->type == GGML_TYPE_F32) {
+                        cur = sizeof(ggml_fp16_t)*(
+                                nk*ggml_up32(node->src0->ne[1])*node->src0->ne[2] +
+                                ( 2*(nk/2) + node->src1->ne[0])*node->src1->ne[1]
+                                );
+                    } else if (node->src0->type == GGML_TYPE_F32 &&
+                               node->src1->type == GGML_TYPE_F32) {
+                        cur = sizeof(float)*(
+                                nk*ggml_up32(node->src0->ne[1])*node->src0->ne[2] +
+                                ( 2*(nk/2) + node->src1->ne[0])*node->src1->ne[1]
+                                );
+                    } else {
+                        GGML_ASSERT(false);
+                    }
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_CONV_2D:
-                    {
-                        node->n_tasks = n_threads;
+                    work_size = MAX(work_size, cur);
+                } break;
+            case GGML_OP_CONV_2D:
+                {
+                    node->n_tasks = n_threads;
 
-                        GGML_ASSERT(node->src1->ne[3] == 1);
+                    GGML_ASSERT(node->src1->ne[3] == 1);
 
-                        const int64_t ne00 = node->src0->ne[0]; // W
-                        const int64_t ne01 = node->src0->ne[1]; // H
-                        const int64_t ne02 = node->src0->ne[2]; // C
-                        const int64_t ne03 = node->src0->ne[3]; // N
+                    const int64_t ne00 = node->src0->ne[0]; // W
+                    const int64_t ne01 = node->src0->ne[1]; // H
+                    const int64_t ne02 = node->src0->ne[2]; // C
+                    const int64_t ne03 = node->src0->ne[3]; // N
 
-                        const int64_t ne10 = node->src1->ne[0]; // W
-                        const int64_t ne11 = node->src1->ne[1]; // H
-                        const int64_t ne12 = node->src1->ne[2]; // C
+                    const int64_t ne10 = node->src1->ne[0]; // W
+                    const int64_t ne11 = node->src1->ne[1]; // H
+                    const int64_t ne12 = node->src1->ne[2]; // C
 
-                        const int64_t nk = ne00*ne01;
+                    const int64_t nk = ne00*ne01;
 
-                        UNUSED(ne02);
-                        UNUSED(ne03);
-                        UNUSED(nk);
+                    UNUSED(ne02);
+                    UNUSED(ne03);
+                    UNUSED(nk);
 
-                        size_t cur = 0;
+                    size_t cur = 0;
 
-                        if (node->src0->type == GGML_TYPE_F16 &&
-                            node->src1->type == GGML_TYPE_F32) {
-                            cur = sizeof(ggml_fp16_t)*(ne10*ne11*ne12);
-                        } else if (node->src0->type == GGML_TYPE_F32 &&
-                                   node->src1->type == GGML_TYPE_F32) {
-                            cur = sizeof(float)*      (ne10*ne11*ne12);
-                        } else {
-                            GGML_ASSERT(false);
-                        }
+                    if (node->src0->type == GGML_TYPE_F16 &&
+                        node->src1->type == GGML_TYPE_F32) {
+                        cur = sizeof(ggml_fp16_t)*(ne10*ne11*ne12);
+                    } else if (node->src0->type == GGML_TYPE_F32 &&
+                               node->src1->type == GGML_TYPE_F32) {
+                        cur = sizeof(float)*      (ne10*ne11*ne12);
+                    } else {
+                        GGML_ASSERT(false);
+                    }
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_FLASH_ATTN:
-                    {
-                        node->n_tasks = n_threads;
+                    work_size = MAX(work_size, cur);
+                } break;
+            case GGML_OP_FLASH_ATTN:
+            case GGML_OP_FLASH_ATTN_EXT:
+                {
+                    node->n_tasks = n_threads;
 
-                        size_t cur = 0;
+                    size_t cur = 0;
 
-                        const int64_t ne11 = ggml_up(node->src1->ne[1], GGML_SOFT_MAX_UNROLL);
+                    const int64_t ne11 = ggml_up(node->src1->ne[1], GGML_SOFT_MAX_UNROLL);
 
-                        if (node->src1->type == GGML_TYPE_F32) {
-                            cur  = sizeof(float)*ne11*node->n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*ne11*node->n_tasks; // this is overestimated by x2
-                        }
+                    if (node->src1->type == GGML_TYPE_F32) {
+                        cur  = sizeof(float)*ne11*node->n_tasks; // TODO: this can become (n_tasks-1)
+                        cur += sizeof(float)*ne11*node->n_tasks; // this is overestimated by x2
+                    }
 
-                        if (node->src1->type == GGML_TYPE_F16) {
-                            cur  = sizeof(float)*ne11*node->n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*ne11*node->n_tasks; // this is overestimated by x2
+                    if (node->src1->type == GGML_TYPE_F16 || ggml_is_quantized(node->src1->type)) {
+                        const int64_t D = node->src0->ne[0];
+
+                        if (node->src0->ne[1] < GGML_FLASH_ATTN_MIN_N) {
+                            cur = sizeof(float)*(GGML_FLASH_ATTN_WSIZE_ROWS(D, node->src1->ne[1]) + CACHE_LINE_SIZE_F32)*node->n_tasks;
+                        } else {
+                            cur = sizeof(float)*(GGML_FLASH_ATTN_WSIZE(D) + CACHE_LINE_SIZE_F32)*node->n_tasks;
                         }
+                    }
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_FLASH_FF:
-                    {
-                        node->n_tasks = n_threads;
+                    work_size = MAX(work_size, cur);
+                } break;
+            case GGML_OP_FLASH_FF:
+                {
+                    node->n_tasks = n_threads;
 
-                        size_t cur = 0;
+                    size_t cur = 0;
 
-                        if (node->src1->type == GGML_TYPE_F32) {
-                            cur  = sizeof(float)*node->src1->ne[1]*node->n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*node->src1->ne[1]*node->n_tasks; // this is overestimated by x2
-                        }
+                    if (node->src1->type == GGML_TYPE_F32) {
+                        cur  = sizeof(float)*node->src1->ne[1]*node->n_tasks; // TODO: this can become (n_tasks-1)
+                        cur += sizeof(float)*node->src1->ne[1]*node->n_tasks; // this is overestimated by x2
+                    }
 
-                        if (node->src1->type == GGML_TYPE_F16) {
-                            cur  = sizeof(float)*node->src1->ne[1]*node->n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*node->src1->ne[1]*node->n_tasks; // this is overestimated by x2
-                        }
+                    if (node->src1->type == GGML_TYPE_F16) {
+                        cur  = sizeof(float)*node->src1->ne[1]*node->n_tasks; // TODO: this can become (n_tasks-1)
+                        cur += sizeof(float)*node->src1->ne[1]*node->n_tasks; // this is overestimated by x2
+                    }
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_FLASH_ATTN_BACK:
-                    {
-                        node->n_tasks = n_threads;
+                    work_size = MAX(work_size, cur);
+                } break;
+            case GGML_OP_FLASH_ATTN_BACK:
+                {
+                    node->n_tasks = n_threads;
 
-                        size_t cur = 0;
+                    size_t cur = 0;
 
-                        const int64_t    D = node->src0->ne[0];
-                        const int64_t ne11 = ggml_up(node->src1->ne[1], GGML_SOFT_MAX_UNROLL);
-                        const int64_t mxDn = MAX(D, ne11) * 2; // *2 because of S and SM in ggml_compute_forward_flash_attn_back
-                        if (node->src1->type == GGML_TYPE_F32) {
-                            cur  = sizeof(float)*mxDn*node->n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*mxDn*node->n_tasks; // this is overestimated by x2
-                        }
+                    const int64_t    D = node->src0->ne[0];
+                    const int64_t ne11 = ggml_up(node->src1->ne[1], GGML_SOFT_MAX_UNROLL);
+                    const int64_t mxDn = MAX(D, ne11) * 2; // *2 because of S and SM in ggml_compute_forward_flash_attn_back
+                    if (node->src1->type == GGML_TYPE_F32) {
+                        cur  = sizeof(float)*mxDn*node->n_tasks; // TODO: this can become (n_tasks-1)
+                        cur += sizeof(float)*mxDn*node->n_tasks; // this is overestimated by x2
+                    }
 
-                        if (node->src1->type == GGML_TYPE_F16) {
-                            cur  = sizeof(float)*mxDn*node->n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*mxDn*node->n_tasks; // this is overestimated by x2
-                        }
+                    if (node->src1->type == GGML_TYPE_F16) {
+                        cur  = sizeof(float)*mxDn*node->n_tasks; // TODO: this can become (n_tasks-1)
+                        cur += sizeof(float)*mxDn*node->n_tasks; // this is overestimated by x2
+                    }
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_WIN_PART:
-                case GGML_OP_WIN_UNPART:
-                case GGML_OP_MAP_UNARY:
-                case GGML_OP_MAP_BINARY:
-                case GGML_OP_MAP_CUSTOM1:
-                case GGML_OP_MAP_CUSTOM2:
-                case GGML_OP_MAP_CUSTOM3:
-                    {
-                        node->n_tasks = 1;
-                    } break;
-                case GGML_OP_CROSS_ENTROPY_LOSS:
-                    {
-                        node->n_tasks = n_threads;
-
-                        size_t cur = ggml_type_size(node->type)*(node->n_tasks + node->src0->ne[0]*node->n_tasks);
-
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_CROSS_ENTROPY_LOSS_BACK:
-                    {
-                        node->n_tasks = n_threads;
-
-                        size_t cur = ggml_type_size(node->type)*node->src0->ne[0]*node->n_tasks;
-
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_NONE:
-                    {
-                        node->n_tasks = 1;
-                    } break;
-                case GGML_OP_COUNT:
-                    {
-                        GGML_ASSERT(false);
-                    } break;
-            }
+                    work_size = MAX(work_size, cur);
+                } break;
+            case GGML_OP_WIN_PART:
+            case GGML_OP_WIN_UNPART:
+            case GGML_OP_MAP_UNARY:
+            case GGML_OP_MAP_BINARY:
+            case GGML_OP_MAP_CUSTOM1:
+            case GGML_OP_MAP_CUSTOM2:
+            case GGML_OP_MAP_CUSTOM3:
+                {
+                    node->n_tasks = 1;
+                } break;
+            case GGML_OP_CROSS_ENTROPY_LOSS:
+                {
+                    node->n_tasks = n_threads;
+
+                    size_t cur = ggml_type_size(node->type)*(node->n_tasks + node->src0->ne[0]*node->n_tasks);
+
+                    work_size = MAX(work_size, cur);
+                } break;
+            case GGML_OP_CROSS_ENTROPY_LOSS_BACK:
+                {
+                    node->n_tasks = n_threads;
+
+                    size_t cur = ggml_type_size(node->type)*node->src0->ne[0]*node->n_tasks;
+
+                    work_size = MAX(work_size, cur);
+                } break;
+            case GGML_OP_NONE:
+                {
+                    node->n_tasks = 1;
+                } break;
+            case GGML_OP_COUNT:
+                {
+                    GGML_ASSERT(false);
+                } break;
         }
+    }
+
+    return work_size;
+}
+
+size_t ggml_graph_work_size(struct ggml_cgraph * cgraph) {
+    const size_t work_size = ggml_graph_plan_tasks(cgraph);
+
+    return work_size > 0 ? work_size + CACHE_LINE_SIZE*(cgraph->n_threads - 1) : 0;
+}
+
+void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph) {
+    const int n_threads = cgraph->n_threads;
+
+    struct ggml_compute_state_shared state_shared = {
+        /*.cgraph                  =*/ cgraph,
+        /*.perf_node_start_cycles  =*/ 0,
+        /*.perf_node_start_time_us =*/ 0,
+        /*.n_threads               =*/ n_threads,
+        /*.n_active                =*/ n_threads,
+        /*.node_n                  =*/ -1,
+    };
+    struct ggml_compute_state * workers = alloca(sizeof(struct ggml_compute_state)*n_threads);
+
+    // initialize tasks + work buffer
+    {
+        const size_t work_size = ggml_graph_plan_tasks(cgraph);
 
         if (cgraph->work != NULL && work_size > cgraph->work_size) {
             GGML_ASSERT(false); // TODO: better handling
@@ -16782,7 +17952,11 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
             cgraph->work_size = work_size + CACHE_LINE_SIZE*(n_threads - 1);
 
             GGML_PRINT_DEBUG("%s: allocating work buffer for graph (%zu bytes)\n", __func__, cgraph->work_size);
+
+            // the work buffer is never placed in a scratch buffer and is allocated also in no_alloc contexts
+            ggml_scratch_save(ctx);
             cgraph->work = ggml_new_tensor_1d(ctx, GGML_TYPE_I8, cgraph->work_size);
+            ggml_scratch_load(ctx);
         }
     }
 
@@ -17580,6 +18754,380 @@ void ggml_graph_dump_dot(const struct ggml_cgraph * gb, const struct ggml_cgraph
 
 ////////////////////////////////////////////////////////////////////////////////
 
+// graph allocator
+//
+// The tensors of a graph that were created in a no_alloc context are placed in a single buffer. The nodes are
+// visited in the order of the computation: the result of a node is allocated right before the node and released
+// after its last consumer, so that the memory of the intermediate results is reused. Views share the data of the
+// tensor they view, which is kept alive as long as any of its views is used. An element-wise op takes over the data
+// of a parent that has no other consumers and the same layout.
+//
+// In measure mode no memory is used - the peak size of the buffer is computed for sizing the real buffer. The
+// placement is the same in both modes, so a buffer of the measured size is enough for the same graph.
+//
+
+#define GGML_ALLOCR_MAX_FREE_BLOCKS 256
+#define GGML_ALLOCR_HASH_SIZE       16411 // prime, more than 2x the tensors of a graph
+
+struct ggml_allocr_block {
+    size_t offs;
+    size_t size;
+};
+
+struct ggml_allocr_hash_node {
+    const struct ggml_tensor * t;
+
+    int  n_children; // number of nodes that use the tensor and are not computed yet
+    int  n_views;    // number of views of the tensor that are still in use
+    bool own;        // the data was allocated by the allocator while allocating the current graph
+};
+
+struct ggml_allocr {
+    char * data;
+    size_t size;
+    size_t alignment;
+    size_t max_size;
+    bool   measure;
+
+    int n_free_blocks;
+    struct ggml_allocr_block free_blocks[GGML_ALLOCR_MAX_FREE_BLOCKS]; // sorted by offset
+
+    struct ggml_allocr_hash_node hash[GGML_ALLOCR_HASH_SIZE];
+};
+
+static struct ggml_allocr * ggml_allocr_new_impl(void * data, size_t size, size_t alignment, bool measure) {
+    GGML_ASSERT(alignment > 0 && (alignment & (alignment - 1)) == 0);
+
+    struct ggml_allocr * alloc = malloc(sizeof(struct ggml_allocr));
+    GGML_ASSERT(alloc != NULL);
+
+    // align the start of the buffer, so that the offsets can be aligned instead of the addresses
+    const size_t pad = (alignment - ((uintptr_t) data % alignment)) % alignment;
+    GGML_ASSERT(pad <= size);
+
+    alloc->data      = (char *) data + pad;
+    alloc->size      = size - pad;
+    alloc->alignment = alignment;
+    alloc->max_size  = 0;
+    alloc->measure   = measure;
+
+    ggml_allocr_reset(alloc);
+
+    return alloc;
+}
+
+struct ggml_allocr * ggml_allocr_new(void * data, size_t size, size_t alignment) {
+    return ggml_allocr_new_impl(data, size, alignment, false);
+}
+
+struct ggml_allocr * ggml_allocr_new_measure(size_t alignment) {
+    // the tensors get addresses in a fake buffer - they must not be used for computing
+    return ggml_allocr_new_impl((void *) alignment, SIZE_MAX/2, alignment, true);
+}
+
+void ggml_allocr_free(struct ggml_allocr * alloc) {
+    free(alloc);
+}
+
+bool ggml_allocr_is_measure(const struct ggml_allocr * alloc) {
+    return alloc->measure;
+}
+
+size_t ggml_allocr_max_size(const struct ggml_allocr * alloc) {
+    return alloc->max_size;
+}
+
+void ggml_allocr_reset(struct ggml_allocr * alloc) {
+    alloc->n_free_blocks = 1;
+    alloc->free_blocks[0].offs = 0;
+    alloc->free_blocks[0].size = alloc->size;
+}
+
+static size_t ggml_allocr_aligned_size(const struct ggml_allocr * alloc, const struct ggml_tensor * tensor) {
+    return ((ggml_nbytes(tensor) + alloc->alignment - 1)/alloc->alignment)*alloc->alignment;
+}
+
+void ggml_allocr_alloc(struct ggml_allocr * alloc, struct ggml_tensor * tensor) {
+    GGML_ASSERT(tensor->data == NULL && tensor->view_src == NULL);
+
+    const size_t size = ggml_allocr_aligned_size(alloc, tensor);
+
+    // best fit, the last block is used only if no other block fits - it is the only one that differs between the
+    // measure mode and a buffer of the measured size
+    int best = -1;
+    for (int i = 0; i < alloc->n_free_blocks - 1; i++) {
+        const struct ggml_allocr_block * block = &alloc->free_blocks[i];
+        if (block->size >= size && (best == -1 || block->size < alloc->free_blocks[best].size)) {
+            best = i;
+        }
+    }
+
+    if (best == -1) {
+        best = alloc->n_free_blocks - 1;
+
+        if (alloc->free_blocks[best].size < size) {
+            GGML_PRINT("%s: not enough space in the buffer (needed %zu, largest block available %zu)\n",
+                    __func__, size, alloc->free_blocks[best].size);
+            GGML_ASSERT(false);
+        }
+    }
+
+    struct ggml_allocr_block * block = &alloc->free_blocks[best];
+
+    const size_t offs = block->offs;
+
+    block->offs += size;
+    block->size -= size;
+
+    if (block->size == 0 && alloc->n_free_blocks > 1) {
+        for (int i = best; i < alloc->n_free_blocks - 1; i++) {
+            alloc->free_blocks[i] = alloc->free_blocks[i + 1];
+        }
+        alloc->n_free_blocks--;
+    }
+
+    tensor->data = alloc->data + offs;
+
+    alloc->max_size = MAX(alloc->max_size, offs + size);
+}
+
+// the tensor keeps its data pointer - the memory is reused by the tensors that are allocated after it
+static void ggml_allocr_free_tensor(struct ggml_allocr * alloc, struct ggml_tensor * tensor) {
+    const size_t offs = (char *) tensor->data - alloc->data;
+    const size_t size = ggml_allocr_aligned_size(alloc, tensor);
+
+    int i = 0;
+    while (i < alloc->n_free_blocks && alloc->free_blocks[i].offs < offs) {
+        i++;
+    }
+
+    // merge with the previous and the next free block
+    const bool merge_prev = i > 0                     && alloc->free_blocks[i - 1].offs + alloc->free_blocks[i - 1].size == offs;
+    const bool merge_next = i < alloc->n_free_blocks && offs + size == alloc->free_blocks[i].offs;
+
+    if (merge_prev && merge_next) {
+        alloc->free_blocks[i - 1].size += size + alloc->free_blocks[i].size;
+        for (int j = i; j < alloc->n_free_blocks - 1; j++) {
+            alloc->free_blocks[j] = alloc->free_blocks[j + 1];
+        }
+        alloc->n_free_blocks--;
+    } else if (merge_prev) {
+        alloc->free_blocks[i - 1].size += size;
+    } else if (merge_next) {
+        alloc->free_blocks[i].offs  = offs;
+        alloc->free_blocks[i].size += size;
+    } else {
+        GGML_ASSERT(alloc->n_free_blocks < GGML_ALLOCR_MAX_FREE_BLOCKS && "too many free blocks");
+
+        for (int j = alloc->n_free_blocks; j > i; j--) {
+            alloc->free_blocks[j] = alloc->free_blocks[j - 1];
+        }
+        alloc->free_blocks[i].offs = offs;
+        alloc->free_blocks[i].size = size;
+        alloc->n_free_blocks++;
+    }
+}
+
+static struct ggml_allocr_hash_node * ggml_allocr_hash_get(struct ggml_allocr * alloc, const struct ggml_tensor * t) {
+    size_t h = ((uintptr_t) t >> 4) % GGML_ALLOCR_HASH_SIZE;
+
+    for (int n = 0; n < GGML_ALLOCR_HASH_SIZE; n++) {
+        struct ggml_allocr_hash_node * hn = &alloc->hash[h];
+
+        if (hn->t == t) {
+            return hn;
+        }
+
+        if (hn->t == NULL) {
+            hn->t = t;
+            return hn;
+        }
+
+        h = (h + 1) % GGML_ALLOCR_HASH_SIZE;
+    }
+
+    GGML_ASSERT(false && "graph allocator hash table is full");
+
+    return NULL;
+}
+
+// ops that compute each element of the result only from the elements of the sources at the same position
+static bool ggml_op_can_inplace(enum ggml_op op) {
+    switch (op) {
+        case GGML_OP_ADD:
+        case GGML_OP_ADD1:
+        case GGML_OP_SUB:
+        case GGML_OP_MUL:
+        case GGML_OP_DIV:
+        case GGML_OP_SQR:
+        case GGML_OP_SQRT:
+        case GGML_OP_LOG:
+        case GGML_OP_ABS:
+        case GGML_OP_SGN:
+        case GGML_OP_NEG:
+        case GGML_OP_STEP:
+        case GGML_OP_RELU:
+        case GGML_OP_GELU:
+        case GGML_OP_SILU:
+        case GGML_OP_SCALE:
+        case GGML_OP_SOFT_MAX:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool ggml_are_same_layout(const struct ggml_tensor * t0, const struct ggml_tensor * t1) {
+    if (t0->type != t1->type) {
+        return false;
+    }
+
+    for (int i = 0; i < GGML_MAX_DIMS; i++) {
+        if (t0->ne[i] != t1->ne[i] || t0->nb[i] != t1->nb[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void ggml_allocr_allocate_node(struct ggml_allocr * alloc, struct ggml_tensor * node) {
+    if (node->data != NULL) {
+        // allocated externally, or already visited
+        return;
+    }
+
+    if (node->view_src != NULL) {
+        if (node->view_src->data == NULL) {
+            ggml_allocr_allocate_node(alloc, node->view_src);
+        }
+
+        node->data = (char *) node->view_src->data + node->view_offs;
+
+        return;
+    }
+
+    struct ggml_allocr_hash_node * hn = ggml_allocr_hash_get(alloc, node);
+
+    if (ggml_op_can_inplace(node->op)) {
+        struct ggml_tensor * parents[2] = { node->src0, node->src1 };
+
+        for (int i = 0; i < 2; i++) {
+            struct ggml_tensor * parent = parents[i];
+
+            if (parent == NULL || parent->data == NULL || !ggml_are_same_layout(node, parent)) {
+                continue;
+            }
+
+            struct ggml_allocr_hash_node * p_hn = ggml_allocr_hash_get(alloc, parent);
+
+            if (p_hn->n_children != 1 || p_hn->n_views != 0) {
+                continue;
+            }
+
+            // the data of the parent must not be used after this node - take over the memory that would be released
+            struct ggml_allocr_hash_node * o_hn = parent->view_src != NULL ? ggml_allocr_hash_get(alloc, parent->view_src) : p_hn;
+
+            if (!o_hn->own) {
+                continue;
+            }
+
+            if (parent->view_src != NULL &&
+                (o_hn->n_views != 1 || o_hn->n_children != 0 || parent->view_src->data != parent->data ||
+                 ggml_nbytes(parent->view_src) != ggml_nbytes(node))) {
+                continue;
+            }
+
+            node->data = parent->data;
+
+            o_hn->own = false;
+            hn->own   = true;
+
+            return;
+        }
+    }
+
+    ggml_allocr_alloc(alloc, node);
+
+    hn->own = true;
+}
+
+size_t ggml_allocr_alloc_graph(struct ggml_allocr * alloc, struct ggml_cgraph * graph) {
+    memset(alloc->hash, 0, sizeof(alloc->hash));
+
+    // count the consumers and the views of each tensor
+    for (int i = 0; i < graph->n_nodes; i++) {
+        struct ggml_tensor * node = graph->nodes[i];
+
+        if (node->view_src != NULL) {
+            ggml_allocr_hash_get(alloc, node->view_src)->n_views += 1;
+        }
+
+        struct ggml_tensor * parents[2 + GGML_MAX_OPT] = { node->src0, node->src1 };
+        for (int j = 0; j < GGML_MAX_OPT; j++) {
+            parents[2 + j] = node->opt[j];
+        }
+
+        for (int j = 0; j < 2 + GGML_MAX_OPT; j++) {
+            if (parents[j] != NULL) {
+                ggml_allocr_hash_get(alloc, parents[j])->n_children += 1;
+            }
+        }
+    }
+
+    for (int i = 0; i < graph->n_nodes; i++) {
+        struct ggml_tensor * node = graph->nodes[i];
+
+        struct ggml_tensor * parents[2 + GGML_MAX_OPT] = { node->src0, node->src1 };
+        for (int j = 0; j < GGML_MAX_OPT; j++) {
+            parents[2 + j] = node->opt[j];
+        }
+
+        // the leafs are allocated on their first use
+        for (int j = 0; j < 2 + GGML_MAX_OPT; j++) {
+            if (parents[j] != NULL) {
+                ggml_allocr_allocate_node(alloc, parents[j]);
+            }
+        }
+
+        ggml_allocr_allocate_node(alloc, node);
+
+        // release the parents that are not used anymore
+        for (int j = 0; j < 2 + GGML_MAX_OPT; j++) {
+            struct ggml_tensor * parent = parents[j];
+            if (parent == NULL) {
+                continue;
+            }
+
+            struct ggml_allocr_hash_node * p_hn = ggml_allocr_hash_get(alloc, parent);
+
+            p_hn->n_children -= 1;
+
+            if (p_hn->n_children > 0 || p_hn->n_views > 0) {
+                continue;
+            }
+
+            if (parent->view_src != NULL) {
+                struct ggml_allocr_hash_node * v_hn = ggml_allocr_hash_get(alloc, parent->view_src);
+
+                v_hn->n_views -= 1;
+
+                if (v_hn->n_views == 0 && v_hn->n_children == 0 && v_hn->own) {
+                    ggml_allocr_free_tensor(alloc, parent->view_src);
+                    v_hn->own = false;
+                }
+            } else if (p_hn->own) {
+                ggml_allocr_free_tensor(alloc, parent);
+                p_hn->own = false;
+            }
+        }
+    }
+
+    return alloc->max_size;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 static void ggml_opt_set_params(int np, struct ggml_tensor * const ps[], const float * x) {
     int i = 0;
     for (int p = 0; p < np; ++p) {
@@ -17858,7 +19406,7 @@ static enum ggml_opt_result linesearch_backtracking(
     }
 
     // compute the initial gradient in the search direction
-    ggml_vec_dot_f32(nx, &dginit, g, d);
+    ggml_cpu.vec_dot_f32(nx, &dginit, g, d);
 
     // make sure that d points to a descent direction
     if (0 < dginit) {
@@ -17871,7 +19419,7 @@ static enum ggml_opt_result linesearch_backtracking(
 
     while (true) {
         ggml_vec_cpy_f32(nx, x, xp);
-        ggml_vec_mad_f32(nx, x, d, *step);
+        ggml_cpu.vec_mad_f32(nx, x, d, *step);
 
         // evaluate the function and gradient values
         {
@@ -17896,7 +19444,7 @@ static enum ggml_opt_result linesearch_backtracking(
                 return count;
             }
 
-            ggml_vec_dot_f32(nx, &dg, g, d);
+            ggml_cpu.vec_dot_f32(nx, &dg, g, d);
 
             // check the Wolfe condition
             if (dg < params->lbfgs.wolfe * dginit) {
@@ -18127,8 +19675,8 @@ static enum ggml_opt_result ggml_opt_lbfgs(
         //     ys = y^t \cdot s    -> 1 / \rho.
         //     yy = y^t \cdot y.
         //
-        ggml_vec_dot_f32(nx, &ys, &lm_y[end[0]*nx], &lm_s[end[0] *nx]);
-        ggml_vec_dot_f32(nx, &yy, &lm_y[end[0]*nx], &lm_y[end[0]*nx]);
+        ggml_cpu.vec_dot_f32(nx, &ys, &lm_y[end[0]*nx], &lm_s[end[0] *nx]);
+        ggml_cpu.vec_dot_f32(nx, &yy, &lm_y[end[0]*nx], &lm_y[end[0]*nx]);
 
         lm_ys[end[0]] = ys;
 
@@ -18147,20 +19695,20 @@ static enum ggml_opt_result ggml_opt_lbfgs(
         for (int i = 0; i < bound; ++i) {
             j[0] = (j[0] + m - 1) % m;
             // \alpha_{j} = \rho_{j} s^{t}_{j} \cdot q_{k+1}
-            ggml_vec_dot_f32(nx, &lm_alpha[j[0]], &lm_s[j[0]*nx], d);
+            ggml_cpu.vec_dot_f32(nx, &lm_alpha[j[0]], &lm_s[j[0]*nx], d);
             lm_alpha[j[0]] /= lm_ys[j[0]];
             // q_{i} = q_{i+1} - \alpha_{i} y_{i}
-            ggml_vec_mad_f32(nx, d, &lm_y[j[0]*nx], -lm_alpha[j[0]]);
+            ggml_cpu.vec_mad_f32(nx, d, &lm_y[j[0]*nx], -lm_alpha[j[0]]);
         }
 
         ggml_vec_scale_f32(nx, d, ys/yy);
 
         for (int i = 0; i < bound; ++i) {
             // \beta_{j} = \rho_{j} y^t_{j} \cdot \gamma_{i}
-            ggml_vec_dot_f32(nx, &beta, &lm_y[j[0]*nx], d);
+            ggml_cpu.vec_dot_f32(nx, &beta, &lm_y[j[0]*nx], d);
             beta /= lm_ys[j[0]];
             // \gamma_{i+1} = \gamma_{i} + (\alpha_{j} - \beta_{j}) s_{j}
-            ggml_vec_mad_f32(nx, d, &lm_s[j[0]*nx], lm_alpha[j[0]] - beta);
+            ggml_cpu.vec_mad_f32(nx, d, &lm_s[j[0]*nx], lm_alpha[j[0]] - beta);
             j[0] = (j[0] + 1)%m;
         }
 
@@ -18598,91 +20146,47 @@ size_t ggml_quantize_chunk(enum ggml_type type, const float * src, void * dst, i
 ////////////////////////////////////////////////////////////////////////////////
 
 int ggml_cpu_has_avx(void) {
-#if defined(__AVX__)
-    return 1;
-#else
-    return 0;
-#endif
+    return (ggml_cpu.features & GGML_CPU_AVX) != 0;
 }
 
 int ggml_cpu_has_avx2(void) {
-#if defined(__AVX2__)
-    return 1;
-#else
-    return 0;
-#endif
+    return (ggml_cpu.features & GGML_CPU_AVX2) != 0;
 }
 
 int ggml_cpu_has_avx512(void) {
-#if defined(__AVX512F__)
-    return 1;
-#else
-    return 0;
-#endif
+    return (ggml_cpu.features & GGML_CPU_AVX512) != 0;
 }
 
 int ggml_cpu_has_avx512_vbmi(void) {
-#if defined(__AVX512VBMI__)
-    return 1;
-#else
-    return 0;
-#endif
+    return (ggml_cpu.features & GGML_CPU_AVX512_VBMI) != 0;
 }
 
 int ggml_cpu_has_avx512_vnni(void) {
-#if defined(__AVX512VNNI__)
-    return 1;
-#else
-    return 0;
-#endif
+    return (ggml_cpu.features & GGML_CPU_AVX512_VNNI) != 0;
 }
 
 int ggml_cpu_has_fma(void) {
-#if defined(__FMA__)
-    return 1;
-#else
-    return 0;
-#endif
+    return (ggml_cpu.features & GGML_CPU_FMA) != 0;
 }
 
 int ggml_cpu_has_neon(void) {
-#if defined(__ARM_NEON)
-    return 1;
-#else
-    return 0;
-#endif
+    return (ggml_cpu.features & GGML_CPU_NEON) != 0;
 }
 
 int ggml_cpu_has_arm_fma(void) {
-#if defined(__ARM_FEATURE_FMA)
-    return 1;
-#else
-    return 0;
-#endif
+    return (ggml_cpu.features & GGML_CPU_ARM_FMA) != 0;
 }
 
 int ggml_cpu_has_f16c(void) {
-#if defined(__F16C__)
-    return 1;
-#else
-    return 0;
-#endif
+    return (ggml_cpu.features & GGML_CPU_F16C) != 0;
 }
 
 int ggml_cpu_has_fp16_va(void) {
-#if defined(__ARM_FEATURE_FP16_VECTOR_ARITHMETIC)
-    return 1;
-#else
-    return 0;
-#endif
+    return (ggml_cpu.features & GGML_CPU_FP16_VA) != 0;
 }
 
 int ggml_cpu_has_wasm_simd(void) {
-#if defined(__wasm_simd128__)
-    return 1;
-#else
-    return 0;
-#endif
+    return (ggml_cpu.features & GGML_CPU_WASM_SIMD) != 0;
 }
 
 int ggml_cpu_has_blas(void) {
@@ -18714,19 +20218,13 @@ int ggml_cpu_has_gpublas(void) {
 }
 
 int ggml_cpu_has_sse3(void) {
-#if defined(__SSE3__)
-    return 1;
-#else
-    return 0;
-#endif
+    return (ggml_cpu.features & GGML_CPU_SSE3) != 0;
 }
 
 int ggml_cpu_has_vsx(void) {
-#if defined(__POWER9_VECTOR__)
-    return 1;
-#else
-    return 0;
-#endif
+    return (ggml_cpu.features & GGML_CPU_VSX) != 0;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
+
+#endif // GGML_CPU_VARIANT
@@ -302,6 +302,8 @@ extern "C" {
         GGML_FTYPE_MOSTLY_Q4_K = 12, // except 1d tensors
         GGML_FTYPE_MOSTLY_Q5_K = 13, // except 1d tensors
         GGML_FTYPE_MOSTLY_Q6_K = 14, // except 1d tensors
+        GGML_FTYPE_MOSTLY_Q4_K_M = 15, // Q4_K, the tensors that are most sensitive to quantization are Q6_K
+        GGML_FTYPE_MOSTLY_Q5_K_M = 16, // Q5_K, the tensors that are most sensitive to quantization are Q6_K
     };
 
     // available tensor operations:
@@ -336,10 +338,12 @@ extern "C" {
         GGML_OP_SILU,
         GGML_OP_SILU_BACK,
         GGML_OP_NORM, // normalize
+        GGML_OP_NORM_AFFINE,
         GGML_OP_RMS_NORM,
         GGML_OP_RMS_NORM_BACK,
 
         GGML_OP_MUL_MAT,
+        GGML_OP_MUL_MAT_BIAS,
         GGML_OP_OUT_PROD,
 
         GGML_OP_SCALE,
@@ -365,6 +369,7 @@ extern "C" {
         GGML_OP_CONV_2D,
 
         GGML_OP_FLASH_ATTN,
+        GGML_OP_FLASH_ATTN_EXT,
         GGML_OP_FLASH_FF,
         GGML_OP_FLASH_ATTN_BACK,
         GGML_OP_WIN_PART,
@@ -428,6 +433,10 @@ extern "C" {
 
         void * data;
 
+        // views and in-place results share the data of view_src, starting at offset view_offs
+        struct ggml_tensor * view_src;
+        size_t               view_offs;
+
         char name[GGML_MAX_NAME];
 
         void * extra; // extra things e.g. for ggml-cuda.cu
@@ -437,6 +446,10 @@ extern "C" {
 
     static const size_t GGML_TENSOR_SIZE = sizeof(struct ggml_tensor);
 
+    // called after the compute thread ith has worked on the node node_n of the graph from t_start_us to t_end_us
+    // a node with several tasks is reported once per thread, and the calls come from all threads concurrently
+    typedef void (*ggml_graph_profile_callback)(int node_n, int ith, int64_t t_start_us, int64_t t_end_us, void * user_data);
+
     // computation graph
     struct ggml_cgraph {
         int n_nodes;
@@ -450,6 +463,10 @@ extern "C" {
         struct ggml_tensor * grads[GGML_MAX_NODES];
         struct ggml_tensor * leafs[GGML_MAX_NODES];
 
+        // optional per node profiling, the times are from ggml_time_us()
+        ggml_graph_profile_callback profile_cb;
+        void *                      profile_data;
+
         // performance
         int     perf_runs;
         int64_t perf_cycles;
@@ -582,7 +599,7 @@ extern "C" {
     GGML_API struct ggml_tensor * ggml_new_f32(struct ggml_context * ctx, float value);
 
     GGML_API struct ggml_tensor * ggml_dup_tensor (struct ggml_context * ctx, const struct ggml_tensor * src);
-    GGML_API struct ggml_tensor * ggml_view_tensor(struct ggml_context * ctx, const struct ggml_tensor * src);
+    GGML_API struct ggml_tensor * ggml_view_tensor(struct ggml_context * ctx, struct ggml_tensor * src);
 
     GGML_API struct ggml_tensor * ggml_get_tensor(struct ggml_context * ctx, const char * name);
 
@@ -611,6 +628,7 @@ extern "C" {
             struct ggml_context * ctx,
             struct ggml_tensor  * a);
 
+    // b is repeated to the shape of a if it is smaller (F32 only)
     GGML_API struct ggml_tensor * ggml_add(
             struct ggml_context * ctx,
             struct ggml_tensor  * a,
@@ -659,6 +677,7 @@ extern "C" {
             struct ggml_tensor  * a,
             struct ggml_tensor  * b);
 
+    // b is repeated across the rows of a if it is smaller (b->ne[0] == a->ne[0])
     GGML_API struct ggml_tensor * ggml_mul(
             struct ggml_context * ctx,
             struct ggml_tensor  * a,
@@ -833,6 +852,14 @@ extern "C" {
             struct ggml_context * ctx,
             struct ggml_tensor  * a);
 
+    // ggml_norm(a)*w + b in a single op, the result is identical to ggml_add(ggml_mul(ggml_norm(a), w), b)
+    // w and b are vectors with a->ne[0] elements
+    GGML_API struct ggml_tensor * ggml_norm_affine(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            struct ggml_tensor  * w,
+            struct ggml_tensor  * b);
+
     GGML_API struct ggml_tensor * ggml_rms_norm(
             struct ggml_context * ctx,
             struct ggml_tensor  * a);
@@ -856,6 +883,21 @@ extern "C" {
             struct ggml_tensor  * a,
             struct ggml_tensor  * b);
 
+    // ggml_mul_mat(a, b) + c, with c a vector of a->ne[1] elements
+    // the bias (and the GELU) is applied to each result while it is still in the cache
+    GGML_API struct ggml_tensor * ggml_mul_mat_bias(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            struct ggml_tensor  * b,
+            struct ggml_tensor  * c);
+
+    // ggml_gelu(ggml_mul_mat(a, b) + c)
+    GGML_API struct ggml_tensor * ggml_mul_mat_bias_gelu(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            struct ggml_tensor  * b,
+            struct ggml_tensor  * c);
+
     // A: m columns, n rows,
     // B: p columns, n rows,
     // result is m columns, p rows
@@ -1168,6 +1210,16 @@ extern "C" {
             struct ggml_tensor  * v,
             bool                  masked);
 
+    // q: [D, N, H], k and v: [D, M, H] - v has one row per key like k, so k and v can be F16 or quantized
+    // query row i attends to the keys up to n_past + i, n_past < 0 for no mask
+    // n_past is stored in an I32 tensor that can be changed before the graph is computed again
+    GGML_API struct ggml_tensor * ggml_flash_attn_ext(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * q,
+            struct ggml_tensor  * k,
+            struct ggml_tensor  * v,
+            int                   n_past);
+
     GGML_API struct ggml_tensor * ggml_flash_attn_back(
            struct ggml_context * ctx,
            struct ggml_tensor  * q,
@@ -1300,6 +1352,9 @@ extern "C" {
     GGML_API void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph);
     GGML_API void ggml_graph_reset  (struct ggml_cgraph * cgraph);
 
+    // size of the work buffer that ggml_graph_compute() allocates in the context for the graph
+    GGML_API size_t ggml_graph_work_size(struct ggml_cgraph * cgraph);
+
     GGML_API struct ggml_tensor * ggml_graph_get_tensor(struct ggml_cgraph * cgraph, const char * name);
 
     GGML_API void               ggml_graph_export(const struct ggml_cgraph * cgraph, const char * fname);
@@ -1311,6 +1366,42 @@ extern "C" {
     // dump the graph into a file using the dot format
     GGML_API void ggml_graph_dump_dot(const struct ggml_cgraph * gb, const struct ggml_cgraph * gf, const char * filename);
 
+    //
+    // graph allocator
+    //
+    // places the data of the tensors of a graph built in a no_alloc context in a single buffer, reusing the memory of
+    // the intermediate results that are not needed anymore
+    //
+    //   struct ggml_allocr * alloc = ggml_allocr_new_measure(alignment);
+    //   const size_t size = ggml_allocr_alloc_graph(alloc, &gf); // peak size of the buffer
+    //   ggml_allocr_free(alloc);
+    //
+    //   // ... build the graph again and place it in a buffer of the measured size
+    //   alloc = ggml_allocr_new(buf, size, alignment);
+    //   ggml_allocr_alloc(alloc, inp); // the inputs are allocated first and are never reused
+    //   ggml_allocr_alloc_graph(alloc, &gf);
+    //
+    //   ... set the inputs and compute, then ggml_allocr_reset() before the next graph
+    //
+
+    struct ggml_allocr;
+
+    GGML_API struct ggml_allocr * ggml_allocr_new        (void * data, size_t size, size_t alignment);
+    GGML_API struct ggml_allocr * ggml_allocr_new_measure(size_t alignment);
+    GGML_API void                 ggml_allocr_free       (struct ggml_allocr * alloc);
+
+    GGML_API bool   ggml_allocr_is_measure(const struct ggml_allocr * alloc);
+    GGML_API size_t ggml_allocr_max_size  (const struct ggml_allocr * alloc); // peak of the used buffer so far
+
+    // release all the tensors - the buffer can be used for a new graph
+    GGML_API void   ggml_allocr_reset(struct ggml_allocr * alloc);
+
+    // allocate a single tensor, e.g. an input of the graph
+    GGML_API void   ggml_allocr_alloc(struct ggml_allocr * alloc, struct ggml_tensor * tensor);
+
+    // allocate the nodes and the leafs of the graph that have no data yet, returns the peak size of the buffer
+    GGML_API size_t ggml_allocr_alloc_graph(struct ggml_allocr * alloc, struct ggml_cgraph * graph);
+
     //
     // optimization
     //
@@ -1492,6 +1583,10 @@ extern "C" {
     // system info
     //
 
+    // the SIMD features are those of the kernels in use - with GGML_CPU_DISPATCH they are selected for the CPU in
+    // ggml_init(), ggml_cpu_variant() returns the name of the selected set (e.g. "avx2")
+    GGML_API const char * ggml_cpu_variant(void);
+
     GGML_API int ggml_cpu_has_avx        (void);
     GGML_API int ggml_cpu_has_avx2       (void);
     GGML_API int ggml_cpu_has_avx512     (void);
@@ -0,0 +1,1418 @@
+#include "k_quants.h"
+
+#include <math.h>
+#include <string.h>
+#include <assert.h>
+
+#if defined(__AVX__) || defined(__AVX2__) || defined(__F16C__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#undef MIN
+#undef MAX
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+// the super-block scales are converted once per QK_K values, the conversion of ggml.c is used when there is no F16C
+#if defined(__F16C__)
+#define K_FP16_TO_FP32(x) _cvtsh_ss(x)
+#define K_FP32_TO_FP16(x) _cvtss_sh(x, 0)
+#elif defined(__ARM_NEON)
+#define K_FP16_TO_FP32(x) ((float) (x))
+#define K_FP32_TO_FP16(x) (x)
+#else
+#define K_FP16_TO_FP32(x) ggml_fp16_to_fp32(x)
+#define K_FP32_TO_FP16(x) ggml_fp32_to_fp16(x)
+#endif
+
+//
+// quantization helpers
+//
+
+static inline int nearest_int(float fval) {
+    assert(fval <= 4194303.f);
+    float val = fval + 12582912.f;
+    int i; memcpy(&i, &val, sizeof(int));
+    return (i & 0x007fffff) - 0x00400000;
+}
+
+// symmetric quantization of n values to [-nmax, nmax - 1], stored in L with an offset of nmax
+// a few scales around the one that maps the largest value to -nmax are tried, and the scale is the least squares fit
+// weighted with x^2 of the best rounding, so that the large values are more accurate
+static float make_qx_quants(int n, int nmax, const float * restrict x, int8_t * restrict L) {
+    float max  = 0;
+    float amax = 0;
+    for (int i = 0; i < n; ++i) {
+        const float ax = fabsf(x[i]);
+        if (ax > amax) { amax = ax; max = x[i]; }
+    }
+    if (!amax) {
+        for (int i = 0; i < n; ++i) {
+            L[i] = nmax;
+        }
+        return 0.f;
+    }
+
+    // the largest value maps to -nmax, the end of the range with one more level
+    float scale = 0.f;
+    float best  = 0.f;
+
+    for (int is = -4; is <= 4; ++is) {
+        const float iscale = -(nmax + 0.1f*is)/max;
+
+        float sumlx = 0;
+        float suml2 = 0;
+        for (int i = 0; i < n; ++i) {
+            int l = nearest_int(iscale*x[i]);
+            l = MAX(-nmax, MIN(nmax - 1, l));
+            const float w = x[i]*x[i];
+            sumlx += w*x[i]*l;
+            suml2 += w*l*l;
+        }
+
+        // the error of the least squares scale sumlx/suml2 is smaller when sumlx^2/suml2 is larger
+        if (suml2 > 0 && (scale == 0.f || sumlx*sumlx > best*suml2)) {
+            for (int i = 0; i < n; ++i) {
+                const int l = nearest_int(iscale*x[i]);
+                L[i] = nmax + MAX(-nmax, MIN(nmax - 1, l));
+            }
+            scale = sumlx/suml2;
+            best  = scale*sumlx;
+        }
+    }
+
+    return scale;
+}
+
+// asymmetric quantization of n values to [0, nmax] with x = scale*L - min, min >= 0
+static float make_qkx1_quants(int n, int nmax, const float * restrict x, uint8_t * restrict L, float * restrict the_min, int ntry) {
+    float min = x[0];
+    float max = x[0];
+    for (int i = 1; i < n; ++i) {
+        if (x[i] < min) min = x[i];
+        if (x[i] > max) max = x[i];
+    }
+    if (max == min) {
+        for (int i = 0; i < n; ++i) L[i] = 0;
+        *the_min = 0;
+        return 0.f;
+    }
+    if (min > 0) min = 0;
+
+    float iscale = nmax/(max - min);
+    float scale  = 1/iscale;
+
+    for (int itry = 0; itry < ntry; ++itry) {
+        float sumlx = 0;
+        int   suml2 = 0;
+        bool  did_change = false;
+        for (int i = 0; i < n; ++i) {
+            int l = nearest_int(iscale*(x[i] - min));
+            l = MAX(0, MIN(nmax, l));
+            if (itry == 0 || l != L[i]) {
+                L[i] = l;
+                did_change = true;
+            }
+            sumlx += (x[i] - min)*l;
+            suml2 += l*l;
+        }
+        if (suml2 == 0) {
+            break;
+        }
+        scale = sumlx/suml2;
+        float sum = 0;
+        for (int i = 0; i < n; ++i) {
+            sum += x[i] - scale*L[i];
+        }
+        min = sum/n;
+        if (min > 0) min = 0;
+        iscale = 1/scale;
+        if (!did_change) break;
+    }
+    *the_min = -min;
+    return scale;
+}
+
+static inline void get_scale_min_k4(int j, const uint8_t * restrict q, uint8_t * restrict d, uint8_t * restrict m) {
+    if (j < 4) {
+        *d = q[j] & 63; *m = q[j + 4] & 63;
+    } else {
+        *d = (q[j+4] & 0xF) | ((q[j-4] >> 6) << 4);
+        *m = (q[j+4] >>  4) | ((q[j-0] >> 6) << 4);
+    }
+}
+
+//
+// unpacking
+//
+// the quants of a super-block in element order, as unsigned integers - the dequantized value is d*sc*L - dmin*m
+// (q2_K, q4_K, q5_K) or d*sc*(L - offset) (q3_K, q6_K). The scalar kernels and the histograms are built on these
+//
+
+static void unpack_q2_K(const block_q2_K * restrict x, uint8_t * restrict L) {
+    for (int n = 0; n < QK_K; n += 128) {
+        const uint8_t * restrict q = x->qs + n/4;
+        for (int j = 0; j < 4; ++j) {
+            for (int l = 0; l < 32; ++l) {
+                L[n + 32*j + l] = (q[l] >> (2*j)) & 3;
+            }
+        }
+    }
+}
+
+static void unpack_q3_K(const block_q3_K * restrict x, uint8_t * restrict L) {
+    // the high bit of the i-th group of 32 quants is bit i of hmask
+    for (int n = 0; n < QK_K; n += 128) {
+        const uint8_t * restrict q = x->qs + n/4;
+        for (int j = 0; j < 4; ++j) {
+            const int m = n/32 + j;
+            for (int l = 0; l < 32; ++l) {
+                L[n + 32*j + l] = ((q[l] >> (2*j)) & 3) | (((x->hmask[l] >> m) & 1) << 2);
+            }
+        }
+    }
+}
+
+static void unpack_q4_K(const block_q4_K * restrict x, uint8_t * restrict L) {
+    for (int n = 0; n < QK_K; n += 64) {
+        const uint8_t * restrict q = x->qs + n/2;
+        for (int l = 0; l < 32; ++l) {
+            L[n +  0 + l] = q[l] & 0xF;
+            L[n + 32 + l] = q[l] >>  4;
+        }
+    }
+}
+
+static void unpack_q5_K(const block_q5_K * restrict x, uint8_t * restrict L) {
+    for (int n = 0; n < QK_K; n += 64) {
+        const uint8_t * restrict q = x->qs + n/2;
+        const int m = n/32;
+        for (int l = 0; l < 32; ++l) {
+            L[n +  0 + l] = (q[l] & 0xF) | (((x->qh[l] >> (m + 0)) & 1) << 4);
+            L[n + 32 + l] = (q[l] >>  4) | (((x->qh[l] >> (m + 1)) & 1) << 4);
+        }
+    }
+}
+
+static void unpack_q6_K(const block_q6_K * restrict x, uint8_t * restrict L) {
+    for (int n = 0; n < QK_K; n += 128) {
+        const uint8_t * restrict ql = x->ql + n/2;
+        const uint8_t * restrict qh = x->qh + n/4;
+        for (int l = 0; l < 32; ++l) {
+            L[n +  0 + l] = (ql[l +  0] & 0xF) | (((qh[l] >> 0) & 3) << 4);
+            L[n + 32 + l] = (ql[l + 32] & 0xF) | (((qh[l] >> 2) & 3) << 4);
+            L[n + 64 + l] = (ql[l +  0] >>  4) | (((qh[l] >> 4) & 3) << 4);
+            L[n + 96 + l] = (ql[l + 32] >>  4) | (((qh[l] >> 6) & 3) << 4);
+        }
+    }
+}
+
+// the 16 signed 6-bit scales of q3_K
+static inline void get_scales_q3_K(const uint8_t * restrict q, int * restrict sc) {
+    for (int j = 0; j < 16; ++j) {
+        const int lo = j < 8 ? q[j] & 0xF : q[j - 8] >> 4;
+        const int hi = (q[8 + j%4] >> (2*(j/4))) & 3;
+        sc[j] = (lo | (hi << 4)) - 32;
+    }
+}
+
+// the 8 scales and mins of q4_K and q5_K
+static inline void get_scales_mins_k4(const uint8_t * restrict q, int * restrict sc, int * restrict m) {
+    for (int j = 0; j < QK_K/32; ++j) {
+        uint8_t d8, m8;
+        get_scale_min_k4(j, q, &d8, &m8);
+        sc[j] = d8;
+        m[j]  = m8;
+    }
+}
+
+//
+// q2_K
+//
+
+void quantize_row_q2_K_reference(const float * restrict x, block_q2_K * restrict y, int k) {
+    assert(k % QK_K == 0);
+    const int nb = k / QK_K;
+
+    uint8_t L[QK_K];
+    float mins[QK_K/16];
+    float scales[QK_K/16];
+
+    const float q4scale = 15.f;
+
+    for (int i = 0; i < nb; i++) {
+        float max_scale = 0; // as we are deducting the min, scales are always positive
+        float max_min = 0;
+        for (int j = 0; j < QK_K/16; ++j) {
+            scales[j] = make_qkx1_quants(16, 3, x + 16*j, L + 16*j, &mins[j], 5);
+            max_scale = MAX(max_scale, scales[j]);
+            max_min   = MAX(max_min,   mins[j]);
+        }
+
+        if (max_scale > 0) {
+            const float iscale = q4scale/max_scale;
+            for (int j = 0; j < QK_K/16; ++j) {
+                y[i].scales[j] = MIN(15, nearest_int(iscale*scales[j]));
+            }
+            y[i].d = K_FP32_TO_FP16(max_scale/q4scale);
+        } else {
+            for (int j = 0; j < QK_K/16; ++j) y[i].scales[j] = 0;
+            y[i].d = K_FP32_TO_FP16(0.f);
+        }
+        if (max_min > 0) {
+            const float iscale = q4scale/max_min;
+            for (int j = 0; j < QK_K/16; ++j) {
+                y[i].scales[j] |= MIN(15, nearest_int(iscale*mins[j])) << 4;
+            }
+            y[i].dmin = K_FP32_TO_FP16(max_min/q4scale);
+        } else {
+            y[i].dmin = K_FP32_TO_FP16(0.f);
+        }
+
+        // requantize with the quantized scales and mins
+        for (int j = 0; j < QK_K/16; ++j) {
+            const float d = K_FP16_TO_FP32(y[i].d) * (y[i].scales[j] & 0xF);
+            if (!d) {
+                for (int ii = 0; ii < 16; ++ii) L[16*j + ii] = 0;
+                continue;
+            }
+            const float dm = K_FP16_TO_FP32(y[i].dmin) * (y[i].scales[j] >> 4);
+            for (int ii = 0; ii < 16; ++ii) {
+                const int l = nearest_int((x[16*j + ii] + dm)/d);
+                L[16*j + ii] = MAX(0, MIN(3, l));
+            }
+        }
+
+        for (int j = 0; j < QK_K; j += 128) {
+            for (int l = 0; l < 32; ++l) {
+                y[i].qs[j/4 + l] = L[j + l] | (L[j + l + 32] << 2) | (L[j + l + 64] << 4) | (L[j + l + 96] << 6);
+            }
+        }
+
+        x += QK_K;
+    }
+}
+
+void dequantize_row_q2_K(const block_q2_K * restrict x, float * restrict y, int k) {
+    assert(k % QK_K == 0);
+    const int nb = k / QK_K;
+
+    uint8_t L[QK_K];
+
+    for (int i = 0; i < nb; i++) {
+        const float d   = K_FP16_TO_FP32(x[i].d);
+        const float min = K_FP16_TO_FP32(x[i].dmin);
+
+        unpack_q2_K(&x[i], L);
+
+        for (int j = 0; j < QK_K/16; ++j) {
+            const float dl = d   * (x[i].scales[j] & 0xF);
+            const float ml = min * (x[i].scales[j] >>  4);
+            for (int l = 0; l < 16; ++l) {
+                *y++ = dl*L[16*j + l] - ml;
+            }
+        }
+    }
+}
+
+void quantize_row_q2_K(const float * restrict x, void * restrict vy, int k) {
+    quantize_row_q2_K_reference(x, vy, k);
+}
+
+size_t ggml_quantize_q2_K(const float * restrict src, void * restrict dst, int n, int k, int64_t * restrict hist) {
+    assert(k % QK_K == 0);
+    const int nb = k / QK_K;
+
+    uint8_t L[QK_K];
+
+    for (int j = 0; j < n; j += k) {
+        block_q2_K * restrict y = (block_q2_K *)dst + j/QK_K;
+        quantize_row_q2_K_reference(src + j, y, k);
+
+        for (int i = 0; i < nb; i++) {
+            unpack_q2_K(&y[i], L);
+            for (int l = 0; l < QK_K; ++l) hist[L[l] << 2]++;
+        }
+    }
+    return (n/QK_K*sizeof(block_q2_K));
+}
+
+//
+// q3_K
+//
+
+void quantize_row_q3_K_reference(const float * restrict x, block_q3_K * restrict y, int k) {
+    assert(k % QK_K == 0);
+    const int nb = k / QK_K;
+
+    int8_t L[QK_K];
+    float scales[QK_K / 16];
+    int sc[QK_K/16];
+
+    for (int i = 0; i < nb; i++) {
+        float max_scale = 0;
+        float amax = 0;
+        for (int j = 0; j < QK_K/16; ++j) {
+            scales[j] = make_qx_quants(16, 4, x + 16*j, L + 16*j);
+            const float scale = fabsf(scales[j]);
+            if (scale > amax) {
+                amax = scale; max_scale = scales[j];
+            }
+        }
+
+        memset(y[i].scales, 0, 12);
+        if (max_scale) {
+            const float iscale = -32.f/max_scale;
+            for (int j = 0; j < QK_K/16; ++j) {
+                int l = nearest_int(iscale*scales[j]);
+                l = MAX(-32, MIN(31, l)) + 32;
+                if (j < 8) {
+                    y[i].scales[j] = l & 0xF;
+                } else {
+                    y[i].scales[j-8] |= ((l & 0xF) << 4);
+                }
+                l >>= 4;
+                y[i].scales[j%4 + 8] |= (l << (2*(j/4)));
+            }
+            y[i].d = K_FP32_TO_FP16(1/iscale);
+        } else {
+            y[i].d = K_FP32_TO_FP16(0.f);
+        }
+
+        get_scales_q3_K(y[i].scales, sc);
+
+        for (int j = 0; j < QK_K/16; ++j) {
+            const float d = K_FP16_TO_FP32(y[i].d) * sc[j];
+            if (!d) {
+                for (int ii = 0; ii < 16; ++ii) L[16*j + ii] = 4;
+                continue;
+            }
+            for (int ii = 0; ii < 16; ++ii) {
+                const int l = nearest_int(x[16*j + ii]/d);
+                L[16*j + ii] = MAX(-4, MIN(3, l)) + 4;
+            }
+        }
+
+        // the high bit of the 1st 32 quants goes into bit 0 of hmask, the next 32 into bit 1, etc.
+        memset(y[i].hmask, 0, QK_K/8);
+        int m = 0;
+        uint8_t hm = 1;
+        for (int j = 0; j < QK_K; ++j) {
+            if (L[j] > 3) {
+                y[i].hmask[m] |= hm;
+                L[j] -= 4;
+            }
+            if (++m == QK_K/8) {
+                m = 0; hm <<= 1;
+            }
+        }
+        for (int j = 0; j < QK_K; j += 128) {
+            for (int l = 0; l < 32; ++l) {
+                y[i].qs[j/4 + l] = L[j + l] | (L[j + l + 32] << 2) | (L[j + l + 64] << 4) | (L[j + l + 96] << 6);
+            }
+        }
+
+        x += QK_K;
+    }
+}
+
+void dequantize_row_q3_K(const block_q3_K * restrict x, float * restrict y, int k) {
+    assert(k % QK_K == 0);
+    const int nb = k / QK_K;
+
+    uint8_t L[QK_K];
+    int sc[QK_K/16];
+
+    for (int i = 0; i < nb; i++) {
+        const float d = K_FP16_TO_FP32(x[i].d);
+
+        unpack_q3_K(&x[i], L);
+        get_scales_q3_K(x[i].scales, sc);
+
+        for (int j = 0; j < QK_K/16; ++j) {
+            const float dl = d*sc[j];
+            for (int l = 0; l < 16; ++l) {
+                *y++ = dl*((int) L[16*j + l] - 4);
+            }
+        }
+    }
+}
+
+void quantize_row_q3_K(const float * restrict x, void * restrict vy, int k) {
+    quantize_row_q3_K_reference(x, vy, k);
+}
+
+size_t ggml_quantize_q3_K(const float * restrict src, void * restrict dst, int n, int k, int64_t * restrict hist) {
+    assert(k % QK_K == 0);
+    const int nb = k / QK_K;
+
+    uint8_t L[QK_K];
+
+    for (int j = 0; j < n; j += k) {
+        block_q3_K * restrict y = (block_q3_K *)dst + j/QK_K;
+        quantize_row_q3_K_reference(src + j, y, k);
+
+        for (int i = 0; i < nb; i++) {
+            unpack_q3_K(&y[i], L);
+            for (int l = 0; l < QK_K; ++l) hist[L[l] << 1]++;
+        }
+    }
+    return (n/QK_K*sizeof(block_q3_K));
+}
+
+//
+// q4_K
+//
+
+// the 6-bit scales and mins of the 8 blocks of q4_K and q5_K, packed into 12 bytes
+static void pack_scales_mins_k4(const float * restrict scales, const float * restrict mins, uint8_t * restrict q,
+        ggml_fp16_t * restrict d, ggml_fp16_t * restrict dmin) {
+    float max_scale = 0;
+    float max_min   = 0;
+    for (int j = 0; j < QK_K/32; ++j) {
+        max_scale = MAX(max_scale, scales[j]);
+        max_min   = MAX(max_min,   mins[j]);
+    }
+
+    const float inv_scale = max_scale > 0 ? 63.f/max_scale : 0.f;
+    const float inv_min   = max_min   > 0 ? 63.f/max_min   : 0.f;
+
+    for (int j = 0; j < QK_K/32; ++j) {
+        const uint8_t ls = MIN(63, nearest_int(inv_scale*scales[j]));
+        const uint8_t lm = MIN(63, nearest_int(inv_min*mins[j]));
+        if (j < 4) {
+            q[j]     = ls;
+            q[j + 4] = lm;
+        } else {
+            q[j + 4]  = (ls & 0xF) | ((lm & 0xF) << 4);
+            q[j - 4] |= ((ls >> 4) << 6);
+            q[j - 0] |= ((lm >> 4) << 6);
+        }
+    }
+
+    *d    = K_FP32_TO_FP16(max_scale/63.f);
+    *dmin = K_FP32_TO_FP16(max_min/63.f);
+}
+
+void quantize_row_q4_K_reference(const float * restrict x, block_q4_K * restrict y, int k) {
+    assert(k % QK_K == 0);
+    const int nb = k / QK_K;
+
+    uint8_t L[QK_K];
+    float mins[QK_K/32];
+    float scales[QK_K/32];
+    int sc[QK_K/32];
+    int m[QK_K/32];
+
+    for (int i = 0; i < nb; i++) {
+        for (int j = 0; j < QK_K/32; ++j) {
+            scales[j] = make_qkx1_quants(32, 15, x + 32*j, L + 32*j, &mins[j], 5);
+        }
+
+        pack_scales_mins_k4(scales, mins, y[i].scales, &y[i].d, &y[i].dmin);
+        get_scales_mins_k4(y[i].scales, sc, m);
+
+        for (int j = 0; j < QK_K/32; ++j) {
+            const float d = K_FP16_TO_FP32(y[i].d) * sc[j];
+            if (!d) {
+                for (int ii = 0; ii < 32; ++ii) L[32*j + ii] = 0;
+                continue;
+            }
+            const float dm = K_FP16_TO_FP32(y[i].dmin) * m[j];
+            for (int ii = 0; ii < 32; ++ii) {
+                const int l = nearest_int((x[32*j + ii] + dm)/d);
+                L[32*j + ii] = MAX(0, MIN(15, l));
+            }
+        }
+
+        uint8_t * q = y[i].qs;
+        for (int j = 0; j < QK_K; j += 64) {
+            for (int l = 0; l < 32; ++l) q[l] = L[j + l] | (L[j + l + 32] << 4);
+            q += 32;
+        }
+
+        x += QK_K;
+    }
+}
+
+void dequantize_row_q4_K(const block_q4_K * restrict x, float * restrict y, int k) {
+    assert(k % QK_K == 0);
+    const int nb = k / QK_K;
+
+    uint8_t L[QK_K];
+    int sc[QK_K/32];
+    int m[QK_K/32];
+
+    for (int i = 0; i < nb; i++) {
+        const float d   = K_FP16_TO_FP32(x[i].d);
+        const float min = K_FP16_TO_FP32(x[i].dmin);
+
+        unpack_q4_K(&x[i], L);
+        get_scales_mins_k4(x[i].scales, sc, m);
+
+        for (int j = 0; j < QK_K/32; ++j) {
+            const float dl = d*sc[j];
+            const float ml = min*m[j];
+            for (int l = 0; l < 32; ++l) {
+                *y++ = dl*L[32*j + l] - ml;
+            }
+        }
+    }
+}
+
+void quantize_row_q4_K(const float * restrict x, void * restrict vy, int k) {
+    quantize_row_q4_K_reference(x, vy, k);
+}
+
+size_t ggml_quantize_q4_K(const float * restrict src, void * restrict dst, int n, int k, int64_t * restrict hist) {
+    assert(k % QK_K == 0);
+    const int nb = k / QK_K;
+
+    uint8_t L[QK_K];
+
+    for (int j = 0; j < n; j += k) {
+        block_q4_K * restrict y = (block_q4_K *)dst + j/QK_K;
+        quantize_row_q4_K_reference(src + j, y, k);
+
+        for (int i = 0; i < nb; i++) {
+            unpack_q4_K(&y[i], L);
+            for (int l = 0; l < QK_K; ++l) hist[L[l]]++;
+        }
+    }
+    return (n/QK_K*sizeof(block_q4_K));
+}
+
+//
+// q5_K
+//
+
+void quantize_row_q5_K_reference(const float * restrict x, block_q5_K * restrict y, int k) {
+    assert(k % QK_K == 0);
+    const int nb = k / QK_K;
+
+    uint8_t L[QK_K];
+    float mins[QK_K/32];
+    float scales[QK_K/32];
+    int sc[QK_K/32];
+    int m[QK_K/32];
+
+    for (int i = 0; i < nb; i++) {
+        for (int j = 0; j < QK_K/32; ++j) {
+            scales[j] = make_qkx1_quants(32, 31, x + 32*j, L + 32*j, &mins[j], 5);
+        }
+
+        pack_scales_mins_k4(scales, mins, y[i].scales, &y[i].d, &y[i].dmin);
+        get_scales_mins_k4(y[i].scales, sc, m);
+
+        for (int j = 0; j < QK_K/32; ++j) {
+            const float d = K_FP16_TO_FP32(y[i].d) * sc[j];
+            if (!d) {
+                for (int ii = 0; ii < 32; ++ii) L[32*j + ii] = 0;
+                continue;
+            }
+            const float dm = K_FP16_TO_FP32(y[i].dmin) * m[j];
+            for (int ii = 0; ii < 32; ++ii) {
+                const int l = nearest_int((x[32*j + ii] + dm)/d);
+                L[32*j + ii] = MAX(0, MIN(31, l));
+            }
+        }
+
+        // the high bit of the i-th group of 32 quants goes into bit i of qh
+        uint8_t * restrict qh = y[i].qh;
+        uint8_t * restrict ql = y[i].qs;
+        memset(qh, 0, QK_K/8);
+
+        uint8_t m1 = 1, m2 = 2;
+        for (int n = 0; n < QK_K; n += 64) {
+            for (int j = 0; j < 32; ++j) {
+                int l1 = L[n + j];
+                if (l1 > 15) {
+                    l1 -= 16; qh[j] |= m1;
+                }
+                int l2 = L[n + j + 32];
+                if (l2 > 15) {
+                    l2 -= 16; qh[j] |= m2;
+                }
+                ql[j] = l1 | (l2 << 4);
+            }
+            m1 <<= 2; m2 <<= 2;
+            ql += 32;
+        }
+
+        x += QK_K;
+    }
+}
+
+void dequantize_row_q5_K(const block_q5_K * restrict x, float * restrict y, int k) {
+    assert(k % QK_K == 0);
+    const int nb = k / QK_K;
+
+    uint8_t L[QK_K];
+    int sc[QK_K/32];
+    int m[QK_K/32];
+
+    for (int i = 0; i < nb; i++) {
+        const float d   = K_FP16_TO_FP32(x[i].d);
+        const float min = K_FP16_TO_FP32(x[i].dmin);
+
+        unpack_q5_K(&x[i], L);
+        get_scales_mins_k4(x[i].scales, sc, m);
+
+        for (int j = 0; j < QK_K/32; ++j) {
+            const float dl = d*sc[j];
+            const float ml = min*m[j];
+            for (int l = 0; l < 32; ++l) {
+                *y++ = dl*L[32*j + l] - ml;
+            }
+        }
+    }
+}
+
+void quantize_row_q5_K(const float * restrict x, void * restrict vy, int k) {
+    quantize_row_q5_K_reference(x, vy, k);
+}
+
+size_t ggml_quantize_q5_K(const float * restrict src, void * restrict dst, int n, int k, int64_t * restrict hist) {
+    assert(k % QK_K == 0);
+    const int nb = k / QK_K;
+
+    uint8_t L[QK_K];
+
+    for (int j = 0; j < n; j += k) {
+        block_q5_K * restrict y = (block_q5_K *)dst + j/QK_K;
+        quantize_row_q5_K_reference(src + j, y, k);
+
+        for (int i = 0; i < nb; i++) {
+            unpack_q5_K(&y[i], L);
+            for (int l = 0; l < QK_K; ++l) hist[L[l] >> 1]++;
+        }
+    }
+    return (n/QK_K*sizeof(block_q5_K));
+}
+
+//
+// q6_K
+//
+
+void quantize_row_q6_K_reference(const float * restrict x, block_q6_K * restrict y, int k) {
+    assert(k % QK_K == 0);
+    const int nb = k / QK_K;
+
+    int8_t L[QK_K];
+    float scales[QK_K/16];
+
+    for (int i = 0; i < nb; i++) {
+        float max_scale = 0;
+        float max_abs_scale = 0;
+
+        for (int ib = 0; ib < QK_K/16; ++ib) {
+            const float scale = make_qx_quants(16, 32, x + 16*ib, L + 16*ib);
+            scales[ib] = scale;
+
+            const float abs_scale = fabsf(scale);
+            if (abs_scale > max_abs_scale) {
+                max_abs_scale = abs_scale;
+                max_scale = scale;
+            }
+        }
+
+        if (!max_abs_scale) {
+            memset(&y[i], 0, sizeof(block_q6_K));
+            y[i].d = K_FP32_TO_FP16(0.f);
+            x += QK_K;
+            continue;
+        }
+
+        const float iscale = -128.f/max_scale;
+        y[i].d = K_FP32_TO_FP16(1/iscale);
+        for (int ib = 0; ib < QK_K/16; ++ib) {
+            y[i].scales[ib] = MIN(127, nearest_int(iscale*scales[ib]));
+        }
+
+        for (int j = 0; j < QK_K/16; ++j) {
+            const float d = K_FP16_TO_FP32(y[i].d) * y[i].scales[j];
+            if (!d) {
+                for (int ii = 0; ii < 16; ++ii) L[16*j + ii] = 32;
+                continue;
+            }
+            for (int ii = 0; ii < 16; ++ii) {
+                const int l = nearest_int(x[16*j + ii]/d);
+                L[16*j + ii] = MAX(-32, MIN(31, l)) + 32;
+            }
+        }
+
+        uint8_t * restrict ql = y[i].ql;
+        uint8_t * restrict qh = y[i].qh;
+        for (int j = 0; j < QK_K; j += 128) {
+            for (int l = 0; l < 32; ++l) {
+                const uint8_t q1 = L[j + l +  0] & 0xF;
+                const uint8_t q2 = L[j + l + 32] & 0xF;
+                const uint8_t q3 = L[j + l + 64] & 0xF;
+                const uint8_t q4 = L[j + l + 96] & 0xF;
+                ql[l +  0] = q1 | (q3 << 4);
+                ql[l + 32] = q2 | (q4 << 4);
+                qh[l] = (L[j + l] >> 4) | ((L[j + l + 32] >> 4) << 2) | ((L[j + l + 64] >> 4) << 4) | ((L[j + l + 96] >> 4) << 6);
+            }
+            ql += 64;
+            qh += 32;
+        }
+
+        x += QK_K;
+    }
+}
+
+void dequantize_row_q6_K(const block_q6_K * restrict x, float * restrict y, int k) {
+    assert(k % QK_K == 0);
+    const int nb = k / QK_K;
+
+    uint8_t L[QK_K];
+
+    for (int i = 0; i < nb; i++) {
+        const float d = K_FP16_TO_FP32(x[i].d);
+
+        unpack_q6_K(&x[i], L);
+
+        for (int j = 0; j < QK_K/16; ++j) {
+            const float dl = d*x[i].scales[j];
+            for (int l = 0; l < 16; ++l) {
+                *y++ = dl*((int) L[16*j + l] - 32);
+            }
+        }
+    }
+}
+
+void quantize_row_q6_K(const float * restrict x, void * restrict vy, int k) {
+    quantize_row_q6_K_reference(x, vy, k);
+}
+
+size_t ggml_quantize_q6_K(const float * restrict src, void * restrict dst, int n, int k, int64_t * restrict hist) {
+    assert(k % QK_K == 0);
+    const int nb = k / QK_K;
+
+    uint8_t L[QK_K];
+
+    for (int j = 0; j < n; j += k) {
+        block_q6_K * restrict y = (block_q6_K *)dst + j/QK_K;
+        quantize_row_q6_K_reference(src + j, y, k);
+
+        for (int i = 0; i < nb; i++) {
+            unpack_q6_K(&y[i], L);
+            for (int l = 0; l < QK_K; ++l) hist[L[l] >> 2]++;
+        }
+    }
+    return (n/QK_K*sizeof(block_q6_K));
+}
+
+//
+// q8_K
+//
+
+void quantize_row_q8_K_reference(const float * restrict x, block_q8_K * restrict y, int k) {
+    assert(k % QK_K == 0);
+    const int nb = k / QK_K;
+
+    for (int i = 0; i < nb; i++) {
+        float max  = 0;
+        float amax = 0;
+        for (int j = 0; j < QK_K; ++j) {
+            const float ax = fabsf(x[j]);
+            if (ax > amax) {
+                amax = ax; max = x[j];
+            }
+        }
+        if (!amax) {
+            y[i].d = 0;
+            memset(y[i].qs, 0, QK_K);
+            memset(y[i].bsums, 0, sizeof(y[i].bsums));
+            x += QK_K;
+            continue;
+        }
+        const float iscale = -128.f/max;
+        for (int j = 0; j < QK_K; ++j) {
+            const int v = nearest_int(iscale*x[j]);
+            y[i].qs[j] = MIN(127, v);
+        }
+        for (int j = 0; j < QK_K/16; ++j) {
+            int sum = 0;
+            for (int ii = 0; ii < 16; ++ii) {
+                sum += y[i].qs[j*16 + ii];
+            }
+            y[i].bsums[j] = sum;
+        }
+        y[i].d = 1/iscale;
+        x += QK_K;
+    }
+}
+
+void dequantize_row_q8_K(const block_q8_K * restrict x, float * restrict y, int k) {
+    assert(k % QK_K == 0);
+    const int nb = k / QK_K;
+
+    for (int i = 0; i < nb; i++) {
+        for (int j = 0; j < QK_K; ++j) {
+            *y++ = x[i].d * x[i].qs[j];
+        }
+    }
+}
+
+void quantize_row_q8_K(const float * restrict x, void * restrict y, int k) {
+    quantize_row_q8_K_reference(x, y, k);
+}
+
+//
+// dot products
+//
+// all kernels compute the integer dot products of the quants with the q8_K quants of a super-block, weighted with the
+// block scales. The offsets of q3_K and q6_K and the mins of q2_K, q4_K and q5_K are applied with the block sums of
+// q8_K (bsums), so the quants are always handled as unsigned integers - this maps directly onto maddubs on x86, and
+// on Arm the quants (< 64) are small enough to be multiplied as signed 8-bit integers
+//
+
+#if defined(__AVX2__)
+
+// horizontally add 8 floats
+static inline float hsum_float_8(const __m256 x) {
+    __m128 res = _mm256_extractf128_ps(x, 1);
+    res = _mm_add_ps(res, _mm256_castps256_ps128(x));
+    res = _mm_add_ps(res, _mm_movehl_ps(res, res));
+    res = _mm_add_ss(res, _mm_movehdup_ps(res));
+    return _mm_cvtss_f32(res);
+}
+
+// the scales of two blocks of 16 values, in the layout of the result of maddubs over 32 values
+static inline __m256i get_scale_16x2(int s0, int s1) {
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_set1_epi16(s0)), _mm_set1_epi16(s1), 1);
+}
+
+// sum_l u[l]*q8[l] over 32 values, multiplied with the scales and added to acc as 8 int32
+static inline __m256i dot_u8_q8_32(__m256i acc, const __m256i u, const int8_t * restrict q8, const __m256i scales) {
+    const __m256i p16 = _mm256_maddubs_epi16(u, _mm256_loadu_si256((const __m256i *) q8));
+    return _mm256_add_epi32(acc, _mm256_madd_epi16(p16, scales));
+}
+
+#elif defined(__ARM_NEON)
+
+static inline int hsum_i32_4(const int32x4_t x) {
+#if defined(__aarch64__)
+    return vaddvq_s32(x);
+#else
+    return vgetq_lane_s32(x, 0) + vgetq_lane_s32(x, 1) + vgetq_lane_s32(x, 2) + vgetq_lane_s32(x, 3);
+#endif
+}
+
+// sum_l u[l]*q8[l] over 16 values, as 4 int32
+static inline int32x4_t dot_u8_q8_16(const uint8x16_t u, const int8_t * restrict q8) {
+    const int8x16_t q = vreinterpretq_s8_u8(u);
+    const int8x16_t y = vld1q_s8(q8);
+#if defined(__ARM_FEATURE_DOTPROD)
+    return vdotq_s32(vdupq_n_s32(0), q, y);
+#else
+    const int16x8_t p0 = vmull_s8(vget_low_s8 (q), vget_low_s8 (y));
+    const int16x8_t p1 = vmull_s8(vget_high_s8(q), vget_high_s8(y));
+    return vaddq_s32(vpaddlq_s16(p0), vpaddlq_s16(p1));
+#endif
+}
+
+// the same over 32 values, in two halves
+static inline int32x4_t dot_u8_q8_32(const uint8x16_t u0, const uint8x16_t u1, const int8_t * restrict q8) {
+    return vaddq_s32(dot_u8_q8_16(u0, q8), dot_u8_q8_16(u1, q8 + 16));
+}
+
+#endif
+
+// sum_j sc[j]*bsums[j] over the blocks of 16 values, for the offsets and mins
+static inline int sum_bsums_16(const int16_t * restrict bsums, const int * restrict sc) {
+    int sum = 0;
+    for (int j = 0; j < QK_K/16; ++j) {
+        sum += sc[j]*bsums[j];
+    }
+    return sum;
+}
+
+static inline int sum_bsums_32(const int16_t * restrict bsums, const int * restrict m) {
+    int sum = 0;
+    for (int j = 0; j < QK_K/32; ++j) {
+        sum += m[j]*(bsums[2*j] + bsums[2*j + 1]);
+    }
+    return sum;
+}
+
+// the scalar kernels, on the unpacked quants
+static inline int dot_u8_q8(const uint8_t * restrict L, const int8_t * restrict q8, const int * restrict sc, int n) {
+    int isum = 0;
+    for (int j = 0; j < QK_K/n; ++j) {
+        int sumi = 0;
+        for (int l = 0; l < n; ++l) {
+            sumi += L[n*j + l]*q8[n*j + l];
+        }
+        isum += sc[j]*sumi;
+    }
+    return isum;
+}
+
+void ggml_vec_dot_q2_K_q8_K(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    const block_q2_K * restrict x = vx;
+    const block_q8_K * restrict y = vy;
+
+    const int nb = n / QK_K;
+
+    int sc[QK_K/16];
+    int m[QK_K/16];
+
+    float sumf = 0;
+
+#if defined(__AVX2__)
+    const __m256i m3 = _mm256_set1_epi8(3);
+
+    __m256 acc = _mm256_setzero_ps();
+
+    for (int i = 0; i < nb; ++i) {
+        for (int j = 0; j < QK_K/16; ++j) {
+            sc[j] = x[i].scales[j] & 0xF;
+            m[j]  = x[i].scales[j] >>  4;
+        }
+
+        __m256i sumi = _mm256_setzero_si256();
+
+        for (int ic = 0; ic < QK_K/128; ++ic) {
+            const __m256i q2 = _mm256_loadu_si256((const __m256i *)(x[i].qs + 32*ic));
+            for (int j = 0; j < 4; ++j) {
+                const int ib = 4*ic + j;
+                const __m256i u = _mm256_and_si256(_mm256_srli_epi16(q2, 2*j), m3);
+                sumi = dot_u8_q8_32(sumi, u, y[i].qs + 32*ib, get_scale_16x2(sc[2*ib], sc[2*ib + 1]));
+            }
+        }
+
+        const float d    = y[i].d * K_FP16_TO_FP32(x[i].d);
+        const float dmin = y[i].d * K_FP16_TO_FP32(x[i].dmin);
+
+        acc   = _mm256_fmadd_ps(_mm256_set1_ps(d), _mm256_cvtepi32_ps(sumi), acc);
+        sumf -= dmin*sum_bsums_16(y[i].bsums, m);
+    }
+
+    *s = hsum_float_8(acc) + sumf;
+#elif defined(__ARM_NEON)
+    const uint8x16_t m3 = vdupq_n_u8(3);
+
+    for (int i = 0; i < nb; ++i) {
+        for (int j = 0; j < QK_K/16; ++j) {
+            sc[j] = x[i].scales[j] & 0xF;
+            m[j]  = x[i].scales[j] >>  4;
+        }
+
+        int32x4_t sumi = vdupq_n_s32(0);
+
+        for (int ic = 0; ic < QK_K/128; ++ic) {
+            uint8x16_t q2_0 = vld1q_u8(x[i].qs + 32*ic +  0);
+            uint8x16_t q2_1 = vld1q_u8(x[i].qs + 32*ic + 16);
+            for (int j = 0; j < 4; ++j) {
+                const int ib = 4*ic + j;
+                sumi = vmlaq_n_s32(sumi, dot_u8_q8_16(vandq_u8(q2_0, m3), y[i].qs + 32*ib +  0), sc[2*ib + 0]);
+                sumi = vmlaq_n_s32(sumi, dot_u8_q8_16(vandq_u8(q2_1, m3), y[i].qs + 32*ib + 16), sc[2*ib + 1]);
+                q2_0 = vshrq_n_u8(q2_0, 2);
+                q2_1 = vshrq_n_u8(q2_1, 2);
+            }
+        }
+
+        const float d    = y[i].d * K_FP16_TO_FP32(x[i].d);
+        const float dmin = y[i].d * K_FP16_TO_FP32(x[i].dmin);
+
+        sumf += d*hsum_i32_4(sumi) - dmin*sum_bsums_16(y[i].bsums, m);
+    }
+
+    *s = sumf;
+#else
+    uint8_t L[QK_K];
+
+    for (int i = 0; i < nb; ++i) {
+        for (int j = 0; j < QK_K/16; ++j) {
+            sc[j] = x[i].scales[j] & 0xF;
+            m[j]  = x[i].scales[j] >>  4;
+        }
+
+        unpack_q2_K(&x[i], L);
+
+        const float d    = y[i].d * K_FP16_TO_FP32(x[i].d);
+        const float dmin = y[i].d * K_FP16_TO_FP32(x[i].dmin);
+
+        sumf += d*dot_u8_q8(L, y[i].qs, sc, 16) - dmin*sum_bsums_16(y[i].bsums, m);
+    }
+
+    *s = sumf;
+#endif
+}
+
+void ggml_vec_dot_q3_K_q8_K(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    const block_q3_K * restrict x = vx;
+    const block_q8_K * restrict y = vy;
+
+    const int nb = n / QK_K;
+
+    int sc[QK_K/16];
+
+    float sumf = 0;
+
+#if defined(__AVX2__)
+    const __m256i m3 = _mm256_set1_epi8(3);
+    const __m256i m1 = _mm256_set1_epi8(1);
+
+    __m256 acc = _mm256_setzero_ps();
+
+    for (int i = 0; i < nb; ++i) {
+        get_scales_q3_K(x[i].scales, sc);
+
+        const __m256i hbits = _mm256_loadu_si256((const __m256i *) x[i].hmask);
+
+        __m256i sumi = _mm256_setzero_si256();
+
+        for (int ic = 0; ic < QK_K/128; ++ic) {
+            const __m256i q3 = _mm256_loadu_si256((const __m256i *)(x[i].qs + 32*ic));
+            for (int j = 0; j < 4; ++j) {
+                const int ib = 4*ic + j;
+                const __m256i ql = _mm256_and_si256(_mm256_srli_epi16(q3, 2*j), m3);
+                const __m256i qh = _mm256_slli_epi16(_mm256_and_si256(_mm256_srli_epi16(hbits, ib), m1), 2);
+                sumi = dot_u8_q8_32(sumi, _mm256_or_si256(ql, qh), y[i].qs + 32*ib, get_scale_16x2(sc[2*ib], sc[2*ib + 1]));
+            }
+        }
+
+        const float d = y[i].d * K_FP16_TO_FP32(x[i].d);
+
+        acc   = _mm256_fmadd_ps(_mm256_set1_ps(d), _mm256_cvtepi32_ps(sumi), acc);
+        sumf -= d*4*sum_bsums_16(y[i].bsums, sc);
+    }
+
+    *s = hsum_float_8(acc) + sumf;
+#elif defined(__ARM_NEON)
+    const uint8x16_t m3 = vdupq_n_u8(3);
+    const uint8x16_t m1 = vdupq_n_u8(1);
+
+    for (int i = 0; i < nb; ++i) {
+        get_scales_q3_K(x[i].scales, sc);
+
+        // the high bits of the next group of 32 quants are in the lowest bit
+        uint8x16_t hbits_0 = vld1q_u8(x[i].hmask +  0);
+        uint8x16_t hbits_1 = vld1q_u8(x[i].hmask + 16);
+
+        int32x4_t sumi = vdupq_n_s32(0);
+
+        for (int ic = 0; ic < QK_K/128; ++ic) {
+            uint8x16_t q3_0 = vld1q_u8(x[i].qs + 32*ic +  0);
+            uint8x16_t q3_1 = vld1q_u8(x[i].qs + 32*ic + 16);
+            for (int j = 0; j < 4; ++j) {
+                const int ib = 4*ic + j;
+                const uint8x16_t u0 = vorrq_u8(vandq_u8(q3_0, m3), vshlq_n_u8(vandq_u8(hbits_0, m1), 2));
+                const uint8x16_t u1 = vorrq_u8(vandq_u8(q3_1, m3), vshlq_n_u8(vandq_u8(hbits_1, m1), 2));
+                sumi = vmlaq_n_s32(sumi, dot_u8_q8_16(u0, y[i].qs + 32*ib +  0), sc[2*ib + 0]);
+                sumi = vmlaq_n_s32(sumi, dot_u8_q8_16(u1, y[i].qs + 32*ib + 16), sc[2*ib + 1]);
+                q3_0    = vshrq_n_u8(q3_0, 2);
+                q3_1    = vshrq_n_u8(q3_1, 2);
+                hbits_0 = vshrq_n_u8(hbits_0, 1);
+                hbits_1 = vshrq_n_u8(hbits_1, 1);
+            }
+        }
+
+        const float d = y[i].d * K_FP16_TO_FP32(x[i].d);
+
+        sumf += d*(hsum_i32_4(sumi) - 4*sum_bsums_16(y[i].bsums, sc));
+    }
+
+    *s = sumf;
+#else
+    uint8_t L[QK_K];
+
+    for (int i = 0; i < nb; ++i) {
+        get_scales_q3_K(x[i].scales, sc);
+        unpack_q3_K(&x[i], L);
+
+        const float d = y[i].d * K_FP16_TO_FP32(x[i].d);
+
+        sumf += d*(dot_u8_q8(L, y[i].qs, sc, 16) - 4*sum_bsums_16(y[i].bsums, sc));
+    }
+
+    *s = sumf;
+#endif
+}
+
+void ggml_vec_dot_q4_K_q8_K(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    const block_q4_K * restrict x = vx;
+    const block_q8_K * restrict y = vy;
+
+    const int nb = n / QK_K;
+
+    int sc[QK_K/32];
+    int m[QK_K/32];
+
+    float sumf = 0;
+
+#if defined(__AVX2__)
+    const __m256i m4 = _mm256_set1_epi8(0xF);
+
+    __m256 acc = _mm256_setzero_ps();
+
+    for (int i = 0; i < nb; ++i) {
+        get_scales_mins_k4(x[i].scales, sc, m);
+
+        __m256i sumi = _mm256_setzero_si256();
+
+        for (int j = 0; j < QK_K/64; ++j) {
+            const __m256i q4 = _mm256_loadu_si256((const __m256i *)(x[i].qs + 32*j));
+            const __m256i q4l = _mm256_and_si256(q4, m4);
+            const __m256i q4h = _mm256_and_si256(_mm256_srli_epi16(q4, 4), m4);
+            sumi = dot_u8_q8_32(sumi, q4l, y[i].qs + 64*j +  0, _mm256_set1_epi16(sc[2*j + 0]));
+            sumi = dot_u8_q8_32(sumi, q4h, y[i].qs + 64*j + 32, _mm256_set1_epi16(sc[2*j + 1]));
+        }
+
+        const float d    = y[i].d * K_FP16_TO_FP32(x[i].d);
+        const float dmin = y[i].d * K_FP16_TO_FP32(x[i].dmin);
+
+        acc   = _mm256_fmadd_ps(_mm256_set1_ps(d), _mm256_cvtepi32_ps(sumi), acc);
+        sumf -= dmin*sum_bsums_32(y[i].bsums, m);
+    }
+
+    *s = hsum_float_8(acc) + sumf;
+#elif defined(__ARM_NEON)
+    const uint8x16_t m4 = vdupq_n_u8(0xF);
+
+    for (int i = 0; i < nb; ++i) {
+        get_scales_mins_k4(x[i].scales, sc, m);
+
+        int32x4_t sumi = vdupq_n_s32(0);
+
+        for (int j = 0; j < QK_K/64; ++j) {
+            const uint8x16_t q4_0 = vld1q_u8(x[i].qs + 32*j +  0);
+            const uint8x16_t q4_1 = vld1q_u8(x[i].qs + 32*j + 16);
+            sumi = vmlaq_n_s32(sumi, dot_u8_q8_32(vandq_u8(q4_0, m4), vandq_u8(q4_1, m4), y[i].qs + 64*j +  0), sc[2*j + 0]);
+            sumi = vmlaq_n_s32(sumi, dot_u8_q8_32(vshrq_n_u8(q4_0, 4), vshrq_n_u8(q4_1, 4), y[i].qs + 64*j + 32), sc[2*j + 1]);
+        }
+
+        const float d    = y[i].d * K_FP16_TO_FP32(x[i].d);
+        const float dmin = y[i].d * K_FP16_TO_FP32(x[i].dmin);
+
+        sumf += d*hsum_i32_4(sumi) - dmin*sum_bsums_32(y[i].bsums, m);
+    }
+
+    *s = sumf;
+#else
+    uint8_t L[QK_K];
+
+    for (int i = 0; i < nb; ++i) {
+        get_scales_mins_k4(x[i].scales, sc, m);
+        unpack_q4_K(&x[i], L);
+
+        const float d    = y[i].d * K_FP16_TO_FP32(x[i].d);
+        const float dmin = y[i].d * K_FP16_TO_FP32(x[i].dmin);
+
+        sumf += d*dot_u8_q8(L, y[i].qs, sc, 32) - dmin*sum_bsums_32(y[i].bsums, m);
+    }
+
+    *s = sumf;
+#endif
+}
+
+void ggml_vec_dot_q5_K_q8_K(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    const block_q5_K * restrict x = vx;
+    const block_q8_K * restrict y = vy;
+
+    const int nb = n / QK_K;
+
+    int sc[QK_K/32];
+    int m[QK_K/32];
+
+    float sumf = 0;
+
+#if defined(__AVX2__)
+    const __m256i m4 = _mm256_set1_epi8(0xF);
+    const __m256i m1 = _mm256_set1_epi8(1);
+
+    __m256 acc = _mm256_setzero_ps();
+
+    for (int i = 0; i < nb; ++i) {
+        get_scales_mins_k4(x[i].scales, sc, m);
+
+        const __m256i hbits = _mm256_loadu_si256((const __m256i *) x[i].qh);
+
+        __m256i sumi = _mm256_setzero_si256();
+
+        for (int j = 0; j < QK_K/64; ++j) {
+            const __m256i q5 = _mm256_loadu_si256((const __m256i *)(x[i].qs + 32*j));
+            const __m256i q5h_0 = _mm256_slli_epi16(_mm256_and_si256(_mm256_srli_epi16(hbits, 2*j + 0), m1), 4);
+            const __m256i q5h_1 = _mm256_slli_epi16(_mm256_and_si256(_mm256_srli_epi16(hbits, 2*j + 1), m1), 4);
+            const __m256i q5_0 = _mm256_or_si256(_mm256_and_si256(q5, m4), q5h_0);
+            const __m256i q5_1 = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(q5, 4), m4), q5h_1);
+            sumi = dot_u8_q8_32(sumi, q5_0, y[i].qs + 64*j +  0, _mm256_set1_epi16(sc[2*j + 0]));
+            sumi = dot_u8_q8_32(sumi, q5_1, y[i].qs + 64*j + 32, _mm256_set1_epi16(sc[2*j + 1]));
+        }
+
+        const float d    = y[i].d * K_FP16_TO_FP32(x[i].d);
+        const float dmin = y[i].d * K_FP16_TO_FP32(x[i].dmin);
+
+        acc   = _mm256_fmadd_ps(_mm256_set1_ps(d), _mm256_cvtepi32_ps(sumi), acc);
+        sumf -= dmin*sum_bsums_32(y[i].bsums, m);
+    }
+
+    *s = hsum_float_8(acc) + sumf;
+#elif defined(__ARM_NEON)
+    const uint8x16_t m4 = vdupq_n_u8(0xF);
+    const uint8x16_t m1 = vdupq_n_u8(1);
+
+    for (int i = 0; i < nb; ++i) {
+        get_scales_mins_k4(x[i].scales, sc, m);
+
+        // the high bits of the next group of 32 quants are in the lowest bit
+        uint8x16_t hbits_0 = vld1q_u8(x[i].qh +  0);
+        uint8x16_t hbits_1 = vld1q_u8(x[i].qh + 16);
+
+        int32x4_t sumi = vdupq_n_s32(0);
+
+        for (int j = 0; j < QK_K/64; ++j) {
+            const uint8x16_t q5_0 = vld1q_u8(x[i].qs + 32*j +  0);
+            const uint8x16_t q5_1 = vld1q_u8(x[i].qs + 32*j + 16);
+
+            const uint8x16_t u0 = vorrq_u8(vandq_u8(q5_0, m4), vshlq_n_u8(vandq_u8(hbits_0, m1), 4));
+            const uint8x16_t u1 = vorrq_u8(vandq_u8(q5_1, m4), vshlq_n_u8(vandq_u8(hbits_1, m1), 4));
+            hbits_0 = vshrq_n_u8(hbits_0, 1);
+            hbits_1 = vshrq_n_u8(hbits_1, 1);
+
+            const uint8x16_t u2 = vorrq_u8(vshrq_n_u8(q5_0, 4), vshlq_n_u8(vandq_u8(hbits_0, m1), 4));
+            const uint8x16_t u3 = vorrq_u8(vshrq_n_u8(q5_1, 4), vshlq_n_u8(vandq_u8(hbits_1, m1), 4));
+            hbits_0 = vshrq_n_u8(hbits_0, 1);
+            hbits_1 = vshrq_n_u8(hbits_1, 1);
+
+            sumi = vmlaq_n_s32(sumi, dot_u8_q8_32(u0, u1, y[i].qs + 64*j +  0), sc[2*j + 0]);
+            sumi = vmlaq_n_s32(sumi, dot_u8_q8_32(u2, u3, y[i].qs + 64*j + 32), sc[2*j + 1]);
+        }
+
+        const float d    = y[i].d * K_FP16_TO_FP32(x[i].d);
+        const float dmin = y[i].d * K_FP16_TO_FP32(x[i].dmin);
+
+        sumf += d*hsum_i32_4(sumi) - dmin*sum_bsums_32(y[i].bsums, m);
+    }
+
+    *s = sumf;
+#else
+    uint8_t L[QK_K];
+
+    for (int i = 0; i < nb; ++i) {
+        get_scales_mins_k4(x[i].scales, sc, m);
+        unpack_q5_K(&x[i], L);
+
+        const float d    = y[i].d * K_FP16_TO_FP32(x[i].d);
+        const float dmin = y[i].d * K_FP16_TO_FP32(x[i].dmin);
+
+        sumf += d*dot_u8_q8(L, y[i].qs, sc, 32) - dmin*sum_bsums_32(y[i].bsums, m);
+    }
+
+    *s = sumf;
+#endif
+}
+
+void ggml_vec_dot_q6_K_q8_K(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    const block_q6_K * restrict x = vx;
+    const block_q8_K * restrict y = vy;
+
+    const int nb = n / QK_K;
+
+    int sc[QK_K/16];
+
+    float sumf = 0;
+
+#if defined(__AVX2__)
+    const __m256i m4 = _mm256_set1_epi8(0xF);
+    const __m256i m3 = _mm256_set1_epi8(3);
+
+    __m256 acc = _mm256_setzero_ps();
+
+    for (int i = 0; i < nb; ++i) {
+        for (int j = 0; j < QK_K/16; ++j) {
+            sc[j] = x[i].scales[j];
+        }
+
+        __m256i sumi = _mm256_setzero_si256();
+
+        for (int ic = 0; ic < QK_K/128; ++ic) {
+            const __m256i ql0 = _mm256_loadu_si256((const __m256i *)(x[i].ql + 64*ic +  0));
+            const __m256i ql1 = _mm256_loadu_si256((const __m256i *)(x[i].ql + 64*ic + 32));
+            const __m256i qh  = _mm256_loadu_si256((const __m256i *)(x[i].qh + 32*ic));
+
+            for (int j = 0; j < 4; ++j) {
+                const int ib = 4*ic + j;
+                const __m256i ql = j % 2 == 0 ? ql0 : ql1;
+                const __m256i lo = _mm256_and_si256(j < 2 ? ql : _mm256_srli_epi16(ql, 4), m4);
+                const __m256i hi = _mm256_slli_epi16(_mm256_and_si256(_mm256_srli_epi16(qh, 2*j), m3), 4);
+                sumi = dot_u8_q8_32(sumi, _mm256_or_si256(lo, hi), y[i].qs + 32*ib, get_scale_16x2(sc[2*ib], sc[2*ib + 1]));
+            }
+        }
+
+        const float d = y[i].d * K_FP16_TO_FP32(x[i].d);
+
+        acc   = _mm256_fmadd_ps(_mm256_set1_ps(d), _mm256_cvtepi32_ps(sumi), acc);
+        sumf -= d*32*sum_bsums_16(y[i].bsums, sc);
+    }
+
+    *s = hsum_float_8(acc) + sumf;
+#elif defined(__ARM_NEON)
+    const uint8x16_t m4 = vdupq_n_u8(0xF);
+    const uint8x16_t m3 = vdupq_n_u8(3);
+
+    for (int i = 0; i < nb; ++i) {
+        for (int j = 0; j < QK_K/16; ++j) {
+            sc[j] = x[i].scales[j];
+        }
+
+        int32x4_t sumi = vdupq_n_s32(0);
+
+        for (int ic = 0; ic < QK_K/128; ++ic) {
+            // ql holds the low 4 bits of the groups 0 and 2 (ql0) and 1 and 3 (ql1), qh the high 2 bits of all 4
+            const uint8x16_t ql0_0 = vld1q_u8(x[i].ql + 64*ic +  0);
+            const uint8x16_t ql0_1 = vld1q_u8(x[i].ql + 64*ic + 16);
+            const uint8x16_t ql1_0 = vld1q_u8(x[i].ql + 64*ic + 32);
+            const uint8x16_t ql1_1 = vld1q_u8(x[i].ql + 64*ic + 48);
+
+            uint8x16_t qh_0 = vld1q_u8(x[i].qh + 32*ic +  0);
+            uint8x16_t qh_1 = vld1q_u8(x[i].qh + 32*ic + 16);
+
+            for (int j = 0; j < 4; ++j) {
+                const int ib = 4*ic + j;
+
+                const uint8x16_t ql_0 = j % 2 == 0 ? ql0_0 : ql1_0;
+                const uint8x16_t ql_1 = j % 2 == 0 ? ql0_1 : ql1_1;
+
+                const uint8x16_t lo_0 = j < 2 ? vandq_u8(ql_0, m4) : vshrq_n_u8(ql_0, 4);
+                const uint8x16_t lo_1 = j < 2 ? vandq_u8(ql_1, m4) : vshrq_n_u8(ql_1, 4);
+
+                const uint8x16_t u0 = vorrq_u8(lo_0, vshlq_n_u8(vandq_u8(qh_0, m3), 4));
+                const uint8x16_t u1 = vorrq_u8(lo_1, vshlq_n_u8(vandq_u8(qh_1, m3), 4));
+                qh_0 = vshrq_n_u8(qh_0, 2);
+                qh_1 = vshrq_n_u8(qh_1, 2);
+
+                sumi = vmlaq_n_s32(sumi, dot_u8_q8_16(u0, y[i].qs + 32*ib +  0), sc[2*ib + 0]);
+                sumi = vmlaq_n_s32(sumi, dot_u8_q8_16(u1, y[i].qs + 32*ib + 16), sc[2*ib + 1]);
+            }
+        }
+
+        const float d = y[i].d * K_FP16_TO_FP32(x[i].d);
+
+        sumf += d*(hsum_i32_4(sumi) - 32*sum_bsums_16(y[i].bsums, sc));
+    }
+
+    *s = sumf;
+#else
+    uint8_t L[QK_K];
+
+    for (int i = 0; i < nb; ++i) {
+        for (int j = 0; j < QK_K/16; ++j) {
+            sc[j] = x[i].scales[j];
+        }
+
+        unpack_q6_K(&x[i], L);
+
+        const float d = y[i].d * K_FP16_TO_FP32(x[i].d);
+
+        sumf += d*(dot_u8_q8(L, y[i].qs, sc, 16) - 32*sum_bsums_16(y[i].bsums, sc));
+    }
+
+    *s = sumf;
+#endif
+}
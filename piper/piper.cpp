@@ -211,14 +211,17 @@ void terminate(PiperConfig &config) {
   //spdlog::info("Terminated piper");
 }
 
-void loadModel(std::string modelPath, ModelSession &session) {
+void loadModel(std::string modelPath, ModelSession &session, int numThreads) {
   //spdlog::debug("Loading onnx model from {}", modelPath);
   session.env = Ort::Env(OrtLoggingLevel::ORT_LOGGING_LEVEL_WARNING,
                          instanceName.c_str());
   session.env.DisableTelemetryEvents();
 
-  // Slows down performance by ~2x
-  // session.options.SetIntraOpNumThreads(1);
+  // Slows down performance by ~2x with 1 thread, but leaves the cores to the
+  // other work of the application
+  if (numThreads > 0) {
+    session.options.SetIntraOpNumThreads(numThreads);
+  }
 
   // Roughly doubles load time for no visible inference benefit
   // session.options.SetGraphOptimizationLevel(
@@ -265,7 +268,7 @@ void loadVoice(PiperConfig &config, std::string modelPath,
 
   //spdlog::debug("Voice contains {} speaker(s)", voice.modelConfig.numSpeakers);
 
-  loadModel(modelPath, voice.session);
+  loadModel(modelPath, voice.session, config.numThreads);
 
 } /* loadVoice */
 
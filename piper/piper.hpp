@@ -31,6 +31,9 @@ struct PiperConfig {
   bool useTashkeel = false;
   std::optional<std::string> tashkeelModelPath;
   std::unique_ptr<tashkeel::State> tashkeelState;
+
+  // Threads used by onnxruntime within an operator (0 = onnxruntime default)
+  int numThreads = 0;
 };
 
 enum PhonemeType { eSpeakPhonemes, TextPhonemes };
@@ -0,0 +1,168 @@
+// quantize -> dequantize round trip and vec_dot of every quantized type, against the float data
+// pass any argument to print the errors of the types that pass
+
+#include "ggml.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N_TEST 4096 // a multiple of every block size (QK_K = 256)
+
+// the RMS error allowed after a round trip, for data with |x| <= ~2 - roughly halves with each extra bit
+static const float max_round_trip_error[GGML_TYPE_COUNT] = {
+    [GGML_TYPE_Q4_0] = 0.10f,
+    [GGML_TYPE_Q4_1] = 0.10f,
+    [GGML_TYPE_Q5_0] = 0.05f,
+    [GGML_TYPE_Q5_1] = 0.05f,
+    [GGML_TYPE_Q8_0] = 0.008f,
+    [GGML_TYPE_Q8_1] = 0.008f,
+    [GGML_TYPE_Q2_K] = 0.40f,
+    [GGML_TYPE_Q3_K] = 0.22f,
+    [GGML_TYPE_Q4_K] = 0.10f,
+    [GGML_TYPE_Q5_K] = 0.05f,
+    [GGML_TYPE_Q6_K] = 0.025f,
+};
+
+// the error allowed in vec_dot_q, per element
+#define MAX_DOT_PRODUCT_ERROR 0.02f
+
+static void fill(float * dst, int n, float offset) {
+    for (int i = 0; i < n; i++) {
+        dst[i] = 0.1f + 2.0f*cosf(i + offset);
+    }
+}
+
+static float rms_diff(const float * a, const float * b, int n) {
+    double sum = 0.0;
+    for (int i = 0; i < n; i++) {
+        const double d = a[i] - b[i];
+        sum += d*d;
+    }
+    return sqrt(sum/n);
+}
+
+static float round_trip_error(const quantize_fns_t * qfns, const float * src, int n) {
+    void  * q   = malloc(n*sizeof(float));
+    float * out = malloc(n*sizeof(float));
+
+    qfns->quantize_row_q(src, q, n);
+    qfns->dequantize_row_q(q, out, n);
+
+    const float err = rms_diff(src, out, n);
+
+    free(out);
+    free(q);
+
+    return err;
+}
+
+static float reference_error(const quantize_fns_t * qfns, const float * src, int n) {
+    void  * q   = malloc(n*sizeof(float));
+    void  * ref = malloc(n*sizeof(float));
+    float * out = malloc(n*sizeof(float));
+    float * out_ref = malloc(n*sizeof(float));
+
+    qfns->quantize_row_q(src, q, n);
+    qfns->quantize_row_q_reference(src, ref, n);
+    qfns->dequantize_row_q(q, out, n);
+    qfns->dequantize_row_q(ref, out_ref, n);
+
+    const float err = rms_diff(out, out_ref, n);
+
+    free(out_ref);
+    free(out);
+    free(ref);
+    free(q);
+
+    return err;
+}
+
+static float dot_product_error(const quantize_fns_t * qfns, const float * x, const float * y, int n) {
+    void * qx = malloc(n*sizeof(float));
+    void * qy = malloc(n*sizeof(float));
+
+    qfns->quantize_row_q(x, qx, n);
+    qfns->quantize_row_q_dot(y, qy, n);
+
+    float result = INFINITY;
+    qfns->vec_dot_q(n, &result, qx, qy);
+
+    double dot = 0.0;
+    for (int i = 0; i < n; i++) {
+        dot += x[i]*y[i];
+    }
+
+    free(qy);
+    free(qx);
+
+    return fabs(result - dot)/n;
+}
+
+int main(int argc, char ** argv) {
+    (void) argv;
+
+    const bool verbose = argc > 1;
+
+    // ggml_init selects the kernels for this CPU
+    struct ggml_init_params params = { 1024, NULL, true };
+    struct ggml_context * ctx = ggml_init(params);
+
+    static float x[N_TEST];
+    static float y[N_TEST];
+
+    fill(x, N_TEST, 0.0f);
+    fill(y, N_TEST, 1.0f);
+
+    int n_failed = 0;
+
+    for (int i = 0; i < GGML_TYPE_COUNT; i++) {
+        const enum ggml_type type = (enum ggml_type) i;
+        const quantize_fns_t qfns = ggml_internal_get_quantize_fn(i);
+
+        if (qfns.quantize_row_q == NULL || qfns.dequantize_row_q == NULL || max_round_trip_error[i] == 0.0f) {
+            continue;
+        }
+
+        const char * name = ggml_type_name(type);
+
+        const float max_error = max_round_trip_error[i];
+
+        const float err_round_trip = round_trip_error(&qfns, x, N_TEST);
+        if (err_round_trip > max_error) {
+            printf("%5s: round trip error %f > %f\n", name, err_round_trip, max_error);
+            n_failed++;
+        } else if (verbose) {
+            printf("%5s: round trip error %f\n", name, err_round_trip);
+        }
+
+        if (qfns.quantize_row_q_reference) {
+            const float err_reference = reference_error(&qfns, x, N_TEST);
+            if (err_reference > max_error) {
+                printf("%5s: reference quantization error %f > %f\n", name, err_reference, max_error);
+                n_failed++;
+            } else if (verbose) {
+                printf("%5s: reference quantization error %f\n", name, err_reference);
+            }
+        }
+
+        if (qfns.vec_dot_q) {
+            const float err_dot = dot_product_error(&qfns, x, y, N_TEST);
+            if (err_dot > MAX_DOT_PRODUCT_ERROR) {
+                printf("%5s: dot product error %f > %f\n", name, err_dot, MAX_DOT_PRODUCT_ERROR);
+                n_failed++;
+            } else if (verbose) {
+                printf("%5s: dot product error %f\n", name, err_dot);
+            }
+        }
+    }
+
+    ggml_free(ctx);
+
+    if (n_failed > 0) {
+        printf("%d checks failed\n", n_failed);
+    }
+
+    return n_failed > 0 ? 1 : 0;
+}
@@ -11,12 +11,17 @@
 
 #include <algorithm>
 #include <cassert>
+#include <cinttypes>
+#include <condition_variable>
 #define _USE_MATH_DEFINES
 #include <cmath>
 #include <cstdio>
 #include <cstring>
 #include <fstream>
+#include <limits>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <thread>
 #include <vector>
@@ -109,12 +114,29 @@ static void byteswap_tensor(ggml_tensor * tensor) {
 #define WHISPER_PRINT_DEBUG(...)
 #endif
 
-//#define WHISPER_USE_FLASH_ATTN
+// the attention uses ggml_flash_attn and ggml_flash_attn_ext, which never store the KQ matrix - the decoder KV caches
+// then hold V with one row per position like K, so they can be quantized (see whisper_ctx_set_kv_q8_0)
+// define this to compute the attention with mul_mat and soft_max instead
+//#define WHISPER_NO_FLASH_ATTN
 //#define WHISPER_USE_FLASH_FF
 #define WHISPER_MAX_DECODERS 16
 
-#define WHISPER_USE_SCRATCH
-#define WHISPER_MAX_SCRATCH_BUFFERS 16
+// alignment of the tensors in the compute buffer
+#define WHISPER_TENSOR_ALIGNMENT 32
+
+// the single token decoder graphs are built once per this many KV cache entries and then reused
+#define WHISPER_DECODE_GRAPH_N_KV_STEP 64
+// the context of the cached decoder graphs can hold this many graphs
+#define WHISPER_DECODE_GRAPH_CACHE_SIZE 8
+
+// the profiler stops recording the trace after this many spans, the per op totals are still updated
+#define WHISPER_PROFILE_MAX_SPANS (1 << 20)
+
+// whisper_full_parallel: look for silence up to this far from the nominal split points
+#define WHISPER_PARALLEL_SPLIT_SEARCH_MS 3000
+#define WHISPER_PARALLEL_SPLIT_WINDOW_MS 100
+// whisper_full_parallel: audio before each split point that is decoded to warm up the context
+#define WHISPER_PARALLEL_LEAD_IN_MS      10000
 
 // available whisper models
 enum e_model {
@@ -230,104 +252,6 @@ static const std::map<std::string, std::pair<int, std::string>> g_lang = {
 
 static const size_t MB = 1ull*1024*1024;
 
-static const std::map<e_model, size_t> MEM_REQ_SCRATCH0 = {
-    { MODEL_TINY,     62ull*MB },
-    { MODEL_BASE,     80ull*MB },
-    { MODEL_SMALL,   120ull*MB },
-    { MODEL_MEDIUM,  158ull*MB },
-    { MODEL_LARGE,   198ull*MB },
-};
-
-static const std::map<e_model, size_t> MEM_REQ_SCRATCH1 = {
-    { MODEL_TINY,     18ull*MB },
-    { MODEL_BASE,     24ull*MB },
-    { MODEL_SMALL,    36ull*MB },
-    { MODEL_MEDIUM,   48ull*MB },
-    { MODEL_LARGE,    60ull*MB },
-};
-
-static const std::map<e_model, size_t> MEM_REQ_SCRATCH2 = {
-    { MODEL_TINY,      4ull*MB },
-    { MODEL_BASE,      4ull*MB },
-    { MODEL_SMALL,     6ull*MB },
-    { MODEL_MEDIUM,    7ull*MB },
-    { MODEL_LARGE,     9ull*MB },
-};
-
-static const std::map<e_model, size_t> MEM_REQ_SCRATCH3 = {
-    { MODEL_TINY,      4ull*MB },
-    { MODEL_BASE,      4ull*MB },
-    { MODEL_SMALL,     6ull*MB },
-    { MODEL_MEDIUM,    7ull*MB },
-    { MODEL_LARGE,     9ull*MB },
-};
-
-static const std::map<ggml_type, std::map<e_model, size_t>> MEM_REQ_MODEL = {
-    { GGML_TYPE_F32,
-        {
-            { MODEL_TINY,     74ull*MB },
-            { MODEL_BASE,    142ull*MB },
-            { MODEL_SMALL,   466ull*MB },
-            { MODEL_MEDIUM, 1464ull*MB },
-            { MODEL_LARGE,  2952ull*MB },
-        },
-    },
-    { GGML_TYPE_F16,
-        {
-            { MODEL_TINY,     74ull*MB },
-            { MODEL_BASE,    142ull*MB },
-            { MODEL_SMALL,   466ull*MB },
-            { MODEL_MEDIUM, 1464ull*MB },
-            { MODEL_LARGE,  2952ull*MB },
-        },
-    },
-    { GGML_TYPE_Q4_0,
-        {
-            { MODEL_TINY,     26ull*MB },
-            { MODEL_BASE,     50ull*MB },
-            { MODEL_SMALL,   154ull*MB },
-            { MODEL_MEDIUM,  470ull*MB },
-            { MODEL_LARGE,   940ull*MB },
-        },
-    },
-    { GGML_TYPE_Q4_1,
-        {
-            { MODEL_TINY,     32ull*MB },
-            { MODEL_BASE,     58ull*MB },
-            { MODEL_SMALL,   182ull*MB },
-            { MODEL_MEDIUM,  562ull*MB },
-            { MODEL_LARGE,  1124ull*MB },
-        },
-    },
-    { GGML_TYPE_Q5_0,
-        {
-            { MODEL_TINY,     30ull*MB },
-            { MODEL_BASE,     54ull*MB },
-            { MODEL_SMALL,   170ull*MB },
-            { MODEL_MEDIUM,  516ull*MB },
-            { MODEL_LARGE,  1034ull*MB },
-        },
-    },
-    { GGML_TYPE_Q5_1,
-        {
-            { MODEL_TINY,     32ull*MB },
-            { MODEL_BASE,     58ull*MB },
-            { MODEL_SMALL,   182ull*MB },
-            { MODEL_MEDIUM,  562ull*MB },
-            { MODEL_LARGE,  1124ull*MB },
-        },
-    },
-    { GGML_TYPE_Q8_0,
-        {
-            { MODEL_TINY,     45ull*MB },
-            { MODEL_BASE,     84ull*MB },
-            { MODEL_SMALL,   268ull*MB },
-            { MODEL_MEDIUM,  834ull*MB },
-            { MODEL_LARGE,  1674ull*MB },
-        },
-    },
-};
-
 static const std::map<e_model, size_t> MEM_REQ_KV_SELF = {
     { MODEL_TINY,      3ull*MB },
     { MODEL_BASE,      6ull*MB },
@@ -344,22 +268,6 @@ static const std::map<e_model, size_t> MEM_REQ_KV_CROSS = {
     { MODEL_LARGE,   235ull*MB },
 };
 
-static const std::map<e_model, size_t> MEM_REQ_ENCODE = {
-    { MODEL_TINY,     30ull*MB },
-    { MODEL_BASE,     38ull*MB },
-    { MODEL_SMALL,    56ull*MB },
-    { MODEL_MEDIUM,   74ull*MB },
-    { MODEL_LARGE,    94ull*MB },
-};
-
-static const std::map<e_model, size_t> MEM_REQ_DECODE = {
-    { MODEL_TINY,      3ull*MB },
-    { MODEL_BASE,      5ull*MB },
-    { MODEL_SMALL,    10ull*MB },
-    { MODEL_MEDIUM,   18ull*MB },
-    { MODEL_LARGE,    27ull*MB },
-};
-
 struct whisper_mel {
     int n_len;
     int n_len_org;
@@ -598,6 +506,26 @@ struct whisper_sequence {
     double score;            // likelihood rank score
 };
 
+struct whisper_partial_utf8 {
+    uint32_t value;    // bit value so far (unshifted)
+    int      n_remain; // num bytes remaining; -1 indicates invalid sequence
+};
+
+struct whisper_grammar {
+    // the stacks point into the rules, so the rules are shared (and never modified) between copies of the grammar
+    std::shared_ptr<const std::vector<std::vector<whisper_grammar_element>>> rules;
+    std::vector<std::vector<const whisper_grammar_element *>>                stacks;
+
+    // buffer for partially generated UTF-8 sequence from accepted tokens
+    whisper_partial_utf8 partial_utf8;
+};
+
+struct whisper_grammar_candidate {
+    whisper_token          id;
+    const uint32_t       * code_points;
+    whisper_partial_utf8   partial_utf8;
+};
+
 // TAGS: WHISPER_DECODER_INIT
 struct whisper_decoder {
     // each decoders keeps its own KV-cache
@@ -606,6 +534,9 @@ struct whisper_decoder {
     // the currently generated sequence of tokens
     whisper_sequence sequence;
 
+    // grammar parse state of the current sequence (empty when grammar is not used)
+    whisper_grammar grammar;
+
     int seek_delta; // the window shift found so far based on the decoded timestamp tokens
 
     bool failed;    // has the current segment failed to decode?
@@ -620,6 +551,71 @@ struct whisper_decoder {
     std::vector<whisper_token> tokens_tmp; // used for whisper_decode calls
 };
 
+// a decoder graph and its tensors that change between the evaluations (see whisper_decode_graph_set)
+struct whisper_decode_graph {
+    struct ggml_cgraph gf = {};
+
+    int n_kv = 0; // number of KV cache entries the self-attention attends to
+
+    struct ggml_tensor * embd     = nullptr;
+    struct ggml_tensor * position = nullptr;
+    struct ggml_tensor * logits   = nullptr;
+
+    // per layer
+    std::vector<struct ggml_tensor *> k_store; // copies of the new keys and values into the KV cache
+    std::vector<struct ggml_tensor *> v_store;
+    std::vector<struct ggml_tensor *> k_read;  // views of the first n_kv keys and values
+    std::vector<struct ggml_tensor *> v_read;
+    std::vector<struct ggml_tensor *> n_past;  // the I32 n_past of the causal masks
+};
+
+// time that a compute thread spent in a graph node
+struct whisper_profile_span {
+    int32_t node; // index in whisper_profile::nodes - the graph node while the graph is computed
+    int32_t ith;  // compute thread
+
+    int64_t t_start_us;
+    int64_t t_end_us;
+};
+
+struct whisper_profile_node {
+    int     graph; // 0 - encoder, 1 - decoder
+    ggml_op op;
+
+    char    name[GGML_MAX_NAME];
+    int64_t ne[4];
+
+    int64_t flops; // estimate
+    size_t  bytes; // read and written
+};
+
+struct whisper_profile_op {
+    int64_t n     = 0;
+    int64_t t_us  = 0; // from the first thread starting a node to the last one finishing it
+    int64_t flops = 0;
+    int64_t bytes = 0;
+};
+
+struct whisper_profile {
+    bool enabled = false;
+
+    int64_t t_start_us = 0;
+
+    // spans of the graph that is being computed, per thread
+    std::vector<std::vector<whisper_profile_span>> spans_cur;
+
+    // totals per op type of the encoder and decoder graphs
+    whisper_profile_op ops[2][GGML_OP_COUNT];
+
+    // recorded trace
+    std::vector<whisper_profile_node> nodes;
+    std::vector<whisper_profile_span> spans;
+
+    // work containers used to avoid memory allocations
+    std::vector<int64_t> t_node_start;
+    std::vector<int64_t> t_node_end;
+};
+
 struct whisper_state {
     int64_t t_sample_us = 0;
     int64_t t_encode_us = 0;
@@ -640,11 +636,21 @@ struct whisper_state {
     whisper_decoder decoders[WHISPER_MAX_DECODERS] = {};
 
     // memory buffers used by encode / decode contexts
-    std::vector<uint8_t> buf_compute;
-    std::vector<uint8_t> buf_scratch[WHISPER_MAX_SCRATCH_BUFFERS];
+    std::vector<uint8_t> buf_compute; // tensor objects of the graphs
+    std::vector<uint8_t> buf_work;    // work buffer of the computation
+
+    // the data of the graph tensors - sized by measuring the largest encoder and decoder graphs
+    std::vector<uint8_t> buf_alloc;
+    struct ggml_allocr * alloc = nullptr;
 
-    int    buf_last = 0;
-    size_t buf_max_size[WHISPER_MAX_SCRATCH_BUFFERS] = { 0 };
+    // cached single token decoder graphs, keyed by n_kv
+    std::vector<uint8_t> buf_graph;
+    struct ggml_context * ctx_graph = nullptr;
+    std::map<int, whisper_decode_graph> graphs;
+
+    int graph_n_audio_ctx = 0;
+
+    whisper_profile profile;
 
     // decode output (2-dimensional array: [n_tokens][n_vocab])
     std::vector<float> logits;
@@ -676,37 +682,6 @@ struct whisper_state {
 
     // [EXPERIMENTAL] speed-up techniques
     int32_t exp_n_audio_ctx = 0; // 0 - use default
-
-    void use_buf(struct ggml_context * ctx, int i) {
-#if defined(WHISPER_USE_SCRATCH)
-        size_t last_size = 0;
-
-        if (i == -1) {
-            last_size = ggml_set_scratch(ctx, { 0, 0, nullptr, });
-        } else {
-            auto & buf = buf_scratch[i];
-            last_size = ggml_set_scratch(ctx, { 0, buf.size(), buf.data(), });
-        }
-
-        if (buf_last >= 0) {
-            buf_max_size[buf_last] = std::max(buf_max_size[buf_last], last_size);
-        }
-
-        buf_last = i;
-#else
-        (void) i;
-        (void) ctx;
-#endif
-    }
-
-    size_t get_buf_max_mem(int i) const {
-#if defined(WHISPER_USE_SCRATCH)
-        return buf_max_size[i];
-#else
-        (void) i;
-        return 0;
-#endif
-    }
 };
 
 struct whisper_context {
@@ -715,6 +690,7 @@ struct whisper_context {
 
     ggml_type wtype = ggml_type::GGML_TYPE_F16; // weight type (FP32 / FP16 / QX)
     ggml_type itype = ggml_type::GGML_TYPE_F16; // intermediate type (FP32 or FP16)
+    ggml_type ktype = ggml_type::GGML_TYPE_F16; // KV cache type (FP16 or Q8_0), see whisper_ctx_set_kv_q8_0()
 
     whisper_model model;
     whisper_vocab vocab;
@@ -731,11 +707,16 @@ static void read_safe(whisper_model_loader * loader, T & dest) {
 
 static bool kv_cache_init(
         const struct whisper_hparams & hparams,
-                        const size_t   mem_bytes,
              struct whisper_kv_cache & cache,
                            ggml_type   wtype,
                                  int   n_ctx) {
-    cache.buf.resize(mem_bytes);
+    const int n_text_state = hparams.n_text_state;
+    const int n_text_layer = hparams.n_text_layer;
+
+    const int n_mem      = n_text_layer*n_ctx;
+    const int n_elements = n_text_state*n_mem;
+
+    cache.buf.resize(2*(ggml_tensor_overhead() + (n_elements/ggml_blck_size(wtype))*ggml_type_size(wtype)));
 
     struct ggml_init_params params = {
         /*.mem_size   =*/ cache.buf.size(),
@@ -750,12 +731,6 @@ static bool kv_cache_init(
         return false;
     }
 
-    const int n_text_state = hparams.n_text_state;
-    const int n_text_layer = hparams.n_text_layer;
-
-    const int n_mem      = n_text_layer*n_ctx;
-    const int n_elements = n_text_state*n_mem;
-
     cache.k = ggml_new_tensor_1d(cache.ctx, wtype, n_elements);
     cache.v = ggml_new_tensor_1d(cache.ctx, wtype, n_elements);
 
@@ -799,6 +774,39 @@ static void kv_cache_free(struct whisper_kv_cache & cache) {
     }
 }
 
+// size in bytes of n consecutive values of a cache tensor - not n*ggml_element_size() when the cache is quantized
+static size_t kv_cache_row_size(const struct ggml_tensor * t, int n) {
+    return (n/ggml_blck_size(t->type))*ggml_type_size(t->type);
+}
+
+// the type of a weight matrix with rows of n_per_row values in a model of the given ftype - the loader creates the
+// tensors with these types and the quantize example writes them (whisper_model_tensor_type)
+//
+// sensitive: the attention output and the token embedding, which the mixed k-quant ftypes keep at Q6_K
+//
+static ggml_type whisper_weight_type(ggml_ftype ftype, bool sensitive, int n_per_row) {
+    ggml_type type = ggml_ftype_to_ggml_type(ftype);
+
+    if (sensitive && (ftype == GGML_FTYPE_MOSTLY_Q4_K_M || ftype == GGML_FTYPE_MOSTLY_Q5_K_M)) {
+        type = GGML_TYPE_Q6_K;
+    }
+
+    // the k-quants have super-blocks of 256 values - the rows of the tiny model (384) use a legacy type that is at
+    // least as accurate instead
+    if (n_per_row % 256 != 0) {
+        switch (type) {
+            case GGML_TYPE_Q2_K:
+            case GGML_TYPE_Q3_K: type = GGML_TYPE_Q4_0; break;
+            case GGML_TYPE_Q4_K: type = GGML_TYPE_Q5_0; break;
+            case GGML_TYPE_Q5_K: type = GGML_TYPE_Q5_1; break;
+            case GGML_TYPE_Q6_K: type = GGML_TYPE_Q8_0; break;
+            default: break;
+        }
+    }
+
+    return type;
+}
+
 // load the model from a ggml file
 //
 // file format:
@@ -880,7 +888,10 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
             return false;
         }
 
-        const size_t scale = model.hparams.ftype ? 1 : 2;
+        if (ggml_type_size(wctx.wtype) == 0) {
+            fprintf(stderr, "%s: the %s models are not supported by this build (WHISPER_NO_K_QUANTS)\n", __func__, ggml_type_name(wctx.wtype));
+            return false;
+        }
 
         fprintf(stderr, "%s: n_vocab       = %d\n", __func__, hparams.n_vocab);
         fprintf(stderr, "%s: n_audio_ctx   = %d\n", __func__, hparams.n_audio_ctx);
@@ -896,32 +907,6 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         fprintf(stderr, "%s: qntvr         = %d\n", __func__, qntvr);
         fprintf(stderr, "%s: type          = %d\n", __func__, model.type);
 
-        // print memory requirements
-        {
-            // this is the total memory required to run the inference
-            const size_t mem_required =
-                     MEM_REQ_SCRATCH0.at(model.type) +
-                     MEM_REQ_SCRATCH1.at(model.type) +
-                     MEM_REQ_SCRATCH2.at(model.type) +
-                     MEM_REQ_SCRATCH3.at(model.type) +
-                scale*MEM_REQ_MODEL.at(wctx.wtype).at(model.type) +
-                scale*MEM_REQ_KV_CROSS.at(model.type) +
-                scale*std::max(MEM_REQ_ENCODE.at(model.type), MEM_REQ_DECODE.at(model.type));
-
-            // this is the memory required by one decoder
-            const size_t mem_required_decoder =
-                scale*MEM_REQ_KV_SELF.at(model.type);
-
-            fprintf(stderr, "%s: mem required  = %7.2f MB (+ %7.2f MB per decoder)\n", __func__,
-                    mem_required / 1024.0 / 1024.0, mem_required_decoder / 1024.0 / 1024.0);
-        }
-
-        // initialize all memory buffers
-        // always have at least one decoder
-
-        wctx.model.buf = new std::vector<uint8_t>();
-        wctx.model.buf->resize(scale*MEM_REQ_MODEL.at(wctx.wtype).at(model.type));
-
         // we skip initialization of the state until it is needed
         // because it might be that state will always be provided externally.
     }
@@ -1017,9 +1002,20 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
 
     size_t ctx_size = 0;
 
-    const ggml_type wtype = wctx.wtype;
     const ggml_type vtype = wctx.wtype == GGML_TYPE_F32 ? GGML_TYPE_F32 : GGML_TYPE_F16; // conv type
 
+    // the types of the weight matrices of the encoder (a) and the decoder (t), for rows of n_state and 4*n_state (mlp_1)
+    // values and for the attention output and the token embedding (o) - see whisper_model_tensor_type()
+    const ggml_ftype ftype = (ggml_ftype) model.hparams.ftype;
+
+    const ggml_type wtype_a   = whisper_weight_type(ftype, false,   model.hparams.n_audio_state);
+    const ggml_type wtype_a_4 = whisper_weight_type(ftype, false, 4*model.hparams.n_audio_state);
+    const ggml_type wtype_a_o = whisper_weight_type(ftype, true,    model.hparams.n_audio_state);
+
+    const ggml_type wtype_t   = whisper_weight_type(ftype, false,   model.hparams.n_text_state);
+    const ggml_type wtype_t_4 = whisper_weight_type(ftype, false, 4*model.hparams.n_text_state);
+    const ggml_type wtype_t_o = whisper_weight_type(ftype, true,    model.hparams.n_text_state);
+
     {
         const auto & hparams = model.hparams;
 
@@ -1053,7 +1049,7 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         {
             ctx_size += n_text_ctx*n_text_state*ggml_type_sizef(GGML_TYPE_F32); // d_pe;
 
-            ctx_size += n_vocab*n_text_state*ggml_type_sizef(wtype); // d_te;
+            ctx_size += n_vocab*n_text_state*ggml_type_sizef(wtype_t_o); // d_te;
 
             ctx_size += n_text_state*ggml_type_sizef(GGML_TYPE_F32); // d_ln_w;
             ctx_size += n_text_state*ggml_type_sizef(GGML_TYPE_F32); // d_ln_b;
@@ -1064,24 +1060,24 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
             ctx_size += n_audio_layer*(n_audio_state*ggml_type_sizef(GGML_TYPE_F32)); // mlp_ln_w
             ctx_size += n_audio_layer*(n_audio_state*ggml_type_sizef(GGML_TYPE_F32)); // mlp_ln_b
 
-            ctx_size += n_audio_layer*(4*n_audio_state*n_audio_state*ggml_type_sizef(wtype));         // mlp_0_w
+            ctx_size += n_audio_layer*(4*n_audio_state*n_audio_state*ggml_type_sizef(wtype_a));       // mlp_0_w
             ctx_size += n_audio_layer*(              4*n_audio_state*ggml_type_sizef(GGML_TYPE_F32)); // mlp_0_b
 
-            ctx_size += n_audio_layer*(4*n_audio_state*n_audio_state*ggml_type_sizef(wtype));         // mlp_1_w
+            ctx_size += n_audio_layer*(4*n_audio_state*n_audio_state*ggml_type_sizef(wtype_a_4));     // mlp_1_w
             ctx_size += n_audio_layer*(                n_audio_state*ggml_type_sizef(GGML_TYPE_F32)); // mlp_1_b
 
             ctx_size += n_audio_layer*(n_audio_state*ggml_type_sizef(GGML_TYPE_F32)); // attn_ln_0_w
             ctx_size += n_audio_layer*(n_audio_state*ggml_type_sizef(GGML_TYPE_F32)); // attn_ln_0_b
 
-            ctx_size += n_audio_layer*(n_audio_state*n_audio_state*ggml_type_sizef(wtype));         // attn_q_w
+            ctx_size += n_audio_layer*(n_audio_state*n_audio_state*ggml_type_sizef(wtype_a));       // attn_q_w
             ctx_size += n_audio_layer*(              n_audio_state*ggml_type_sizef(GGML_TYPE_F32)); // attn_q_b
 
-            ctx_size += n_audio_layer*(n_audio_state*n_audio_state*ggml_type_sizef(wtype)); // attn_k_w
+            ctx_size += n_audio_layer*(n_audio_state*n_audio_state*ggml_type_sizef(wtype_a)); // attn_k_w
 
-            ctx_size += n_audio_layer*(n_audio_state*n_audio_state*ggml_type_sizef(wtype));         // attn_v_w
+            ctx_size += n_audio_layer*(n_audio_state*n_audio_state*ggml_type_sizef(wtype_a));       // attn_v_w
             ctx_size += n_audio_layer*(              n_audio_state*ggml_type_sizef(GGML_TYPE_F32)); // attn_v_b
 
-            ctx_size += n_audio_layer*(n_audio_state*n_audio_state*ggml_type_sizef(wtype));         // attn_ln_1_w
+            ctx_size += n_audio_layer*(n_audio_state*n_audio_state*ggml_type_sizef(wtype_a_o));     // attn_ln_1_w
             ctx_size += n_audio_layer*(              n_audio_state*ggml_type_sizef(GGML_TYPE_F32)); // attn_ln_1_b
         }
 
@@ -1090,38 +1086,38 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
             ctx_size += n_text_layer*(n_text_state*ggml_type_sizef(GGML_TYPE_F32)); // mlp_ln_w
             ctx_size += n_text_layer*(n_text_state*ggml_type_sizef(GGML_TYPE_F32)); // mlp_ln_b
 
-            ctx_size += n_text_layer*(4*n_text_state*n_text_state*ggml_type_sizef(wtype));         // mlp_0_w
+            ctx_size += n_text_layer*(4*n_text_state*n_text_state*ggml_type_sizef(wtype_t));       // mlp_0_w
             ctx_size += n_text_layer*(             4*n_text_state*ggml_type_sizef(GGML_TYPE_F32)); // mlp_0_b
 
-            ctx_size += n_text_layer*(4*n_text_state*n_text_state*ggml_type_sizef(wtype));         // mlp_1_w
+            ctx_size += n_text_layer*(4*n_text_state*n_text_state*ggml_type_sizef(wtype_t_4));     // mlp_1_w
             ctx_size += n_text_layer*(               n_text_state*ggml_type_sizef(GGML_TYPE_F32)); // mlp_1_b
 
             ctx_size += n_text_layer*(n_text_state*ggml_type_sizef(GGML_TYPE_F32)); // attn_ln_0_w
             ctx_size += n_text_layer*(n_text_state*ggml_type_sizef(GGML_TYPE_F32)); // attn_ln_0_b
 
-            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_sizef(wtype));         // attn_q_w
+            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_sizef(wtype_t));       // attn_q_w
             ctx_size += n_text_layer*(             n_text_state*ggml_type_sizef(GGML_TYPE_F32)); // attn_q_b
 
-            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_sizef(wtype)); // attn_k_w
+            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_sizef(wtype_t)); // attn_k_w
 
-            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_sizef(wtype));         // attn_v_w
+            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_sizef(wtype_t));       // attn_v_w
             ctx_size += n_text_layer*(             n_text_state*ggml_type_sizef(GGML_TYPE_F32)); // attn_v_b
 
-            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_sizef(wtype));         // attn_ln_1_w
+            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_sizef(wtype_t_o));     // attn_ln_1_w
             ctx_size += n_text_layer*(             n_text_state*ggml_type_sizef(GGML_TYPE_F32)); // attn_ln_1_b
                                                                                                 //
             ctx_size += n_text_layer*(n_text_state*ggml_type_sizef(GGML_TYPE_F32)); // cross_attn_ln_0_w
             ctx_size += n_text_layer*(n_text_state*ggml_type_sizef(GGML_TYPE_F32)); // cross_attn_ln_0_b
 
-            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_sizef(wtype));         // cross_attn_q_w
+            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_sizef(wtype_t));       // cross_attn_q_w
             ctx_size += n_text_layer*(             n_text_state*ggml_type_sizef(GGML_TYPE_F32)); // cross_attn_q_b
 
-            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_sizef(wtype)); // cross_attn_k_w
+            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_sizef(wtype_t)); // cross_attn_k_w
 
-            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_sizef(wtype));         // cross_attn_v_w
+            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_sizef(wtype_t));       // cross_attn_v_w
             ctx_size += n_text_layer*(             n_text_state*ggml_type_sizef(GGML_TYPE_F32)); // cross_attn_v_b
 
-            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_sizef(wtype));         // cross_attn_ln_1_w
+            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_sizef(wtype_t_o));     // cross_attn_ln_1_w
             ctx_size += n_text_layer*(             n_text_state*ggml_type_sizef(GGML_TYPE_F32)); // cross_attn_ln_1_b
         }
 
@@ -1130,6 +1126,29 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         fprintf(stderr, "%s: model ctx     = %7.2f MB\n", __func__, ctx_size/(1024.0*1024.0));
     }
 
+    // print memory requirements
+    {
+        const size_t scale = model.hparams.ftype ? 1 : 2;
+
+        // this is the memory required by the model and the cross-attention cache - the compute buffers are
+        // measured when a state is initialized
+        const size_t mem_required =
+            ctx_size +
+            scale*MEM_REQ_KV_CROSS.at(model.type);
+
+        // this is the memory required by one decoder
+        const size_t mem_required_decoder =
+            scale*MEM_REQ_KV_SELF.at(model.type);
+
+        fprintf(stderr, "%s: mem required  = %7.2f MB (+ %7.2f MB per decoder)\n", __func__,
+                mem_required / 1024.0 / 1024.0, mem_required_decoder / 1024.0 / 1024.0);
+    }
+
+    // the model buffer is sized from the types of the weights, which differ between the tensors of the mixed k-quant
+    // models
+    wctx.model.buf = new std::vector<uint8_t>();
+    wctx.model.buf->resize(ctx_size);
+
     // create the ggml context
     {
         struct ggml_init_params params = {
@@ -1197,24 +1216,24 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
                 layer.mlp_ln_w    = ggml_new_tensor_1d(ctx, GGML_TYPE_F32,   n_audio_state);
                 layer.mlp_ln_b    = ggml_new_tensor_1d(ctx, GGML_TYPE_F32,   n_audio_state);
 
-                layer.mlp_0_w     = ggml_new_tensor_2d(ctx, wtype,           n_audio_state, 4*n_audio_state);
+                layer.mlp_0_w     = ggml_new_tensor_2d(ctx, wtype_a,         n_audio_state, 4*n_audio_state);
                 layer.mlp_0_b     = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 4*n_audio_state);
 
-                layer.mlp_1_w     = ggml_new_tensor_2d(ctx, wtype,         4*n_audio_state, n_audio_state);
+                layer.mlp_1_w     = ggml_new_tensor_2d(ctx, wtype_a_4,     4*n_audio_state, n_audio_state);
                 layer.mlp_1_b     = ggml_new_tensor_1d(ctx, GGML_TYPE_F32,   n_audio_state);
 
                 layer.attn_ln_0_w = ggml_new_tensor_1d(ctx, GGML_TYPE_F32,   n_audio_state);
                 layer.attn_ln_0_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32,   n_audio_state);
 
-                layer.attn_q_w    = ggml_new_tensor_2d(ctx, wtype,           n_audio_state, n_audio_state);
+                layer.attn_q_w    = ggml_new_tensor_2d(ctx, wtype_a,         n_audio_state, n_audio_state);
                 layer.attn_q_b    = ggml_new_tensor_1d(ctx, GGML_TYPE_F32,   n_audio_state);
 
-                layer.attn_k_w    = ggml_new_tensor_2d(ctx, wtype,           n_audio_state, n_audio_state);
+                layer.attn_k_w    = ggml_new_tensor_2d(ctx, wtype_a,         n_audio_state, n_audio_state);
 
-                layer.attn_v_w    = ggml_new_tensor_2d(ctx, wtype,           n_audio_state, n_audio_state);
+                layer.attn_v_w    = ggml_new_tensor_2d(ctx, wtype_a,         n_audio_state, n_audio_state);
                 layer.attn_v_b    = ggml_new_tensor_1d(ctx, GGML_TYPE_F32,   n_audio_state);
 
-                layer.attn_ln_1_w = ggml_new_tensor_2d(ctx, wtype,           n_audio_state, n_audio_state);
+                layer.attn_ln_1_w = ggml_new_tensor_2d(ctx, wtype_a_o,       n_audio_state, n_audio_state);
                 layer.attn_ln_1_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32,   n_audio_state);
 
                 // map by name
@@ -1247,7 +1266,7 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         {
             model.d_pe   = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_text_state, n_text_ctx);
 
-            model.d_te   = ggml_new_tensor_2d(ctx, wtype,         n_text_state, n_vocab);
+            model.d_te   = ggml_new_tensor_2d(ctx, wtype_t_o,     n_text_state, n_vocab);
 
             model.d_ln_w = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state);
             model.d_ln_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state);
@@ -1266,38 +1285,38 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
                 layer.mlp_ln_w          = ggml_new_tensor_1d(ctx, GGML_TYPE_F32,   n_text_state);
                 layer.mlp_ln_b          = ggml_new_tensor_1d(ctx, GGML_TYPE_F32,   n_text_state);
 
-                layer.mlp_0_w           = ggml_new_tensor_2d(ctx, wtype,           n_text_state, 4*n_text_state);
+                layer.mlp_0_w           = ggml_new_tensor_2d(ctx, wtype_t,         n_text_state, 4*n_text_state);
                 layer.mlp_0_b           = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 4*n_text_state);
 
-                layer.mlp_1_w           = ggml_new_tensor_2d(ctx, wtype,         4*n_text_state, n_text_state);
+                layer.mlp_1_w           = ggml_new_tensor_2d(ctx, wtype_t_4,     4*n_text_state, n_text_state);
                 layer.mlp_1_b           = ggml_new_tensor_1d(ctx, GGML_TYPE_F32,   n_text_state);
 
                 layer.attn_ln_0_w       = ggml_new_tensor_1d(ctx, GGML_TYPE_F32,   n_text_state);
                 layer.attn_ln_0_b       = ggml_new_tensor_1d(ctx, GGML_TYPE_F32,   n_text_state);
 
-                layer.attn_q_w          = ggml_new_tensor_2d(ctx, wtype,           n_text_state, n_text_state);
+                layer.attn_q_w          = ggml_new_tensor_2d(ctx, wtype_t,         n_text_state, n_text_state);
                 layer.attn_q_b          = ggml_new_tensor_1d(ctx, GGML_TYPE_F32,   n_text_state);
 
-                layer.attn_k_w          = ggml_new_tensor_2d(ctx, wtype,           n_text_state, n_text_state);
+                layer.attn_k_w          = ggml_new_tensor_2d(ctx, wtype_t,         n_text_state, n_text_state);
 
-                layer.attn_v_w          = ggml_new_tensor_2d(ctx, wtype,           n_text_state, n_text_state);
+                layer.attn_v_w          = ggml_new_tensor_2d(ctx, wtype_t,         n_text_state, n_text_state);
                 layer.attn_v_b          = ggml_new_tensor_1d(ctx, GGML_TYPE_F32,   n_text_state);
 
-                layer.attn_ln_1_w       = ggml_new_tensor_2d(ctx, wtype,           n_text_state, n_text_state);
+                layer.attn_ln_1_w       = ggml_new_tensor_2d(ctx, wtype_t_o,       n_text_state, n_text_state);
                 layer.attn_ln_1_b       = ggml_new_tensor_1d(ctx, GGML_TYPE_F32,   n_text_state);
 
                 layer.cross_attn_ln_0_w = ggml_new_tensor_1d(ctx, GGML_TYPE_F32,   n_text_state);
                 layer.cross_attn_ln_0_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32,   n_text_state);
 
-                layer.cross_attn_q_w    = ggml_new_tensor_2d(ctx, wtype,           n_text_state, n_text_state);
+                layer.cross_attn_q_w    = ggml_new_tensor_2d(ctx, wtype_t,         n_text_state, n_text_state);
                 layer.cross_attn_q_b    = ggml_new_tensor_1d(ctx, GGML_TYPE_F32,   n_text_state);
 
-                layer.cross_attn_k_w    = ggml_new_tensor_2d(ctx, wtype,           n_text_state, n_text_state);
+                layer.cross_attn_k_w    = ggml_new_tensor_2d(ctx, wtype_t,         n_text_state, n_text_state);
 
-                layer.cross_attn_v_w    = ggml_new_tensor_2d(ctx, wtype,           n_text_state, n_text_state);
+                layer.cross_attn_v_w    = ggml_new_tensor_2d(ctx, wtype_t,         n_text_state, n_text_state);
                 layer.cross_attn_v_b    = ggml_new_tensor_1d(ctx, GGML_TYPE_F32,   n_text_state);
 
-                layer.cross_attn_ln_1_w = ggml_new_tensor_2d(ctx, wtype,           n_text_state, n_text_state);
+                layer.cross_attn_ln_1_w = ggml_new_tensor_2d(ctx, wtype_t_o,       n_text_state, n_text_state);
                 layer.cross_attn_ln_1_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32,   n_text_state);
 
                 // map by name
@@ -1391,6 +1410,12 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
                 return false;
             }
 
+            if (tensor->type != ggml_type(ttype)) {
+                fprintf(stderr, "%s: tensor '%s' has wrong type in model file: got %s, expected %s\n",
+                        __func__, name.data(), ggml_type_name(ggml_type(ttype)), ggml_type_name(tensor->type));
+                return false;
+            }
+
             const size_t bpe = ggml_type_size(ggml_type(ttype));
 
             if ((nelements*bpe)/ggml_blck_size(tensor->type) != ggml_nbytes(tensor)) {
@@ -1422,104 +1447,225 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
     return true;
 }
 
-// evaluate the encoder with the given state
-//
-// given audio recording (more specifically, its log mel spectrogram), runs forward pass of the encoder
-// part of the transformer model and returns the encoded features
-//
-//   - wctx:      the model
-//   - wstate:     the state of the encoder
-//   - n_threads:  number of threads to use
-//   - mel_offset: offset in the mel spectrogram (i.e. audio offset)
-//
-static bool whisper_encode_internal(
-        whisper_context & wctx,
-          whisper_state & wstate,
-              const int   mel_offset,
-              const int   n_threads){
+// records the time span of every node computed by every thread
+static void whisper_profile_callback(int node_n, int ith, int64_t t_start_us, int64_t t_end_us, void * user_data) {
+    whisper_profile & prof = *(whisper_profile *) user_data;
 
-    const int64_t t_start_us = ggml_time_us();
+    // each thread appends to its own list
+    prof.spans_cur[ith].push_back({ node_n, ith, t_start_us, t_end_us });
+}
 
-    const auto & model   = wctx.model;
-    const auto & mel_inp = wstate.mel;
-    const auto & hparams = model.hparams;
+// rough estimate of the floating point operations of a graph node
+static int64_t whisper_profile_flops(const struct ggml_tensor * t) {
+    const int64_t n = ggml_nelements(t);
+
+    switch (t->op) {
+        case GGML_OP_NONE:
+        case GGML_OP_VIEW:
+        case GGML_OP_RESHAPE:
+        case GGML_OP_PERMUTE:
+        case GGML_OP_TRANSPOSE:
+        case GGML_OP_CPY:
+        case GGML_OP_DUP:
+            return 0;
+        case GGML_OP_MUL_MAT:
+        case GGML_OP_MUL_MAT_BIAS:
+            return 2*t->src0->ne[0]*n;
+        case GGML_OP_CONV_1D:
+            return 2*t->src0->ne[0]*t->src0->ne[1]*n;
+        case GGML_OP_FLASH_ATTN:
+        case GGML_OP_FLASH_ATTN_EXT:
+            // KQ and KQV
+            return 4*t->src1->ne[1]*n;
+        case GGML_OP_NORM:
+        case GGML_OP_NORM_AFFINE:
+        case GGML_OP_SOFT_MAX:
+            return 5*n;
+        default:
+            return n;
+    }
+}
 
-    const int n_ctx   = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
-    const int n_state = hparams.n_audio_state;
-    const int n_head  = hparams.n_audio_head;
-    const int n_layer = hparams.n_audio_layer;
+static size_t whisper_profile_bytes(const struct ggml_tensor * t) {
+    switch (t->op) {
+        case GGML_OP_NONE:
+        case GGML_OP_VIEW:
+        case GGML_OP_RESHAPE:
+        case GGML_OP_PERMUTE:
+        case GGML_OP_TRANSPOSE:
+            return 0;
+        case GGML_OP_GET_ROWS:
+            // only the gathered rows are read
+            return ggml_nelements(t)*ggml_type_sizef(t->src0->type) + ggml_nbytes(t->src1) + ggml_nbytes(t);
+        default:
+            break;
+    }
 
-    const int n_mels = hparams.n_mels;
-    assert(mel_inp.n_mel == n_mels);
+    size_t bytes = ggml_nbytes(t);
+
+    if (t->src0) bytes += ggml_nbytes(t->src0);
+    if (t->src1) bytes += ggml_nbytes(t->src1);
+
+    for (int i = 0; i < GGML_MAX_OPT; ++i) {
+        if (t->opt[i]) bytes += ggml_nbytes(t->opt[i]);
+    }
+
+    return bytes;
+}
+
+// add the spans of a computed graph to the totals and to the trace
+static void whisper_profile_record(whisper_profile & prof, const struct ggml_cgraph & gf, int graph) {
+    prof.t_node_start.assign(gf.n_nodes, INT64_MAX);
+    prof.t_node_end  .assign(gf.n_nodes, 0);
+
+    for (const auto & spans : prof.spans_cur) {
+        for (const auto & span : spans) {
+            prof.t_node_start[span.node] = std::min(prof.t_node_start[span.node], span.t_start_us);
+            prof.t_node_end  [span.node] = std::max(prof.t_node_end  [span.node], span.t_end_us);
+        }
+    }
+
+    const bool trace = prof.spans.size() < WHISPER_PROFILE_MAX_SPANS;
+
+    const int node0 = prof.nodes.size();
+
+    for (int i = 0; i < gf.n_nodes; ++i) {
+        const struct ggml_tensor * t = gf.nodes[i];
+
+        whisper_profile_node node;
+        node.graph = graph;
+        node.op    = t->op;
+        node.flops = whisper_profile_flops(t);
+        node.bytes = whisper_profile_bytes(t);
+
+        memcpy(node.name, t->name, sizeof(node.name));
+        memcpy(node.ne,   t->ne,   sizeof(node.ne));
+
+        auto & op = prof.ops[graph][t->op];
+
+        op.n     += 1;
+        op.t_us  += prof.t_node_end[i] > prof.t_node_start[i] ? prof.t_node_end[i] - prof.t_node_start[i] : 0;
+        op.flops += node.flops;
+        op.bytes += node.bytes;
+
+        if (trace) {
+            prof.nodes.push_back(node);
+        }
+    }
+
+    if (trace) {
+        for (const auto & spans : prof.spans_cur) {
+            for (auto span : spans) {
+                span.node += node0;
+                prof.spans.push_back(span);
+            }
+        }
+    }
+}
+
+// compute a graph that was placed in the compute buffer of the state
+//
+// the work buffer of the computation is kept in the state and grows as needed - the graphs are built in no_alloc
+// contexts and the work buffer depends on the number of threads
+//
+static void whisper_graph_compute(whisper_state & wstate, struct ggml_cgraph & gf, int graph) {
+    const size_t work_size = ggml_graph_work_size(&gf);
+
+    if (wstate.buf_work.size() < work_size + ggml_tensor_overhead()) {
+        wstate.buf_work.resize(work_size + ggml_tensor_overhead());
+    }
 
     struct ggml_init_params params = {
-        /*.mem_size   =*/ wstate.buf_compute.size(),
-        /*.mem_buffer =*/ wstate.buf_compute.data(),
+        /*.mem_size   =*/ wstate.buf_work.size(),
+        /*.mem_buffer =*/ wstate.buf_work.data(),
         /*.no_alloc   =*/ false,
     };
 
-    struct ggml_context * ctx0 = ggml_init(params);
+    struct ggml_context * ctx_work = ggml_init(params);
 
-    wstate.use_buf(ctx0, 0);
+    // the work tensor of a previous computation might be gone
+    gf.work      = nullptr;
+    gf.work_size = 0;
 
-    struct ggml_tensor * mel = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, 2*n_ctx, n_mels);
-    assert(mel->type == GGML_TYPE_F32);
-    {
-        float * dst = (float *) mel->data;
-        memset(dst, 0, ggml_nbytes(mel));
+    whisper_profile & prof = wstate.profile;
 
-        const int i0 = std::min(mel_offset, mel_inp.n_len);
-        const int i1 = std::min(mel_offset + 2*n_ctx, mel_inp.n_len);
+    gf.profile_cb   = nullptr;
+    gf.profile_data = nullptr;
 
-        for (int j = 0; j < mel_inp.n_mel; ++j) {
-            for (int i = i0; i < i1; ++i) {
-                dst[j*2*n_ctx + (i - i0)] = mel_inp.data[j*mel_inp.n_len + i];
-            }
+    if (prof.enabled) {
+        prof.spans_cur.resize(gf.n_threads);
+        for (auto & spans : prof.spans_cur) {
+            spans.clear();
         }
+
+        gf.profile_cb   = whisper_profile_callback;
+        gf.profile_data = &prof;
     }
 
-    struct ggml_tensor * cur;
+    ggml_graph_compute(ctx_work, &gf);
 
-#ifndef WHISPER_USE_COREML
-    const bool use_coreml = false;
-#else
-    const bool use_coreml = wstate.ctx_coreml != nullptr;
-#endif
+    if (prof.enabled) {
+        whisper_profile_record(prof, gf, graph);
+    }
 
-#ifndef WHISPER_USE_OPENVINO
-    const bool use_openvino = false;
-#else
-    const bool use_openvino = wstate.ctx_openvino != nullptr;
-#endif
+    gf.work      = nullptr;
+    gf.work_size = 0;
+
+    ggml_free(ctx_work);
+}
+
+// build the encoder graph - from the mel spectrogram to the cross-attention KV cache of the decoders
+//
+// when the encoder runs outside of ggml (Core ML, OpenVINO), the graph only computes the cross-attention KV cache from
+// the embd input, that receives the encoded features
+//
+// the graph replaces the previous one in the compute buffer, its inputs are allocated first so they can be set after
+// the graph has been allocated
+//
+static void whisper_build_graph_encoder(
+          whisper_context & wctx,
+            whisper_state & wstate,
+      struct ggml_context * ctx0,
+       struct ggml_allocr * alloc,
+                     bool   external,
+       struct ggml_cgraph & gf,
+     struct ggml_tensor * & mel,
+     struct ggml_tensor * & embd) {
+    const auto & model   = wctx.model;
+    const auto & hparams = model.hparams;
+
+    const int n_ctx   = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
+    const int n_state = hparams.n_audio_state;
+    const int n_head  = hparams.n_audio_head;
+    const int n_layer = hparams.n_audio_layer;
+
+    const int n_mels = hparams.n_mels;
+
+    ggml_allocr_reset(alloc);
+
+    mel = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, 2*n_ctx, n_mels);
+    ggml_allocr_alloc(alloc, mel);
+
+    if (!external) {
+        struct ggml_tensor * cur;
 
-    if (!use_coreml && !use_openvino) {
         // convolution + gelu
         {
-            wstate.use_buf(ctx0, 1);
-
             cur = ggml_conv_1d_ph(ctx0, model.e_conv_1_w, mel, 1, 1);
             cur = ggml_add(ctx0,
-                    ggml_repeat(ctx0,
-                        model.e_conv_1_b,
-                        cur),
-                    cur);
+                    cur,
+                    model.e_conv_1_b);
 
             cur = ggml_gelu(ctx0, cur);
 
-            wstate.use_buf(ctx0, 0);
-
             cur = ggml_conv_1d_ph(ctx0, model.e_conv_2_w, cur, 2, 1);
             cur = ggml_add(ctx0,
-                    ggml_repeat(ctx0,
-                        model.e_conv_2_b,
-                        cur),
-                    cur);
+                    cur,
+                    model.e_conv_2_b);
 
             cur = ggml_gelu(ctx0, cur);
         }
 
-        wstate.use_buf(ctx0, 3);
-
         // ===================================================================
         // NOTE: experimenting with partial evaluation of the encoder (ignore)
         //static int iter = -1;
@@ -1553,31 +1699,16 @@ static bool whisper_encode_internal(
 
             // norm
             {
-                wstate.use_buf(ctx0, 0);
-
-                cur = ggml_norm(ctx0, inpL);
-
-                // cur = ln_0_w*cur + ln_0_b
-                cur = ggml_add(ctx0,
-                        ggml_mul(ctx0,
-                            ggml_repeat(ctx0, layer.attn_ln_0_w, cur),
-                            cur),
-                        ggml_repeat(ctx0, layer.attn_ln_0_b, cur));
+                // cur = ln_0_w*norm(inpL) + ln_0_b
+                cur = ggml_norm_affine(ctx0, inpL, layer.attn_ln_0_w, layer.attn_ln_0_b);
             }
 
             // self-attention
             {
-                wstate.use_buf(ctx0, 1);
-
-                struct ggml_tensor * Qcur = ggml_mul_mat(ctx0,
+                struct ggml_tensor * Qcur = ggml_mul_mat_bias(ctx0,
                         layer.attn_q_w,
-                        cur);
-
-                Qcur = ggml_add(ctx0,
-                        ggml_repeat(ctx0,
-                            layer.attn_q_b,
-                            Qcur),
-                        Qcur);
+                        cur,
+                        layer.attn_q_b);
 
                 //Qcur = ggml_scale_inplace(ctx0, Qcur, ggml_new_f32(ctx0, pow(float(n_state)/n_head, -0.25)));
 
@@ -1588,26 +1719,20 @@ static bool whisper_encode_internal(
 
                 //Kcur = ggml_scale_inplace(ctx0, Kcur, ggml_new_f32(ctx0, pow(float(n_state)/n_head, -0.25)));
 
-                struct ggml_tensor * Vcur = ggml_mul_mat(ctx0,
+                struct ggml_tensor * Vcur = ggml_mul_mat_bias(ctx0,
                         layer.attn_v_w,
-                        cur);
-
-                Vcur = ggml_add(ctx0,
-                        ggml_repeat(ctx0,
-                            layer.attn_v_b,
-                            Vcur),
-                        Vcur);
+                        cur,
+                        layer.attn_v_b);
 
                 // ------
 
-                wstate.use_buf(ctx0, 0);
-
-#ifdef WHISPER_USE_FLASH_ATTN
+#ifndef WHISPER_NO_FLASH_ATTN
+                // Q is read in place, K and V are converted to the intermediate type
                 struct ggml_tensor * Q =
                     ggml_permute(ctx0,
-                            ggml_cpy(ctx0,
+                            ggml_reshape_3d(ctx0,
                                 Qcur,
-                                ggml_new_tensor_3d(ctx0, wctx.itype, n_state/n_head, n_head, n_ctx)),
+                                n_state/n_head, n_head, n_ctx),
                             0, 2, 1, 3);
 
                 struct ggml_tensor * K =
@@ -1667,8 +1792,6 @@ static bool whisper_encode_internal(
 #endif
                 struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
 
-                wstate.use_buf(ctx0, 1);
-
                 cur = ggml_cpy(ctx0,
                         KQV_merged,
                         ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_ctx));
@@ -1676,21 +1799,12 @@ static bool whisper_encode_internal(
 
             // projection
             {
-                wstate.use_buf(ctx0, 0);
-
-                cur = ggml_mul_mat(ctx0,
+                cur = ggml_mul_mat_bias(ctx0,
                         layer.attn_ln_1_w,
-                        cur);
-
-                wstate.use_buf(ctx0, 1);
-
-                cur = ggml_add(ctx0,
-                        ggml_repeat(ctx0, layer.attn_ln_1_b, cur),
-                        cur);
+                        cur,
+                        layer.attn_ln_1_b);
             }
 
-            wstate.use_buf(ctx0, 2);
-
             // add the input
             cur = ggml_add(ctx0, cur, inpL);
 
@@ -1700,62 +1814,29 @@ static bool whisper_encode_internal(
             {
                 // norm
                 {
-                    wstate.use_buf(ctx0, 0);
-
-                    cur = ggml_norm(ctx0, inpFF);
-
-                    wstate.use_buf(ctx0, 1);
-
-                    // cur = mlp_ln_w*cur + mlp_ln_b
-                    cur = ggml_add(ctx0,
-                            ggml_mul(ctx0,
-                                ggml_repeat(ctx0, layer.mlp_ln_w, cur),
-                                cur),
-                            ggml_repeat(ctx0, layer.mlp_ln_b, cur));
+                    // cur = mlp_ln_w*norm(inpFF) + mlp_ln_b
+                    cur = ggml_norm_affine(ctx0, inpFF, layer.mlp_ln_w, layer.mlp_ln_b);
                 }
 
 #ifdef WHISPER_USE_FLASH_FF
-                wstate.use_buf(ctx0, 0);
-
                 cur = ggml_flash_ff(ctx0,
                         ggml_cpy(ctx0, cur, ggml_new_tensor_2d(ctx0, wstate.itype, n_state, n_ctx)),
                         layer.mlp_0_w, layer.mlp_0_b, layer.mlp_1_w, layer.mlp_1_b);
 #else
-                wstate.use_buf(ctx0, 0);
-
-                // fully connected
-                cur = ggml_mul_mat(ctx0,
+                // fully connected + GELU activation
+                cur = ggml_mul_mat_bias_gelu(ctx0,
                         layer.mlp_0_w,
-                        cur);
-
-                wstate.use_buf(ctx0, 1);
-
-                cur = ggml_add(ctx0,
-                        ggml_repeat(ctx0, layer.mlp_0_b, cur),
-                        cur);
-
-                wstate.use_buf(ctx0, 0);
-
-                // GELU activation
-                cur = ggml_gelu(ctx0, cur);
-
-                wstate.use_buf(ctx0, 1);
+                        cur,
+                        layer.mlp_0_b);
 
                 // projection
-                cur = ggml_mul_mat(ctx0,
+                cur = ggml_mul_mat_bias(ctx0,
                         layer.mlp_1_w,
-                        cur);
-
-                wstate.use_buf(ctx0, 0);
-
-                cur = ggml_add(ctx0,
-                        ggml_repeat(ctx0, layer.mlp_1_b, cur),
-                        cur);
+                        cur,
+                        layer.mlp_1_b);
 #endif
             }
 
-            wstate.use_buf(ctx0, 3);
-
             inpL = ggml_add(ctx0, cur, inpFF);
         }
 
@@ -1763,126 +1844,137 @@ static bool whisper_encode_internal(
 
         // norm
         {
-            wstate.use_buf(ctx0, 0);
-
-            cur = ggml_norm(ctx0, cur);
+            // cur = ln_f_g*norm(cur) + ln_f_b
+            cur = ggml_norm_affine(ctx0, cur, model.e_ln_w, model.e_ln_b);
+        }
 
-            wstate.use_buf(ctx0, 1);
+        embd = cur;
+    } else {
+        embd = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_ctx);
+        ggml_allocr_alloc(alloc, embd);
+    }
 
-            // cur = ln_f_g*cur + ln_f_b
-            cur = ggml_add(ctx0,
-                    ggml_mul(ctx0,
-                        ggml_repeat(ctx0, model.e_ln_w, cur),
-                        cur),
-                    ggml_repeat(ctx0, model.e_ln_b, cur));
-        }
+    // pre-compute cross-attention memory
+    {
+        for (int il = 0; il < model.hparams.n_text_layer; ++il) {
+            auto& layer = model.layers_decoder[il];
 
-        wstate.use_buf(ctx0, -1);
+            struct ggml_tensor* Kcross = ggml_mul_mat(ctx0,
+                layer.cross_attn_k_w,
+                embd);
 
-        // run the computation
-        {
-            struct ggml_cgraph gf = {};
-            gf.n_threads = n_threads;
+            Kcross = ggml_scale_inplace(ctx0, Kcross, ggml_new_f32(ctx0, pow(float(n_state) / n_head, -0.25)));
 
-            ggml_build_forward_expand(&gf, cur);
-            ggml_graph_compute(ctx0, &gf);
+            struct ggml_tensor* Vcross = ggml_mul_mat_bias(ctx0,
+                layer.cross_attn_v_w,
+                embd,
+                layer.cross_attn_v_b);
 
-            //ggml_graph_print(&gf);
-        }
-    }
-#ifdef WHISPER_USE_COREML
-    else if (use_coreml) {
-        wstate.use_buf(ctx0, -1);
+            struct ggml_tensor * k = ggml_view_1d(ctx0, wstate.kv_cross.k, n_state*n_ctx, kv_cache_row_size(wstate.kv_cross.k, n_state)*(il*n_ctx));
 
-        cur = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_ctx);
+#ifndef WHISPER_NO_FLASH_ATTN
+            // one row per position, like K
+            struct ggml_tensor * v = ggml_view_1d(ctx0, wstate.kv_cross.v, n_state*n_ctx, kv_cache_row_size(wstate.kv_cross.v, n_state)*(il*n_ctx));
+#else
+            Vcross = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, Vcross, n_state, n_ctx));
 
-        whisper_coreml_encode(wstate.ctx_coreml, (float *) mel->data, (float *) cur->data);
-    }
+            struct ggml_tensor * v = ggml_view_2d(ctx0, wstate.kv_cross.v, n_ctx, n_state,
+                    (   n_ctx)*ggml_element_size(wstate.kv_cross.v),
+                    (il*n_ctx)*ggml_element_size(wstate.kv_cross.v)*n_state);
 #endif
-#ifdef WHISPER_USE_OPENVINO
-    else if (use_openvino) {
-        wstate.use_buf(ctx0, -1);
 
-        cur = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_ctx);
-
-        if (!whisper_openvino_encode(wstate.ctx_openvino, mel, cur)) {
-            return false;
+            ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Kcross, k));
+            ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Vcross, v));
         }
     }
-#endif
 
-    // cur
-    //{
-    //    printf("ne0 = %d\n", cur->ne[0]);
-    //    printf("ne1 = %d\n", cur->ne[1]);
-    //    for (int i = 0; i < 10; ++i) {
-    //        printf("%8.4f ", ((float *)(cur->data))[i]);
-    //    }
-    //    printf("... ");
-    //    for (int i = cur->ne[0] - 10; i < cur->ne[0]; ++i) {
-    //        printf("%8.4f ", ((float *)(cur->data))[i]);
-    //    }
-    //    printf("\n");
-    //}
+    ggml_allocr_alloc_graph(alloc, &gf);
+}
 
-    // pre-compute cross-attention memory
-    {
-        struct ggml_cgraph gf = {};
-        gf.n_threads = n_threads;
+// evaluate the encoder with the given state
+//
+// given audio recording (more specifically, its log mel spectrogram), runs forward pass of the encoder
+// part of the transformer model and returns the encoded features
+//
+//   - wctx:      the model
+//   - wstate:     the state of the encoder
+//   - n_threads:  number of threads to use
+//   - mel_offset: offset in the mel spectrogram (i.e. audio offset)
+//
+static bool whisper_encode_internal(
+        whisper_context & wctx,
+          whisper_state & wstate,
+              const int   mel_offset,
+              const int   n_threads){
 
-        // TODO: hack to disconnect the encoded features from the previous graph
-        cur->op = GGML_OP_NONE;
-        cur->src0 = nullptr;
-        cur->src1 = nullptr;
+    const int64_t t_start_us = ggml_time_us();
 
-        for (int il = 0; il < model.hparams.n_text_layer; ++il) {
-            auto& layer = model.layers_decoder[il];
+    const auto & mel_inp = wstate.mel;
 
-            wstate.use_buf(ctx0, 0);
+    assert(mel_inp.n_mel == wctx.model.hparams.n_mels);
 
-            struct ggml_tensor* Kcross = ggml_mul_mat(ctx0,
-                layer.cross_attn_k_w,
-                cur);
+#ifndef WHISPER_USE_COREML
+    const bool use_coreml = false;
+#else
+    const bool use_coreml = wstate.ctx_coreml != nullptr;
+#endif
 
-            Kcross = ggml_scale_inplace(ctx0, Kcross, ggml_new_f32(ctx0, pow(float(n_state) / n_head, -0.25)));
+#ifndef WHISPER_USE_OPENVINO
+    const bool use_openvino = false;
+#else
+    const bool use_openvino = wstate.ctx_openvino != nullptr;
+#endif
+
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ wstate.buf_compute.size(),
+        /*.mem_buffer =*/ wstate.buf_compute.data(),
+        /*.no_alloc   =*/ true,
+    };
 
-            wstate.use_buf(ctx0, 1);
+    struct ggml_context * ctx0 = ggml_init(params);
 
-            struct ggml_tensor* Vcross = ggml_mul_mat(ctx0,
-                layer.cross_attn_v_w,
-                cur);
+    struct ggml_cgraph gf = {};
+    gf.n_threads = n_threads;
 
-            Vcross = ggml_add(ctx0,
-                ggml_repeat(ctx0,
-                    layer.cross_attn_v_b,
-                    Vcross),
-                Vcross);
+    struct ggml_tensor * mel  = nullptr;
+    struct ggml_tensor * embd = nullptr;
 
-            wstate.use_buf(ctx0, -1);
+    whisper_build_graph_encoder(wctx, wstate, ctx0, wstate.alloc, use_coreml || use_openvino, gf, mel, embd);
 
-            Vcross = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, Vcross, n_state, n_ctx));
+    {
+        const int n_ctx = mel->ne[0]/2;
 
-            struct ggml_tensor * k = ggml_view_1d(ctx0, wstate.kv_cross.k, n_state*n_ctx, (ggml_element_size(wstate.kv_cross.k)*n_state)*(il*n_ctx));
-            struct ggml_tensor * v = ggml_view_2d(ctx0, wstate.kv_cross.v, n_ctx, n_state,
-                    (   n_ctx)*ggml_element_size(wstate.kv_cross.v),
-                    (il*n_ctx)*ggml_element_size(wstate.kv_cross.v)*n_state);
+        float * dst = (float *) mel->data;
+        memset(dst, 0, ggml_nbytes(mel));
 
-            ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Kcross, k));
-            ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Vcross, v));
+        const int i0 = std::min(mel_offset, mel_inp.n_len);
+        const int i1 = std::min(mel_offset + 2*n_ctx, mel_inp.n_len);
+
+        for (int j = 0; j < mel_inp.n_mel; ++j) {
+            for (int i = i0; i < i1; ++i) {
+                dst[j*2*n_ctx + (i - i0)] = mel_inp.data[j*mel_inp.n_len + i];
+            }
         }
+    }
 
-        ggml_graph_compute(ctx0, &gf);
-        //ggml_graph_print(&gf);
+#ifdef WHISPER_USE_COREML
+    if (use_coreml) {
+        whisper_coreml_encode(wstate.ctx_coreml, (float *) mel->data, (float *) embd->data);
+    }
+#endif
+#ifdef WHISPER_USE_OPENVINO
+    if (use_openvino) {
+        if (!whisper_openvino_encode(wstate.ctx_openvino, mel, embd)) {
+            ggml_free(ctx0);
+            return false;
+        }
     }
+#endif
 
-    ////////////////////////////////////////////////////////////////////////////
+    // run the computation
+    whisper_graph_compute(wstate, gf, 0);
 
-    //printf("%s: used_mem = %f MB, %f MB, %f MB %f MB %f MB\n", __func__,
-    //        ggml_used_mem(ctx0)/1024.0/1024.0,
-    //        wstate.get_buf_max_mem(0)/1024.0/1024.0,
-    //        wstate.get_buf_max_mem(1)/1024.0/1024.0,
-    //        wstate.get_buf_max_mem(2)/1024.0/1024.0,
-    //        wstate.get_buf_max_mem(3)/1024.0/1024.0);
+    //ggml_graph_print(&gf);
 
     ggml_free(ctx0);
 
@@ -1892,67 +1984,56 @@ static bool whisper_encode_internal(
     return true;
 }
 
-// evaluate the decoder
+// build the decoder graph for N tokens that attend to the first n_kv entries of the KV cache
 //
-// given text prompt + audio features -> computes the logits for the next token
+// the inputs and the views of the KV cache are set by whisper_decode_graph_set(), so the graph can be evaluated for
+// any decoder and any n_past with n_past + N <= n_kv - the entries after n_past + N are masked out
 //
-//   - model:      the model
-//   - n_threads:  number of threads to use
-//   - tokens:     text prompt
-//   - n_tokens:   number of tokens in the prompt
-//   - n_past:     number of past tokens to prefix the prompt with
+// like the encoder graph, the graph replaces the previous one in the compute buffer
 //
-static bool whisper_decode_internal(
-        whisper_context & wctx,
-          whisper_state & wstate,
-        whisper_decoder & decoder,
-    const whisper_token * tokens,
-              const int   n_tokens,
-              const int   n_past,
-              const int   n_threads) {
-    const int64_t t_start_us = ggml_time_us();
-
+static void whisper_build_graph_decoder(
+          whisper_context & wctx,
+            whisper_state & wstate,
+   const whisper_kv_cache & kv_self,
+      struct ggml_context * ctx0,
+       struct ggml_allocr * alloc,
+                const int   N,
+                const int   n_kv,
+                const int   n_threads,
+     whisper_decode_graph & graph) {
     const auto & model   = wctx.model;
     const auto & hparams = model.hparams;
 
-    auto & kv_self = decoder.kv_self;
-
-    WHISPER_ASSERT(!!kv_self.ctx);
-
-    auto & logits_out = wstate.logits;
-
-    const int n_vocab = hparams.n_vocab;
-
     const int n_ctx   = hparams.n_text_ctx;
     const int n_state = hparams.n_text_state;
     const int n_head  = hparams.n_text_head;
     const int n_layer = hparams.n_text_layer;
 
-    const int N = n_tokens;
     const int M = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
 
-    //WHISPER_PRINT_DEBUG("%s: n_past = %d, N = %d, M = %d, n_ctx = %d\n", __func__, n_past, N, M, n_ctx);
+    // placeholder - see whisper_decode_graph_set()
+    const int n_past = n_kv - N;
 
-    struct ggml_init_params params = {
-        /*.mem_size   =*/ wstate.buf_compute.size(),
-        /*.mem_buffer =*/ wstate.buf_compute.data(),
-        /*.no_alloc   =*/ false,
-    };
+    graph.n_kv = n_kv;
 
-    struct ggml_context * ctx0 = ggml_init(params);
+    graph.k_store.clear();
+    graph.v_store.clear();
+    graph.k_read.clear();
+    graph.v_read.clear();
+    graph.n_past.clear();
 
-    struct ggml_cgraph gf = {};
+    struct ggml_cgraph & gf = graph.gf;
+
+    gf = {};
     gf.n_threads = n_threads;
 
-    struct ggml_tensor * embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
-    memcpy(embd->data, tokens, N*ggml_element_size(embd));
+    ggml_allocr_reset(alloc);
 
+    struct ggml_tensor * embd     = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
     struct ggml_tensor * position = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
-    for (int i = 0; i < N; ++i) {
-        ((int32_t *) position->data)[i] = n_past + i;
-    }
 
-    wstate.use_buf(ctx0, 3);
+    ggml_allocr_alloc(alloc, embd);
+    ggml_allocr_alloc(alloc, position);
 
     // token encoding + position encoding
     struct ggml_tensor * cur =
@@ -1967,31 +2048,23 @@ static bool whisper_decode_internal(
 
         // norm
         {
-            wstate.use_buf(ctx0, 0);
-
-            cur = ggml_norm(ctx0, inpL);
-
-            // cur = ln_0_w*cur + ln_0_b
-            cur = ggml_add(ctx0,
-                    ggml_mul(ctx0,
-                        ggml_repeat(ctx0, layer.attn_ln_0_w, cur),
-                        cur),
-                    ggml_repeat(ctx0, layer.attn_ln_0_b, cur));
+            // cur = ln_0_w*norm(inpL) + ln_0_b
+            cur = ggml_norm_affine(ctx0, inpL, layer.attn_ln_0_w, layer.attn_ln_0_b);
         }
 
         // self-attention
         {
-            struct ggml_tensor * Qcur = ggml_mul_mat(ctx0,
+            struct ggml_tensor * Qcur = ggml_mul_mat_bias(ctx0,
                     layer.attn_q_w,
-                    cur);
-
-            Qcur = ggml_add(ctx0,
-                    ggml_repeat(ctx0,
-                        layer.attn_q_b,
-                        Qcur),
-                    Qcur);
+                    cur,
+                    layer.attn_q_b);
 
+#ifndef WHISPER_NO_FLASH_ATTN
+            // Kcur is scaled by (n_state/n_head)^-0.25 and ggml_flash_attn_ext scales KQ by (n_state/n_head)^-0.5
+            Qcur = ggml_scale_inplace(ctx0, Qcur, ggml_new_f32(ctx0, pow(float(n_state)/n_head, 0.25)));
+#else
             Qcur = ggml_scale_inplace(ctx0, Qcur, ggml_new_f32(ctx0, pow(float(n_state)/n_head, -0.25)));
+#endif
 
             // note: no bias for Key
             struct ggml_tensor * Kcur = ggml_mul_mat(ctx0,
@@ -2002,46 +2075,80 @@ static bool whisper_decode_internal(
 
             // store key and value to memory
             {
-                struct ggml_tensor * Vcur = ggml_mul_mat(ctx0,
+                struct ggml_tensor * Vcur = ggml_mul_mat_bias(ctx0,
                         layer.attn_v_w,
-                        cur);
+                        cur,
+                        layer.attn_v_b);
 
-                Vcur = ggml_add(ctx0,
-                        ggml_repeat(ctx0,
-                            layer.attn_v_b,
-                            Vcur),
-                        Vcur);
+                struct ggml_tensor * k = ggml_view_1d(ctx0, kv_self.k, N*n_state, kv_cache_row_size(kv_self.k, n_state)*(il*n_ctx + n_past));
 
+#ifndef WHISPER_NO_FLASH_ATTN
+                // one row per token, like K
+                struct ggml_tensor * v = ggml_view_1d(ctx0, kv_self.v, N*n_state, kv_cache_row_size(kv_self.v, n_state)*(il*n_ctx + n_past));
+#else
                 Vcur = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, Vcur, n_state, N));
 
-                struct ggml_tensor * k = ggml_view_1d(ctx0, kv_self.k, N*n_state, (ggml_element_size(kv_self.k)*n_state)*(il*n_ctx + n_past));
                 struct ggml_tensor * v = ggml_view_2d(ctx0, kv_self.v, N, n_state,
                         (   n_ctx)*ggml_element_size(kv_self.v),
                         (il*n_ctx)*ggml_element_size(kv_self.v)*n_state + n_past*ggml_element_size(kv_self.v));
+#endif
+
+                // the copies write through their own views of the cache, these are patched for n_past
+                struct ggml_tensor * k_store = ggml_cpy(ctx0, Kcur, k);
+                struct ggml_tensor * v_store = ggml_cpy(ctx0, Vcur, v);
 
-                ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Kcur, k));
-                ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Vcur, v));
+                ggml_build_forward_expand(&gf, k_store);
+                ggml_build_forward_expand(&gf, v_store);
+
+                graph.k_store.push_back(k_store);
+                graph.v_store.push_back(v_store);
             }
 
             // ------
 
-            wstate.use_buf(ctx0, 0);
-
+#ifndef WHISPER_NO_FLASH_ATTN
             struct ggml_tensor * Q =
                 ggml_permute(ctx0,
-                        ggml_cpy(ctx0,
+                        ggml_reshape_3d(ctx0,
                             Qcur,
-                            ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_state/n_head, n_head, N)),
+                            n_state/n_head, n_head, N),
                         0, 2, 1, 3);
 
+            // [n_state/n_head, n_kv, n_head]
             struct ggml_tensor * K =
+                ggml_view_3d(ctx0, kv_self.k,
+                        n_state/n_head, n_kv, n_head,
+                        kv_cache_row_size(kv_self.k, n_state),
+                        kv_cache_row_size(kv_self.k, n_state/n_head),
+                        kv_cache_row_size(kv_self.k, n_state)*n_ctx*il);
+
+            struct ggml_tensor * V =
+                ggml_view_3d(ctx0, kv_self.v,
+                        n_state/n_head, n_kv, n_head,
+                        kv_cache_row_size(kv_self.v, n_state),
+                        kv_cache_row_size(kv_self.v, n_state/n_head),
+                        kv_cache_row_size(kv_self.v, n_state)*n_ctx*il);
+
+            struct ggml_tensor * KQV = ggml_flash_attn_ext(ctx0, Q, K, V, n_past);
+
+            graph.k_read.push_back(K);
+            graph.v_read.push_back(V);
+            graph.n_past.push_back(KQV->opt[1]);
+#else
+            struct ggml_tensor * Q =
                 ggml_permute(ctx0,
-                        ggml_reshape_3d(ctx0,
-                            ggml_view_1d(ctx0, kv_self.k, (n_past + N)*n_state, il*n_ctx*ggml_element_size(kv_self.k)*n_state),
-                            n_state/n_head, n_head, n_past + N),
+                        ggml_cpy(ctx0,
+                            Qcur,
+                            ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_state/n_head, n_head, N)),
                         0, 2, 1, 3);
 
-            wstate.use_buf(ctx0, 1);
+            // [n_state/n_head, n_kv, n_head]
+            struct ggml_tensor * K =
+                ggml_view_3d(ctx0, kv_self.k,
+                        n_state/n_head, n_kv, n_head,
+                        ggml_element_size(kv_self.k)*n_state,
+                        ggml_element_size(kv_self.k)*n_state/n_head,
+                        ggml_element_size(kv_self.k)*n_state*n_ctx*il);
 
             // K * Q
             struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
@@ -2054,16 +2161,22 @@ static bool whisper_decode_internal(
 
             struct ggml_tensor * KQ_masked = ggml_diag_mask_inf_inplace(ctx0, KQ, n_past);
 
+            graph.k_read.push_back(K);
+            graph.n_past.push_back(KQ_masked->src1);
+
             struct ggml_tensor * KQ_soft_max = ggml_soft_max_inplace(ctx0, KQ_masked);
 
             struct ggml_tensor * V =
                 ggml_view_3d(ctx0, kv_self.v,
-                        n_past + N, n_state/n_head, n_head,
+                        n_kv, n_state/n_head, n_head,
                         n_ctx*ggml_element_size(kv_self.v),
                         n_ctx*ggml_element_size(kv_self.v)*n_state/n_head,
                         il*n_ctx*ggml_element_size(kv_self.v)*n_state);
 
+            graph.v_read.push_back(V);
+
             struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
+#endif
 
             struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
 
@@ -2074,77 +2187,71 @@ static bool whisper_decode_internal(
 
         // projection
         {
-            wstate.use_buf(ctx0, 0);
-
-            cur = ggml_mul_mat(ctx0,
+            cur = ggml_mul_mat_bias(ctx0,
                     layer.attn_ln_1_w,
-                    cur);
-
-            wstate.use_buf(ctx0, 1);
-
-            cur = ggml_add(ctx0,
-                    ggml_repeat(ctx0, layer.attn_ln_1_b, cur),
-                    cur);
+                    cur,
+                    layer.attn_ln_1_b);
         }
 
-        wstate.use_buf(ctx0, 2);
-
         // add the input
         struct ggml_tensor * inpCA = ggml_add(ctx0, cur, inpL);
 
         // norm
         {
-            wstate.use_buf(ctx0, 0);
-
-            cur = ggml_norm(ctx0, inpCA); // note: we use inpCA here
-
-            // cur = ln_0_w*cur + ln_0_b
-            cur = ggml_add(ctx0,
-                    ggml_mul(ctx0,
-                        ggml_repeat(ctx0, layer.cross_attn_ln_0_w, cur),
-                        cur),
-                    ggml_repeat(ctx0, layer.cross_attn_ln_0_b, cur));
+            // cur = ln_0_w*norm(inpCA) + ln_0_b
+            cur = ggml_norm_affine(ctx0, inpCA, layer.cross_attn_ln_0_w, layer.cross_attn_ln_0_b); // note: we use inpCA here
         }
 
         // cross-attention
         {
-            struct ggml_tensor * Qcur = ggml_mul_mat(ctx0,
+            struct ggml_tensor * Qcur = ggml_mul_mat_bias(ctx0,
                     layer.cross_attn_q_w,
-                    cur);
-
-            Qcur = ggml_add(ctx0,
-                    ggml_repeat(ctx0,
-                        layer.cross_attn_q_b,
-                        Qcur),
-                    Qcur);
+                    cur,
+                    layer.cross_attn_q_b);
 
+#ifndef WHISPER_NO_FLASH_ATTN
+            // Kcross is scaled by (n_state/n_head)^-0.25 and ggml_flash_attn_ext scales KQ by (n_state/n_head)^-0.5
+            Qcur = ggml_scale_inplace(ctx0, Qcur, ggml_new_f32(ctx0, pow(float(n_state)/n_head, 0.25)));
+#else
             Qcur = ggml_scale_inplace(ctx0, Qcur, ggml_new_f32(ctx0, pow(float(n_state)/n_head, -0.25)));
+#endif
 
             // Kcross is already scaled
             struct ggml_tensor * Kcross =
                 ggml_reshape_3d(ctx0,
-                        ggml_view_1d(ctx0, wstate.kv_cross.k, M*n_state, il*M*ggml_element_size(wstate.kv_cross.k)*n_state),
+                        ggml_view_1d(ctx0, wstate.kv_cross.k, M*n_state, il*M*kv_cache_row_size(wstate.kv_cross.k, n_state)),
                         n_state/n_head, n_head, M);
 
-            //struct ggml_tensor * Vcross =
-            //    ggml_reshape_3d(ctx0,
-            //            ggml_view_1d(ctx0, wstate.kv_cross.v, M*n_state, il*M*ggml_element_size(wstate.kv_cross.v)*n_state),
-            //            n_state/n_head, n_head, M);
-
-            //struct ggml_tensor * V_trans =
-            //    ggml_cpy(ctx0,
-            //            ggml_permute(ctx0, Vcross, 1, 2, 0, 3),
-            //            ggml_new_tensor_3d(ctx0, Vcross->type, M, n_state/n_head, n_head));
+#ifndef WHISPER_NO_FLASH_ATTN
+            struct ggml_tensor * Vcross =
+                ggml_reshape_3d(ctx0,
+                        ggml_view_1d(ctx0, wstate.kv_cross.v, M*n_state, il*M*kv_cache_row_size(wstate.kv_cross.v, n_state)),
+                        n_state/n_head, n_head, M);
 
+            struct ggml_tensor * V = ggml_permute(ctx0, Vcross, 0, 2, 1, 3);
+#else
             struct ggml_tensor * V =
                 ggml_view_3d(ctx0, wstate.kv_cross.v,
                         M, n_state/n_head, n_head,
                         M*ggml_element_size(wstate.kv_cross.v),
                         M*ggml_element_size(wstate.kv_cross.v)*n_state/n_head,
                         il*M*ggml_element_size(wstate.kv_cross.v)*n_state);
+#endif
 
             // ------
 
+#ifndef WHISPER_NO_FLASH_ATTN
+            struct ggml_tensor * Q =
+                ggml_permute(ctx0,
+                        ggml_reshape_3d(ctx0,
+                            Qcur,
+                            n_state/n_head, n_head, N),
+                        0, 2, 1, 3);
+
+            struct ggml_tensor * K = ggml_permute(ctx0, Kcross, 0, 2, 1, 3);
+
+            struct ggml_tensor * KQV = ggml_flash_attn_ext(ctx0, Q, K, V, -1);
+#else
             struct ggml_tensor * Q =
                 ggml_permute(ctx0,
                         ggml_cpy(ctx0,
@@ -2169,6 +2276,7 @@ static bool whisper_decode_internal(
             struct ggml_tensor * KQ_soft_max = ggml_soft_max_inplace(ctx0, KQ);
 
             struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
+#endif
 
             struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
 
@@ -2180,21 +2288,12 @@ static bool whisper_decode_internal(
 
         // projection
         {
-            wstate.use_buf(ctx0, 0);
-
-            cur = ggml_mul_mat(ctx0,
+            cur = ggml_mul_mat_bias(ctx0,
                     layer.cross_attn_ln_1_w,
-                    cur);
-
-            wstate.use_buf(ctx0, 1);
-
-            cur = ggml_add(ctx0,
-                    ggml_repeat(ctx0, layer.cross_attn_ln_1_b, cur),
-                    cur);
+                    cur,
+                    layer.cross_attn_ln_1_b);
         }
 
-        wstate.use_buf(ctx0, 2);
-
         // add the input
         cur = ggml_add(ctx0, cur, inpCA);
 
@@ -2204,110 +2303,220 @@ static bool whisper_decode_internal(
         {
             // norm
             {
-                wstate.use_buf(ctx0, 0);
+                // cur = mlp_ln_w*norm(inpFF) + mlp_ln_b
+                cur = ggml_norm_affine(ctx0, inpFF, layer.mlp_ln_w, layer.mlp_ln_b);
+            }
+
+            // fully connected + GELU activation
+            cur = ggml_mul_mat_bias_gelu(ctx0,
+                    layer.mlp_0_w,
+                    cur,
+                    layer.mlp_0_b);
 
-                cur = ggml_norm(ctx0, inpFF);
+            // projection
+            cur = ggml_mul_mat_bias(ctx0,
+                    layer.mlp_1_w,
+                    cur,
+                    layer.mlp_1_b);
+        }
 
-                wstate.use_buf(ctx0, 1);
+        inpL = ggml_add(ctx0, cur, inpFF);
+    }
 
-                // cur = mlp_ln_w*cur + mlp_ln_b
-                cur = ggml_add(ctx0,
-                        ggml_mul(ctx0,
-                            ggml_repeat(ctx0, layer.mlp_ln_w, cur),
-                            cur),
-                        ggml_repeat(ctx0, layer.mlp_ln_b, cur));
-            }
+    cur = inpL;
 
-            wstate.use_buf(ctx0, 0);
+    // norm
+    {
+        cur = ggml_norm_affine(ctx0, cur, model.d_ln_w, model.d_ln_b);
+    }
 
-            // fully connected
-            cur = ggml_mul_mat(ctx0,
-                    layer.mlp_0_w,
-                    cur);
+    // compute logits only for the last token
+    // comment this line to compute logits for all N tokens
+    // might be useful in the future
+    cur = ggml_view_2d(ctx0, cur, cur->ne[0], 1, cur->nb[1], (cur->ne[1] - 1)*cur->nb[1]);
 
-            wstate.use_buf(ctx0, 1);
+    struct ggml_tensor * logits = ggml_mul_mat(ctx0, model.d_te, cur);
 
-            cur = ggml_add(ctx0,
-                    ggml_repeat(ctx0, layer.mlp_0_b, cur),
-                    cur);
+    ggml_build_forward_expand(&gf, logits);
 
-            wstate.use_buf(ctx0, 0);
+    ggml_allocr_alloc_graph(alloc, &gf);
 
-            // GELU activation
-            cur = ggml_gelu(ctx0, cur);
+    graph.embd     = embd;
+    graph.position = position;
+    graph.logits   = logits;
+}
 
-            wstate.use_buf(ctx0, 1);
+// point the graph to the KV cache of a decoder and set the inputs for n_past
+static void whisper_decode_graph_set(
+          whisper_context & wctx,
+     whisper_decode_graph & graph,
+   const whisper_kv_cache & kv_self,
+    const whisper_token   * tokens,
+                const int   N,
+                const int   n_past) {
+    const auto & hparams = wctx.model.hparams;
 
-            // projection
-            cur = ggml_mul_mat(ctx0,
-                    layer.mlp_1_w,
-                    cur);
+    const int n_ctx   = hparams.n_text_ctx;
+    const int n_state = hparams.n_text_state;
+    const int n_layer = hparams.n_text_layer;
 
-            wstate.use_buf(ctx0, 0);
+    WHISPER_ASSERT(graph.embd->ne[0] == N && n_past + N <= graph.n_kv);
 
-            cur = ggml_add(ctx0,
-                    ggml_repeat(ctx0, layer.mlp_1_b, cur),
-                    cur);
-        }
+    memcpy(graph.embd->data, tokens, N*ggml_element_size(graph.embd));
 
-        wstate.use_buf(ctx0, 3);
+    for (int i = 0; i < N; ++i) {
+        ((int32_t *) graph.position->data)[i] = n_past + i;
+    }
 
-        inpL = ggml_add(ctx0, cur, inpFF);
+    // the views only need their data pointers - the offsets stored with them are used only for the backward pass
+    const size_t rsize_k = kv_cache_row_size(kv_self.k, n_state);
+    const size_t rsize_v = kv_cache_row_size(kv_self.v, n_state);
+
+    for (int il = 0; il < n_layer; ++il) {
+        graph.k_store[il]->data = (char *) kv_self.k->data + rsize_k*(il*n_ctx + n_past);
+#ifndef WHISPER_NO_FLASH_ATTN
+        graph.v_store[il]->data = (char *) kv_self.v->data + rsize_v*(il*n_ctx + n_past);
+#else
+        graph.v_store[il]->data = (char *) kv_self.v->data + rsize_v*il*n_ctx + ggml_element_size(kv_self.v)*n_past;
+#endif
+
+        graph.k_read[il]->data  = (char *) kv_self.k->data + rsize_k*il*n_ctx;
+        graph.v_read[il]->data  = (char *) kv_self.v->data + rsize_v*il*n_ctx;
+
+        ((int32_t *) graph.n_past[il]->data)[0] = n_past;
     }
+}
 
-    cur = inpL;
+// returns the cached single token graph that attends to n_kv entries of the KV cache, builds it on first use
+static whisper_decode_graph & whisper_decode_graph_get(
+          whisper_context & wctx,
+            whisper_state & wstate,
+   const whisper_kv_cache & kv_self,
+                const int   n_kv,
+                const int   n_threads) {
+    const auto & hparams = wctx.model.hparams;
+
+    const int M = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
+
+    auto & graphs = wstate.graphs;
+
+    // the audio context is baked into the graphs
+    if (wstate.ctx_graph && wstate.graph_n_audio_ctx != M) {
+        ggml_free(wstate.ctx_graph);
+        wstate.ctx_graph = nullptr;
+        graphs.clear();
+    }
 
-    // norm
     {
-        wstate.use_buf(ctx0, 0);
+        auto it = graphs.find(n_kv);
+        if (it != graphs.end()) {
+            return it->second;
+        }
+    }
 
-        cur = ggml_norm(ctx0, cur);
+    // start over if another graph might not fit
+    if (wstate.ctx_graph && !graphs.empty()) {
+        const size_t used = ggml_used_mem(wstate.ctx_graph);
 
-        wstate.use_buf(ctx0, 1);
+        if (used + 2*(used/graphs.size()) > wstate.buf_graph.size()) {
+            ggml_free(wstate.ctx_graph);
+            wstate.ctx_graph = nullptr;
+            graphs.clear();
+        }
+    }
 
-        cur = ggml_add(ctx0,
-                ggml_mul(ctx0,
-                    ggml_repeat(ctx0, model.d_ln_w, cur),
-                    cur),
-                ggml_repeat(ctx0, model.d_ln_b, cur));
+    if (wstate.ctx_graph == nullptr) {
+        struct ggml_init_params params = {
+            /*.mem_size   =*/ wstate.buf_graph.size(),
+            /*.mem_buffer =*/ wstate.buf_graph.data(),
+            /*.no_alloc   =*/ true,
+        };
+
+        wstate.ctx_graph = ggml_init(params);
+
+        wstate.graph_n_audio_ctx = M;
     }
 
-    wstate.use_buf(ctx0, 0);
+    auto & graph = graphs[n_kv];
 
-    // compute logits only for the last token
-    // comment this line to compute logits for all N tokens
-    // might be useful in the future
-    cur = ggml_view_2d(ctx0, cur, cur->ne[0], 1, cur->nb[1], (cur->ne[1] - 1)*cur->nb[1]);
+    whisper_build_graph_decoder(wctx, wstate, kv_self, wstate.ctx_graph, wstate.alloc, 1, n_kv, n_threads, graph);
 
-    struct ggml_tensor * logits = ggml_mul_mat(ctx0, model.d_te, cur);
+    return graph;
+}
+
+// evaluate the decoder
+//
+// given text prompt + audio features -> computes the logits for the next token
+//
+//   - model:      the model
+//   - n_threads:  number of threads to use
+//   - tokens:     text prompt
+//   - n_tokens:   number of tokens in the prompt
+//   - n_past:     number of past tokens to prefix the prompt with
+//
+static bool whisper_decode_internal(
+        whisper_context & wctx,
+          whisper_state & wstate,
+        whisper_decoder & decoder,
+    const whisper_token * tokens,
+              const int   n_tokens,
+              const int   n_past,
+              const int   n_threads) {
+    const int64_t t_start_us = ggml_time_us();
 
-    wstate.use_buf(ctx0, -1);
+    const auto & hparams = wctx.model.hparams;
 
-    // run the computation
-    {
-        ggml_build_forward_expand(&gf, logits);
-        ggml_graph_compute       (ctx0, &gf);
+    auto & kv_self = decoder.kv_self;
+
+    WHISPER_ASSERT(!!kv_self.ctx);
+
+    auto & logits_out = wstate.logits;
+
+    const int n_vocab = hparams.n_vocab;
+    const int n_ctx   = hparams.n_text_ctx;
+
+    const int N = n_tokens;
+
+    //WHISPER_PRINT_DEBUG("%s: n_past = %d, N = %d, n_ctx = %d\n", __func__, n_past, N, n_ctx);
+
+    struct ggml_context * ctx0 = nullptr;
+
+    whisper_decode_graph   graph_tmp;
+    whisper_decode_graph * graph = nullptr;
+
+    if (N == 1) {
+        // the sampling loop - reuse the graph of the current bucket of KV cache entries
+        const int n_kv = std::min(n_ctx, ((n_past + N + WHISPER_DECODE_GRAPH_N_KV_STEP - 1)/WHISPER_DECODE_GRAPH_N_KV_STEP)*WHISPER_DECODE_GRAPH_N_KV_STEP);
+
+        graph = &whisper_decode_graph_get(wctx, wstate, kv_self, n_kv, n_threads);
+    } else {
+        struct ggml_init_params params = {
+            /*.mem_size   =*/ wstate.buf_compute.size(),
+            /*.mem_buffer =*/ wstate.buf_compute.data(),
+            /*.no_alloc   =*/ true,
+        };
+
+        ctx0  = ggml_init(params);
+        graph = &graph_tmp;
+
+        whisper_build_graph_decoder(wctx, wstate, kv_self, ctx0, wstate.alloc, N, n_past + N, n_threads, graph_tmp);
     }
 
-    // extract logits for all N tokens
-    //logits_out.resize(N*n_vocab);
-    //memcpy(logits_out.data(), ggml_get_data(logits), sizeof(float)*N*n_vocab);
+    whisper_decode_graph_set(wctx, *graph, kv_self, tokens, N, n_past);
+
+    // run the computation
+    graph->gf.n_threads = n_threads;
+
+    whisper_graph_compute(wstate, graph->gf, 1);
 
     // extract logits only for the last token
     logits_out.resize(n_vocab);
-    memcpy(logits_out.data(), ggml_get_data(logits), sizeof(float)*n_vocab);
+    memcpy(logits_out.data(), ggml_get_data(graph->logits), sizeof(float)*n_vocab);
 
-    if (N > 1) {
-        //printf("%s: used_mem = %f MB, %f MB, %f MB %f MB %f MB\n", __func__,
-        //        ggml_used_mem(ctx0)/1024.0/1024.0,
-        //        wstate.get_buf_max_mem(0)/1024.0/1024.0,
-        //        wstate.get_buf_max_mem(1)/1024.0/1024.0,
-        //        wstate.get_buf_max_mem(2)/1024.0/1024.0,
-        //        wstate.get_buf_max_mem(3)/1024.0/1024.0);
+    if (ctx0) {
+        ggml_free(ctx0);
     }
 
-    ggml_free(ctx0);
-
     wstate.t_decode_us += ggml_time_us() - t_start_us;
     wstate.n_decode++;
 
@@ -2421,6 +2630,14 @@ static void log_mel_spectrogram_worker_thread(int ith, const std::vector<float>
     for (int i = ith; i < mel.n_len; i += n_threads) {
         const int offset = i * fft_step;
 
+        // the frames of the zero padding have no energy - skip the FFT, the padding is at least 30 s long
+        if (offset >= n_samples) {
+            for (int j = 0; j < mel.n_mel; j++) {
+                mel.data[j * mel.n_len + i] = log10(1e-10);
+            }
+            continue;
+        }
+
         // apply Hanning window
         for (int j = 0; j < fft_size; j++) {
             if (offset + j < n_samples) {
@@ -2680,9 +2897,7 @@ static std::string whisper_openvino_get_path_cache(std::string path_bin) {
 struct whisper_state * whisper_init_state(whisper_context * ctx) {
     whisper_state * state = new whisper_state;
 
-    const size_t scale = ctx->model.hparams.ftype ? 1 : 2;
-
-    if (!kv_cache_init(ctx->model.hparams, scale * MEM_REQ_KV_SELF.at(ctx->model.type), state->decoders[0].kv_self, ctx->itype, ctx->model.hparams.n_text_ctx)) {
+    if (!kv_cache_init(ctx->model.hparams, state->decoders[0].kv_self, ctx->ktype, ctx->model.hparams.n_text_ctx)) {
         fprintf(stderr, "%s: kv_cache_init() failed for self-attention cache\n", __func__);
         delete state;
         return nullptr;
@@ -2693,7 +2908,7 @@ struct whisper_state * whisper_init_state(whisper_context * ctx) {
         fprintf(stderr, "%s: kv self size  = %7.2f MB\n", __func__, memory_size / 1024.0 / 1024.0);
     }
 
-    if (!kv_cache_init(ctx->model.hparams, scale * MEM_REQ_KV_CROSS.at(ctx->model.type), state->kv_cross, ctx->itype, ctx->model.hparams.n_audio_ctx)) {
+    if (!kv_cache_init(ctx->model.hparams, state->kv_cross, ctx->ktype, ctx->model.hparams.n_audio_ctx)) {
         fprintf(stderr, "%s: kv_cache_init() failed for cross-attention cache\n", __func__);
         delete state;
         return nullptr;
@@ -2731,12 +2946,79 @@ struct whisper_state * whisper_init_state(whisper_context * ctx) {
     state->decoders[0].probs.reserve(ctx->vocab.n_vocab);
     state->decoders[0].logits.reserve(ctx->vocab.n_vocab);
     state->decoders[0].logprobs.reserve(ctx->vocab.n_vocab);
-    state->buf_compute.resize(scale * std::max(MEM_REQ_ENCODE.at(ctx->model.type), MEM_REQ_DECODE.at(ctx->model.type)));
 
-    state->buf_scratch[0].resize(MEM_REQ_SCRATCH0.at(ctx->model.type));
-    state->buf_scratch[1].resize(MEM_REQ_SCRATCH1.at(ctx->model.type));
-    state->buf_scratch[2].resize(MEM_REQ_SCRATCH2.at(ctx->model.type));
-    state->buf_scratch[3].resize(MEM_REQ_SCRATCH3.at(ctx->model.type));
+    // measure the largest encoder and decoder graphs and allocate the compute buffers
+    {
+        const auto & hparams = ctx->model.hparams;
+
+        // enough for the tensor objects of any of the graphs
+        std::vector<uint8_t> buf_meta(2*GGML_MAX_NODES*ggml_tensor_overhead());
+
+        struct ggml_init_params params = {
+            /*.mem_size   =*/ buf_meta.size(),
+            /*.mem_buffer =*/ buf_meta.data(),
+            /*.no_alloc   =*/ true,
+        };
+
+        struct ggml_allocr * alloc = ggml_allocr_new_measure(WHISPER_TENSOR_ALIGNMENT);
+
+        size_t mem_meta  = 0;
+        size_t mem_graph = 0;
+
+        // the encoder for the full audio context
+        {
+            struct ggml_context * ctx0 = ggml_init(params);
+
+            struct ggml_cgraph gf = {};
+            gf.n_threads = 1;
+
+            struct ggml_tensor * mel  = nullptr;
+            struct ggml_tensor * embd = nullptr;
+
+            whisper_build_graph_encoder(*ctx, *state, ctx0, alloc, false, gf, mel, embd);
+
+            mem_meta = std::max(mem_meta, ggml_used_mem(ctx0));
+
+            ggml_free(ctx0);
+        }
+
+        // the decoder for a prompt that fills the text context
+        {
+            struct ggml_context * ctx0 = ggml_init(params);
+
+            whisper_decode_graph graph;
+            whisper_build_graph_decoder(*ctx, *state, state->decoders[0].kv_self, ctx0, alloc, hparams.n_text_ctx, hparams.n_text_ctx, 1, graph);
+
+            mem_meta = std::max(mem_meta, ggml_used_mem(ctx0));
+
+            ggml_free(ctx0);
+        }
+
+        // a single token decoder graph - the cached graphs share a context
+        {
+            struct ggml_context * ctx0 = ggml_init(params);
+
+            whisper_decode_graph graph;
+            whisper_build_graph_decoder(*ctx, *state, state->decoders[0].kv_self, ctx0, alloc, 1, hparams.n_text_ctx, 1, graph);
+
+            mem_graph = ggml_used_mem(ctx0);
+
+            ggml_free(ctx0);
+        }
+
+        const size_t mem_alloc = ggml_allocr_max_size(alloc) + WHISPER_TENSOR_ALIGNMENT;
+
+        ggml_allocr_free(alloc);
+
+        state->buf_compute.resize(mem_meta + ggml_tensor_overhead());
+        state->buf_graph  .resize(WHISPER_DECODE_GRAPH_CACHE_SIZE*(mem_graph + ggml_tensor_overhead()));
+        state->buf_alloc  .resize(mem_alloc);
+
+        state->alloc = ggml_allocr_new(state->buf_alloc.data(), state->buf_alloc.size(), WHISPER_TENSOR_ALIGNMENT);
+
+        fprintf(stderr, "%s: compute buffer = %7.2f MB (+ %7.2f MB for the graphs)\n", __func__,
+                mem_alloc / 1024.0 / 1024.0, (state->buf_compute.size() + state->buf_graph.size()) / 1024.0 / 1024.0);
+    }
 
     state->rng = std::mt19937(0);
 
@@ -2792,6 +3074,45 @@ int whisper_ctx_init_openvino_encoder(
 #endif
 }
 
+int whisper_ctx_set_kv_q8_0(struct whisper_context * ctx, bool enable) {
+#ifdef WHISPER_NO_FLASH_ATTN
+    (void)(ctx);
+
+    if (enable) {
+        fprintf(stderr, "%s: a quantized KV cache needs the flash attention (WHISPER_NO_FLASH_ATTN is defined)\n", __func__);
+        return 1;
+    }
+
+    return 0;
+#else
+    const ggml_type ktype = enable ? GGML_TYPE_Q8_0 : GGML_TYPE_F16;
+
+    if (ctx->ktype == ktype) {
+        return 0;
+    }
+
+    const ggml_type ktype_old = ctx->ktype;
+
+    ctx->ktype = ktype;
+
+    // the caches of the default state are allocated with the context - the new state replaces it only when it could be
+    // created, otherwise the context is left as it was
+    if (ctx->state) {
+        whisper_state * state = whisper_init_state(ctx);
+        if (!state) {
+            fprintf(stderr, "%s: failed to re-create the state\n", __func__);
+            ctx->ktype = ktype_old;
+            return 1;
+        }
+
+        whisper_free_state(ctx->state);
+        ctx->state = state;
+    }
+
+    return 0;
+#endif
+}
+
 struct whisper_context * whisper_init_from_file_no_state(const char * path_model) {
 
     fprintf(stderr, "%s: loading model from '%s'\n", __func__, path_model);
@@ -2939,6 +3260,16 @@ void whisper_free_state(struct whisper_state * state)
             kv_cache_free(state->decoders[i].kv_self);
         }
 
+        if (state->ctx_graph) {
+            ggml_free(state->ctx_graph);
+            state->ctx_graph = nullptr;
+        }
+
+        if (state->alloc) {
+            ggml_allocr_free(state->alloc);
+            state->alloc = nullptr;
+        }
+
 #ifdef WHISPER_USE_COREML
         if (state->ctx_coreml != nullptr) {
             whisper_coreml_free(state->ctx_coreml);
@@ -2966,10 +3297,130 @@ void whisper_free(struct whisper_context * ctx) {
             delete ctx->model.buf;
         }
 
-        whisper_free_state(ctx->state);
+        whisper_free_state(ctx->state);
+
+        delete ctx;
+    }
+}
+
+//
+// state pool
+//
+
+struct whisper_state_pool {
+    whisper_context * ctx;
+
+    std::vector<whisper_state *> states; // all states owned by the pool
+    std::vector<whisper_state *> free;   // states that are not checked out
+
+    std::mutex              mutex;
+    std::condition_variable cv;
+};
+
+struct whisper_state_pool * whisper_state_pool_init(struct whisper_context * ctx, int n_states) {
+    if (ctx == nullptr || n_states <= 0) {
+        fprintf(stderr, "%s: invalid arguments\n", __func__);
+        return nullptr;
+    }
+
+    whisper_state_pool * pool = new whisper_state_pool;
+    pool->ctx = ctx;
+
+    for (int i = 0; i < n_states; ++i) {
+        whisper_state * state = whisper_init_state(ctx);
+        if (state == nullptr) {
+            fprintf(stderr, "%s: failed to allocate state %d / %d\n", __func__, i + 1, n_states);
+            whisper_state_pool_free(pool);
+            return nullptr;
+        }
+
+        pool->states.push_back(state);
+    }
+
+    pool->free = pool->states;
+
+    return pool;
+}
+
+void whisper_state_pool_free(struct whisper_state_pool * pool) {
+    if (pool) {
+        if (pool->free.size() != pool->states.size()) {
+            fprintf(stderr, "%s: WARNING: %d states are still checked out\n", __func__, (int) (pool->states.size() - pool->free.size()));
+        }
+
+        for (auto * state : pool->states) {
+            whisper_free_state(state);
+        }
+
+        delete pool;
+    }
+}
+
+struct whisper_state * whisper_state_pool_acquire(struct whisper_state_pool * pool) {
+    std::unique_lock<std::mutex> lock(pool->mutex);
+    pool->cv.wait(lock, [pool] { return !pool->free.empty(); });
+
+    whisper_state * state = pool->free.back();
+    pool->free.pop_back();
+
+    return state;
+}
+
+struct whisper_state * whisper_state_pool_try_acquire(struct whisper_state_pool * pool) {
+    std::lock_guard<std::mutex> lock(pool->mutex);
+    if (pool->free.empty()) {
+        return nullptr;
+    }
+
+    whisper_state * state = pool->free.back();
+    pool->free.pop_back();
+
+    return state;
+}
+
+void whisper_state_pool_release(struct whisper_state_pool * pool, struct whisper_state * state) {
+    if (state == nullptr) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(pool->mutex);
+
+    // only a state that is checked out of this pool is reset
+    WHISPER_ASSERT(std::find(pool->states.begin(), pool->states.end(), state) != pool->states.end());
+    WHISPER_ASSERT(std::find(pool->free.begin(),   pool->free.end(),   state) == pool->free.end());
 
-        delete ctx;
-    }
+    // forget everything about the previous request - the buffers and the KV caches are kept as they are
+    state->result_all.clear();
+    state->prompt_past.clear();
+    state->energy.clear();
+
+    state->t_sample_us = 0;
+    state->t_encode_us = 0;
+    state->t_decode_us = 0;
+    state->t_mel_us    = 0;
+
+    state->n_sample = 0;
+    state->n_encode = 0;
+    state->n_decode = 0;
+    state->n_fail_p = 0;
+    state->n_fail_h = 0;
+
+    state->lang_id         = 0;
+    state->exp_n_audio_ctx = 0;
+
+    pool->free.push_back(state);
+
+    pool->cv.notify_one();
+}
+
+int whisper_state_pool_n_states(struct whisper_state_pool * pool) {
+    std::lock_guard<std::mutex> lock(pool->mutex);
+    return pool->states.size();
+}
+
+int whisper_state_pool_n_free(struct whisper_state_pool * pool) {
+    std::lock_guard<std::mutex> lock(pool->mutex);
+    return pool->free.size();
 }
 
 void whisper_free_params(struct whisper_full_params * params) {
@@ -3006,6 +3457,56 @@ int whisper_pcm_to_mel_phase_vocoder(struct whisper_context * ctx, const float *
     return whisper_pcm_to_mel_phase_vocoder_with_state(ctx, ctx->state, samples, n_samples, n_threads);
 }
 
+int whisper_pcm_to_mel_data(struct whisper_context * ctx, const float * samples, int n_samples, int n_threads, float * data, int n_len_max) {
+    whisper_mel mel;
+
+    mel.n_mel     = WHISPER_N_MEL;
+    mel.n_len     = n_samples/WHISPER_HOP_LENGTH;
+    mel.n_len_org = mel.n_len;
+
+    if (mel.n_len > n_len_max) {
+        fprintf(stderr, "%s: not enough space for %d frames (n_len_max = %d)\n", __func__, mel.n_len, n_len_max);
+        return -1;
+    }
+
+    if (mel.n_len == 0) {
+        return 0;
+    }
+
+    mel.data.resize(mel.n_mel*mel.n_len);
+
+    std::vector<float> hann(WHISPER_N_FFT);
+    for (int i = 0; i < WHISPER_N_FFT; i++) {
+        hann[i] = 0.5*(1.0 - cos((2.0*M_PI*i)/(WHISPER_N_FFT)));
+    }
+
+    // no padding - the frames past the end of the audio are never computed
+    n_threads = std::max(1, std::min(n_threads, mel.n_len));
+
+    std::vector<std::thread> workers(n_threads - 1);
+    for (int iw = 0; iw < n_threads - 1; ++iw) {
+        workers[iw] = std::thread(
+                log_mel_spectrogram_worker_thread, iw + 1, std::cref(hann), samples,
+                n_samples, WHISPER_N_FFT, WHISPER_HOP_LENGTH, n_threads,
+                std::cref(ctx->model.filters), false, std::ref(mel));
+    }
+
+    log_mel_spectrogram_worker_thread(0, hann, samples, n_samples, WHISPER_N_FFT, WHISPER_HOP_LENGTH, n_threads, ctx->model.filters, false, mel);
+
+    for (int iw = 0; iw < n_threads - 1; ++iw) {
+        workers[iw].join();
+    }
+
+    // same clamping and normalization as log_mel_spectrogram()
+    const float mmax = *std::max_element(mel.data.begin(), mel.data.end()) - 8.0f;
+
+    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
+        data[i] = (std::max(mel.data[i], mmax) + 4.0f)/4.0f;
+    }
+
+    return mel.n_len;
+}
+
 int whisper_set_mel_with_state(
         struct whisper_context * /*ctx*/,
           struct whisper_state * state,
@@ -3384,6 +3885,134 @@ void whisper_reset_timings(struct whisper_context * ctx) {
     }
 }
 
+void whisper_profile_enable(struct whisper_context * ctx, bool enable) {
+    if (ctx->state == nullptr) {
+        fprintf(stderr, "%s: no state\n", __func__);
+        return;
+    }
+
+    whisper_profile & prof = ctx->state->profile;
+
+    if (enable && prof.t_start_us == 0) {
+        prof.t_start_us = ggml_time_us();
+    }
+
+    prof.enabled = enable;
+}
+
+void whisper_profile_reset(struct whisper_context * ctx) {
+    if (ctx->state == nullptr) {
+        return;
+    }
+
+    whisper_profile & prof = ctx->state->profile;
+
+    const bool enabled = prof.enabled;
+
+    prof = whisper_profile();
+
+    prof.enabled    = enabled;
+    prof.t_start_us = enabled ? ggml_time_us() : 0;
+}
+
+void whisper_profile_print(struct whisper_context * ctx) {
+    if (ctx->state == nullptr) {
+        return;
+    }
+
+    const whisper_profile & prof = ctx->state->profile;
+
+    static const char * graph_names[2] = { "encode", "decode" };
+
+    for (int graph = 0; graph < 2; ++graph) {
+        int64_t t_total_us = 0;
+
+        std::vector<int> ops;
+        for (int op = 0; op < GGML_OP_COUNT; ++op) {
+            if (prof.ops[graph][op].n > 0) {
+                ops.push_back(op);
+                t_total_us += prof.ops[graph][op].t_us;
+            }
+        }
+
+        if (ops.empty()) {
+            continue;
+        }
+
+        std::sort(ops.begin(), ops.end(), [&](int a, int b) {
+            return prof.ops[graph][a].t_us > prof.ops[graph][b].t_us;
+        });
+
+        fprintf(stderr, "\n");
+        fprintf(stderr, "%s: %s - %.2f ms in the graph nodes\n", __func__, graph_names[graph], t_total_us/1000.0);
+        fprintf(stderr, "%s: %-16s %8s %10s %6s %10s %9s %8s\n", __func__, "op", "nodes", "time ms", "%", "GFLOP", "GFLOP/s", "GB/s");
+
+        for (const int op : ops) {
+            const auto & stats = prof.ops[graph][op];
+
+            const double t_s = std::max<int64_t>(stats.t_us, 1)/1e6;
+
+            fprintf(stderr, "%s: %-16s %8" PRId64 " %10.2f %6.2f %10.3f %9.2f %8.2f\n", __func__,
+                    ggml_op_name((enum ggml_op) op), stats.n, stats.t_us/1000.0, 100.0*stats.t_us/std::max<int64_t>(t_total_us, 1),
+                    stats.flops/1e9, stats.flops/1e9/t_s, stats.bytes/1e9/t_s);
+        }
+    }
+
+    if (prof.spans.size() >= WHISPER_PROFILE_MAX_SPANS) {
+        fprintf(stderr, "%s: the trace is truncated after %d spans\n", __func__, WHISPER_PROFILE_MAX_SPANS);
+    }
+}
+
+int whisper_profile_save_trace(struct whisper_context * ctx, const char * fname) {
+    if (ctx->state == nullptr) {
+        fprintf(stderr, "%s: no state\n", __func__);
+        return -1;
+    }
+
+    const whisper_profile & prof = ctx->state->profile;
+
+    FILE * fout = fopen(fname, "w");
+    if (fout == nullptr) {
+        fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, fname);
+        return -2;
+    }
+
+    static const char * graph_names[2] = { "encode", "decode" };
+
+    fprintf(fout, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+
+    for (size_t i = 0; i < prof.spans.size(); ++i) {
+        const auto & span = prof.spans[i];
+        const auto & node = prof.nodes[span.node];
+
+        // keep the tensor names JSON safe
+        std::string name;
+        for (const char * c = node.name; *c; ++c) {
+            if (*c == '"' || *c == '\\') {
+                name += '\\';
+            }
+            if ((unsigned char) *c >= 0x20) {
+                name += *c;
+            }
+        }
+
+        fprintf(fout, "{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 0, \"tid\": %d, "
+                "\"ts\": %" PRId64 ", \"dur\": %" PRId64 ", \"args\": {\"tensor\": \"%s\", "
+                "\"ne\": [%" PRId64 ", %" PRId64 ", %" PRId64 ", %" PRId64 "], \"flops\": %" PRId64 ", \"bytes\": %zu}}%s\n",
+                ggml_op_name(node.op), graph_names[node.graph], span.ith,
+                span.t_start_us - prof.t_start_us, span.t_end_us - span.t_start_us, name.c_str(),
+                node.ne[0], node.ne[1], node.ne[2], node.ne[3], node.flops, node.bytes,
+                i + 1 < prof.spans.size() ? "," : "");
+    }
+
+    fprintf(fout, "]}\n");
+    fclose(fout);
+
+    fprintf(stderr, "%s: saved %zu spans to '%s'\n", __func__, prof.spans.size(), fname);
+
+    return 0;
+}
+
 static int whisper_has_coreml(void) {
 #ifdef WHISPER_USE_COREML
     return 1;
@@ -3404,6 +4033,7 @@ const char * whisper_print_system_info(void) {
     static std::string s;
 
     s  = "";
+    s += "KERNELS = "   + std::string(ggml_cpu_variant())          + " | ";
     s += "AVX = "       + std::to_string(ggml_cpu_has_avx())       + " | ";
     s += "AVX2 = "      + std::to_string(ggml_cpu_has_avx2())      + " | ";
     s += "AVX512 = "    + std::to_string(ggml_cpu_has_avx512())    + " | ";
@@ -3501,6 +4131,11 @@ struct whisper_full_params whisper_full_default_params(enum whisper_sampling_str
 
         /*.logits_filter_callback           =*/ nullptr,
         /*.logits_filter_callback_user_data =*/ nullptr,
+
+        /*.grammar_rules   =*/ nullptr,
+        /*.n_grammar_rules =*/ 0,
+        /*.i_start_rule    =*/ 0,
+        /*.grammar_penalty =*/ 100.0f,
     };
 
     switch (strategy) {
@@ -3554,51 +4189,470 @@ static int whisper_wrap_segment(struct whisper_context & ctx, struct whisper_sta
             continue;
         }
 
-        const auto txt = whisper_token_to_str(&ctx, token.id);
-        const int cur = strlen(txt);
+        const auto txt = whisper_token_to_str(&ctx, token.id);
+        const int cur = strlen(txt);
+
+        if (acc + cur > max_len && i > 0 && should_split_on_word(txt, split_on_word)) {
+            state.result_all.back().text = std::move(text);
+            state.result_all.back().t1 = token.t0;
+            state.result_all.back().tokens.resize(i);
+            state.result_all.back().speaker_turn_next = false;
+
+            state.result_all.push_back({});
+            state.result_all.back().t0 = token.t0;
+            state.result_all.back().t1 = segment.t1;
+
+            // add tokens [i, end] to the new segment
+            state.result_all.back().tokens.insert(
+                state.result_all.back().tokens.end(),
+                    segment.tokens.begin() + i,
+                    segment.tokens.end());
+
+            state.result_all.back().speaker_turn_next = segment.speaker_turn_next;
+
+            acc = 0;
+            text = "";
+
+            segment = state.result_all.back();
+            i = -1;
+
+            res++;
+        } else {
+            acc += cur;
+            text += txt;
+        }
+    }
+
+    state.result_all.back().text = std::move(text);
+
+    return res;
+}
+
+static const std::vector<std::string> non_speech_tokens = {
+    "\"", "#", "(", ")", "*", "+", "/", ":", ";", "<", "=", ">", "@", "[", "\\", "]", "^",
+    "_", "`", "{", "|", "}", "~", "「", "」", "『", "』", "<<", ">>", "<<<", ">>>", "--",
+    "---", "-(", "-[", "('", "(\"", "((", "))", "(((", ")))", "[[", "]]", "{{", "}}", "♪♪",
+    "♪♪♪","♩", "♪", "♫", "♬", "♭", "♮", "♯"
+};
+
+//
+// grammar-constrained decoding
+// ref: https://github.com/ggerganov/llama.cpp/pull/1773
+//
+
+// decode a UTF-8 string into code points, continuing a partially decoded sequence from the previous token
+// the returned code point array is terminated by 0
+static std::pair<std::vector<uint32_t>, whisper_partial_utf8> decode_utf8(
+        const char         * src,
+        whisper_partial_utf8 partial_start) {
+    static const int      lookup[] = { 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 2, 2, 3, 4 };
+    const char          * pos      = src;
+    std::vector<uint32_t> code_points;
+    uint32_t              value    = partial_start.value;
+    int                   n_remain = partial_start.n_remain;
+
+    // continue previous decode, if applicable
+    while (*pos != 0 && n_remain > 0) {
+        uint8_t next_byte = static_cast<uint8_t>(*pos);
+        if ((next_byte >> 6) != 2) {
+            // invalid sequence, abort
+            code_points.push_back(0);
+            return std::make_pair(std::move(code_points), whisper_partial_utf8{ 0, -1 });
+        }
+        value = (value << 6) + (next_byte & 0x3F);
+        ++pos;
+        --n_remain;
+    }
+
+    if (partial_start.n_remain > 0 && n_remain == 0) {
+        code_points.push_back(value);
+    }
+
+    // decode any subsequent utf-8 sequences, which may be incomplete
+    while (*pos != 0) {
+        uint8_t  first_byte = static_cast<uint8_t>(*pos);
+        uint8_t  highbits   = first_byte >> 4;
+                 n_remain   = lookup[highbits] - 1;
+
+        if (n_remain < 0) {
+            // invalid sequence, abort
+            code_points.clear();
+            code_points.push_back(0);
+            return std::make_pair(std::move(code_points), whisper_partial_utf8{ 0, n_remain });
+        }
+
+        uint8_t  mask       = (1 << (7 - n_remain)) - 1;
+                 value      = first_byte & mask;
+        ++pos;
+        while (*pos != 0 && n_remain > 0) {
+            value = (value << 6) + (static_cast<uint8_t>(*pos) & 0x3F);
+            ++pos;
+            --n_remain;
+        }
+        if (n_remain == 0) {
+            code_points.push_back(value);
+        }
+    }
+    code_points.push_back(0);
+
+    return std::make_pair(std::move(code_points), whisper_partial_utf8{ value, n_remain });
+}
+
+// returns true iff pos points to the end of one of the definitions of a rule
+static bool whisper_grammar_is_end_of_sequence(const whisper_grammar_element * pos) {
+    switch (pos->type) {
+        case WHISPER_GRETYPE_END: return true;
+        case WHISPER_GRETYPE_ALT: return true;
+        default:                  return false;
+    }
+}
+
+// returns true iff chr satisfies the char range at pos (regular or inverse range)
+// asserts that pos is pointing to a char range element
+static std::pair<bool, const whisper_grammar_element *> whisper_grammar_match_char(
+        const whisper_grammar_element * pos,
+        const uint32_t                  chr) {
+    bool found            = false;
+    bool is_positive_char = pos->type == WHISPER_GRETYPE_CHAR;
+
+    WHISPER_ASSERT(is_positive_char || pos->type == WHISPER_GRETYPE_CHAR_NOT);
+
+    do {
+        if (pos[1].type == WHISPER_GRETYPE_CHAR_RNG_UPPER) {
+            // inclusive range, e.g. [a-z]
+            found = found || (pos->value <= chr && chr <= pos[1].value);
+            pos += 2;
+        } else {
+            // exact char match, e.g. [a] or "a"
+            found = found || pos->value == chr;
+            pos += 1;
+        }
+    } while (pos->type == WHISPER_GRETYPE_CHAR_ALT);
+
+    return std::make_pair(found == is_positive_char, pos);
+}
+
+// returns true iff some continuation of the given partial UTF-8 sequence could satisfy the char
+// range at pos (regular or inverse range)
+// asserts that pos is pointing to a char range element
+static bool whisper_grammar_match_partial_char(
+        const whisper_grammar_element * pos,
+        const whisper_partial_utf8      partial_utf8) {
+    bool is_positive_char = pos->type == WHISPER_GRETYPE_CHAR;
+
+    WHISPER_ASSERT(is_positive_char || pos->type == WHISPER_GRETYPE_CHAR_NOT);
+
+    uint32_t partial_value = partial_utf8.value;
+    int      n_remain      = partial_utf8.n_remain;
+
+    // invalid sequence or 7-bit char split across 2 bytes (overlong)
+    if (n_remain < 0 || (n_remain == 1 && partial_value < 2)) {
+        return false;
+    }
+
+    // range of possible code points this partial UTF-8 sequence could complete to
+    uint32_t low  = partial_value << (n_remain * 6);
+    uint32_t high = low | ((1 << (n_remain * 6)) - 1);
+
+    if (low == 0) {
+        if (n_remain == 2) {
+            low = 1 << 11;
+        } else if (n_remain == 3) {
+            low = 1 << 16;
+        }
+    }
+
+    do {
+        if (pos[1].type == WHISPER_GRETYPE_CHAR_RNG_UPPER) {
+            // inclusive range, e.g. [a-z]
+            if (pos->value <= high && low <= pos[1].value) {
+                return is_positive_char;
+            }
+            pos += 2;
+        } else {
+            // exact char match, e.g. [a] or "a"
+            if (low <= pos->value && pos->value <= high) {
+                return is_positive_char;
+            }
+            pos += 1;
+        }
+    } while (pos->type == WHISPER_GRETYPE_CHAR_ALT);
+
+    return !is_positive_char;
+}
+
+// transforms a grammar pushdown stack into N possible stacks, all ending
+// at a character range (terminal element)
+static void whisper_grammar_advance_stack(
+        const std::vector<std::vector<whisper_grammar_element>>   & rules,
+        const std::vector<const whisper_grammar_element *>        & stack,
+        std::vector<std::vector<const whisper_grammar_element *>> & new_stacks) {
+    if (stack.empty()) {
+        new_stacks.push_back(stack);
+        return;
+    }
+
+    const whisper_grammar_element * pos = stack.back();
+
+    switch (pos->type) {
+        case WHISPER_GRETYPE_RULE_REF:
+            {
+                const size_t                    rule_id = static_cast<size_t>(pos->value);
+                const whisper_grammar_element * subpos  = rules[rule_id].data();
+                do {
+                    // init new stack without the top (pos)
+                    std::vector<const whisper_grammar_element *> new_stack(stack.begin(), stack.end() - 1);
+                    if (!whisper_grammar_is_end_of_sequence(pos + 1)) {
+                        // if this rule ref is followed by another element, add that to stack
+                        new_stack.push_back(pos + 1);
+                    }
+                    if (!whisper_grammar_is_end_of_sequence(subpos)) {
+                        // if alternate is nonempty, add to stack
+                        new_stack.push_back(subpos);
+                    }
+                    whisper_grammar_advance_stack(rules, new_stack, new_stacks);
+                    while (!whisper_grammar_is_end_of_sequence(subpos)) {
+                        // scan to end of alternate def
+                        subpos++;
+                    }
+                    if (subpos->type == WHISPER_GRETYPE_ALT) {
+                        // there's another alternate def of this rule to process
+                        subpos++;
+                    } else {
+                        break;
+                    }
+                } while (true);
+            } break;
+        case WHISPER_GRETYPE_CHAR:
+        case WHISPER_GRETYPE_CHAR_NOT:
+            new_stacks.push_back(stack);
+            break;
+        default:
+            // end of alternate (WHISPER_GRETYPE_END, WHISPER_GRETYPE_ALT) or middle of char range
+            // (WHISPER_GRETYPE_CHAR_ALT, WHISPER_GRETYPE_CHAR_RNG_UPPER); stack should never be left on
+            // those
+            WHISPER_ASSERT(false);
+    }
+}
+
+// takes a set of possible pushdown stacks on a grammar, which are required to
+// be positioned at a character range (see `whisper_grammar_advance_stack`), and
+// produces the N possible stacks if the given char is accepted at those
+// positions
+static std::vector<std::vector<const whisper_grammar_element *>> whisper_grammar_accept(
+        const std::vector<std::vector<whisper_grammar_element>>         & rules,
+        const std::vector<std::vector<const whisper_grammar_element *>> & stacks,
+        const uint32_t                                                    chr) {
+    std::vector<std::vector<const whisper_grammar_element *>> new_stacks;
+
+    for (const auto & stack : stacks) {
+        if (stack.empty()) {
+            continue;
+        }
+
+        auto match = whisper_grammar_match_char(stack.back(), chr);
+        if (match.first) {
+            const whisper_grammar_element * pos = match.second;
+
+            // update top of stack to next element, if any
+            std::vector<const whisper_grammar_element *> new_stack(stack.begin(), stack.end() - 1);
+            if (!whisper_grammar_is_end_of_sequence(pos)) {
+                new_stack.push_back(pos);
+            }
+            whisper_grammar_advance_stack(rules, new_stack, new_stacks);
+        }
+    }
+
+    return new_stacks;
+}
+
+static std::vector<whisper_grammar_candidate> whisper_grammar_reject_candidates(
+        const std::vector<std::vector<whisper_grammar_element>>         & rules,
+        const std::vector<std::vector<const whisper_grammar_element *>> & stacks,
+        const std::vector<whisper_grammar_candidate>                    & candidates);
+
+static std::vector<whisper_grammar_candidate> whisper_grammar_reject_candidates_for_stack(
+        const std::vector<std::vector<whisper_grammar_element>> & rules,
+        const std::vector<const whisper_grammar_element *>      & stack,
+        const std::vector<whisper_grammar_candidate>            & candidates) {
+    std::vector<whisper_grammar_candidate> rejects;
+
+    if (stack.empty()) {
+        for (auto tok : candidates) {
+            if (*tok.code_points != 0 || tok.partial_utf8.n_remain != 0) {
+                rejects.push_back(tok);
+            }
+        }
+        return rejects;
+    }
+
+    const whisper_grammar_element * stack_pos = stack.back();
+
+    std::vector<whisper_grammar_candidate> next_candidates;
+    for (auto tok : candidates) {
+        if (*tok.code_points == 0) {
+            // reached end of full codepoints in token, reject iff it ended in a partial sequence
+            // that cannot satisfy this position in grammar
+            if (tok.partial_utf8.n_remain != 0 && !whisper_grammar_match_partial_char(stack_pos, tok.partial_utf8)) {
+                rejects.push_back(tok);
+            }
+        } else if (whisper_grammar_match_char(stack_pos, *tok.code_points).first) {
+            next_candidates.push_back({ tok.id, tok.code_points + 1, tok.partial_utf8 });
+        } else {
+            rejects.push_back(tok);
+        }
+    }
+
+    const auto * stack_pos_after = whisper_grammar_match_char(stack_pos, 0).second;
+
+    // update top of stack to next element, if any
+    std::vector<const whisper_grammar_element *> stack_after(stack.begin(), stack.end() - 1);
+    if (!whisper_grammar_is_end_of_sequence(stack_pos_after)) {
+        stack_after.push_back(stack_pos_after);
+    }
+    std::vector<std::vector<const whisper_grammar_element *>> next_stacks;
+    whisper_grammar_advance_stack(rules, stack_after, next_stacks);
+
+    auto next_rejects = whisper_grammar_reject_candidates(rules, next_stacks, next_candidates);
+    for (auto tok : next_rejects) {
+        rejects.push_back({ tok.id, tok.code_points - 1, tok.partial_utf8 });
+    }
+
+    return rejects;
+}
+
+static std::vector<whisper_grammar_candidate> whisper_grammar_reject_candidates(
+        const std::vector<std::vector<whisper_grammar_element>>         & rules,
+        const std::vector<std::vector<const whisper_grammar_element *>> & stacks,
+        const std::vector<whisper_grammar_candidate>                    & candidates) {
+    if (candidates.empty() || stacks.empty()) {
+        return std::vector<whisper_grammar_candidate>();
+    }
+
+    auto rejects = whisper_grammar_reject_candidates_for_stack(rules, stacks.front(), candidates);
+
+    for (size_t i = 1, size = stacks.size(); i < size; ++i) {
+        rejects = whisper_grammar_reject_candidates_for_stack(rules, stacks[i], rejects);
+    }
+
+    return rejects;
+}
+
+static struct whisper_grammar whisper_grammar_init(
+        const whisper_grammar_element ** rules,
+                               size_t    n_rules,
+                               size_t    i_start_rule) {
+    const whisper_grammar_element * pos;
+
+    // copy rule definitions into vectors
+    auto vec_rules_ptr = std::make_shared<std::vector<std::vector<whisper_grammar_element>>>(n_rules);
+    auto & vec_rules   = *vec_rules_ptr;
+    for (size_t i = 0; i < n_rules; i++) {
+        for (pos = rules[i]; pos->type != WHISPER_GRETYPE_END; pos++) {
+            vec_rules[i].push_back(*pos);
+        }
+        vec_rules[i].push_back({WHISPER_GRETYPE_END, 0});
+    }
+
+    // loop over alternates of start rule to build initial stacks
+    std::vector<std::vector<const whisper_grammar_element *>> stacks;
+    pos = vec_rules[i_start_rule].data();
+    do {
+        std::vector<const whisper_grammar_element *> stack;
+        if (!whisper_grammar_is_end_of_sequence(pos)) {
+            // if alternate is nonempty, add to stack
+            stack.push_back(pos);
+        }
+        whisper_grammar_advance_stack(vec_rules, stack, stacks);
+        while (!whisper_grammar_is_end_of_sequence(pos)) {
+            // scan to end of alternate def
+            pos++;
+        }
+        if (pos->type == WHISPER_GRETYPE_ALT) {
+            // there's another alternate def of this rule to process
+            pos++;
+        } else {
+            break;
+        }
+    } while (true);
+
+    return { std::move(vec_rules_ptr), std::move(stacks), { 0, 0 } };
+}
+
+// penalize the text tokens that cannot continue any of the current parse stacks
+// the end-of-text token is penalized as well until the grammar has been matched completely
+static void whisper_suppress_invalid_grammar(
+             whisper_context  & ctx,
+    const whisper_full_params & params,
+           std::vector<float> & logits,
+      const whisper_grammar   & grammar) {
+    if (!grammar.rules || grammar.stacks.empty()) {
+        return;
+    }
+
+    bool allow_eot = false;
+    for (const auto & stack : grammar.stacks) {
+        if (stack.empty()) {
+            allow_eot = true;
+            break;
+        }
+    }
+
+    const whisper_token eot = whisper_token_eot(&ctx);
 
-        if (acc + cur > max_len && i > 0 && should_split_on_word(txt, split_on_word)) {
-            state.result_all.back().text = std::move(text);
-            state.result_all.back().t1 = token.t0;
-            state.result_all.back().tokens.resize(i);
-            state.result_all.back().speaker_turn_next = false;
+    // the candidates keep pointers into the decoded code points, so reserve upfront to avoid reallocations
+    std::vector<std::pair<std::vector<uint32_t>, whisper_partial_utf8>> candidates_decoded;
+    std::vector<whisper_grammar_candidate>                              candidates_grammar;
 
-            state.result_all.push_back({});
-            state.result_all.back().t0 = token.t0;
-            state.result_all.back().t1 = segment.t1;
+    candidates_decoded.reserve(eot);
+    candidates_grammar.reserve(eot);
 
-            // add tokens [i, end] to the new segment
-            state.result_all.back().tokens.insert(
-                state.result_all.back().tokens.end(),
-                    segment.tokens.begin() + i,
-                    segment.tokens.end());
+    for (whisper_token id = 0; id < eot; ++id) {
+        const std::string & text = ctx.vocab.id_to_token[id];
+        if (!text.empty() && logits[id] > -INFINITY) {
+            candidates_decoded.push_back(decode_utf8(text.c_str(), grammar.partial_utf8));
+            candidates_grammar.push_back({ id, candidates_decoded.back().first.data(), candidates_decoded.back().second });
+        }
+    }
 
-            state.result_all.back().speaker_turn_next = segment.speaker_turn_next;
+    const auto rejects = whisper_grammar_reject_candidates(*grammar.rules, grammar.stacks, candidates_grammar);
 
-            acc = 0;
-            text = "";
+    for (const auto & reject : rejects) {
+        logits[reject.id] -= params.grammar_penalty;
+    }
 
-            segment = state.result_all.back();
-            i = -1;
+    if (!allow_eot) {
+        logits[eot] -= params.grammar_penalty;
+    }
 
-            res++;
-        } else {
-            acc += cur;
-            text += txt;
+    // the remaining special tokens (sot, language, task, etc.) would only compete with the penalized text tokens
+    for (whisper_token id = eot + 1; id < whisper_token_beg(&ctx); ++id) {
+        if (params.tdrz_enable && id == whisper_token_solm(&ctx)) {
+            continue;
         }
+        logits[id] = -INFINITY;
     }
+}
 
-    state.result_all.back().text = std::move(text);
+// advance the grammar stacks with the text of the sampled token
+// special and timestamp tokens are transparent to the grammar
+static void whisper_grammar_accept_token(whisper_context & ctx, whisper_grammar & grammar, whisper_token token) {
+    if (!grammar.rules || grammar.stacks.empty() || token >= whisper_token_eot(&ctx)) {
+        return;
+    }
 
-    return res;
-}
+    const std::string & text = ctx.vocab.id_to_token.at(token);
 
-static const std::vector<std::string> non_speech_tokens = {
-    "\"", "#", "(", ")", "*", "+", "/", ":", ";", "<", "=", ">", "@", "[", "\\", "]", "^",
-    "_", "`", "{", "|", "}", "~", "「", "」", "『", "』", "<<", ">>", "<<<", ">>>", "--",
-    "---", "-(", "-[", "('", "(\"", "((", "))", "(((", ")))", "[[", "]]", "{{", "}}", "♪♪",
-    "♪♪♪","♩", "♪", "♫", "♬", "♭", "♮", "♯"
-};
+    // note the terminating 0 in the decoded string
+    const auto   decoded     = decode_utf8(text.c_str(), grammar.partial_utf8);
+    const auto & code_points = decoded.first;
+
+    for (auto it = code_points.begin(), end = code_points.end() - 1; it != end; ++it) {
+        grammar.stacks = whisper_grammar_accept(*grammar.rules, grammar.stacks, *it);
+    }
+
+    grammar.partial_utf8 = decoded.second;
+}
 
 // process the logits for the selected decoder
 // - applies logit filters
@@ -3733,6 +4787,11 @@ static void whisper_process_logits(
             }
         }
 
+        // suppress any tokens that would not be allowed by the grammar
+        if (params.grammar_rules != nullptr) {
+            whisper_suppress_invalid_grammar(ctx, params, logits, decoder.grammar);
+        }
+
         // populate the logprobs array (log_softmax)
         {
             const float logit_max = *std::max_element(logits.begin(), logits.end());
@@ -4186,6 +5245,7 @@ int whisper_full_with_state(
         bool has_ts;
 
         whisper_sequence sequence;
+        whisper_grammar  grammar;
     };
 
     std::vector<beam_candidate> beam_candidates;
@@ -4275,6 +5335,12 @@ int whisper_full_with_state(
                 decoder.failed    = false;
                 decoder.completed = false;
                 decoder.has_ts    = false;
+
+                if (params.grammar_rules != nullptr) {
+                    decoder.grammar = whisper_grammar_init(params.grammar_rules, params.n_grammar_rules, params.i_start_rule);
+                } else {
+                    decoder.grammar = {};
+                }
             }
 
             // init prompt and kv cache for the current iteration
@@ -4376,7 +5442,7 @@ int whisper_full_with_state(
                                 const auto tokens_new = whisper_sample_token_topk(*ctx, *state, decoder, params.beam_search.beam_size);
 
                                 for (const auto & token : tokens_new) {
-                                    beam_candidates.push_back({ j, decoder.seek_delta, decoder.has_ts, decoder.sequence });
+                                    beam_candidates.push_back({ j, decoder.seek_delta, decoder.has_ts, decoder.sequence, decoder.grammar });
                                     beam_candidates.back().sequence.tokens.push_back(token);
                                     beam_candidates.back().sequence.sum_logprobs_all += token.plog;
 
@@ -4411,6 +5477,7 @@ int whisper_full_with_state(
                         }
 
                         decoder.sequence   = cur.sequence;
+                        decoder.grammar    = cur.grammar;
                         decoder.seek_delta = cur.seek_delta;
                         decoder.has_ts     = cur.has_ts;
 
@@ -4442,6 +5509,8 @@ int whisper_full_with_state(
                     {
                         const auto & token = decoder.sequence.tokens.back();
 
+                        whisper_grammar_accept_token(*ctx, decoder.grammar, token.id);
+
                         // timestamp token - update sliding window
                         if (token.id > whisper_token_beg(ctx)) {
                             const int seek_delta_new = 2*(token.id - whisper_token_beg(ctx));
@@ -4763,6 +5832,38 @@ int whisper_full(
     return whisper_full_with_state(ctx, ctx->state, params, samples, n_samples);
 }
 
+// find the quietest point in [center - radius, center + radius] to split the audio at
+// the energy is measured over a sliding window of WHISPER_PARALLEL_SPLIT_WINDOW_MS
+static int whisper_parallel_find_split(const float * samples, int n_samples, int center, int radius) {
+    const int n_window = (WHISPER_SAMPLE_RATE*WHISPER_PARALLEL_SPLIT_WINDOW_MS)/1000;
+    const int n_hop    = WHISPER_SAMPLE_RATE/100;
+
+    const int i0 = std::max(0,         center - radius);
+    const int i1 = std::min(n_samples, center + radius) - n_window;
+
+    if (i1 <= i0) {
+        return center;
+    }
+
+    int    best        = center;
+    double best_energy = std::numeric_limits<double>::max();
+
+    for (int i = i0; i <= i1; i += n_hop) {
+        double energy = 0.0;
+        for (int j = 0; j < n_window; ++j) {
+            energy += samples[i + j]*samples[i + j];
+        }
+
+        // prefer the split closest to the nominal point among equally quiet windows
+        if (energy < best_energy || (energy == best_energy && std::abs(i + n_window/2 - center) < std::abs(best - center))) {
+            best_energy = energy;
+            best        = i + n_window/2;
+        }
+    }
+
+    return best;
+}
+
 int whisper_full_parallel(
         struct whisper_context * ctx,
         struct whisper_full_params params,
@@ -4774,22 +5875,40 @@ int whisper_full_parallel(
     }
     int ret = 0;
 
-    // prepare separate states for each thread
-    std::vector<whisper_state*> states;
-
     const int offset_samples = (WHISPER_SAMPLE_RATE*params.offset_ms)/1000;
     const int n_samples_per_processor = (n_samples - offset_samples)/n_processors;
 
+    // move the nominal split points to the nearest silence, so that words are not cut in half
+    std::vector<int> splits(n_processors + 1);
+    splits[0]            = offset_samples;
+    splits[n_processors] = n_samples;
+    {
+        const int radius = std::min((WHISPER_SAMPLE_RATE*WHISPER_PARALLEL_SPLIT_SEARCH_MS)/1000, n_samples_per_processor/4);
+
+        for (int i = 1; i < n_processors; ++i) {
+            splits[i] = whisper_parallel_find_split(samples, n_samples, offset_samples + i*n_samples_per_processor, radius);
+            splits[i] = std::max(splits[i], splits[i - 1] + 1);
+        }
+    }
+
     // the calling thread will process the first chunk
     // while the other threads will process the remaining chunks
 
-    std::vector<std::thread> workers(n_processors - 1);
+    std::vector<whisper_state *> states(n_processors - 1, nullptr);
+    std::vector<int>             rets  (n_processors - 1, 0);
+    std::vector<std::thread>     workers(n_processors - 1);
+
     for (int i = 0; i < n_processors - 1; ++i) {
         // create a new state for each thread
-        states.push_back(whisper_init_state(ctx));
+        states[i] = whisper_init_state(ctx);
+        if (states[i] == nullptr) {
+            fprintf(stderr, "%s: failed to initialize state for chunk %d\n", __func__, i + 1);
+            rets[i] = -1;
+            continue;
+        }
 
-        const int start_samples = offset_samples + (i + 1)*n_samples_per_processor;
-        const int n_samples_cur = (i == n_processors - 2) ? n_samples - start_samples : n_samples_per_processor;
+        const int start_samples = splits[i + 1];
+        const int n_samples_cur = splits[i + 2] - start_samples;
 
         auto params_cur = params;
 
@@ -4803,7 +5922,24 @@ int whisper_full_parallel(
         params_cur.progress_callback = nullptr;
         params_cur.progress_callback_user_data = nullptr;
 
-        workers[i] = std::thread(whisper_full_with_state, ctx, states[i], std::move(params_cur), samples + start_samples, n_samples_cur);
+        workers[i] = std::thread([ctx, state = states[i], params_cur, samples, start_samples, n_samples_cur, lead_min = splits[i], &ret_cur = rets[i]]() mutable {
+            // warm up the decoder context by transcribing the audio right before the split point
+            // the text ends up in the prompt of the state and is used as a prompt for the actual chunk
+            if (!params_cur.no_context) {
+                const int lead_in = std::max(lead_min, start_samples - (WHISPER_SAMPLE_RATE*WHISPER_PARALLEL_LEAD_IN_MS)/1000);
+
+                if (start_samples - lead_in > WHISPER_SAMPLE_RATE) {
+                    if (whisper_full_with_state(ctx, state, params_cur, samples + lead_in, start_samples - lead_in) == 0) {
+                        // the prompt is already part of the state's context
+                        params_cur.initial_prompt  = nullptr;
+                        params_cur.prompt_tokens   = nullptr;
+                        params_cur.prompt_n_tokens = 0;
+                    }
+                }
+            }
+
+            ret_cur = whisper_full_with_state(ctx, state, params_cur, samples + start_samples, n_samples_cur);
+        });
     }
 
     {
@@ -4813,29 +5949,41 @@ int whisper_full_parallel(
         params_cur.print_realtime = false;
 
         // Run the first transformation using default state but only for the first chunk.
-        ret = whisper_full_with_state(ctx, ctx->state, std::move(params_cur), samples, offset_samples + n_samples_per_processor);
-    }
-
-    for (int i = 0; i < n_processors - 1; ++i) {
-        workers[i].join();
+        ret = whisper_full_with_state(ctx, ctx->state, std::move(params_cur), samples, splits[1]);
     }
 
     const int64_t offset_t = (int64_t) params.offset_ms/10.0;
 
     // combine results into result_state->result_all from all other states
+    // the chunks are merged in order as soon as they are done, while the later chunks are still being processed
     for (int i = 0; i < n_processors - 1; ++i) {
+        if (workers[i].joinable()) {
+            workers[i].join();
+        }
+
+        if (states[i] == nullptr) {
+            ret = -1;
+            continue;
+        }
+
+        if (rets[i] != 0) {
+            ret = rets[i];
+        }
+
         auto& results_i = states[i]->result_all;
 
+        const int64_t t_split = (100*(int64_t) (splits[i + 1] - offset_samples))/WHISPER_SAMPLE_RATE + offset_t;
+
         for (auto& result : results_i) {
             // correct the segment timestamp taking into account the offset
-            result.t0 += 100 * ((i + 1) * n_samples_per_processor) / WHISPER_SAMPLE_RATE + offset_t;
-            result.t1 += 100 * ((i + 1) * n_samples_per_processor) / WHISPER_SAMPLE_RATE + offset_t;
-
+            result.t0 += t_split;
+            result.t1 += t_split;
 
             // make sure that segments are not overlapping
             if (!ctx->state->result_all.empty()) {
                 result.t0 = std::max(result.t0, ctx->state->result_all.back().t1);
             }
+            result.t1 = std::max(result.t1, result.t0);
 
             ctx->state->result_all.push_back(std::move(result));
 
@@ -4863,10 +6011,9 @@ int whisper_full_parallel(
     // print information about the audio boundaries
     fprintf(stderr, "\n");
     fprintf(stderr, "%s: the audio has been split into %d chunks at the following times:\n", __func__, n_processors);
-    for (int i = 0; i < n_processors - 1; ++i) {
-        fprintf(stderr, "%s: split %d - %s\n", __func__, (i + 1), to_timestamp(100*((i + 1)*n_samples_per_processor)/WHISPER_SAMPLE_RATE + offset_t).c_str());
+    for (int i = 1; i < n_processors; ++i) {
+        fprintf(stderr, "%s: split %d - %s\n", __func__, i, to_timestamp((100*(int64_t) (splits[i] - offset_samples))/WHISPER_SAMPLE_RATE + offset_t).c_str());
     }
-    fprintf(stderr, "%s: the transcription quality may be degraded near these boundaries\n", __func__);
 
     return ret;
 }
@@ -4957,6 +6104,358 @@ float whisper_full_get_token_p(struct whisper_context * ctx, int i_segment, int
 
 // =================================================================================================
 
+//
+// Streaming with local agreement
+//
+
+struct whisper_stream {
+    whisper_context * ctx;
+    whisper_state   * state;
+
+    bool owns_state = true;
+
+    whisper_stream_params params;
+
+    std::vector<float> pcmf32;     // audio that is not committed yet
+    int64_t            n_past = 0; // number of samples dropped from the front of the buffer
+
+    int64_t t_committed = 0; // end time of the last committed token
+
+    // only the prompt window and the tokens committed by the last call are kept
+    int64_t                         n_committed_dropped = 0;
+    std::vector<whisper_token_data> committed;
+    std::vector<whisper_token_data> tentative;
+
+    std::vector<whisper_token> prompt;
+};
+
+struct whisper_stream_params whisper_stream_default_params(enum whisper_sampling_strategy strategy) {
+    struct whisper_stream_params result = {
+        /*.wparams       =*/ whisper_full_default_params(strategy),
+        /*.n_max_prompt  =*/ 128,
+        /*.margin_ms     =*/ 200,
+        /*.max_buffer_ms =*/ 20000,
+
+        /*.audio_ctx_auto =*/ false,
+    };
+
+    result.wparams.print_progress   = false;
+    result.wparams.print_realtime   = false;
+    result.wparams.print_timestamps = false;
+
+    return result;
+}
+
+struct whisper_stream * whisper_stream_init_with_state(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+    struct whisper_stream_params params) {
+    if (params.max_buffer_ms <= 0 || params.max_buffer_ms >= 30000) {
+        fprintf(stderr, "%s: max_buffer_ms must be in (0, 30000)\n", __func__);
+        return nullptr;
+    }
+
+    if (state == nullptr) {
+        fprintf(stderr, "%s: no state\n", __func__);
+        return nullptr;
+    }
+
+    whisper_stream * stream = new whisper_stream;
+
+    stream->ctx        = ctx;
+    stream->state      = state;
+    stream->owns_state = false;
+    stream->params     = params;
+
+    return stream;
+}
+
+struct whisper_stream * whisper_stream_init(struct whisper_context * ctx, struct whisper_stream_params params) {
+    if (params.max_buffer_ms <= 0 || params.max_buffer_ms >= 30000) {
+        fprintf(stderr, "%s: max_buffer_ms must be in (0, 30000)\n", __func__);
+        return nullptr;
+    }
+
+    whisper_state * state = whisper_init_state(ctx);
+    if (state == nullptr) {
+        return nullptr;
+    }
+
+    whisper_stream * stream = whisper_stream_init_with_state(ctx, state, params);
+    stream->owns_state = true;
+
+    return stream;
+}
+
+void whisper_stream_free(struct whisper_stream * stream) {
+    if (stream) {
+        if (stream->owns_state) {
+            whisper_free_state(stream->state);
+        }
+        delete stream;
+    }
+}
+
+void whisper_stream_reset(struct whisper_stream * stream) {
+    stream->pcmf32.clear();
+    stream->n_past      = 0;
+    stream->t_committed = 0;
+
+    stream->n_committed_dropped = 0;
+    stream->committed.clear();
+    stream->tentative.clear();
+}
+
+int whisper_stream_push(struct whisper_stream * stream, const float * samples, int n_samples) {
+    if (n_samples < 0) {
+        return -1;
+    }
+
+    stream->pcmf32.insert(stream->pcmf32.end(), samples, samples + n_samples);
+
+    return 0;
+}
+
+// the counters of a whisper_state that whisper_print_timings() reports
+struct whisper_stream_timings {
+    int64_t t_mel_us;
+    int64_t t_sample_us;
+    int64_t t_encode_us;
+    int64_t t_decode_us;
+
+    int32_t n_sample;
+    int32_t n_encode;
+    int32_t n_decode;
+    int32_t n_fail_p;
+    int32_t n_fail_h;
+};
+
+static whisper_stream_timings whisper_stream_get_timings(const whisper_state * state) {
+    return {
+        state->t_mel_us, state->t_sample_us, state->t_encode_us, state->t_decode_us,
+        state->n_sample, state->n_encode, state->n_decode, state->n_fail_p, state->n_fail_h,
+    };
+}
+
+// add the timings of a step to the default state of the context, like whisper_full_parallel() does for its states,
+// so that whisper_print_timings() covers the stream
+static void whisper_stream_add_timings(struct whisper_stream * stream, const whisper_stream_timings & before) {
+    whisper_state * dst = stream->ctx->state;
+    whisper_state * src = stream->state;
+
+    if (dst == nullptr || dst == src) {
+        return;
+    }
+
+    dst->t_mel_us    += src->t_mel_us    - before.t_mel_us;
+    dst->t_sample_us += src->t_sample_us - before.t_sample_us;
+    dst->t_encode_us += src->t_encode_us - before.t_encode_us;
+    dst->t_decode_us += src->t_decode_us - before.t_decode_us;
+
+    dst->n_sample += src->n_sample - before.n_sample;
+    dst->n_encode += src->n_encode - before.n_encode;
+    dst->n_decode += src->n_decode - before.n_decode;
+    dst->n_fail_p += src->n_fail_p - before.n_fail_p;
+    dst->n_fail_h += src->n_fail_h - before.n_fail_h;
+}
+
+// drop the committed tokens that are older than the prompt window - the ones of the last call were read by now
+static void whisper_stream_trim_committed(struct whisper_stream * stream) {
+    // the repeated tokens at the start of a hypothesis are matched against the last 5 committed tokens
+    const int n_keep = std::max(5, stream->params.n_max_prompt);
+
+    if ((int) stream->committed.size() > n_keep) {
+        const int n_drop = (int) stream->committed.size() - n_keep;
+
+        stream->committed.erase(stream->committed.begin(), stream->committed.begin() + n_drop);
+        stream->n_committed_dropped += n_drop;
+    }
+}
+
+// transcribe the buffered audio and return the tokens that follow the committed ones
+static int whisper_stream_transcribe(struct whisper_stream * stream, std::vector<whisper_token_data> & hyp) {
+    hyp.clear();
+
+    whisper_stream_trim_committed(stream);
+
+    if (stream->pcmf32.empty()) {
+        return 0;
+    }
+
+    auto wparams = stream->params.wparams;
+
+    wparams.no_context       = true;
+    wparams.token_timestamps = true;
+    wparams.offset_ms        = 0;
+    wparams.duration_ms      = 0;
+
+    // 50 encoder frames per second - keep some padding after the audio and few distinct graph sizes
+    if (stream->params.audio_ctx_auto) {
+        const int n_frames = (int) ((50*(int64_t) stream->pcmf32.size())/WHISPER_SAMPLE_RATE) + 64;
+
+        wparams.audio_ctx = std::min(whisper_n_audio_ctx(stream->ctx), 64*((n_frames + 63)/64));
+    }
+
+    // the committed text is the context for the remaining audio
+    if (!stream->committed.empty()) {
+        const int n_prompt = std::min((int) stream->committed.size(), stream->params.n_max_prompt);
+
+        stream->prompt.clear();
+        for (int i = (int) stream->committed.size() - n_prompt; i < (int) stream->committed.size(); ++i) {
+            stream->prompt.push_back(stream->committed[i].id);
+        }
+
+        wparams.initial_prompt  = nullptr;
+        wparams.prompt_tokens   = stream->prompt.data();
+        wparams.prompt_n_tokens = stream->prompt.size();
+    }
+
+    const whisper_stream_timings before = whisper_stream_get_timings(stream->state);
+
+    const int ret = whisper_full_with_state(stream->ctx, stream->state, wparams, stream->pcmf32.data(), stream->pcmf32.size());
+
+    whisper_stream_add_timings(stream, before);
+
+    if (ret != 0) {
+        fprintf(stderr, "%s: failed to process audio\n", __func__);
+        return -1;
+    }
+
+    const whisper_token token_eot = whisper_token_eot(stream->ctx);
+    const int64_t       t_offset  = (100*stream->n_past)/WHISPER_SAMPLE_RATE;
+
+    for (const auto & segment : stream->state->result_all) {
+        for (auto token : segment.tokens) {
+            if (token.id >= token_eot) {
+                continue;
+            }
+
+            token.t0 += t_offset;
+            token.t1 += t_offset;
+
+            // the buffer starts a bit before the last committed token
+            if (token.t1 <= stream->t_committed) {
+                continue;
+            }
+
+            hyp.push_back(token);
+        }
+    }
+
+    // the kept margin may be transcribed again - drop the tokens that repeat the end of the committed text
+    if (!stream->committed.empty() && !hyp.empty() && hyp[0].t0 < stream->t_committed + 100) {
+        const int n_max = std::min({ 5, (int) stream->committed.size(), (int) hyp.size() });
+
+        for (int n = n_max; n > 0; --n) {
+            bool match = true;
+            for (int i = 0; i < n; ++i) {
+                if (stream->committed[stream->committed.size() - n + i].id != hyp[i].id) {
+                    match = false;
+                    break;
+                }
+            }
+
+            if (match) {
+                hyp.erase(hyp.begin(), hyp.begin() + n);
+                break;
+            }
+        }
+    }
+
+    return 0;
+}
+
+// drop the buffered audio before time t (in centiseconds from the start of the stream)
+static void whisper_stream_trim(struct whisper_stream * stream, int64_t t) {
+    const int64_t n_margin = ((int64_t) stream->params.margin_ms*WHISPER_SAMPLE_RATE)/1000;
+
+    int64_t n_drop = (t*WHISPER_SAMPLE_RATE)/100 - n_margin - stream->n_past;
+    n_drop = std::max<int64_t>(0, std::min<int64_t>(n_drop, stream->pcmf32.size()));
+
+    stream->pcmf32.erase(stream->pcmf32.begin(), stream->pcmf32.begin() + n_drop);
+    stream->n_past += n_drop;
+}
+
+int whisper_stream_process(struct whisper_stream * stream) {
+    std::vector<whisper_token_data> hyp;
+
+    if (whisper_stream_transcribe(stream, hyp) != 0) {
+        return -1;
+    }
+
+    // commit the longest common prefix of the last two hypotheses
+    size_t n_commit = 0;
+    while (n_commit < hyp.size() && n_commit < stream->tentative.size() && hyp[n_commit].id == stream->tentative[n_commit].id) {
+        ++n_commit;
+    }
+
+    // the buffer cannot grow beyond the 30 s window of the encoder - commit whatever we have
+    const bool is_full = (int64_t) stream->pcmf32.size() > ((int64_t) stream->params.max_buffer_ms*WHISPER_SAMPLE_RATE)/1000;
+    if (is_full) {
+        n_commit = hyp.size();
+    }
+
+    for (size_t i = 0; i < n_commit; ++i) {
+        stream->committed.push_back(hyp[i]);
+        stream->t_committed = std::max(stream->t_committed, hyp[i].t1);
+    }
+
+    stream->tentative.assign(hyp.begin() + n_commit, hyp.end());
+
+    if (n_commit > 0) {
+        whisper_stream_trim(stream, stream->t_committed);
+    } else if (is_full) {
+        // no speech in the buffer
+        whisper_stream_trim(stream, (100*(stream->n_past + (int64_t) stream->pcmf32.size()))/WHISPER_SAMPLE_RATE);
+    }
+
+    return n_commit;
+}
+
+int whisper_stream_flush(struct whisper_stream * stream) {
+    std::vector<whisper_token_data> hyp;
+
+    if (whisper_stream_transcribe(stream, hyp) != 0) {
+        return -1;
+    }
+
+    for (const auto & token : hyp) {
+        stream->committed.push_back(token);
+        stream->t_committed = std::max(stream->t_committed, token.t1);
+    }
+
+    stream->tentative.clear();
+
+    stream->n_past += stream->pcmf32.size();
+    stream->pcmf32.clear();
+
+    return hyp.size();
+}
+
+int whisper_stream_n_buffered(struct whisper_stream * stream) {
+    return stream->pcmf32.size();
+}
+
+int whisper_stream_n_committed(struct whisper_stream * stream) {
+    return stream->n_committed_dropped + stream->committed.size();
+}
+
+whisper_token_data whisper_stream_get_committed(struct whisper_stream * stream, int i_token) {
+    WHISPER_ASSERT(i_token >= stream->n_committed_dropped && i_token < whisper_stream_n_committed(stream));
+
+    return stream->committed[i_token - stream->n_committed_dropped];
+}
+
+int whisper_stream_n_tentative(struct whisper_stream * stream) {
+    return stream->tentative.size();
+}
+
+whisper_token_data whisper_stream_get_tentative(struct whisper_stream * stream, int i_token) {
+    return stream->tentative[i_token];
+}
+
+// =================================================================================================
+
 //
 // Temporary interface needed for exposing ggml interface
 // Will be removed in the future when ggml becomes a separate library
@@ -5144,6 +6643,19 @@ WHISPER_API const char * whisper_bench_ggml_mul_mat_str(int n_threads) {
     return s.c_str();
 }
 
+int whisper_model_tensor_type(int ftype, const char * name, int n_per_row) {
+    static const std::string attn_out = "attn.out.weight";
+
+    const std::string s = name;
+
+    // decoder.blocks.*.attn.out.weight, decoder.blocks.*.cross_attn.out.weight and the encoder ones
+    const bool sensitive =
+        s == "decoder.token_embedding.weight" ||
+        (s.size() >= attn_out.size() && s.compare(s.size() - attn_out.size(), attn_out.size(), attn_out) == 0);
+
+    return whisper_weight_type((ggml_ftype) ftype, sensitive, n_per_row);
+}
+
 // =================================================================================================
 
 // =================================================================================================
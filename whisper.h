@@ -95,6 +95,39 @@ extern "C" {
         void  (*close)(void * ctx);
     } whisper_model_loader;
 
+    // grammar element type
+    enum whisper_gretype {
+        // end of rule definition
+        WHISPER_GRETYPE_END            = 0,
+
+        // start of alternate definition for rule
+        WHISPER_GRETYPE_ALT            = 1,
+
+        // non-terminal element: reference to rule
+        WHISPER_GRETYPE_RULE_REF       = 2,
+
+        // terminal element: character (code point)
+        WHISPER_GRETYPE_CHAR           = 3,
+
+        // inverse char(s) ([^a], [^a-b] [^abc])
+        WHISPER_GRETYPE_CHAR_NOT       = 4,
+
+        // modifies a preceding WHISPER_GRETYPE_CHAR or WHISPER_GRETYPE_CHAR_ALT to
+        // be an inclusive range ([a-z])
+        WHISPER_GRETYPE_CHAR_RNG_UPPER = 5,
+
+        // modifies a preceding WHISPER_GRETYPE_CHAR or WHISPER_GRETYPE_CHAR_RNG_UPPER
+        // to add an alternate char to match ([ab], [a-zA])
+        WHISPER_GRETYPE_CHAR_ALT       = 6,
+    };
+
+    // a rule is a sequence of elements terminated by WHISPER_GRETYPE_END
+    // alternatives within a rule are separated by WHISPER_GRETYPE_ALT
+    typedef struct whisper_grammar_element {
+        enum whisper_gretype type;
+        uint32_t             value; // Unicode code point or rule ID
+    } whisper_grammar_element;
+
     // Various functions for loading a ggml whisper model.
     // Allocate (almost) all memory needed for the model.
     // Return NULL on failure
@@ -127,11 +160,41 @@ extern "C" {
                     const char * device,
                     const char * cache_dir);
 
+    // Store the self-attention and cross-attention KV caches as Q8_0 instead of F16 - about half the memory per
+    // decoder and for the cross-attention, at a small loss of accuracy.
+    // Applies to the states created afterwards. The default state of the context is re-created, so call this before
+    // whisper_ctx_init_openvino_encoder().
+    // Returns 0 on success, 1 if the build does not support it (WHISPER_NO_FLASH_ATTN) or the state cannot be created -
+    // the context then keeps its KV cache type and its default state.
+    WHISPER_API int whisper_ctx_set_kv_q8_0(struct whisper_context * ctx, bool enable);
+
     // Frees all allocated memory
     WHISPER_API void whisper_free      (struct whisper_context * ctx);
     WHISPER_API void whisper_free_state(struct whisper_state * state);
     WHISPER_API void whisper_free_params(struct whisper_full_params * params);
 
+    // State pool
+    //
+    // A bounded set of states that are allocated upfront and share the model weights of one context.
+    // Check out a state for every transcription request with whisper_state_pool_acquire(), run it with
+    // whisper_full_with_state() and give it back with whisper_state_pool_release().
+    // Released states are reset, so no text context leaks from one request into the next one.
+    // The pool functions are thread-safe. The pool must be freed before the context.
+    struct whisper_state_pool;
+
+    // Returns NULL on failure
+    WHISPER_API struct whisper_state_pool * whisper_state_pool_init(struct whisper_context * ctx, int n_states);
+    WHISPER_API void                        whisper_state_pool_free(struct whisper_state_pool * pool);
+
+    // Blocks until a state is available
+    WHISPER_API struct whisper_state * whisper_state_pool_acquire    (struct whisper_state_pool * pool);
+    // Returns NULL if all states are checked out
+    WHISPER_API struct whisper_state * whisper_state_pool_try_acquire(struct whisper_state_pool * pool);
+    WHISPER_API void                   whisper_state_pool_release    (struct whisper_state_pool * pool, struct whisper_state * state);
+
+    WHISPER_API int whisper_state_pool_n_states(struct whisper_state_pool * pool);
+    WHISPER_API int whisper_state_pool_n_free  (struct whisper_state_pool * pool);
+
     // Convert RAW PCM audio to log mel spectrogram.
     // The resulting spectrogram is stored inside the default state of the provided whisper context.
     // Returns 0 on success
@@ -164,6 +227,19 @@ extern "C" {
                            int   n_samples,
                            int   n_threads);
 
+    // Compute the log mel spectrogram of a short clip without storing it in a state.
+    // Unlike whisper_pcm_to_mel(), the audio is not padded to 30 seconds, so this is cheap enough to run
+    // continuously on small windows (e.g. for keyword spotting).
+    // data must have room for WHISPER_N_MEL*n_len_max floats and the result is stored as [WHISPER_N_MEL][n_len]
+    // Returns the number of frames n_len = n_samples/WHISPER_HOP_LENGTH or a negative value on failure
+    WHISPER_API int whisper_pcm_to_mel_data(
+            struct whisper_context * ctx,
+                       const float * samples,
+                               int   n_samples,
+                               int   n_threads,
+                             float * data,
+                               int   n_len_max);
+
     // This can be used to set a custom log mel spectrogram inside the default state of the provided whisper context.
     // Use this instead of whisper_pcm_to_mel() if you want to provide your own log mel spectrogram.
     // n_mel must be 80
@@ -309,6 +385,19 @@ extern "C" {
     WHISPER_API void whisper_print_timings(struct whisper_context * ctx);
     WHISPER_API void whisper_reset_timings(struct whisper_context * ctx);
 
+    // Profiling of the encoder and decoder graphs of the default state.
+    // When enabled, the time that each compute thread spends in each graph node is recorded, together with the op,
+    // the shape, the bytes touched and an estimate of the FLOPs of the node.
+    WHISPER_API void whisper_profile_enable(struct whisper_context * ctx, bool enable);
+    WHISPER_API void whisper_profile_reset (struct whisper_context * ctx);
+
+    // Print the totals per op type
+    WHISPER_API void whisper_profile_print(struct whisper_context * ctx);
+
+    // Save the recorded spans in the Chrome trace event format (chrome://tracing, ui.perfetto.dev)
+    // Returns 0 on success
+    WHISPER_API int whisper_profile_save_trace(struct whisper_context * ctx, const char * fname);
+
     // Print system information
     WHISPER_API const char * whisper_print_system_info(void);
 
@@ -429,6 +518,13 @@ extern "C" {
         // called by each decoder to filter obtained logits
         whisper_logits_filter_callback logits_filter_callback;
         void * logits_filter_callback_user_data;
+
+        // grammar-constrained decoding (set grammar_rules to nullptr to disable)
+        // text tokens that cannot continue any parse of the grammar are penalized by grammar_penalty
+        const whisper_grammar_element ** grammar_rules;
+        size_t                           n_grammar_rules;
+        size_t                           i_start_rule;
+        float                            grammar_penalty;
     };
 
     // NOTE: this function allocates memory, and it is the responsibility of the caller to free the pointer - see whisper_free_params()
@@ -454,8 +550,9 @@ extern "C" {
     // Split the input audio in chunks and process each chunk separately using whisper_full_with_state()
     // Result is stored in the default state of the context
     // Not thread safe if executed in parallel on the same context.
-    // It seems this approach can offer some speedup in some cases.
-    // However, the transcription accuracy can be worse at the beginning and end of each chunk.
+    // The audio is split at the quietest point near each of the n_processors - 1 equally spaced boundaries.
+    // Unless params.no_context is set, each chunk is prompted with the transcription of the audio preceding it.
+    // The chunks are merged in order and new_segment_callback is called as soon as the preceding chunks are done.
     WHISPER_API int whisper_full_parallel(
                 struct whisper_context * ctx,
             struct whisper_full_params   params,
@@ -510,6 +607,77 @@ extern "C" {
 
     ////////////////////////////////////////////////////////////////////////////
 
+    // Streaming transcription with local agreement
+    //
+    // Audio is appended with whisper_stream_push() and the buffered audio is re-transcribed on each call to
+    // whisper_stream_process(). Tokens on which two consecutive hypotheses agree are committed - they are final and
+    // will not change. The audio of the committed tokens is dropped from the buffer and the committed tokens are used
+    // as the prompt for the following steps, so the work per step stays bounded no matter how long the stream is.
+    // The rest of the latest hypothesis is tentative and may still change.
+    //
+    // The token timestamps of the committed and tentative tokens are in centiseconds from the start of the stream.
+    // Each stream owns its own whisper_state, so several streams can share one context. The timings of each step are
+    // added to the default state of the context for whisper_print_timings() - do not use that state from another
+    // thread while a stream is processing.
+    //
+    // The committed tokens are indexed from the start of the stream, but only the prompt window (n_max_prompt tokens)
+    // and the tokens committed by the last call to whisper_stream_process() / whisper_stream_flush() are kept - read the
+    // new committed tokens after each call.
+    //
+    // For speculative transcription of an utterance that is still being spoken, push the audio as it is captured and
+    // call whisper_stream_process() while the user talks. At the end of the utterance whisper_stream_flush() only has
+    // to transcribe the audio after the committed tokens. With audio_ctx_auto the encoder runs on the buffered audio
+    // instead of a full 30 s window, so the cost of a step follows the length of the tail.
+
+    struct whisper_stream;
+
+    struct whisper_stream_params {
+        struct whisper_full_params wparams; // decoding parameters for each step (no_context and token_timestamps are forced)
+
+        int n_max_prompt;   // max number of committed tokens used as the prompt
+        int margin_ms;      // audio kept before the end of the last committed token when trimming the buffer
+        int max_buffer_ms;  // commit the whole hypothesis if the buffer grows beyond this (must be < 30000)
+
+        bool audio_ctx_auto; // size the audio context to the buffered audio (faster, slightly less accurate)
+    };
+
+    WHISPER_API struct whisper_stream_params whisper_stream_default_params(enum whisper_sampling_strategy strategy);
+
+    // Returns NULL on failure
+    WHISPER_API struct whisper_stream * whisper_stream_init(struct whisper_context * ctx, struct whisper_stream_params params);
+    WHISPER_API void                    whisper_stream_free(struct whisper_stream * stream);
+
+    // Use an existing state (e.g. from a whisper_state_pool) - it is not freed by whisper_stream_free()
+    // Returns NULL on failure
+    WHISPER_API struct whisper_stream * whisper_stream_init_with_state(
+            struct whisper_context * ctx,
+              struct whisper_state * state,
+        struct whisper_stream_params params);
+
+    // Drop the buffered audio and the committed and tentative tokens to start a new stream
+    WHISPER_API void whisper_stream_reset(struct whisper_stream * stream);
+
+    // Append PCM audio to the stream buffer
+    WHISPER_API int whisper_stream_push(struct whisper_stream * stream, const float * samples, int n_samples);
+
+    // Transcribe the buffered audio and commit the tokens that agree with the previous hypothesis
+    // Returns the number of newly committed tokens or a negative value on failure
+    WHISPER_API int whisper_stream_process(struct whisper_stream * stream);
+
+    // Transcribe the remaining audio and commit everything - call at the end of the stream
+    // Returns the number of newly committed tokens or a negative value on failure
+    WHISPER_API int whisper_stream_flush(struct whisper_stream * stream);
+
+    // Number of buffered samples that are not committed yet
+    WHISPER_API int whisper_stream_n_buffered(struct whisper_stream * stream);
+
+    WHISPER_API int                      whisper_stream_n_committed  (struct whisper_stream * stream);
+    WHISPER_API whisper_token_data       whisper_stream_get_committed(struct whisper_stream * stream, int i_token);
+    WHISPER_API int                      whisper_stream_n_tentative  (struct whisper_stream * stream);
+    WHISPER_API whisper_token_data       whisper_stream_get_tentative(struct whisper_stream * stream, int i_token);
+
+    ////////////////////////////////////////////////////////////////////////////
+
     // Temporary helpers needed for exposing ggml interface
 
     WHISPER_API int          whisper_bench_memcpy          (int n_threads);
@@ -517,6 +685,12 @@ extern "C" {
     WHISPER_API int          whisper_bench_ggml_mul_mat    (int n_threads);
     WHISPER_API const char * whisper_bench_ggml_mul_mat_str(int n_threads);
 
+    // The ggml_type of the weight tensor 'name' with rows of n_per_row values in a model file of the given ggml_ftype.
+    // Shared by the quantize example and the model loader: the k-quants need rows that are a multiple of 256 values
+    // and fall back to a legacy type of about the same size, and the mixed ftypes (Q4_K_M, Q5_K_M) keep the attention
+    // output and the token embedding at Q6_K
+    WHISPER_API int          whisper_model_tensor_type     (int ftype, const char * name, int n_per_row);
+
 #ifdef __cplusplus
 }
 #endif